@@ -14,18 +14,79 @@ end
 
 -- EMITS (Asynchronous Events)
 -- Used to broadcast that something happened. Handlers run in background.
-function core.emit_handle(name, func_name) 
-    c_register_hook(name, func_name) 
+-- opts.merge names a function merge(acc, data) that folds coalesced
+-- events into one payload; without it the latest event wins.
+function core.emit_handle(name, func_name, opts) 
+    opts = opts or {}
+    c_register_hook(name, func_name, opts.priority, opts.merge) 
 end
 
-function core.emit(name, data) 
-    return c_trigger_async_event(name, data or {}) 
+-- opts.key coalesces: an event whose key matches a job still waiting
+-- for a worker is merged into it. opts.debounce (ms) holds the first
+-- job of a key that long to collect what follows. opts.partition runs
+-- the jobs of one partition one at a time, in order.
+function core.emit(name, data, opts) 
+    return c_trigger_async_event(name, data or {}, opts) 
 end
 
 -- DEFER (Direct Asynchronous Task)
 -- Used to offload a specific, known function to the background.
-function core.defer(func_name, data) 
-    c_enqueue_job(func_name, data or {}) 
+function core.defer(func_name, data, opts) 
+    c_enqueue_job(func_name, data or {}, opts) 
+end
+
+-- SPAWN (Fork / Join)
+-- Runs func_name(data) on the worker pool; handle:await() returns what
+-- it returned, or raises what it raised.
+function core.spawn(func_name, data)
+    return c_spawn(func_name, data or {})
+end
+
+-- Calls func_name(item) for every item on the worker pool and returns
+-- the results in order. Items go out in chunks of opts.chunk (default:
+-- four chunks per worker); the first error is raised once all are back.
+function core.parallel_map(func_name, items, opts)
+    opts = opts or {}
+    local n = #items
+    local size = opts.chunk or math.max(1, math.ceil(n / (c_job_workers() * 4)))
+    local chunks = {}
+    for first = 1, n, size do
+        local last = math.min(first + size - 1, n)
+        local chunk = table.move(items, first, last, 1, {})
+        chunks[#chunks + 1] = {first = first, last = last,
+                               handle = c_spawn_map(func_name, chunk, first)}
+    end
+
+    local results, err = {}, nil
+    for _, c in ipairs(chunks) do
+        local ok, part = pcall(c.handle.await, c.handle)
+        if not ok then
+            err = err or part
+        else
+            for i = c.first, c.last do
+                results[i] = part[i - c.first + 1]
+            end
+        end
+    end
+    if err then error(err, 2) end
+    return results
+end
+
+-- Runs func_name(data) in the background once, after ms milliseconds.
+-- Returns a timer id for core.cancel_timer.
+function core.defer_in(ms, func_name, data)
+    return c_defer_in(ms, func_name, data or {})
+end
+
+-- Runs func_name(data) in the background every ms milliseconds. Calling
+-- it again for the same function replaces the timer (same id), so it is
+-- safe at the top level of plugin.lua.
+function core.every(ms, func_name, data)
+    return c_every(ms, func_name, data or {})
+end
+
+function core.cancel_timer(id)
+    return c_cancel_timer(id)
 end
 
 local function parse_route(path)
@@ -72,8 +133,57 @@ local function create_response(body)
     return resp
 end
 
+-- JSON response: the host encodes `value` directly into the response
+-- buffer, so no JSON string is built in Lua
+function core.json(value, status)
+    local resp = create_response():status(status or 200):type("application/json")
+    resp.json = value == nil and json.null or value
+    return resp
+end
+
+-- etlua compiler for strbuf output. Runs of text and <%= %> / <%- %>
+-- values become one _put(_b, ...) call rather than a _b[_b_i] = ...
+-- append each, so a page costs a C call per run instead of per chunk.
+-- Every value starts a line with its --[[pos]] mark, which etlua reads
+-- back to point errors at the template line.
+local BufferCompiler = {}
+BufferCompiler.__index = BufferCompiler
+setmetatable(BufferCompiler, { __call = function(cls) return setmetatable({}, cls) end })
+
+function BufferCompiler:compile_chunks(chunks)
+    local out = { "local _tostring, _escape, _b = ...\nlocal _put = _b.put\n" }
+    local args = {}
+    local function flush()
+        if #args > 0 then
+            out[#out + 1] = "_put(_b,\n" .. table.concat(args, ",\n") .. ")\n"
+            args = {}
+        end
+    end
+
+    for _, chunk in ipairs(chunks) do
+        if type(chunk) == "string" then
+            args[#args + 1] = ("%q"):format(chunk)
+        elseif chunk[1] == "code" then
+            flush()
+            out[#out + 1] = "--[[" .. chunk[3] .. "]] " .. chunk[2] .. "\n"
+        elseif chunk[1] == "=" then
+            args[#args + 1] = "--[[" .. chunk[3] .. "]] _escape(_tostring(" .. chunk[2] .. "))"
+        elseif chunk[1] == "-" then
+            args[#args + 1] = "--[[" .. chunk[3] .. "]] _tostring(" .. chunk[2] .. ")"
+        else
+            error("unknown type " .. tostring(chunk[1]))
+        end
+        -- Stay well below Lua's limit on the arguments of one call
+        if #args == 64 then flush() end
+    end
+    flush()
+    out[#out + 1] = "return _b"
+    return table.concat(out)
+end
+
 -- Render function
 function core.render(view_name, data)
+    local span_start = c_trace_now and c_trace_now() or 0
     -- 1. Security Check: Block directory traversal attempts
     if view_name:find("%.%.") then
         return create_response("Security Error: Invalid view name"):status(403)
@@ -97,16 +207,27 @@ function core.render(view_name, data)
 
     -- 5. Robust Compilation & Execution
     -- We use pcall to ensure a Lua error in the template doesn't crash the request
-    local ok_compile, template = pcall(etlua.compile, content)
-    if not ok_compile then
-        return create_response("Template Syntax Error: " .. tostring(template)):status(500)
+    local parser = etlua.Parser()
+    local ok_compile, fn, err = pcall(function()
+        local code, err = parser:compile_to_lua(content, BufferCompiler)
+        if not code then return nil, err end
+        return parser:load(code)
+    end)
+    if not ok_compile or not fn then
+        return create_response("Template Syntax Error: " .. tostring(ok_compile and err or fn)):status(500)
     end
 
-    local ok_render, html = pcall(template, data)
+    -- The template writes into a native buffer, which the host hands to
+    -- the HTTP response as is: no table of chunks, no concat, no copy
+    -- (the buffer starts at the size of this state's last page)
+    local html = strbuf.new()
+    local ok_render, render_err = pcall(parser.run, parser, fn, data, html, 0)
     if not ok_render then
-        return create_response("Template Runtime Error: " .. tostring(html)):status(500)
+        return create_response("Template Runtime Error: " .. tostring(render_err)):status(500)
     end
 
+    if span_start ~= 0 then c_trace_span("render " .. view_name, span_start) end
+
     -- Explicitly set HTML type since we are rendering a template
     return create_response(html):type("text/html")
 end
@@ -122,25 +243,11 @@ function core.redirect(url, status_code)
         :header("Location", url)
 end
 
--- Helper to decode URL-encoded strings (e.g., %20 to space)
-local function url_decode(str)
-    str = str:gsub("+", " ")
-    str = str:gsub("%%(%x%x)", function(h) return string.char(tonumber(h, 16)) end)
-    return str
-end
-
--- Function to parse form data into a table
+-- Function to parse form data into a table (decoded by the native text
+-- module; a key without "=" maps to "")
 function core.parse_form(body)
-    local data = {}
-    if not body or body == "" then return data end
-
-    for pair in body:gmatch("([^&]+)") do
-        local key, value = pair:match("([^=]+)=([^=]*)")
-        if key then
-            data[url_decode(key)] = url_decode(value or "")
-        end
-    end
-    return data
+    if not body or body == "" then return {} end
+    return text.parse_query(body)
 end
 
 function core.memory_kb()
@@ -148,30 +255,46 @@ function core.memory_kb()
 end
 
 -- Routing logic
-function core.match(method, path, handler)
+-- opts.cache = { ttl = seconds, vary = {header, ...}, tags = {tag, ...} }
+-- lets the host answer repeat GETs from its response cache
+function core.match(method, path, handler, opts)
     local pattern, keys = parse_route(path)
+    local cache = opts and opts.cache
+    if cache and c_cache_route then
+        c_cache_route(cache.vary or {})
+    end
     table.insert(core.routes, {
         method = method:upper(),
+        path = path,
         pattern = pattern,
         keys = keys,
-        handler = handler
+        handler = handler,
+        cache = cache
     })
 end
 
-function core.get(path, handler) core.match("GET", path, handler) end
-function core.post(path, handler) core.match("POST", path, handler) end
+function core.get(path, handler, opts) core.match("GET", path, handler, opts) end
+function core.post(path, handler, opts) core.match("POST", path, handler, opts) end
+
+-- Drops every cached response carrying this tag (each plugin's pages
+-- are tagged with the plugin name; db_exec already purges those)
+function core.cache_invalidate(tag)
+    if c_cache_invalidate then c_cache_invalidate(tag) end
+end
 
 
 -- Dispatcher
 function core.handle_request(req)
     local method = req.method:upper()
-    local content_type = (req.headers and req.headers["Content-Type"]) or ""
+    -- Bodies without a Content-Type are treated as form posts
+    local content_type = (req.headers and req.headers["Content-Type"])
+        or "application/x-www-form-urlencoded"
 
     req.form = {}
 
     if method == "POST" or method == "PUT" then
         if content_type:find("application/x-www-form-urlencoded") then
-            req.form = parse_form(req.body or "")
+            req.form = core.parse_form(req.body or "")
         end
     end
     
@@ -188,15 +311,20 @@ function core.handle_request(req)
 
                 local result = route.handler(req)
                 
-                -- Wrap simple string responses
-                if type(result) == "string" then
+                -- Wrap simple string (or strbuf) responses
+                if type(result) == "string" or type(result) == "userdata" then
                     result = { status_code = 200, body = result, headers = {["Content-Type"]="text/html"} }
                 end
 
                 return {
                     status = result.status_code or 200,
                     body = result.body or "",
-                    headers = result.headers or {}
+                    -- encoded by the host straight into the response
+                    json = result.json,
+                    headers = result.headers or {},
+                    -- declared path, used by the host as the metrics label
+                    route = route.path,
+                    cache = route.cache
                 }
             end
         end
@@ -0,0 +1,520 @@
+// Self-contained HTTP/1.1 load generator used by the `bench` target.
+//
+// Each thread drives its share of keep-alive connections from one epoll
+// loop. With --rate the generator is open-loop: requests are scheduled at
+// fixed intervals and latency is measured from the *intended* send time, so
+// a stalled server shows up as queueing delay instead of silently lowering
+// the offered load. Without --rate every connection sends back-to-back.
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define READ_BUFFER_SIZE (256 * 1024)
+// A connection that could not reconnect retries after this, doubling up
+// to the maximum
+#define RECONNECT_MIN_NS 1000000ull
+#define RECONNECT_MAX_NS 100000000ull
+
+typedef enum { CONN_IDLE, CONN_WRITING, CONN_READING } ConnState;
+
+typedef struct {
+  int fd;
+  ConnState state;
+  size_t sent;
+  char *rbuf;
+  size_t rlen;
+  uint64_t intended_ns; // when this request was scheduled to go out
+  uint64_t retry_ns;    // fd < 0: when to try connecting again
+  uint64_t backoff_ns;
+} Conn;
+
+typedef struct {
+  // Shared, read-only configuration
+  const char *scenario;
+  const char *host;
+  int port;
+  const char *request;
+  size_t request_len;
+  int connections;
+  int threads;
+  double duration_s;
+  double warmup_s;
+  double rate; // total requests/second, 0 = closed loop
+} Config;
+
+typedef struct {
+  const Config *cfg;
+  pthread_t tid;
+  int nconns;
+  Conn *conns;
+  double rate; // this thread's share
+
+  uint64_t *samples; // latencies in ns, measured after warmup
+  size_t nsamples;
+  size_t cap;
+  uint64_t requests;
+  uint64_t errors;
+  uint64_t connect_failures;
+  int conns_down; // connections still without a socket at the end
+  uint64_t non_2xx;
+  uint64_t bytes;
+} Worker;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void record_sample(Worker *w, uint64_t ns) {
+  if (w->nsamples == w->cap) {
+    size_t new_cap = w->cap ? w->cap * 2 : 65536;
+    uint64_t *grown = realloc(w->samples, new_cap * sizeof(uint64_t));
+    if (grown == NULL)
+      return;
+    w->samples = grown;
+    w->cap = new_cap;
+  }
+  w->samples[w->nsamples++] = ns;
+}
+
+static int open_connection(const Config *cfg) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons((uint16_t)cfg->port)};
+  inet_pton(AF_INET, cfg->host, &addr.sin_addr);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+static void conn_watch(int epfd, Conn *c, uint32_t events, int op) {
+  struct epoll_event ev = {.events = events, .data.ptr = c};
+  epoll_ctl(epfd, op, c->fd, &ev);
+}
+
+// Opens the connection's socket; on failure schedules the next attempt
+// with exponential backoff, so the offered load recovers once the server
+// accepts again instead of silently shrinking
+static void conn_connect(Worker *w, int epfd, Conn *c) {
+  c->fd = open_connection(w->cfg);
+  c->state = CONN_IDLE;
+  c->rlen = 0;
+  if (c->fd >= 0) {
+    c->backoff_ns = 0;
+    conn_watch(epfd, c, EPOLLIN, EPOLL_CTL_ADD);
+    return;
+  }
+  w->connect_failures++;
+  c->backoff_ns = c->backoff_ns ? c->backoff_ns * 2 : RECONNECT_MIN_NS;
+  if (c->backoff_ns > RECONNECT_MAX_NS)
+    c->backoff_ns = RECONNECT_MAX_NS;
+  c->retry_ns = now_ns() + c->backoff_ns;
+}
+
+static void conn_reset(Worker *w, int epfd, Conn *c) {
+  w->errors++;
+  if (c->fd >= 0) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+  }
+  conn_connect(w, epfd, c);
+}
+
+static void conn_flush(Worker *w, int epfd, Conn *c) {
+  const Config *cfg = w->cfg;
+  while (c->sent < cfg->request_len) {
+    ssize_t n = write(c->fd, cfg->request + c->sent, cfg->request_len - c->sent);
+    if (n < 0) {
+      if (errno == EAGAIN) {
+        if (c->state != CONN_WRITING)
+          conn_watch(epfd, c, EPOLLIN | EPOLLOUT, EPOLL_CTL_MOD);
+        c->state = CONN_WRITING;
+        return;
+      }
+      conn_reset(w, epfd, c);
+      return;
+    }
+    c->sent += (size_t)n;
+  }
+  if (c->state == CONN_WRITING)
+    conn_watch(epfd, c, EPOLLIN, EPOLL_CTL_MOD);
+  c->state = CONN_READING;
+}
+
+static void conn_send(Worker *w, int epfd, Conn *c, uint64_t intended_ns) {
+  c->intended_ns = intended_ns;
+  c->sent = 0;
+  c->rlen = 0;
+  c->state = CONN_READING; // conn_flush moves it to WRITING if needed
+  conn_flush(w, epfd, c);
+}
+
+// Returns the size of a complete response at the start of buf, 0 if more
+// bytes are needed, or -1 if the response cannot be framed.
+static long response_size(const char *buf, size_t len, int *status) {
+  const char *end = memmem(buf, len, "\r\n\r\n", 4);
+  if (end == NULL)
+    return 0;
+  size_t header_len = (size_t)(end - buf) + 4;
+  *status = (len > 12) ? atoi(buf + 9) : 0;
+
+  long content_length = -1;
+  bool chunked = false;
+  for (const char *line = strstr(buf, "\r\n"); line && line < end;
+       line = strstr(line + 2, "\r\n")) {
+    if (strncasecmp(line + 2, "Content-Length:", 15) == 0)
+      content_length = atol(line + 17);
+    else if (strncasecmp(line + 2, "Transfer-Encoding:", 18) == 0 &&
+             strstr(line + 20, "chunked") != NULL)
+      chunked = true;
+  }
+
+  if (chunked) {
+    const char *term =
+        memmem(buf + header_len, len - header_len, "0\r\n\r\n", 5);
+    return term ? (long)(term - buf) + 5 : 0;
+  }
+  if (content_length < 0)
+    content_length = 0;
+  size_t total = header_len + (size_t)content_length;
+  if (total > READ_BUFFER_SIZE)
+    return -1;
+  return (len >= total) ? (long)total : 0;
+}
+
+static void conn_read(Worker *w, int epfd, Conn *c, uint64_t measure_from) {
+  while (1) {
+    ssize_t n = read(c->fd, c->rbuf + c->rlen, READ_BUFFER_SIZE - 1 - c->rlen);
+    if (n == 0) {
+      conn_reset(w, epfd, c);
+      return;
+    }
+    if (n < 0) {
+      if (errno != EAGAIN)
+        conn_reset(w, epfd, c);
+      return;
+    }
+    c->rlen += (size_t)n;
+    c->rbuf[c->rlen] = '\0';
+
+    int status = 0;
+    long size = response_size(c->rbuf, c->rlen, &status);
+    if (size < 0) {
+      conn_reset(w, epfd, c);
+      return;
+    }
+    if (size > 0) {
+      uint64_t done = now_ns();
+      w->requests++;
+      w->bytes += (uint64_t)size;
+      if (status < 200 || status >= 400)
+        w->non_2xx++;
+      if (c->intended_ns >= measure_from)
+        record_sample(w, done - c->intended_ns);
+      c->state = CONN_IDLE;
+      c->rlen = 0;
+      return;
+    }
+  }
+}
+
+static void *worker_main(void *arg) {
+  Worker *w = (Worker *)arg;
+  const Config *cfg = w->cfg;
+  int epfd = epoll_create1(0);
+
+  for (int i = 0; i < w->nconns; i++) {
+    Conn *c = &w->conns[i];
+    c->rbuf = malloc(READ_BUFFER_SIZE);
+    conn_connect(w, epfd, c);
+  }
+
+  // Open loop: the next send is due at an absolute time, so a timerfd in
+  // the epoll set wakes the loop to the nanosecond. epoll_wait's
+  // millisecond timeout would either spin on sub-millisecond gaps or send
+  // late, and the lateness would show up as latency.
+  int tfd = -1;
+  if (w->rate > 0) {
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+  }
+
+  uint64_t start = now_ns();
+  uint64_t measure_from = start + (uint64_t)(cfg->warmup_s * 1e9);
+  uint64_t end = measure_from + (uint64_t)(cfg->duration_s * 1e9);
+  uint64_t interval = w->rate > 0 ? (uint64_t)(1e9 / w->rate) : 0;
+  uint64_t next_intended = start;
+  struct epoll_event events[256];
+
+  while (1) {
+    uint64_t now = now_ns();
+    if (now >= end)
+      break;
+
+    // 1. Hand out work to idle connections, reconnecting the ones whose
+    // retry is due
+    uint64_t next_retry = UINT64_MAX;
+    for (int i = 0; i < w->nconns; i++) {
+      Conn *c = &w->conns[i];
+      if (c->fd < 0 && c->retry_ns <= now)
+        conn_connect(w, epfd, c);
+      if (c->fd < 0) {
+        if (c->retry_ns < next_retry)
+          next_retry = c->retry_ns;
+        continue;
+      }
+      if (c->state != CONN_IDLE)
+        continue;
+      if (interval == 0) {
+        conn_send(w, epfd, c, now);
+      } else if (next_intended <= now) {
+        // Late requests keep their original schedule slot, so the
+        // queueing delay is part of the measured latency
+        conn_send(w, epfd, c, next_intended);
+        next_intended += interval;
+      }
+    }
+
+    // 2. Wait for responses, the next scheduled send or a reconnect. An
+    // overdue send waits for a response to free a connection.
+    if (tfd >= 0 && next_intended > now) {
+      struct itimerspec at = {
+          .it_value = {(time_t)(next_intended / 1000000000ull),
+                       (long)(next_intended % 1000000000ull)}};
+      timerfd_settime(tfd, TFD_TIMER_ABSTIME, &at, NULL);
+    }
+    int timeout_ms = 100;
+    if (next_retry != UINT64_MAX) {
+      // Rounded up: a retry never needs to be early, and 0 would spin
+      uint64_t wait = next_retry > now ? next_retry - now : 0;
+      int retry_ms = (int)((wait + 999999) / 1000000);
+      if (retry_ms < 1)
+        retry_ms = 1;
+      if (retry_ms < timeout_ms)
+        timeout_ms = retry_ms;
+    }
+    int n = epoll_wait(epfd, events, 256, timeout_ms);
+    for (int i = 0; i < n; i++) {
+      Conn *c = (Conn *)events[i].data.ptr;
+      if (c == NULL) { // the send timer
+        uint64_t expirations; // drained only; step 1 checks the schedule
+        ssize_t r = read(tfd, &expirations, sizeof(expirations));
+        (void)r;
+        continue;
+      }
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        conn_reset(w, epfd, c);
+        continue;
+      }
+      if ((events[i].events & EPOLLOUT) && c->state == CONN_WRITING)
+        conn_flush(w, epfd, c);
+      if (events[i].events & EPOLLIN)
+        conn_read(w, epfd, c, measure_from);
+    }
+  }
+
+  for (int i = 0; i < w->nconns; i++) {
+    if (w->conns[i].fd >= 0)
+      close(w->conns[i].fd);
+    else
+      w->conns_down++;
+    free(w->conns[i].rbuf);
+  }
+  if (tfd >= 0)
+    close(tfd);
+  close(epfd);
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile_ms(const uint64_t *sorted, size_t n, double q) {
+  if (n == 0)
+    return 0.0;
+  size_t idx = (size_t)(q * (double)(n - 1) + 0.5);
+  return sorted[idx] / 1e6;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -s, --scenario NAME     label used in the JSON output\n"
+          "  -H, --host ADDR         IPv4 address (default 127.0.0.1)\n"
+          "  -p, --port PORT         port (default 8888)\n"
+          "  -u, --path PATH         request path (default /)\n"
+          "  -m, --method METHOD     GET or POST (default GET)\n"
+          "  -b, --body DATA         form-encoded request body\n"
+          "  -c, --connections N     keep-alive connections (default 32)\n"
+          "  -t, --threads N         generator threads (default 4)\n"
+          "  -d, --duration SECONDS  measured duration (default 10)\n"
+          "  -w, --warmup SECONDS    unmeasured warmup (default 2)\n"
+          "  -r, --rate RPS          open-loop rate, 0 = closed loop\n",
+          prog);
+}
+
+int main(int argc, char **argv) {
+  Config cfg = {.scenario = "default",
+                .host = "127.0.0.1",
+                .port = 8888,
+                .connections = 32,
+                .threads = 4,
+                .duration_s = 10,
+                .warmup_s = 2,
+                .rate = 0};
+  const char *path = "/";
+  const char *method = "GET";
+  const char *body = NULL;
+
+  static struct option long_opts[] = {
+      {"scenario", required_argument, 0, 's'},
+      {"host", required_argument, 0, 'H'},
+      {"port", required_argument, 0, 'p'},
+      {"path", required_argument, 0, 'u'},
+      {"method", required_argument, 0, 'm'},
+      {"body", required_argument, 0, 'b'},
+      {"connections", required_argument, 0, 'c'},
+      {"threads", required_argument, 0, 't'},
+      {"duration", required_argument, 0, 'd'},
+      {"warmup", required_argument, 0, 'w'},
+      {"rate", required_argument, 0, 'r'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, "s:H:p:u:m:b:c:t:d:w:r:h", long_opts,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 's': cfg.scenario = optarg; break;
+    case 'H': cfg.host = optarg; break;
+    case 'p': cfg.port = atoi(optarg); break;
+    case 'u': path = optarg; break;
+    case 'm': method = optarg; break;
+    case 'b': body = optarg; break;
+    case 'c': cfg.connections = atoi(optarg); break;
+    case 't': cfg.threads = atoi(optarg); break;
+    case 'd': cfg.duration_s = atof(optarg); break;
+    case 'w': cfg.warmup_s = atof(optarg); break;
+    case 'r': cfg.rate = atof(optarg); break;
+    default: usage(argv[0]); return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (cfg.threads < 1)
+    cfg.threads = 1;
+  if (cfg.connections < cfg.threads)
+    cfg.connections = cfg.threads;
+
+  // 1. Pre-build the request once; every connection sends the same bytes
+  char request[8192];
+  int len;
+  if (body) {
+    len = snprintf(request, sizeof(request),
+                   "%s %s HTTP/1.1\r\nHost: %s:%d\r\nConnection: keep-alive\r\n"
+                   "Content-Type: application/x-www-form-urlencoded\r\n"
+                   "Content-Length: %zu\r\n\r\n%s",
+                   method, path, cfg.host, cfg.port, strlen(body), body);
+  } else {
+    len = snprintf(request, sizeof(request),
+                   "%s %s HTTP/1.1\r\nHost: %s:%d\r\nConnection: "
+                   "keep-alive\r\n\r\n",
+                   method, path, cfg.host, cfg.port);
+  }
+  if (len < 0 || (size_t)len >= sizeof(request)) {
+    fprintf(stderr, "Request too large\n");
+    return 2;
+  }
+  cfg.request = request;
+  cfg.request_len = (size_t)len;
+
+  // 2. Split connections and rate across threads
+  Worker *workers = calloc((size_t)cfg.threads, sizeof(Worker));
+  for (int i = 0; i < cfg.threads; i++) {
+    Worker *w = &workers[i];
+    w->cfg = &cfg;
+    w->nconns = cfg.connections / cfg.threads +
+                (i < cfg.connections % cfg.threads ? 1 : 0);
+    w->conns = calloc((size_t)w->nconns, sizeof(Conn));
+    w->rate = cfg.rate / cfg.threads;
+    pthread_create(&w->tid, NULL, worker_main, w);
+  }
+
+  // 3. Merge results
+  uint64_t requests = 0, errors = 0, connect_failures = 0, non_2xx = 0,
+           bytes = 0;
+  int conns_down = 0;
+  size_t total_samples = 0;
+  for (int i = 0; i < cfg.threads; i++) {
+    pthread_join(workers[i].tid, NULL);
+    total_samples += workers[i].nsamples;
+  }
+  uint64_t *all = malloc((total_samples ? total_samples : 1) * sizeof(uint64_t));
+  size_t pos = 0;
+  double sum_ms = 0;
+  for (int i = 0; i < cfg.threads; i++) {
+    Worker *w = &workers[i];
+    memcpy(all + pos, w->samples, w->nsamples * sizeof(uint64_t));
+    pos += w->nsamples;
+    requests += w->requests;
+    errors += w->errors;
+    connect_failures += w->connect_failures;
+    conns_down += w->conns_down;
+    non_2xx += w->non_2xx;
+    bytes += w->bytes;
+    free(w->samples);
+    free(w->conns);
+  }
+  qsort(all, total_samples, sizeof(uint64_t), compare_u64);
+  for (size_t i = 0; i < total_samples; i++)
+    sum_ms += all[i] / 1e6;
+
+  // 4. One JSON object per run, so runs can be concatenated and diffed
+  printf("{\"scenario\":\"%s\",\"path\":\"%s\",\"method\":\"%s\","
+         "\"connections\":%d,\"threads\":%d,\"target_rate\":%.1f,"
+         "\"duration_s\":%.2f,\"requests\":%zu,\"completed_total\":%llu,"
+         "\"errors\":%llu,\"connect_failures\":%llu,\"connections_down\":%d,"
+         "\"non_2xx\":%llu,\"bytes\":%llu,\"throughput_rps\":%.1f,"
+         "\"latency_ms\":{\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,"
+         "\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}}\n",
+         cfg.scenario, path, method, cfg.connections, cfg.threads, cfg.rate,
+         cfg.duration_s, total_samples, (unsigned long long)requests,
+         (unsigned long long)errors, (unsigned long long)connect_failures,
+         conns_down,
+         (unsigned long long)non_2xx, (unsigned long long)bytes,
+         total_samples / cfg.duration_s,
+         total_samples ? sum_ms / total_samples : 0.0,
+         percentile_ms(all, total_samples, 0.50),
+         percentile_ms(all, total_samples, 0.90),
+         percentile_ms(all, total_samples, 0.99),
+         percentile_ms(all, total_samples, 0.999),
+         total_samples ? all[total_samples - 1] / 1e6 : 0.0);
+
+  free(all);
+  free(workers);
+  return errors > 0 && total_samples == 0 ? 1 : 0;
+}
@@ -0,0 +1,481 @@
+// Micro-benchmarks for the C/Lua bridge in src/lua_helpers.c.
+//
+// Each benchmark is calibrated so one sample takes at least --min-sample-ms,
+// then sampled repeatedly; the median per-op time is what gets compared
+// against a baseline. Results are written as JSON so a run on main can be
+// saved and used as the baseline for a branch.
+#define _GNU_SOURCE
+#include "cJSON.h"
+#include "db_executor.h"
+#include "lua_helpers.h"
+#include "plugin_manager.h"
+#include <getopt.h>
+#include <lauxlib.h>
+#include <lua.h>
+#include <lualib.h>
+#include <math.h>
+#include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+  lua_State *src; // holds the payload at stack index 1
+  lua_State *dst;
+  cJSON *json;    // payload pre-converted, for the decode direction
+  Plugin *plugin; // for db_query
+  PluginManager *pm;
+  const char *sql;
+} BenchState;
+
+typedef struct {
+  const char *name;
+  void (*setup)(BenchState *s);
+  void (*run)(BenchState *s, uint64_t iters);
+} Benchmark;
+
+typedef struct {
+  const char *name;
+  uint64_t iters_per_sample;
+  int samples;
+  double min_ns, median_ns, mean_ns, p90_ns, mad_ns;
+} Result;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// --- Payload shapes ---
+
+// 50 mixed fields, like a wide SELECT * row
+static void push_wide_row(lua_State *L) {
+  lua_createtable(L, 0, 50);
+  char key[32];
+  for (int i = 0; i < 50; i++) {
+    snprintf(key, sizeof(key), "column_%02d", i);
+    if (i % 3 == 0)
+      lua_pushinteger(L, i * 1000);
+    else if (i % 3 == 1)
+      lua_pushnumber(L, i * 1.25);
+    else
+      lua_pushfstring(L, "value for column %d with some text", i);
+    lua_setfield(L, -2, key);
+  }
+}
+
+// Nested 6 levels, 3 children per level (~1100 tables)
+static void push_deep(lua_State *L, int depth) {
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, depth);
+  lua_setfield(L, -2, "depth");
+  if (depth == 0)
+    return;
+  const char *names[] = {"left", "middle", "right"};
+  for (int i = 0; i < 3; i++) {
+    push_deep(L, depth - 1);
+    lua_setfield(L, -2, names[i]);
+  }
+}
+
+// One 256 KB string, like a rendered page passed around
+static void push_large_string(lua_State *L) {
+  size_t len = 256 * 1024;
+  char *buf = malloc(len);
+  for (size_t i = 0; i < len; i++)
+    buf[i] = (char)('a' + i % 26);
+  lua_createtable(L, 0, 1);
+  lua_pushlstring(L, buf, len);
+  lua_setfield(L, -2, "body");
+  free(buf);
+}
+
+// Array of 1000 small records, like a listing page
+static void push_row_array(lua_State *L) {
+  lua_createtable(L, 1000, 0);
+  for (int i = 1; i <= 1000; i++) {
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, i);
+    lua_setfield(L, -2, "id");
+    lua_pushfstring(L, "SKU-%05d", i);
+    lua_setfield(L, -2, "sku");
+    lua_pushfstring(L, "Product number %d", i);
+    lua_setfield(L, -2, "name");
+    lua_pushinteger(L, i * 7);
+    lua_setfield(L, -2, "quantity");
+    lua_rawseti(L, -2, i);
+  }
+}
+
+static void setup_states(BenchState *s, void (*push)(lua_State *)) {
+  s->src = luaL_newstate();
+  s->dst = luaL_newstate();
+  push(s->src);
+  s->json = lua_table_to_json(s->src, 1);
+}
+
+static void push_deep6(lua_State *L) { push_deep(L, 6); }
+static void setup_wide(BenchState *s) { setup_states(s, push_wide_row); }
+static void setup_deep(BenchState *s) { setup_states(s, push_deep6); }
+static void setup_large(BenchState *s) { setup_states(s, push_large_string); }
+static void setup_rows(BenchState *s) { setup_states(s, push_row_array); }
+
+// --- Benchmarked operations ---
+
+static void run_copy_value(BenchState *s, uint64_t iters) {
+  for (uint64_t i = 0; i < iters; i++) {
+    copy_value(s->src, s->dst, 1);
+    lua_settop(s->dst, 0);
+  }
+}
+
+static void run_table_to_json(BenchState *s, uint64_t iters) {
+  // Same work as l_enqueue_job: build the tree and print it
+  for (uint64_t i = 0; i < iters; i++) {
+    cJSON *json = lua_table_to_json(s->src, 1);
+    char *text = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    free(text);
+  }
+}
+
+static void run_json_to_table(BenchState *s, uint64_t iters) {
+  for (uint64_t i = 0; i < iters; i++) {
+    json_to_lua_table(s->dst, s->json);
+    lua_settop(s->dst, 0);
+  }
+}
+
+static char bench_dir[] = "/tmp/microbench-XXXXXX";
+
+static void setup_db(BenchState *s, int columns, const char *sql) {
+  s->pm = create_manager();
+  s->plugin = calloc(1, sizeof(Plugin));
+  s->plugin->name = strdup("microbench");
+  s->plugin->path = strdup(bench_dir);
+  s->src = luaL_newstate();
+  s->sql = sql;
+
+  char db_path[1024];
+  snprintf(db_path, sizeof(db_path), "%s/plugin.db", bench_dir);
+  sqlite3 *db;
+  sqlite3_open(db_path, &db);
+
+  // Table "t<columns>" with alternating INTEGER / REAL / TEXT columns
+  char ddl[4096];
+  int n = snprintf(ddl, sizeof(ddl), "CREATE TABLE IF NOT EXISTS t%d (id INTEGER PRIMARY KEY", columns);
+  for (int c = 1; c < columns; c++)
+    n += snprintf(ddl + n, sizeof(ddl) - n, ", c%d %s", c,
+                  c % 3 == 0 ? "INTEGER" : (c % 3 == 1 ? "REAL" : "TEXT"));
+  snprintf(ddl + n, sizeof(ddl) - n, ")");
+  sqlite3_exec(db, ddl, NULL, NULL, NULL);
+
+  sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+  for (int r = 0; r < 100; r++) {
+    char ins[8192];
+    int m = snprintf(ins, sizeof(ins), "INSERT OR IGNORE INTO t%d VALUES (%d", columns, r + 1);
+    for (int c = 1; c < columns; c++) {
+      if (c % 3 == 0)
+        m += snprintf(ins + m, sizeof(ins) - m, ", %d", r * c);
+      else if (c % 3 == 1)
+        m += snprintf(ins + m, sizeof(ins) - m, ", %d.5", r + c);
+      else
+        m += snprintf(ins + m, sizeof(ins) - m, ", 'text value %d/%d'", r, c);
+    }
+    snprintf(ins + m, sizeof(ins) - m, ")");
+    sqlite3_exec(db, ins, NULL, NULL, NULL);
+  }
+  sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+  sqlite3_close(db);
+
+  // db_query runs its statements on the plugin's executor thread
+  s->plugin->db_executor = db_executor_create(db_path, s->plugin->name);
+  if (s->plugin->db_executor == NULL) {
+    fprintf(stderr, "could not start the db executor for %s\n", db_path);
+    exit(1);
+  }
+
+  lua_pushlightuserdata(s->src, s->plugin);
+  lua_pushcclosure(s->src, l_db_query, 1);
+  lua_setglobal(s->src, "db_query");
+}
+
+static void setup_db_narrow(BenchState *s) {
+  setup_db(s, 4, "SELECT * FROM t4");
+}
+static void setup_db_wide(BenchState *s) {
+  setup_db(s, 40, "SELECT * FROM t40");
+}
+
+static void run_db_query(BenchState *s, uint64_t iters) {
+  for (uint64_t i = 0; i < iters; i++) {
+    lua_getglobal(s->src, "db_query");
+    lua_pushstring(s->src, s->sql);
+    if (lua_pcall(s->src, 1, 1, 0) != LUA_OK) {
+      fprintf(stderr, "db_query failed: %s\n", lua_tostring(s->src, -1));
+      exit(1);
+    }
+    lua_settop(s->src, 0);
+  }
+}
+
+static void setup_env(BenchState *s) {
+  s->pm = create_manager();
+  s->plugin = calloc(1, sizeof(Plugin));
+  s->plugin->name = strdup("microbench");
+  s->plugin->path = strdup(bench_dir);
+}
+
+static void run_setup_environment(BenchState *s, uint64_t iters) {
+  // What every background job pays before running any plugin code
+  for (uint64_t i = 0; i < iters; i++) {
+    lua_State *L = luaL_newstate();
+    setup_lua_environment(L, s->plugin, s->pm);
+    lua_close(L);
+  }
+}
+
+static const Benchmark benchmarks[] = {
+    {"copy_value/wide_row", setup_wide, run_copy_value},
+    {"copy_value/deep", setup_deep, run_copy_value},
+    {"copy_value/large_string", setup_large, run_copy_value},
+    {"copy_value/row_array", setup_rows, run_copy_value},
+    {"lua_table_to_json/wide_row", setup_wide, run_table_to_json},
+    {"lua_table_to_json/deep", setup_deep, run_table_to_json},
+    {"lua_table_to_json/large_string", setup_large, run_table_to_json},
+    {"lua_table_to_json/row_array", setup_rows, run_table_to_json},
+    {"json_to_lua_table/wide_row", setup_wide, run_json_to_table},
+    {"json_to_lua_table/deep", setup_deep, run_json_to_table},
+    {"json_to_lua_table/large_string", setup_large, run_json_to_table},
+    {"json_to_lua_table/row_array", setup_rows, run_json_to_table},
+    {"db_query/100x4", setup_db_narrow, run_db_query},
+    {"db_query/100x40", setup_db_wide, run_db_query},
+    {"setup_lua_environment", setup_env, run_setup_environment},
+};
+#define BENCHMARK_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static void teardown(BenchState *s) {
+  if (s->src)
+    lua_close(s->src);
+  if (s->dst)
+    lua_close(s->dst);
+  if (s->json)
+    cJSON_Delete(s->json);
+  if (s->plugin) {
+    db_executor_destroy(s->plugin->db_executor);
+    free(s->plugin->name);
+    free(s->plugin->path);
+    free(s->plugin);
+  }
+  if (s->pm)
+    destroy_manager(s->pm);
+  memset(s, 0, sizeof(*s));
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void collect_garbage(BenchState *s) {
+  if (s->src)
+    lua_gc(s->src, LUA_GCCOLLECT, 0);
+  if (s->dst)
+    lua_gc(s->dst, LUA_GCCOLLECT, 0);
+}
+
+static Result measure(const Benchmark *b, int samples, double min_sample_ms) {
+  BenchState s = {0};
+  b->setup(&s);
+
+  // 1. Calibrate: double iterations until one sample is long enough
+  uint64_t iters = 1;
+  while (1) {
+    collect_garbage(&s);
+    uint64_t start = now_ns();
+    b->run(&s, iters);
+    double elapsed_ms = (now_ns() - start) / 1e6;
+    if (elapsed_ms >= min_sample_ms || iters >= (1ull << 30))
+      break;
+    iters *= 2;
+  }
+
+  // 2. Sample. GC runs between samples so garbage from one sample does not
+  // land in the next one's timing.
+  double *per_op = malloc(sizeof(double) * samples);
+  for (int i = 0; i < samples; i++) {
+    collect_garbage(&s);
+    uint64_t start = now_ns();
+    b->run(&s, iters);
+    per_op[i] = (double)(now_ns() - start) / (double)iters;
+  }
+  teardown(&s);
+
+  // 3. Robust statistics: median and median absolute deviation
+  qsort(per_op, samples, sizeof(double), compare_double);
+  Result r = {.name = b->name, .iters_per_sample = iters, .samples = samples};
+  r.min_ns = per_op[0];
+  r.median_ns = per_op[samples / 2];
+  r.p90_ns = per_op[(int)(0.9 * (samples - 1))];
+  double sum = 0;
+  for (int i = 0; i < samples; i++)
+    sum += per_op[i];
+  r.mean_ns = sum / samples;
+  for (int i = 0; i < samples; i++)
+    per_op[i] = fabs(per_op[i] - r.median_ns);
+  qsort(per_op, samples, sizeof(double), compare_double);
+  r.mad_ns = per_op[samples / 2];
+  free(per_op);
+  return r;
+}
+
+static cJSON *load_baseline(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return NULL;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *text = malloc((size_t)size + 1);
+  size_t got = fread(text, 1, (size_t)size, f);
+  text[got] = '\0';
+  fclose(f);
+  cJSON *json = cJSON_Parse(text);
+  free(text);
+  return json;
+}
+
+static double baseline_median(cJSON *baseline, const char *name) {
+  cJSON *results = cJSON_GetObjectItem(baseline, "results");
+  for (cJSON *r = results ? results->child : NULL; r; r = r->next) {
+    cJSON *n = cJSON_GetObjectItem(r, "name");
+    cJSON *m = cJSON_GetObjectItem(r, "median_ns");
+    if (n && m && n->valuestring && strcmp(n->valuestring, name) == 0)
+      return m->valuedouble;
+  }
+  return 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -f, --filter TEXT        only run benchmarks containing TEXT\n"
+          "  -n, --samples N          samples per benchmark (default 30)\n"
+          "  -m, --min-sample-ms MS   minimum sample duration (default 20)\n"
+          "  -o, --out FILE           write JSON results to FILE\n"
+          "  -b, --baseline FILE      compare medians against a previous run\n"
+          "  -t, --threshold PCT      allowed median regression (default 10)\n",
+          prog);
+}
+
+int main(int argc, char **argv) {
+  const char *filter = NULL;
+  const char *out_path = NULL;
+  const char *baseline_path = NULL;
+  int samples = 30;
+  double min_sample_ms = 20;
+  double threshold_pct = 10;
+
+  static struct option long_opts[] = {
+      {"filter", required_argument, 0, 'f'},
+      {"samples", required_argument, 0, 'n'},
+      {"min-sample-ms", required_argument, 0, 'm'},
+      {"out", required_argument, 0, 'o'},
+      {"baseline", required_argument, 0, 'b'},
+      {"threshold", required_argument, 0, 't'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, "f:n:m:o:b:t:h", long_opts, NULL)) !=
+         -1) {
+    switch (opt) {
+    case 'f': filter = optarg; break;
+    case 'n': samples = atoi(optarg); break;
+    case 'm': min_sample_ms = atof(optarg); break;
+    case 'o': out_path = optarg; break;
+    case 'b': baseline_path = optarg; break;
+    case 't': threshold_pct = atof(optarg); break;
+    default: usage(argv[0]); return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (samples < 3)
+    samples = 3;
+
+  if (mkdtemp(bench_dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  cJSON *baseline = baseline_path ? load_baseline(baseline_path) : NULL;
+  if (baseline_path && !baseline)
+    fprintf(stderr, "No baseline at %s, skipping comparison\n", baseline_path);
+
+  cJSON *doc = cJSON_CreateObject();
+  cJSON *results = cJSON_CreateArray();
+  cJSON_AddItemToObject(doc, "results", results);
+
+  int regressions = 0;
+  fprintf(stderr, "%-34s %12s %12s %10s %10s\n", "benchmark", "median", "p90",
+          "mad", "vs base");
+  for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+    if (filter && strstr(benchmarks[i].name, filter) == NULL)
+      continue;
+    Result r = measure(&benchmarks[i], samples, min_sample_ms);
+
+    char delta[32] = "-";
+    double base = baseline ? baseline_median(baseline, r.name) : 0;
+    if (base > 0) {
+      double pct = (r.median_ns - base) / base * 100.0;
+      snprintf(delta, sizeof(delta), "%+.1f%%%s", pct,
+               pct > threshold_pct ? " !" : "");
+      if (pct > threshold_pct)
+        regressions++;
+    }
+    fprintf(stderr, "%-34s %10.0fns %10.0fns %8.0fns %10s\n", r.name,
+            r.median_ns, r.p90_ns, r.mad_ns, delta);
+
+    cJSON *item = cJSON_CreateObject();
+    cJSON_AddStringToObject(item, "name", r.name);
+    cJSON_AddNumberToObject(item, "iters_per_sample", (double)r.iters_per_sample);
+    cJSON_AddNumberToObject(item, "samples", r.samples);
+    cJSON_AddNumberToObject(item, "min_ns", r.min_ns);
+    cJSON_AddNumberToObject(item, "median_ns", r.median_ns);
+    cJSON_AddNumberToObject(item, "mean_ns", r.mean_ns);
+    cJSON_AddNumberToObject(item, "p90_ns", r.p90_ns);
+    cJSON_AddNumberToObject(item, "mad_ns", r.mad_ns);
+    cJSON_AddItemToArray(results, item);
+  }
+
+  char *text = cJSON_Print(doc);
+  if (out_path) {
+    FILE *f = fopen(out_path, "w");
+    if (f) {
+      fputs(text, f);
+      fputc('\n', f);
+      fclose(f);
+    }
+  } else {
+    puts(text);
+  }
+  free(text);
+  cJSON_Delete(doc);
+  if (baseline)
+    cJSON_Delete(baseline);
+
+  char db_path[1100];
+  snprintf(db_path, sizeof(db_path), "%s/plugin.db", bench_dir);
+  unlink(db_path);
+  rmdir(bench_dir);
+
+  if (regressions > 0) {
+    fprintf(stderr, "%d benchmark(s) regressed more than %.0f%%\n",
+            regressions, threshold_pct);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Profile-guided optimization workflow:
+#   1. build an instrumented Release server (PGO_MODE=GENERATE)
+#   2. train it with the benchmark scenarios
+#   3. rebuild the same build dir with the collected profiles (PGO_MODE=USE)
+#
+# Usage: bench/pgo.sh [build-dir]   (default: build-pgo)
+#
+# Training length follows the BENCH_* variables of run_bench.sh; the
+# defaults here are shorter since only branch/call frequencies matter.
+set -e
+
+SRC_DIR=$(cd "$(dirname "$0")/.." && pwd)
+BUILD_DIR=$(realpath -m "${1:-build-pgo}")
+PROFILE_DIR="$BUILD_DIR/pgo-profiles"
+
+export BENCH_DURATION=${BENCH_DURATION:-5}
+export BENCH_WARMUP=${BENCH_WARMUP:-1}
+
+rm -rf "$PROFILE_DIR"
+
+echo "==> Building instrumented server" >&2
+cmake -S "$SRC_DIR" -B "$BUILD_DIR" -DCMAKE_BUILD_TYPE=Release \
+    -DPGO_MODE=GENERATE -DPGO_PROFILE_DIR="$PROFILE_DIR"
+cmake --build "$BUILD_DIR" --target main.out loadgen -j"$(nproc)"
+
+echo "==> Training with benchmark scenarios" >&2
+sh "$SRC_DIR/bench/run_bench.sh" "$BUILD_DIR/main.out" "$BUILD_DIR/loadgen" \
+    "$BUILD_DIR/pgo_training.json"
+
+# Profiles are written when the server exits normally, which run_bench.sh
+# brings about with SIGTERM
+if ! find "$PROFILE_DIR" -name '*.gcda' -o -name '*.profraw' 2>/dev/null |
+     grep -q .; then
+    echo "No profiles were written to $PROFILE_DIR" >&2
+    exit 1
+fi
+
+# Clang writes raw profiles that must be merged first
+if ls "$PROFILE_DIR"/*.profraw > /dev/null 2>&1; then
+    llvm-profdata merge -output="$PROFILE_DIR/default.profdata" \
+        "$PROFILE_DIR"/*.profraw
+fi
+
+echo "==> Rebuilding with profiles" >&2
+cmake -S "$SRC_DIR" -B "$BUILD_DIR" -DPGO_MODE=USE
+cmake --build "$BUILD_DIR" --target main.out -j"$(nproc)"
+echo "PGO build ready: $BUILD_DIR/main.out" >&2
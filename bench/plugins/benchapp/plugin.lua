@@ -0,0 +1,60 @@
+app = require("core")
+
+-- Scenario plugin for the bench target. Every route exercises one path
+-- through the host so results can be compared build to build.
+
+schema = {
+    items = {
+        id = "INTEGER PRIMARY KEY AUTOINCREMENT",
+        name = "TEXT NOT NULL",
+        sku = "TEXT NOT NULL",
+        price = "REAL DEFAULT 0",
+        quantity = "INTEGER DEFAULT 0",
+    }
+}
+
+-- Fixed data for the template scenario, so it measures rendering only
+local render_rows = {}
+for i = 1, 100 do
+    render_rows[i] = {
+        id = i,
+        sku = string.format("SKU-%05d", i),
+        name = "Item <" .. i .. "> & co",
+        quantity = i * 3,
+    }
+end
+
+-- The schema is applied after this file runs, so seed on first use
+local seeded = false
+local function ensure_seeded()
+    if seeded then return end
+    local rows = db_query("SELECT COUNT(*) AS n FROM items")
+    if rows[1].n == 0 then
+        for i = 1, 200 do
+            db_exec(string.format(
+                "INSERT INTO items (name, sku, price, quantity) VALUES ('Item %d', 'SKU-%05d', %d.5, %d)",
+                i, i, i, i * 2))
+        end
+    end
+    seeded = true
+end
+
+app.get("/render", function(req)
+    return app.render("list", {items = render_rows})
+end)
+
+app.get("/items", function(req)
+    ensure_seeded()
+    local items = db_query("SELECT * FROM items ORDER BY id LIMIT 100")
+    return app.render("list", {items = items})
+end)
+
+app.get("/query", function(req)
+    local result = app.query("bench.lookup", {id = 42, tags = {"a", "b", "c"}})
+    return "lookup:" .. tostring(result and result.id)
+end)
+
+app.get("/emit", function(req)
+    local listeners = app.emit("bench.event", {id = 42, kind = "update"})
+    return "notified:" .. tostring(listeners)
+end)
@@ -0,0 +1,14 @@
+app = require("core")
+
+-- Sync hook target for the "query" scenario and one of the "emit" listeners
+
+function lookup(data)
+    return {id = data.id, name = "item-" .. tostring(data.id), tags = data.tags}
+end
+
+function on_event(data)
+    return data.id
+end
+
+app.query_handle("bench.lookup", "lookup")
+app.emit_handle("bench.event", "on_event")
@@ -0,0 +1,9 @@
+app = require("core")
+
+-- Extra listener so the "emit" scenario fans out to several plugins
+
+function on_event(data)
+    return data.id
+end
+
+app.emit_handle("bench.event", "on_event")
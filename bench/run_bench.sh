@@ -0,0 +1,115 @@
+#!/bin/sh
+# Runs every benchmark scenario against a fresh server on this machine and
+# writes one JSON document with throughput and latency percentiles.
+#
+# Usage: run_bench.sh <server-binary> <loadgen-binary> [output.json]
+#
+# Tunables (environment):
+#   BENCH_SCENARIOS    space separated subset of: static render db_list query emit
+#   BENCH_DURATION     measured seconds per scenario (default 10)
+#   BENCH_WARMUP       unmeasured seconds per scenario (default 2)
+#   BENCH_CONNECTIONS  keep-alive connections (default 32)
+#   BENCH_THREADS      generator threads (default 4)
+#   BENCH_RATE         open-loop requests/second, 0 = closed loop (default 0)
+#   BENCH_EMIT_RATE    open-loop rate for "emit", which queues background
+#                      jobs and would otherwise grow the queue without bound
+#                      (default 500)
+set -e
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 <server-binary> <loadgen-binary> [output.json]" >&2
+    exit 2
+fi
+
+SERVER=$(realpath "$1")
+LOADGEN=$(realpath "$2")
+OUT=$(realpath -m "${3:-bench_results.json}")
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+
+SCENARIOS=${BENCH_SCENARIOS:-"static render db_list query emit"}
+DURATION=${BENCH_DURATION:-10}
+WARMUP=${BENCH_WARMUP:-2}
+CONNECTIONS=${BENCH_CONNECTIONS:-32}
+THREADS=${BENCH_THREADS:-4}
+RATE=${BENCH_RATE:-0}
+EMIT_RATE=${BENCH_EMIT_RATE:-500}
+
+WORKDIR=$(mktemp -d)
+cleanup() {
+    # SIGTERM shuts the server down the normal way (drain, then exit), so
+    # an instrumented build writes its profiles. Closing stdin does not
+    # stop it: without a terminal only signals do.
+    if [ -n "$SERVER_PID" ]; then
+        kill -TERM "$SERVER_PID" 2>/dev/null || true
+        wait "$SERVER_PID" 2>/dev/null || true
+    fi
+    exec 3>&- 2>/dev/null || true
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT INT TERM
+
+cp -r "$BENCH_DIR/plugins" "$WORKDIR/plugins"
+cd "$WORKDIR"
+
+# 1. Start the server; it runs until cleanup sends SIGTERM. The control
+# pipe keeps its stdin open for reload commands.
+mkfifo control
+"$SERVER" < control > server.log 2>&1 &
+SERVER_PID=$!
+exec 3> control
+
+tries=0
+until "$LOADGEN" -u /_metrics -c 1 -t 1 -d 0.1 -w 0 > /dev/null 2>&1; do
+    tries=$((tries + 1))
+    if [ $tries -ge 50 ]; then
+        echo "Server did not come up, log follows:" >&2
+        cat server.log >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+scenario_path() {
+    case "$1" in
+        static)  echo "/benchapp/static/bench.css" ;;
+        render)  echo "/benchapp/render" ;;
+        db_list) echo "/benchapp/items" ;;
+        query)   echo "/benchapp/query" ;;
+        emit)    echo "/benchapp/emit" ;;
+        *)       return 1 ;;
+    esac
+}
+
+# 2. Run each scenario and collect one JSON object per line
+results=""
+for scenario in $SCENARIOS; do
+    path=$(scenario_path "$scenario") || {
+        echo "Unknown scenario: $scenario" >&2
+        exit 2
+    }
+    rate=$RATE
+    if [ "$scenario" = "emit" ] && [ "$rate" = "0" ]; then
+        rate=$EMIT_RATE
+    fi
+    echo "Running $scenario ($path)..." >&2
+    line=$("$LOADGEN" --scenario "$scenario" --path "$path" \
+        --connections "$CONNECTIONS" --threads "$THREADS" \
+        --duration "$DURATION" --warmup "$WARMUP" --rate "$rate")
+    echo "$line" >&2
+    if [ -z "$results" ]; then
+        results="$line"
+    else
+        results="$results,
+$line"
+    fi
+done
+
+# 3. Wrap the runs with enough context to compare builds
+revision=$(git -C "$BENCH_DIR" rev-parse --short HEAD 2>/dev/null || echo unknown)
+{
+    echo "{\"revision\":\"$revision\",\"host\":\"$(uname -n)\",\"cpus\":$(nproc),"
+    echo "\"timestamp\":\"$(date -u +%Y-%m-%dT%H:%M:%SZ)\",\"results\":["
+    echo "$results"
+    echo "]}"
+} > "$OUT"
+echo "Wrote $OUT" >&2
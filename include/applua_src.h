@@ -2,236 +2,359 @@
 #ifndef APP_LUA_H
 #define APP_LUA_H
 
-const char* app_lua_source = R"lua(
-local core = {}
-core.routes = {}
-local etlua = require("etlua")
-
--- QUERIES (Synchronous)
--- Used when you need an immediate answer from another plugin.
-function core.query_handle(name, func_name) 
-    c_register_hook(name, func_name) 
-end
-
-function core.query(name, data) 
-    return c_call_hook(name, data or {}) 
-end
-
--- EMITS (Asynchronous Events)
--- Used to broadcast that something happened. Handlers run in background.
-function core.emit_handle(name, func_name) 
-    c_register_hook(name, func_name) 
-end
-
-function core.emit(name, data) 
-    return c_trigger_async_event(name, data or {}) 
-end
-
--- DEFER (Direct Asynchronous Task)
--- Used to offload a specific, known function to the background.
-function core.defer(func_name, data) 
-    c_enqueue_job(func_name, data or {}) 
-end
-
-local function parse_route(path)
-    local param_names = {}
-    
-    -- 1. Save the parameter names first
-    for name in path:gmatch("%[([^%]]+)%]") do
-        table.insert(param_names, name)
-    end
-
-    -- 2. Escape special Lua characters (. % + - * ? ^ $ etc.)
-    -- but EXCLUDE the brackets [ ] for a moment so we can find them easily
-    local pattern = path:gsub("([%(%)%.%%%+%-%*%?%^%$])", "%%%1")
-    
-    -- 3. Now replace [something] with the capture group ([^/]+)
-    -- We use .- for a non-greedy match inside the brackets
-    pattern = pattern:gsub("%[.-%]", "([^/]+)")
-    
-    return "^" .. pattern .. "$", param_names
-end
-
-
--- Helper to create a response object with chainable methods
--- Internal helper to create the chainable response
-local function create_response(body)
-    local resp = {
-        status_code = 200,
-        body = body or "",
-        headers = { ["Content-Type"] = "text/html" }
-    }
-    function resp:status(code)
-        self.status_code = code; return self
-    end
-
-    function resp:header(k, v)
-        self.headers[k] = v; return self
-    end
-
-    function resp:type(mime_type)
-        self.headers["Content-Type"] = mime_type
-        return self
-    end
-
-    return resp
-end
-
--- Render function
-function core.render(view_name, data)
-    -- 1. Security Check: Block directory traversal attempts
-    if view_name:find("%.%.") then
-        return create_response("Security Error: Invalid view name"):status(403)
-    end
-
-    -- 2. Normalize PLUGIN_DIR: Remove trailing slash if it exists, then add one
-    local base_path = PLUGIN_DIR:gsub("/$", "") .. "/"
-
-    -- 3. Construct absolute path
-    local path = base_path .. "views/" .. view_name .. ".etlua"
-
-    -- 4. Safe File Loading
-    local f = io.open(path, "r")
-    if not f then
-        core.error("Render Error: File not found at " .. path) -- Use logger!
-        return create_response("Template not found"):status(500)
-    end
-
-    local content = f:read("*a")
-    f:close()
-
-    -- 5. Robust Compilation & Execution
-    -- We use pcall to ensure a Lua error in the template doesn't crash the request
-    local ok_compile, template = pcall(etlua.compile, content)
-    if not ok_compile then
-        return create_response("Template Syntax Error: " .. tostring(template)):status(500)
-    end
-
-    local ok_render, html = pcall(template, data)
-    if not ok_render then
-        return create_response("Template Runtime Error: " .. tostring(html)):status(500)
-    end
-
-    -- Explicitly set HTML type since we are rendering a template
-    return create_response(html):type("text/html")
-end
-
--- Redirect function
-function core.redirect(url, status_code)
-    -- Default to 302 Found (Temporary Redirect) if no status is provided
-    local status = status_code or 302
-    
-    -- We create an empty response body because the browser follows the header
-    return create_response("")
-        :status(status)
-        :header("Location", url)
-end
-
-local function url_decode(str)
-    if not str then return "" end
-    str = str:gsub("+", " ")
-    str = str:gsub("%%(%x%x)", function(h) 
-        return string.char(tonumber(h, 16)) 
-    end)
-    return str
-end
-
-function core.parse_form(body)
-    local data = {}
-    if not body or body == "" then 
-        return data 
-    end
-
-    for key, value in body:gmatch("([^&=]+)=([^&]*)") do
-        local d_key = url_decode(key)
-        local d_val = url_decode(value)
-        data[d_key] = d_val
-    end
-
-    return data
-end
-function core.memory_kb()
-    return c_get_memory()
-end
-
--- Routing logic
-function core.match(method, path, handler)
-    local pattern, keys = parse_route(path)
-    table.insert(core.routes, {
-        method = method:upper(),
-        pattern = pattern,
-        keys = keys,
-        handler = handler
-    })
-end
-
-function core.get(path, handler) core.match("GET", path, handler) end
-function core.post(path, handler) core.match("UPDATE", path, handler) end
-function core.post(path, handler) core.match("POST", path, handler) end
-
-
--- Dispatcher
-function core.handle_request(req)
-    local method = req.method:upper()
-    req.form = {}
-    if method == "POST" or method == "PUT" then
-        -- for now, assume form encoded body    
-        req.form = core.parse_form(req.body or "")
-        for k,v in ipairs(core.parse_form(req.body or "")) do
-            print(k)
-            print(v)
-        end
-    end
-    
-    for _, route in ipairs(core.routes) do
-        if route.method == method then
-            -- match() returns all captures as multiple return values
-            local matches = { req.url:match(route.pattern) }
-            
-            if #matches > 0 then
-                req.params = {}
-                for i, name in ipairs(route.keys) do
-                    req.params[name] = matches[i]
-                end
-
-                local result = route.handler(req)
-                
-                -- Wrap simple string responses
-                if type(result) == "string" then
-                    result = { status_code = 200, body = result, headers = {["Content-Type"]="text/html"} }
-                end
-
-                return {
-                    status = result.status_code or 200,
-                    body = result.body or "",
-                    headers = result.headers or {}
-                }
-            end
-        end
-    end
-    
-    return { status = 404, body = "Not Found", headers = {} }
-end
-
-
-
--- Wrapper for the C-logging function
-function core.log(level, msg)
-    if c_log then
-        c_log(level:upper(), tostring(msg))
-    else
-        -- Fallback if not running inside the C host
-        print("[" .. level:upper() .. "] " .. tostring(msg))
-    end
-end
-
--- Syntax sugar for different levels
-function core.info(msg)  core.log("INFO", msg) end
-function core.warn(msg)  core.log("WARN", msg) end
-function core.error(msg) core.log("ERROR", msg) end
-
-return core
-)lua";
-
+const char* app_lua_source =
+    "local core = {}\n"
+    "core.routes = {}\n"
+    "local etlua = require(\"etlua\")\n"
+    "\n"
+    "-- QUERIES (Synchronous)\n"
+    "-- Used when you need an immediate answer from another plugin.\n"
+    "function core.query_handle(name, func_name) \n"
+    "    c_register_hook(name, func_name) \n"
+    "end\n"
+    "\n"
+    "function core.query(name, data) \n"
+    "    return c_call_hook(name, data or {}) \n"
+    "end\n"
+    "\n"
+    "-- EMITS (Asynchronous Events)\n"
+    "-- Used to broadcast that something happened. Handlers run in background.\n"
+    "-- opts.merge names a function merge(acc, data) that folds coalesced\n"
+    "-- events into one payload; without it the latest event wins.\n"
+    "function core.emit_handle(name, func_name, opts) \n"
+    "    opts = opts or {}\n"
+    "    c_register_hook(name, func_name, opts.priority, opts.merge) \n"
+    "end\n"
+    "\n"
+    "-- opts.key coalesces: an event whose key matches a job still waiting\n"
+    "-- for a worker is merged into it. opts.debounce (ms) holds the first\n"
+    "-- job of a key that long to collect what follows. opts.partition runs\n"
+    "-- the jobs of one partition one at a time, in order.\n"
+    "function core.emit(name, data, opts) \n"
+    "    return c_trigger_async_event(name, data or {}, opts) \n"
+    "end\n"
+    "\n"
+    "-- DEFER (Direct Asynchronous Task)\n"
+    "-- Used to offload a specific, known function to the background.\n"
+    "function core.defer(func_name, data, opts) \n"
+    "    c_enqueue_job(func_name, data or {}, opts) \n"
+    "end\n"
+    "\n"
+    "-- SPAWN (Fork / Join)\n"
+    "-- Runs func_name(data) on the worker pool; handle:await() returns what\n"
+    "-- it returned, or raises what it raised.\n"
+    "function core.spawn(func_name, data)\n"
+    "    return c_spawn(func_name, data or {})\n"
+    "end\n"
+    "\n"
+    "-- Calls func_name(item) for every item on the worker pool and returns\n"
+    "-- the results in order. Items go out in chunks of opts.chunk (default:\n"
+    "-- four chunks per worker); the first error is raised once all are back.\n"
+    "function core.parallel_map(func_name, items, opts)\n"
+    "    opts = opts or {}\n"
+    "    local n = #items\n"
+    "    local size = opts.chunk or math.max(1, math.ceil(n / (c_job_workers() * 4)))\n"
+    "    local chunks = {}\n"
+    "    for first = 1, n, size do\n"
+    "        local last = math.min(first + size - 1, n)\n"
+    "        local chunk = table.move(items, first, last, 1, {})\n"
+    "        chunks[#chunks + 1] = {first = first, last = last,\n"
+    "                               handle = c_spawn_map(func_name, chunk, first)}\n"
+    "    end\n"
+    "\n"
+    "    local results, err = {}, nil\n"
+    "    for _, c in ipairs(chunks) do\n"
+    "        local ok, part = pcall(c.handle.await, c.handle)\n"
+    "        if not ok then\n"
+    "            err = err or part\n"
+    "        else\n"
+    "            for i = c.first, c.last do\n"
+    "                results[i] = part[i - c.first + 1]\n"
+    "            end\n"
+    "        end\n"
+    "    end\n"
+    "    if err then error(err, 2) end\n"
+    "    return results\n"
+    "end\n"
+    "\n"
+    "-- Runs func_name(data) in the background once, after ms milliseconds.\n"
+    "-- Returns a timer id for core.cancel_timer.\n"
+    "function core.defer_in(ms, func_name, data)\n"
+    "    return c_defer_in(ms, func_name, data or {})\n"
+    "end\n"
+    "\n"
+    "-- Runs func_name(data) in the background every ms milliseconds. Calling\n"
+    "-- it again for the same function replaces the timer (same id), so it is\n"
+    "-- safe at the top level of plugin.lua.\n"
+    "function core.every(ms, func_name, data)\n"
+    "    return c_every(ms, func_name, data or {})\n"
+    "end\n"
+    "\n"
+    "function core.cancel_timer(id)\n"
+    "    return c_cancel_timer(id)\n"
+    "end\n"
+    "\n"
+    "local function parse_route(path)\n"
+    "    local param_names = {}\n"
+    "    \n"
+    "    -- 1. Save the parameter names first\n"
+    "    for name in path:gmatch(\"%[([^%]]+)%]\") do\n"
+    "        table.insert(param_names, name)\n"
+    "    end\n"
+    "\n"
+    "    -- 2. Escape special Lua characters (. % + - * ? ^ $ etc.)\n"
+    "    -- but EXCLUDE the brackets [ ] for a moment so we can find them easily\n"
+    "    local pattern = path:gsub(\"([%(%)%.%%%+%-%*%?%^%$])\", \"%%%1\")\n"
+    "    \n"
+    "    -- 3. Now replace [something] with the capture group ([^/]+)\n"
+    "    -- We use .- for a non-greedy match inside the brackets\n"
+    "    pattern = pattern:gsub(\"%[.-%]\", \"([^/]+)\")\n"
+    "    \n"
+    "    return \"^\" .. pattern .. \"$\", param_names\n"
+    "end\n"
+    "\n"
+    "\n"
+    "-- Helper to create a response object with chainable methods\n"
+    "-- Internal helper to create the chainable response\n"
+    "local function create_response(body)\n"
+    "    local resp = {\n"
+    "        status_code = 200,\n"
+    "        body = body or \"\",\n"
+    "        headers = { [\"Content-Type\"] = \"text/html\" }\n"
+    "    }\n"
+    "    function resp:status(code)\n"
+    "        self.status_code = code; return self\n"
+    "    end\n"
+    "\n"
+    "    function resp:header(k, v)\n"
+    "        self.headers[k] = v; return self\n"
+    "    end\n"
+    "\n"
+    "    function resp:type(mime_type)\n"
+    "        self.headers[\"Content-Type\"] = mime_type\n"
+    "        return self\n"
+    "    end\n"
+    "\n"
+    "    return resp\n"
+    "end\n"
+    "\n"
+    "-- JSON response: the host encodes `value` directly into the response\n"
+    "-- buffer, so no JSON string is built in Lua\n"
+    "function core.json(value, status)\n"
+    "    local resp = create_response():status(status or 200):type(\"application/json\")\n"
+    "    resp.json = value == nil and json.null or value\n"
+    "    return resp\n"
+    "end\n"
+    "\n"
+    "-- etlua compiler for strbuf output. Runs of text and <%= %> / <%- %>\n"
+    "-- values become one _put(_b, ...) call rather than a _b[_b_i] = ...\n"
+    "-- append each, so a page costs a C call per run instead of per chunk.\n"
+    "-- Every value starts a line with its --[[pos]] mark, which etlua reads\n"
+    "-- back to point errors at the template line.\n"
+    "local BufferCompiler = {}\n"
+    "BufferCompiler.__index = BufferCompiler\n"
+    "setmetatable(BufferCompiler, { __call = function(cls) return setmetatable({}, cls) end })\n"
+    "\n"
+    "function BufferCompiler:compile_chunks(chunks)\n"
+    "    local out = { \"local _tostring, _escape, _b = ...\\nlocal _put = _b.put\\n\" }\n"
+    "    local args = {}\n"
+    "    local function flush()\n"
+    "        if #args > 0 then\n"
+    "            out[#out + 1] = \"_put(_b,\\n\" .. table.concat(args, \",\\n\") .. \")\\n\"\n"
+    "            args = {}\n"
+    "        end\n"
+    "    end\n"
+    "\n"
+    "    for _, chunk in ipairs(chunks) do\n"
+    "        if type(chunk) == \"string\" then\n"
+    "            args[#args + 1] = (\"%q\"):format(chunk)\n"
+    "        elseif chunk[1] == \"code\" then\n"
+    "            flush()\n"
+    "            out[#out + 1] = \"--[[\" .. chunk[3] .. \"]] \" .. chunk[2] .. \"\\n\"\n"
+    "        elseif chunk[1] == \"=\" then\n"
+    "            args[#args + 1] = \"--[[\" .. chunk[3] .. \"]] _escape(_tostring(\" .. chunk[2] .. \"))\"\n"
+    "        elseif chunk[1] == \"-\" then\n"
+    "            args[#args + 1] = \"--[[\" .. chunk[3] .. \"]] _tostring(\" .. chunk[2] .. \")\"\n"
+    "        else\n"
+    "            error(\"unknown type \" .. tostring(chunk[1]))\n"
+    "        end\n"
+    "        -- Stay well below Lua's limit on the arguments of one call\n"
+    "        if #args == 64 then flush() end\n"
+    "    end\n"
+    "    flush()\n"
+    "    out[#out + 1] = \"return _b\"\n"
+    "    return table.concat(out)\n"
+    "end\n"
+    "\n"
+    "-- Render function\n"
+    "function core.render(view_name, data)\n"
+    "    local span_start = c_trace_now and c_trace_now() or 0\n"
+    "    -- 1. Security Check: Block directory traversal attempts\n"
+    "    if view_name:find(\"%.%.\") then\n"
+    "        return create_response(\"Security Error: Invalid view name\"):status(403)\n"
+    "    end\n"
+    "\n"
+    "    -- 2. Normalize PLUGIN_DIR: Remove trailing slash if it exists, then add one\n"
+    "    local base_path = PLUGIN_DIR:gsub(\"/$\", \"\") .. \"/\"\n"
+    "\n"
+    "    -- 3. Construct absolute path\n"
+    "    local path = base_path .. \"views/\" .. view_name .. \".etlua\"\n"
+    "\n"
+    "    -- 4. Safe File Loading\n"
+    "    local f = io.open(path, \"r\")\n"
+    "    if not f then\n"
+    "        core.error(\"Render Error: File not found at \" .. path) -- Use logger!\n"
+    "        return create_response(\"Template not found\"):status(500)\n"
+    "    end\n"
+    "\n"
+    "    local content = f:read(\"*a\")\n"
+    "    f:close()\n"
+    "\n"
+    "    -- 5. Robust Compilation & Execution\n"
+    "    -- We use pcall to ensure a Lua error in the template doesn't crash the request\n"
+    "    local parser = etlua.Parser()\n"
+    "    local ok_compile, fn, err = pcall(function()\n"
+    "        local code, err = parser:compile_to_lua(content, BufferCompiler)\n"
+    "        if not code then return nil, err end\n"
+    "        return parser:load(code)\n"
+    "    end)\n"
+    "    if not ok_compile or not fn then\n"
+    "        return create_response(\"Template Syntax Error: \" .. tostring(ok_compile and err or fn)):status(500)\n"
+    "    end\n"
+    "\n"
+    "    -- The template writes into a native buffer, which the host hands to\n"
+    "    -- the HTTP response as is: no table of chunks, no concat, no copy\n"
+    "    -- (the buffer starts at the size of this state's last page)\n"
+    "    local html = strbuf.new()\n"
+    "    local ok_render, render_err = pcall(parser.run, parser, fn, data, html, 0)\n"
+    "    if not ok_render then\n"
+    "        return create_response(\"Template Runtime Error: \" .. tostring(render_err)):status(500)\n"
+    "    end\n"
+    "\n"
+    "    if span_start ~= 0 then c_trace_span(\"render \" .. view_name, span_start) end\n"
+    "\n"
+    "    -- Explicitly set HTML type since we are rendering a template\n"
+    "    return create_response(html):type(\"text/html\")\n"
+    "end\n"
+    "\n"
+    "-- Redirect function\n"
+    "function core.redirect(url, status_code)\n"
+    "    -- Default to 302 Found (Temporary Redirect) if no status is provided\n"
+    "    local status = status_code or 302\n"
+    "    \n"
+    "    -- We create an empty response body because the browser follows the header\n"
+    "    return create_response(\"\")\n"
+    "        :status(status)\n"
+    "        :header(\"Location\", url)\n"
+    "end\n"
+    "\n"
+    "-- Function to parse form data into a table (decoded by the native text\n"
+    "-- module; a key without \"=\" maps to \"\")\n"
+    "function core.parse_form(body)\n"
+    "    if not body or body == \"\" then return {} end\n"
+    "    return text.parse_query(body)\n"
+    "end\n"
+    "\n"
+    "function core.memory_kb()\n"
+    "    return c_get_memory()\n"
+    "end\n"
+    "\n"
+    "-- Routing logic\n"
+    "-- opts.cache = { ttl = seconds, vary = {header, ...}, tags = {tag, ...} }\n"
+    "-- lets the host answer repeat GETs from its response cache\n"
+    "function core.match(method, path, handler, opts)\n"
+    "    local pattern, keys = parse_route(path)\n"
+    "    local cache = opts and opts.cache\n"
+    "    if cache and c_cache_route then\n"
+    "        c_cache_route(cache.vary or {})\n"
+    "    end\n"
+    "    table.insert(core.routes, {\n"
+    "        method = method:upper(),\n"
+    "        path = path,\n"
+    "        pattern = pattern,\n"
+    "        keys = keys,\n"
+    "        handler = handler,\n"
+    "        cache = cache\n"
+    "    })\n"
+    "end\n"
+    "\n"
+    "function core.get(path, handler, opts) core.match(\"GET\", path, handler, opts) end\n"
+    "function core.post(path, handler, opts) core.match(\"POST\", path, handler, opts) end\n"
+    "\n"
+    "-- Drops every cached response carrying this tag (each plugin's pages\n"
+    "-- are tagged with the plugin name; db_exec already purges those)\n"
+    "function core.cache_invalidate(tag)\n"
+    "    if c_cache_invalidate then c_cache_invalidate(tag) end\n"
+    "end\n"
+    "\n"
+    "\n"
+    "-- Dispatcher\n"
+    "function core.handle_request(req)\n"
+    "    local method = req.method:upper()\n"
+    "    -- Bodies without a Content-Type are treated as form posts\n"
+    "    local content_type = (req.headers and req.headers[\"Content-Type\"])\n"
+    "        or \"application/x-www-form-urlencoded\"\n"
+    "\n"
+    "    req.form = {}\n"
+    "\n"
+    "    if method == \"POST\" or method == \"PUT\" then\n"
+    "        if content_type:find(\"application/x-www-form-urlencoded\") then\n"
+    "            req.form = core.parse_form(req.body or \"\")\n"
+    "        end\n"
+    "    end\n"
+    "    \n"
+    "    for _, route in ipairs(core.routes) do\n"
+    "        if route.method == method then\n"
+    "            -- match() returns all captures as multiple return values\n"
+    "            local matches = { req.url:match(route.pattern) }\n"
+    "            \n"
+    "            if #matches > 0 then\n"
+    "                req.params = {}\n"
+    "                for i, name in ipairs(route.keys) do\n"
+    "                    req.params[name] = matches[i]\n"
+    "                end\n"
+    "\n"
+    "                local result = route.handler(req)\n"
+    "                \n"
+    "                -- Wrap simple string (or strbuf) responses\n"
+    "                if type(result) == \"string\" or type(result) == \"userdata\" then\n"
+    "                    result = { status_code = 200, body = result, headers = {[\"Content-Type\"]=\"text/html\"} }\n"
+    "                end\n"
+    "\n"
+    "                return {\n"
+    "                    status = result.status_code or 200,\n"
+    "                    body = result.body or \"\",\n"
+    "                    -- encoded by the host straight into the response\n"
+    "                    json = result.json,\n"
+    "                    headers = result.headers or {},\n"
+    "                    -- declared path, used by the host as the metrics label\n"
+    "                    route = route.path,\n"
+    "                    cache = route.cache\n"
+    "                }\n"
+    "            end\n"
+    "        end\n"
+    "    end\n"
+    "    \n"
+    "    return { status = 404, body = \"Not Found\", headers = {} }\n"
+    "end\n"
+    "\n"
+    "\n"
+    "\n"
+    "-- Wrapper for the C-logging function\n"
+    "function core.log(level, msg)\n"
+    "    if c_log then\n"
+    "        c_log(level:upper(), tostring(msg))\n"
+    "    else\n"
+    "        -- Fallback if not running inside the C host\n"
+    "        print(\"[\" .. level:upper() .. \"] \" .. tostring(msg))\n"
+    "    end\n"
+    "end\n"
+    "\n"
+    "-- Syntax sugar for different levels\n"
+    "function core.info(msg)  core.log(\"INFO\", msg) end\n"
+    "function core.warn(msg)  core.log(\"WARN\", msg) end\n"
+    "function core.error(msg) core.log(\"ERROR\", msg) end\n"
+    "\n"
+    "return core\n";
 
 #endif /* APP_LUA_H */
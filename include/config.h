@@ -0,0 +1,56 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+#include "plugin_manager.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// Reserved URL for the effective configuration and server status
+#define STATUS_PATH "/_status"
+
+// How MHD waits for socket events
+typedef enum {
+  POLL_AUTO,   // best available (epoll on Linux)
+  POLL_EPOLL,
+  POLL_POLL,
+  POLL_SELECT,
+  POLL_THREAD_PER_CONNECTION,
+} PollMode;
+
+// HTTP listener settings. Zero means "MHD's default" for every limit.
+typedef struct {
+  unsigned int port;
+  char bind_address[64];        // empty: all interfaces
+  PollMode poll;
+  unsigned int poll_threads;    // listener threads, each with its own poll set
+  unsigned int connection_limit;
+  unsigned int per_ip_limit;
+  unsigned int connection_timeout; // idle seconds before a keep-alive
+                                   // connection is closed
+  size_t connection_memory;     // per-connection buffer, bytes
+  unsigned int listen_backlog;
+  unsigned int tcp_fastopen;    // TFO queue length, 0 = off
+} ServerConfig;
+
+// Reads the config file named by SERVER_CONFIG (default ./server.conf,
+// silently skipped when missing). Each `key = value` line sets the
+// environment variable SERVER_<KEY> unless the environment already has
+// it, so the file covers every SERVER_* setting (`log_level = debug`)
+// and the environment still wins. Call first, before the *_init()
+// functions read their variables.
+void config_load(void);
+const ServerConfig *config_get(void);
+
+// CPUs this process can use: its affinity mask, capped by a cgroup CPU
+// quota rounded up. The default for every thread count.
+int cpu_budget(void);
+// The CPUs of the affinity mask (malloc'd), ordered to alternate between
+// NUMA nodes; returns how many
+int cpu_list(int **out);
+const char *poll_mode_name(PollMode mode);
+
+// JSON with the listener settings, the config file used, uptime, the
+// current connection count and the loaded plugins (malloc'd)
+char *config_render(PluginManager *pm, unsigned int connections,
+                    size_t *len);
+
+#endif
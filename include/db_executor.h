@@ -0,0 +1,104 @@
+#ifndef DB_EXECUTOR_H
+#define DB_EXECUTOR_H
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Per-plugin SQLite executor. The plugin database runs in WAL mode with
+// one writer connection and SERVER_DB_READERS (default 2) reader
+// connections, each on its own thread:
+//   - queries go to whichever reader is free; a query that turns out to
+//     write (INSERT ... RETURNING) is handed to the writer
+//   - statements queued while the writer is busy are committed together
+//     in one transaction (at most SERVER_DB_BATCH, default 64), each in
+//     its own savepoint so one failure does not roll back the others
+//   - a transaction pins the writer: after its BEGIN, the writer serves
+//     only that transaction's statements until COMMIT / ROLLBACK, or
+//     rolls it back after SERVER_DB_TXN_TIMEOUT_MS (default 5000) with
+//     no statement
+// Threads and connections are only created on first use.
+
+typedef enum {
+  DB_EXEC,
+  DB_QUERY,
+  DB_BULK, // one prepared statement, run once per row of `params`
+  DB_BEGIN,
+  DB_COMMIT,
+  DB_ROLLBACK,
+} DbOp;
+
+// One materialized column value (type is the SQLITE_* type code)
+typedef struct {
+  int type;
+  int64_t i;
+  double d;
+  char *s;
+  size_t len;
+} DbValue;
+
+// Outcome of a db_exec / db_query statement, owned by C so it can be
+// produced on one thread and returned to Lua on another
+typedef struct {
+  bool ok;
+  bool open_failed;
+  char *error;
+  int ncols;
+  char **names;
+  size_t nrows;
+  DbValue *values; // nrows * ncols, row-major
+  int64_t changes; // rows written by DB_EXEC / DB_BULK
+} DbResult;
+
+// Writer ownership shared by the statements of one transaction
+typedef struct DbTxn DbTxn;
+
+// A submitted statement. Shared by the executor and the submitter until
+// both have released it.
+typedef struct DbRequest {
+  char *sql;
+  DbOp op;
+  DbTxn *txn;           // NULL outside a transaction
+  DbResult params;      // DB_BULK input rows (names unused)
+  DbResult result;      // valid once done
+  uint64_t trace_start; // trace_now() at submit
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool done;
+  void (*notify)(void *arg); // called once, from the executor thread
+  void *notify_arg;
+  atomic_int refs;
+
+  struct DbRequest *next;
+} DbRequest;
+
+typedef struct DbExecutor DbExecutor;
+
+DbExecutor *db_executor_create(const char *db_path, const char *plugin_name);
+// Finishes every queued statement, then closes the connections
+void db_executor_destroy(DbExecutor *ex);
+
+// Queues a statement and returns immediately; NULL when out of memory.
+// Once db_executor_destroy has begun, the request comes back done, with
+// an error.
+// DB_BULK takes ownership of `params`, the other ops ignore it.
+DbRequest *db_submit(DbExecutor *ex, DbTxn *txn, DbOp op, const char *sql,
+                     DbResult *params);
+// Arranges for notify(arg) once the statement finishes. Returns false
+// (and never calls notify) when it already has.
+bool db_request_set_notify(DbRequest *req, void (*notify)(void *), void *arg);
+void db_request_wait(DbRequest *req);
+bool db_request_done(DbRequest *req);
+void db_request_release(DbRequest *req);
+
+// Submit, wait and take the result in one go
+void db_execute(DbExecutor *ex, const char *sql, bool query, DbResult *out);
+void db_result_free(DbResult *r);
+
+DbTxn *db_txn_create(void);
+// Owners and queued statements each hold a reference
+void db_txn_release(DbTxn *txn);
+
+#endif
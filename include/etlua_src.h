@@ -42,6 +42,9 @@ const char* etlua_source =
     "html_escape = function(str)\n"
     "  return (str:gsub([=[[\"><'&]]=], html_escape_entities))\n"
     "end\n"
+    "if text and text.html_escape then\n"
+    "  html_escape = text.html_escape\n"
+    "end\n"
     "local get_line\n"
     "get_line = function(str, line_num)\n"
     "  for line in str:gmatch(\"([^\\n]*)\\n?\") do\n"
@@ -0,0 +1,58 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+#include "lua_helpers.h"
+#include "plugin_manager.h"
+#include "server.h"
+#include <lua.h>
+#include <stdbool.h>
+
+// Optional execution mode (SERVER_MODE=loop). Instead of one thread per
+// request, handlers run as Lua coroutines on a few epoll loop threads
+// (SERVER_LOOP_THREADS, default one per core). A coroutine yields back
+// to its loop when it would block:
+//   - db_query / db_exec / handle:await() wait on the plugin's DB executor
+//   - a spawned job's handle:await() waits on the worker pool
+//   - app.emit / app.defer wait for the job log to sync their jobs
+//   - the plugin state (or a sync hook's target) is locked elsewhere;
+//     the request is parked on that plugin until its lock is released
+// The plugin lock is only held while a coroutine is actually running,
+// so thousands of slow requests can be in flight at once.
+void event_loop_start(PluginManager *pm);
+void event_loop_stop(void);
+bool event_loop_enabled(void);
+
+// Releases p->lock and hands it to the requests parked on it. Every
+// unlock of a plugin state goes through here, whatever the mode.
+void event_loop_unlock_plugin(Plugin *p);
+
+// Called by respond() for a suspended connection
+void event_loop_submit(RequestContext *ctx);
+
+// True when L is a request coroutine that can yield to its loop. C
+// functions fall back to blocking when this is false (background jobs,
+// thread mode, nested coroutines, non-yieldable C boundaries).
+bool event_loop_can_yield(lua_State *L);
+
+// True while a loop thread runs request code, which must never block:
+// when it cannot yield either, it goes on without waiting
+bool event_loop_on_loop_thread(void);
+
+// Parks the coroutine until `req` finishes, then resumes it through `k`
+// (straight away, without yielding, if it already has)
+int event_loop_yield_db(lua_State *L, DbRequest *req, lua_KContext kctx,
+                        lua_KFunction k);
+
+// Same for a job started with app.spawn
+int event_loop_yield_job(lua_State *L, JobFuture *f, lua_KContext kctx,
+                         lua_KFunction k);
+
+// Same for a job log record written by app.emit / app.defer
+int event_loop_yield_log(lua_State *L, JobLog *log, uint64_t seq,
+                         lua_KContext kctx, lua_KFunction k);
+
+// Resumes through `k` once `target`'s lock is held as well as the
+// caller's plugin lock; the loop releases it when the slice ends
+int event_loop_yield_for_lock(lua_State *L, Plugin *target, lua_KContext kctx,
+                              lua_KFunction k);
+
+#endif
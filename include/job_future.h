@@ -0,0 +1,35 @@
+#ifndef JOB_FUTURE_H
+#define JOB_FUTURE_H
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Result of a job started with app.spawn / app.parallel_map. Shared by
+// the worker that runs the job and the handle the caller awaits, until
+// both have released it.
+typedef struct JobFuture {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool done;
+  bool ok;
+  char *result; // JSON text of the return value, or the error message
+
+  void (*notify)(void *arg); // called once, from the worker
+  void *notify_arg;
+  atomic_int refs;
+} JobFuture;
+
+// Starts with two references: the job's and the caller's
+JobFuture *job_future_create(void);
+// Takes ownership of `result`
+void job_future_complete(JobFuture *f, bool ok, char *result);
+// Arranges for notify(arg) once the job finishes. Returns false (and
+// never calls notify) when it already has.
+bool job_future_set_notify(JobFuture *f, void (*notify)(void *), void *arg);
+void job_future_wait(JobFuture *f);
+// Waits at most timeout_ms; returns whether the job has finished
+bool job_future_wait_for(JobFuture *f, int timeout_ms);
+bool job_future_done(JobFuture *f);
+void job_future_release(JobFuture *f);
+
+#endif
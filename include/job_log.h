@@ -0,0 +1,70 @@
+#ifndef JOB_LOG_H
+#define JOB_LOG_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Durable append log behind the background job queue, enabled with
+// SERVER_JOB_LOG=dir. Each run writes to its own <dir>/<pid>-<start>/
+// directory, held with an flock:
+//   - records go to memory-mapped segment files of
+//     SERVER_JOB_LOG_SEGMENT_MB (default 16); a segment is deleted once
+//     it and every older one hold no unfinished job
+//   - a flusher thread msyncs everything appended since its last pass in
+//     one go, so concurrent enqueues share one sync (group commit)
+//   - a job is acknowledged with its own record after it ran
+//   - a directory whose lock is free belongs to a process that is gone;
+//     its unacknowledged jobs are handed back by job_log_replay_orphans
+// The log also holds jobs spilled out of the in-memory queue: they are
+// appended with `spill` set and read back in order later.
+
+typedef struct JobLog JobLog;
+
+// One job as stored; the strings point into the log and are only valid
+// during the callback they are passed to
+typedef struct {
+  uint64_t seq;
+  const char *plugin;
+  const char *func;
+  const char *payload;
+  const char *partition; // "" when the job has none
+} JobRecord;
+
+typedef void (*JobRecordFn)(void *arg, const JobRecord *job);
+
+JobLog *job_log_open(const char *dir);
+// Syncs and closes; removes the directory when no job is unfinished
+void job_log_close(JobLog *log);
+
+// Appends a job and returns its sequence number (0 on failure). It is
+// durable once job_log_wait() returns for that number.
+uint64_t job_log_append(JobLog *log, const char *plugin, const char *func,
+                        const char *payload, const char *partition,
+                        bool spill);
+void job_log_wait(JobLog *log, uint64_t seq);
+
+// A wait for a sync that does not block a thread; the node belongs to the
+// caller and is linked into the log until notify runs
+typedef struct JobLogWaiter {
+  uint64_t seq;
+  void (*notify)(void *);
+  void *arg;
+  struct JobLogWaiter *next;
+} JobLogWaiter;
+
+// Arranges for notify(arg) once `seq` is durable or the log closes, from
+// the thread that synced it. Returns false (and never calls notify) when
+// that has already happened.
+bool job_log_set_notify(JobLog *log, uint64_t seq, JobLogWaiter *w,
+                        void (*notify)(void *), void *arg);
+// Marks a job as done; it is not replayed after a restart
+void job_log_ack(JobLog *log, uint64_t seq);
+
+// Calls fn for up to `max` spilled jobs in append order; returns how many
+int job_log_read_spilled(JobLog *log, int max, JobRecordFn fn, void *arg);
+
+// Calls fn for every unfinished job left by processes that are gone, in
+// append order, then deletes their logs. fn must copy what it keeps.
+int job_log_replay_orphans(JobLog *log, JobRecordFn fn, void *arg);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef KV_STORE_H
+#define KV_STORE_H
+#include <lua.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Host-wide key-value store shared by every plugin and job state.
+// Keys hash onto lock stripes; values are kept in a compact binary
+// encoding of Lua values (nil, booleans, integers, floats, strings and
+// nested tables), so reads never touch the state that wrote them.
+typedef struct KvStore KvStore;
+
+#define KV_MAX_KEY 256
+
+// Limits come from SERVER_KV_MB (total, default 64) and
+// SERVER_KV_MAX_VALUE_KB (per value, default 64)
+KvStore *kv_store_create(void);
+void kv_store_destroy(KvStore *kv);
+void kv_store_stats(KvStore *kv, size_t *keys_out, size_t *bytes_out);
+
+// Installs the global `kv` table:
+//   kv.get(key)                     -> value | nil
+//   kv.set(key, value [, ttl])      -> true | nil, err  (nil value deletes)
+//   kv.incr(key [, by [, ttl]])     -> new integer
+//   kv.cas(key, old, new [, ttl])   -> true if the value was `old`
+//   kv.expire(key, ttl)             -> true if the key exists (nil ttl
+//                                      makes it permanent)
+//   kv.del(key)                     -> true if the key existed
+// TTLs are in seconds.
+void kv_store_setup_lua(lua_State *L, KvStore *kv);
+
+#endif
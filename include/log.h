@@ -0,0 +1,36 @@
+#ifndef LOG_H
+#define LOG_H
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_OFF } LogLevel;
+
+// Configured once at startup:
+//   SERVER_LOG_LEVEL=debug|info|warn|error|off   (default info)
+//   SERVER_LOG_FORMAT=text|json|logfmt           (default text)
+//   SERVER_LOG_FILE=path                         (default stdout)
+//   SERVER_LOG_MAX_MB=n  SERVER_LOG_KEEP=n       rotation (default 64 / 5)
+// log_init starts the writer thread; log_shutdown drains and joins it.
+// Before log_init (or after log_shutdown) records are written inline.
+void log_init(void);
+void log_shutdown(void);
+
+// Cheap check so callers can skip building a message nobody will see
+bool log_enabled(LogLevel level);
+LogLevel log_level_from_string(const char *name);
+
+// `source` is the plugin name or a host subsystem ("server", "monitor").
+// Never blocks: when this thread's ring is full the record is dropped
+// and counted instead.
+void log_write(LogLevel level, const char *source, const char *fmt, ...);
+void log_vwrite(LogLevel level, const char *source, const char *fmt,
+                va_list args);
+void log_message(LogLevel level, const char *source, const char *msg,
+                 size_t len);
+
+// Records dropped because a producer ring was full
+uint64_t log_dropped(void);
+
+#endif
@@ -3,6 +3,8 @@
 #include "cJSON.h"
 #include "plugin_manager.h"
 #include <lua.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 
 int l_get_mem_usage(lua_State *L);
@@ -15,7 +17,15 @@ void copy_table_between_states(lua_State *from, lua_State *to, int index);
 void copy_value_back(lua_State *from, lua_State *to, int index);
 void setup_lua_environment(lua_State *L, Plugin *p, PluginManager *pm);
 cJSON *lua_table_to_json(lua_State *L, int index);
-void apply_plugin_schema(lua_State *L, Plugin *p);
+void json_to_lua_table(lua_State *L, cJSON *item);
 int l_db_exec(lua_State *L);
 int l_db_query(lua_State *L);
+int l_db_query_async(lua_State *L);
+int l_db_exec_async(lua_State *L);
+int l_db_transaction(lua_State *L);
+int l_db_insert_many(lua_State *L);
+
+int db_result_return(lua_State *L, Plugin *p, DbResult *r, DbOp op);
+// The transaction the running coroutine has open, if any
+DbTxn *db_current_txn(lua_State *L, Plugin *p);
 #endif
\ No newline at end of file
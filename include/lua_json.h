@@ -0,0 +1,30 @@
+#ifndef LUA_JSON_H
+#define LUA_JSON_H
+#include <lua.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// The `json` module of every Lua state. Values are encoded straight from
+// the Lua stack into a growing buffer and decoded straight into Lua
+// tables, without building a cJSON tree in between.
+//
+//   json.encode(value) -> text; raises on values JSON cannot hold
+//   json.decode(text)  -> value, or nil and an error with its position
+//   json.null          -> stands for null in both directions
+//
+// A table is encoded as an array when its keys are exactly 1..#t, as an
+// object otherwise (so {} is "{}"). Object keys must be strings or
+// numbers. NaN and infinities become null.
+
+// Encodes the value at idx into a malloc'd, NUL-terminated string. Never
+// raises: on failure returns NULL and points *err at a static message.
+// Only raw accesses are made, so it is safe outside a protected call.
+char *json_encode(lua_State *L, int idx, size_t *len, const char **err);
+// Pushes the decoded value and returns true, or pushes nothing and
+// writes the error into err. Raises only when out of memory.
+bool json_decode(lua_State *L, const char *text, size_t len, char *err,
+                 size_t err_size);
+// Sets the global `json` and package.loaded.json
+void json_open(lua_State *L);
+
+#endif
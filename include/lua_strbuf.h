@@ -0,0 +1,32 @@
+#ifndef LUA_STRBUF_H
+#define LUA_STRBUF_H
+#include <lua.h>
+#include <stddef.h>
+
+// The `strbuf` module of every Lua state: a growable byte buffer in C
+// memory, used by app.render as etlua's output buffer so a page is never
+// a table of chunks or a Lua string.
+//
+//   strbuf.new([size])  -> an empty buffer, preallocated to size bytes or
+//                          to the last page this state handed off
+//   b:put(...)          -> appends strings and numbers, returns b
+//   b[i] = s            -> appends s (etlua's _b[_b_i] = ...; i is ignored)
+//   b:reset()           -> empties b, keeping its memory
+//   #b, tostring(b), b .. s
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+  size_t *hint; // the state's size of the last page handed off
+} StrBuf;
+
+// Returns the buffer at idx, or NULL when it is not one
+StrBuf *strbuf_test(lua_State *L, int idx);
+// Hands the bytes over as a malloc'd string (for MHD_RESPMEM_MUST_FREE)
+// and leaves b empty; the length becomes the state's size hint. Returns
+// NULL only when out of memory.
+char *strbuf_detach(StrBuf *b, size_t *len);
+// Sets the global `strbuf` and package.loaded.strbuf
+void strbuf_open(lua_State *L);
+
+#endif
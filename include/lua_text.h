@@ -0,0 +1,21 @@
+#ifndef LUA_TEXT_H
+#define LUA_TEXT_H
+#include <lua.h>
+
+// The `text` module of every Lua state: string kernels for the hot spots
+// of rendering and form parsing.
+//
+//   text.html_escape(s)  -> s with & < > " ' as entities (etlua's <%= %>)
+//   text.url_decode(s)   -> '+' as space, %XX as the byte
+//   text.url_encode(s)   -> every byte but A-Z a-z 0-9 - _ . ~ as %XX
+//   text.parse_query(s)  -> {key = value} of an a=1&b=2 string, decoded
+//
+// Each one first scans for the bytes it has to change, 32 or 16 at a
+// time with AVX2 or SSE2 (picked at startup; a byte at a time elsewhere),
+// and returns its argument untouched when there are none, which is the
+// common case for template values.
+
+// Sets the global `text` and package.loaded.text
+void text_open(lua_State *L);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include "plugin_manager.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Reserved URL that serves the Prometheus text exposition
+#define METRICS_PATH "/_metrics"
+
+// Every metric family the host records. Labels are fixed per family so
+// the hot path only hands over label values.
+typedef enum {
+  METRIC_HTTP_REQUEST_SECONDS, // histogram {plugin, route}
+  METRIC_HTTP_RESPONSES_TOTAL, // counter   {plugin, code}
+  METRIC_JOB_WAIT_SECONDS,     // histogram {plugin}
+  METRIC_JOB_RUN_SECONDS,      // histogram {plugin}
+  METRIC_HOOK_CALLS_TOTAL,     // counter   {hook, kind}
+  METRIC_SQLITE_SECONDS,       // histogram {plugin, op}
+  METRIC_SQLITE_STATEMENTS_TOTAL, // counter {plugin, conn}
+  METRIC_LUA_GC_FREED_BYTES,   // counter   {plugin}
+  METRIC_CACHE_LOOKUPS_TOTAL,  // counter   {plugin, result}
+  METRIC_JOBS_COALESCED_TOTAL, // counter   {hook}
+  METRIC_FAMILY_COUNT
+} MetricFamilyId;
+
+typedef struct MetricSeries MetricSeries;
+
+// Monotonic clock in nanoseconds, used for every duration we record
+uint64_t metrics_now_ns(void);
+
+// Find or create the series for a family + label values. Lookups are
+// lock-free; only the first sighting of a label set takes a lock.
+// Unused trailing labels may be NULL.
+MetricSeries *metrics_series(MetricFamilyId family, const char *label1,
+                             const char *label2);
+
+// Histogram families: record one duration
+void metrics_observe_ns(MetricSeries *s, uint64_t ns);
+// Counter families: add n
+void metrics_add(MetricSeries *s, uint64_t n);
+
+// Convenience wrappers for the common "look up, then record" pattern
+void metrics_observe(MetricFamilyId family, const char *label1,
+                     const char *label2, uint64_t ns);
+void metrics_count(MetricFamilyId family, const char *label1,
+                   const char *label2);
+
+// Renders all series plus scrape-time gauges (queue depth, Lua heaps).
+// Returns a malloc'd buffer the caller owns.
+char *metrics_render(PluginManager *pm, size_t *len_out);
+
+#endif
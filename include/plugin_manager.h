@@ -5,13 +5,22 @@
 #include <lauxlib.h>
 #include <pthread.h>
 #include <sqlite3.h>
+#include <stdint.h>
+#include "db_executor.h"
+#include "job_future.h"
+#include "job_log.h"
+#include "kv_store.h"
 
 typedef struct {
     char *name;
     char *path;
     lua_State *L;
     sqlite3 *db;
+    DbExecutor *db_executor; // runs db_exec / db_query off the Lua thread
     pthread_mutex_t lock;
+    pthread_mutex_t park_lock;  // guards parked
+    struct LoopTask *parked;    // loop requests waiting for `lock`
+    size_t heap_seen; // Lua heap after the last request, for GC deltas
 } Plugin;
 
 
@@ -19,7 +28,26 @@ typedef struct Job {
     Plugin *plugin;       // Direct pointer to the owner
     char *lua_func_name;  // Function to call
     char *payload;        // JSON data
+    uint64_t enqueued_ns; // metrics_now_ns() when queued, for wait time
+    uint64_t ready_ns;    // when it last became runnable, for pool sizing
+    uint64_t seq;         // job log sequence, 0 when only held in memory
+    char *partition;      // plugin + key; such jobs run one at a time, in
+                          // order. NULL for unordered jobs.
+    JobFuture *future;    // app.spawn: gets the return value; never logged
+    bool map_items;       // app.parallel_map chunk: payload is
+                          // {first = n, items = [...]}, func runs per item
     struct Job *next;
+
+    // Coalescing (app.emit with a key): later events for the same hook,
+    // listener and key fold into this job until a worker takes it
+    char *coalesce_key;   // NULL for an ordinary job
+    char *merge_func;     // listener's merge function, NULL: last one wins
+    char *batch;          // with merge_func: JSON array text of the later
+    size_t batch_len;     // payloads, without the closing bracket
+    uint64_t *acks;       // log records of the payloads in batch
+    int nacks;
+    bool held;            // waiting out its debounce window
+    struct Job *coalesce_next;
 } Job;
 
 typedef struct {
@@ -29,12 +57,43 @@ typedef struct {
     pthread_mutex_t lock;
     pthread_cond_t cond;
     bool shutdown;
+    bool draining;   // workers exit once the queue is empty
+    int running;     // worker threads that have not exited
+    int retire;      // idle workers asked to exit by the pool scaler
+    uint64_t wait_ns; // time taken jobs spent runnable in the list, and
+    uint64_t waited;  // how many, since the scaler last sampled them
+
+    // Durable mode (SERVER_JOB_LOG): every job is logged before it is
+    // queued; past `high_water` queued jobs new ones stay in the log only
+    JobLog *log;
+    int high_water;
+    int spilled;     // jobs in the log waiting for room in the list
+    bool wait_sync;  // enqueue returns once the job is on disk
+
+    // Keyed jobs not yet taken by a worker, by coalesce_key
+    Job **coalesce;
+    size_t coalesce_buckets;
+
+    // Partitions with a job running or queued; later jobs of the same
+    // partition are parked there until it finishes
+    struct Partition **partitions;
+    size_t partition_buckets;
+    int parked;
 } JobQueue;
 
+// Delayed and periodic jobs (app.defer_in / app.every), kept on a
+// hierarchical timer wheel and queued as normal jobs when they fire
+typedef struct TimerService TimerService;
+
+// Worker threads and the controller that resizes them, see
+// start_worker_pool
+typedef struct WorkerPool WorkerPool;
+
 typedef struct {
     char *hook_name;
     Plugin *plugin;
     char *lua_func_name; // The function name within that plugin's Lua state
+    char *merge_func_name; // Folds coalesced async payloads, or NULL
     int priority; // Lower numbers = higher priority (runs sooner)
 } HookRegistration;
 
@@ -52,8 +111,13 @@ typedef struct {
     // The Job Queue
     JobQueue *queue;
     // Background Worker Management
-    pthread_t *worker_threads;
-    int num_workers;
+    WorkerPool *pool;
+    int num_workers; // live worker threads
+    // Timers started with the worker pool
+    TimerService *timers;
+
+    // Shared key-value store (the `kv` table in every Lua state)
+    KvStore *kv;
 
     pthread_mutex_t lock;
     pthread_cond_t cond;
@@ -66,13 +130,45 @@ Plugin* create_plugin(char *name, char *path);
 void refresh_plugins(PluginManager *pm);
 void preload_module(lua_State *L, const char *name, const char *source);
 int l_log(lua_State *L);
-void register_logger(lua_State *L);
+void register_logger(lua_State *L, Plugin *p);
+// A positive num_workers (or SERVER_JOB_WORKERS) gives a fixed pool.
+// Otherwise it starts at cpu_budget() threads and grows and shrinks
+// between SERVER_JOB_WORKERS_MIN and SERVER_JOB_WORKERS_MAX with the
+// time jobs wait in the queue.
 void start_worker_pool(PluginManager *pm, int num_workers);
 int l_enqueue_job(lua_State *L);
 int l_trigger_async_event(lua_State *L);
 int l_register_hook(lua_State *L);
 int l_call_hook(lua_State *L);
 JobQueue *job_queue_init();
+// Lets the workers finish the queued jobs for up to SERVER_JOB_DRAIN_MS
+// (default 10000), then appends whatever is still queued to the spool
+// file (SERVER_JOB_SPOOL, default ./jobs.spool); in durable mode logged
+// jobs simply stay in the log. Returns false when a worker is still
+// inside a job, so the plugins must not be destroyed.
+bool job_queue_drain(PluginManager *pm);
+// Queues the jobs a previous shutdown spooled, and in durable mode the
+// unfinished jobs of processes that are gone, for the plugins loaded now
+void job_queue_restore(PluginManager *pm);
+
+// Schedules func(payload) after delay_ms, then every interval_ms when
+// interval_ms > 0. A periodic timer replaces the plugin's existing one
+// for the same function and keeps its id. Returns the timer id, 0 on
+// failure.
+uint64_t timer_schedule(PluginManager *pm, Plugin *p, const char *func,
+                        const char *payload, uint64_t delay_ms,
+                        uint64_t interval_ms);
+bool timer_cancel(PluginManager *pm, Plugin *p, uint64_t id);
+size_t timer_count(PluginManager *pm);
+// Blocks until a spawned job finished; inside a background job, runs
+// other queued jobs meanwhile
+void job_await(JobFuture *f);
+int l_spawn(lua_State *L);
+int l_spawn_map(lua_State *L);
+int l_job_workers(lua_State *L);
+int l_defer_in(lua_State *L);
+int l_every(lua_State *L);
+int l_cancel_timer(lua_State *L);
 
 int l_get_mem_usage(lua_State *L);
 
@@ -0,0 +1,27 @@
+#ifndef REQUEST_VIEW_H
+#define REQUEST_VIEW_H
+#include <lua.h>
+#include <microhttpd.h>
+#include <stddef.h>
+
+// The `req` passed to app.handle_request: a userdata over the MHD
+// connection instead of a table copied up front. req.url, req.method and
+// req.body, and each entry of req.headers, req.query and req.cookies, are
+// read from the connection the first time they are indexed and cached in
+// the userdata from then on. req.json is the body decoded when its
+// Content-Type is JSON. Anything else assigned to req (req.form,
+// req.params) is stored like a table field. pairs() works on all of them.
+typedef struct RequestView RequestView;
+
+// Pushes a new req onto L. The strings and the connection must stay
+// valid until request_view_close, which must be called for every view;
+// until then the registry keeps it alive.
+RequestView *request_view_push(lua_State *L, struct MHD_Connection *conn,
+                               const char *url, const char *method,
+                               const char *body, size_t body_len);
+// Called with the plugin state once the handler is done with the
+// request: values already read stay readable, the rest are nil from now
+// on
+void request_view_close(lua_State *L, RequestView *view);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+#include <lua.h>
+#include <microhttpd.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Opt-in cache for GET routes declared with
+//   app.get(path, handler, {cache = {ttl = 5, vary = {...}, tags = {...}}})
+// Hits are served by async_worker without taking the plugin lock or
+// entering Lua. Every entry is tagged with its plugin name, so a
+// successful db_exec purges that plugin's pages.
+#define CACHE_MAX_VARY 8
+
+// SERVER_CACHE_MB bounds the total body + header bytes (default 64,
+// 0 disables the cache)
+void response_cache_init(void);
+
+// Request headers the plugin's cached routes vary on; returns -1 when
+// the plugin has no cached routes (callers then skip building a key)
+int response_cache_vary(const char *plugin, const char **names_out);
+
+// Returns a fresh MHD response for a live entry, or NULL on a miss.
+struct MHD_Response *response_cache_lookup(const char *key, size_t key_len,
+                                           int *status_out);
+
+// Snapshot taken before the handler runs. An entry stored with it is
+// dropped if any of its tags was invalidated while the handler ran.
+uint64_t response_cache_epoch(void);
+
+// Stores the handle_request result at `idx` when it carries a `cache`
+// table ({ttl, tags}) and a 200 status
+void response_cache_store(lua_State *L, int idx, const char *plugin,
+                          const char *key, size_t key_len, uint64_t epoch);
+
+void response_cache_invalidate(const char *tag);
+
+// Lua: c_cache_route(vary_list), c_cache_invalidate(tag)
+void response_cache_setup_lua(lua_State *L, const char *plugin);
+
+#endif
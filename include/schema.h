@@ -0,0 +1,19 @@
+#ifndef SCHEMA_H
+#define SCHEMA_H
+#include "plugin_manager.h"
+#include <lua.h>
+
+// Brings the plugin database in line with its `schema` and `migrations`
+// globals, in one transaction on the plugin's DB executor:
+//   1. tables in `schema` are created, declared columns missing from an
+//      existing table are added (nothing is ever dropped), and the
+//      indexes under each table's `indexes` key are created, rebuilt
+//      when their definition changed, or dropped when no longer declared
+//   2. `migrations[n]` (SQL string or function) runs for every n above
+//      the database's PRAGMA user_version, which is then set to n
+// A failure rolls everything back and is logged; the plugin still
+// loads. After a change the planner statistics are refreshed
+// (PRAGMA optimize, plus ANALYZE when `migrations.analyze` is set).
+void apply_plugin_schema(lua_State *L, Plugin *p);
+
+#endif
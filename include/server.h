@@ -2,9 +2,33 @@
 #define SERVER_H
 #include <microhttpd.h>
 #include "plugin_manager.h"
+#include "request_view.h"
+#include <stdbool.h>
 
+typedef struct {
+  // Data from MHD
+  struct MHD_Connection *connection;
+  char *url;
+  char *method;
+
+  // Upload buffer logic
+  char *upload_data;
+  size_t upload_size;
+
+  // Result storage
+  struct MHD_Response *response;
+  int status_code;
+  bool processing_done;
+
+  // References
+  PluginManager *pm;
+} RequestContext;
 
 struct MHD_Daemon* start_server(PluginManager *pm);
+// Stops accepting connections and waits up to SERVER_DRAIN_MS (default
+// 10000) for the requests in flight to be answered. Returns how many are
+// still running; only with 0 may the daemon and the plugins be torn down.
+int server_drain(struct MHD_Daemon *daemon);
 enum MHD_Result respond(void *cls, struct MHD_Connection *connection,
                       const char *url, const char *method,
                       const char *version, const char *upload_data,
@@ -12,7 +36,34 @@ enum MHD_Result respond(void *cls, struct MHD_Connection *connection,
 struct MHD_Response *get_static_response(const char *path);
 const char* get_mime_type(const char *path);
 struct MHD_Response* build_response_from_lua(lua_State *L, int *status_out);
-struct MHD_Response* call_plugin_logic(Plugin *p, const char *url,
-                                       const char *method, int *status_out, char *body_data, size_t body_len);
+struct MHD_Response* call_plugin_logic(Plugin *p, RequestContext *ctx,
+                                       const char *url, const char *cache_key,
+                                       size_t cache_key_len);
+
+// Building blocks shared by the thread-per-request path (async_worker)
+// and the event loop (event_loop.c).
+
+// Answers reserved paths and static files. Returns NULL otherwise, with
+// *target set to the plugin whose handler should run (NULL if none).
+struct MHD_Response *resolve_request(RequestContext *ctx, Plugin **target,
+                                     const char **rel_url);
+Plugin *find_default_plugin(PluginManager *pm);
+// Returns a cached page, or NULL after writing the cache key for the
+// handler's result (*key_len is 0 when the request is not cacheable)
+struct MHD_Response *lookup_cached_response(RequestContext *ctx, Plugin *p,
+                                            const char *rel_url, char *key,
+                                            size_t key_size, size_t *key_len);
+// Returns the req view, to be closed once the handler is done, or NULL
+// when the plugin has no app.handle_request
+RequestView *push_plugin_request(lua_State *L, RequestContext *ctx,
+                                 const char *url);
+struct MHD_Response *plugin_response_from_result(Plugin *p, lua_State *L,
+                                                 int *status_out,
+                                                 const char *cache_key,
+                                                 size_t cache_key_len,
+                                                 uint64_t cache_epoch,
+                                                 uint64_t started_ns);
+// Falls back to a 404, then resumes the suspended MHD connection
+void finish_request(RequestContext *ctx, uint64_t trace_start);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,38 @@
+#ifndef SUPERVISOR_H
+#define SUPERVISOR_H
+#include "plugin_manager.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// Pre-fork mode, enabled with SERVER_WORKERS=n (n > 0). The original
+// process becomes a supervisor that never serves requests: it forks n
+// workers, each binding the same port with SO_REUSEPORT and running its
+// own PluginManager, so the kernel spreads connections across processes
+// that share no locks, allocator or Lua state.
+//   - a worker that dies is restarted (with a growing delay when it keeps
+//     dying right after start)
+//   - SIGHUP replaces the workers one at a time: the replacement must
+//     report ready before the old one gets SIGTERM
+//     (SERVER_WORKER_READY_MS, default 10000, to come up;
+//     SERVER_WORKER_STOP_MS, default 30000, to drain and exit before
+//     SIGKILL)
+//   - SIGTERM / SIGINT stops every worker, then the supervisor
+// Workers publish their metrics every second so /_metrics on any of them
+// returns the sum over all running workers.
+
+// Call before anything starts a thread. Returns -1 in single-process
+// mode; in pre-fork mode only returns in a worker, with its slot index.
+int supervisor_start(void);
+bool supervisor_is_worker(void);
+
+// Worker side: tells the supervisor the listener is up
+void worker_ready(void);
+// Worker side: blocks until SIGTERM / SIGINT, reloading the plugins on
+// SIGHUP and publishing metrics meanwhile
+void worker_wait(PluginManager *pm);
+
+// /_metrics body: this process's metrics, summed with the other workers'
+// last published ones in pre-fork mode (malloc'd)
+char *supervisor_metrics_render(PluginManager *pm, size_t *len);
+
+#endif
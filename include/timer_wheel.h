@@ -0,0 +1,36 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+#include <stddef.h>
+#include <stdint.h>
+
+// Hierarchical timer wheel: four levels of 256 slots, each level 256
+// times coarser than the one below, so 2^32 ticks ahead fit without any
+// sorting. Insert and remove are O(1) list operations; a timer moves
+// down a level at most three times before it fires. Not thread-safe.
+
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOTS 256
+
+// Embed in the timed object. `expires` is an absolute tick.
+typedef struct WheelEntry {
+  uint64_t expires;
+  struct WheelEntry *prev, *next;
+} WheelEntry;
+
+typedef struct {
+  uint64_t now; // last tick processed
+  size_t count;
+  WheelEntry slots[WHEEL_LEVELS][WHEEL_SLOTS]; // circular list heads
+} TimerWheel;
+
+typedef void (*WheelFireFn)(WheelEntry *e, void *arg);
+
+void wheel_init(TimerWheel *w, uint64_t now);
+// An `expires` already reached fires on the next tick
+void wheel_add(TimerWheel *w, WheelEntry *e);
+void wheel_remove(TimerWheel *w, WheelEntry *e);
+// Processes every tick up to `now`, calling fire for each timer that
+// expires, after unlinking it. fire may add and remove timers.
+void wheel_advance(TimerWheel *w, uint64_t now, WheelFireFn fire, void *arg);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <lua.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Reserved URLs for the trace dump and the folded-stack profile
+#define TRACE_PATH "/_trace"
+#define PROFILE_PATH "/_profile"
+
+// Tracing is opt-in and configured once at startup:
+//   SERVER_TRACE=1          record per-request spans
+//   SERVER_TRACE_FILE=path  also dump the spans there on shutdown
+//   SERVER_PROFILE=1        sample Lua stacks for flamegraphs
+//   SERVER_PROFILE_US=n     sampling period in microseconds (default 1000)
+void trace_init(void);
+void trace_shutdown(void);
+bool trace_enabled(void);
+bool profile_enabled(void);
+
+// Starts a new trace id for everything this thread records until the next
+// call (a request or a background job).
+void trace_begin_request(void);
+
+// Returns a start timestamp, or 0 when tracing is off. Pair with
+// trace_span(), which records [start, now]. `cat` must be a string
+// literal; `name` is copied (and truncated to fit a ring slot).
+uint64_t trace_now(void);
+void trace_span(const char *cat, const char *name, uint64_t start_ns);
+
+// Chrome trace / Perfetto JSON of the spans still held in the rings.
+// Returns a malloc'd buffer the caller owns.
+char *trace_render(size_t *len_out);
+
+// Folded stacks ("a;b;c count") in microseconds, ready for flamegraph.pl
+char *profile_render(size_t *len_out);
+
+// Installs the sampling hook on a Lua state (no-op unless profiling) and
+// exposes c_trace_now / c_trace_span to Lua.
+void trace_setup_lua(lua_State *L);
+
+#endif
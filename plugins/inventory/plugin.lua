@@ -6,13 +6,16 @@ schema = {
         sku = "TEXT UNIQUE NOT NULL",
         name = "TEXT NOT NULL",
         quantity = "INTEGER DEFAULT 0",
+        indexes = {
+            by_name = {"name"},
+        },
     }
 }
 
 app.get("/", function(req)
     local items = db_query("SELECT * FROM products")
     return app.render("index", {items = items})
-end)
+end, {cache = {ttl = 5}})
 
 app.get("/new-item", function (req)
     return app.render("new-item", {})
@@ -31,7 +34,7 @@ app.get("/[item-id]", function (req)
     local items = db_query(query)
     local item = items[1]
     return app.render("view-item", {item = item})
-end)
+end, {cache = {ttl = 5}})
 
 
 app.post("/new-item", function (req)
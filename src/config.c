@@ -0,0 +1,323 @@
+#define _GNU_SOURCE // sched_getaffinity, CPU_COUNT
+#include "config.h"
+#include "log.h"
+#include <cJSON.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_CONFIG_FILE "server.conf"
+#define ENV_PREFIX "SERVER_"
+#define MAX_LINE 1024
+
+
+static ServerConfig config;
+static char config_file[256];
+static time_t started_at;
+
+static char *trim(char *s) {
+  while (isspace((unsigned char)*s))
+    s++;
+  char *end = s + strlen(s);
+  while (end > s && isspace((unsigned char)end[-1]))
+    *--end = '\0';
+  return s;
+}
+
+static unsigned int env_uint(const char *name, unsigned int fallback) {
+  const char *v = getenv(name);
+  return v && atoi(v) >= 0 ? (unsigned int)atoi(v) : fallback;
+}
+
+// `log_level` -> SERVER_LOG_LEVEL; false for keys that cannot be a name
+static bool env_name(const char *key, char *out, size_t size) {
+  size_t n = strlen(ENV_PREFIX);
+  if (*key == '\0' || n + strlen(key) >= size)
+    return false;
+  memcpy(out, ENV_PREFIX, n);
+  for (const char *c = key; *c; c++) {
+    if (!isalnum((unsigned char)*c) && *c != '_' && *c != '-' && *c != '.')
+      return false;
+    out[n++] = isalnum((unsigned char)*c) ? toupper((unsigned char)*c) : '_';
+  }
+  out[n] = '\0';
+  return true;
+}
+
+static void read_file(const char *path, bool required) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    if (required)
+      log_write(LOG_ERROR, "server", "config: cannot open %s", path);
+    return;
+  }
+  snprintf(config_file, sizeof(config_file), "%s", path);
+
+  char line[MAX_LINE];
+  int lineno = 0;
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    char *hash = strchr(line, '#');
+    if (hash)
+      *hash = '\0';
+    char *key = trim(line);
+    if (*key == '\0')
+      continue;
+
+    char name[128];
+    char *eq = strchr(key, '=');
+    if (eq)
+      *eq = '\0';
+    if (eq == NULL || !env_name(trim(key), name, sizeof(name))) {
+      log_write(LOG_WARN, "server", "config: %s:%d: expected key = value",
+                path, lineno);
+      continue;
+    }
+    char *value = trim(eq + 1);
+    size_t len = strlen(value);
+    if (len >= 2 && value[0] == '"' && value[len - 1] == '"') {
+      value[len - 1] = '\0';
+      value++;
+    }
+    setenv(name, value, 0); // the environment overrides the file
+  }
+  fclose(f);
+}
+
+static PollMode parse_poll(const char *v) {
+  if (v == NULL || strcmp(v, "auto") == 0)
+    return POLL_AUTO;
+  if (strcmp(v, "epoll") == 0)
+    return POLL_EPOLL;
+  if (strcmp(v, "poll") == 0)
+    return POLL_POLL;
+  if (strcmp(v, "select") == 0)
+    return POLL_SELECT;
+  if (strcmp(v, "thread-per-connection") == 0)
+    return POLL_THREAD_PER_CONNECTION;
+  log_write(LOG_WARN, "server", "config: unknown poll mode '%s', using auto",
+            v);
+  return POLL_AUTO;
+}
+
+const char *poll_mode_name(PollMode mode) {
+  switch (mode) {
+  case POLL_EPOLL:
+    return "epoll";
+  case POLL_POLL:
+    return "poll";
+  case POLL_SELECT:
+    return "select";
+  case POLL_THREAD_PER_CONNECTION:
+    return "thread-per-connection";
+  default:
+    return "auto";
+  }
+}
+
+// CPUs granted by the cgroup quota (v2 cpu.max, else v1 CFS), 0 when
+// unlimited or unknown
+static double cgroup_cpu_quota(void) {
+  char path[512] = "/sys/fs/cgroup/cpu.max";
+  FILE *f = fopen("/proc/self/cgroup", "r");
+  if (f) {
+    char line[400];
+    while (fgets(line, sizeof(line), f)) {
+      if (strncmp(line, "0::", 3) == 0) {
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max",
+                 trim(line + 3));
+        break;
+      }
+    }
+    fclose(f);
+  }
+  const char *v2[] = {path, "/sys/fs/cgroup/cpu.max"};
+  for (int i = 0; i < 2; i++) {
+    f = fopen(v2[i], "r");
+    if (f == NULL)
+      continue;
+    char quota[32];
+    long period = 0;
+    int n = fscanf(f, "%31s %ld", quota, &period);
+    fclose(f);
+    if (n == 2 && strcmp(quota, "max") != 0 && period > 0)
+      return atof(quota) / (double)period;
+    return 0;
+  }
+
+  long quota = -1, period = 0;
+  f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+  if (f) {
+    if (fscanf(f, "%ld", &quota) != 1)
+      quota = -1;
+    fclose(f);
+  }
+  f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+  if (f) {
+    if (fscanf(f, "%ld", &period) != 1)
+      period = 0;
+    fclose(f);
+  }
+  return quota > 0 && period > 0 ? (double)quota / (double)period : 0;
+}
+
+int cpu_budget(void) {
+  static int budget = 0;
+  if (budget > 0)
+    return budget;
+  cpu_set_t set;
+  long cpus = sched_getaffinity(0, sizeof(set), &set) == 0
+                  ? CPU_COUNT(&set)
+                  : sysconf(_SC_NPROCESSORS_ONLN);
+  // A quota of 2.5 CPUs can keep three threads partly busy
+  double quota = cgroup_cpu_quota();
+  if (quota > 0 && (long)(quota + 0.999) < cpus)
+    cpus = (long)(quota + 0.999);
+  budget = cpus > 0 ? (int)cpus : 1;
+  return budget;
+}
+
+// NUMA node of a CPU from sysfs, 0 when it has none
+static int cpu_node(int cpu) {
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR *dir = opendir(path);
+  if (dir == NULL)
+    return 0;
+  int node = 0;
+  struct dirent *e;
+  while ((e = readdir(dir))) {
+    if (strncmp(e->d_name, "node", 4) == 0 && isdigit((unsigned char)e->d_name[4])) {
+      node = atoi(e->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+int cpu_list(int **out) {
+  *out = NULL;
+  cpu_set_t set;
+  if (sched_getaffinity(0, sizeof(set), &set) != 0)
+    return 0;
+  int n = CPU_COUNT(&set);
+  int *cpus = malloc(n * sizeof(int));
+  int *nodes = malloc(n * sizeof(int));
+  if (cpus == NULL || nodes == NULL) {
+    free(cpus);
+    free(nodes);
+    return 0;
+  }
+  int count = 0, max_node = 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE && count < n; cpu++) {
+    if (!CPU_ISSET(cpu, &set))
+      continue;
+    cpus[count] = cpu;
+    nodes[count] = cpu_node(cpu);
+    if (nodes[count] > max_node)
+      max_node = nodes[count];
+    count++;
+  }
+
+  // Interleave: one CPU of each node in turn, so consecutive threads
+  // spread over the memory controllers
+  int *order = malloc(count * sizeof(int));
+  int placed = 0;
+  for (int round = 0; order && placed < count; round++) {
+    for (int node = 0; node <= max_node; node++) {
+      int seen = 0;
+      for (int i = 0; i < count; i++) {
+        if (nodes[i] == node && seen++ == round) {
+          order[placed++] = cpus[i];
+          break;
+        }
+      }
+    }
+  }
+  free(nodes);
+  if (order == NULL) {
+    *out = cpus;
+    return count;
+  }
+  free(cpus);
+  *out = order;
+  return count;
+}
+
+void config_load(void) {
+  started_at = time(NULL);
+  const char *path = getenv("SERVER_CONFIG");
+  read_file(path ? path : DEFAULT_CONFIG_FILE, path != NULL);
+
+  int cores = cpu_budget();
+  config.port = env_uint("SERVER_PORT", 8888);
+  const char *bind = getenv("SERVER_BIND");
+  snprintf(config.bind_address, sizeof(config.bind_address), "%s",
+           bind ? bind : "");
+  config.poll = parse_poll(getenv("SERVER_POLL"));
+  config.poll_threads =
+      env_uint("SERVER_POLL_THREADS", (unsigned int)cores);
+  if (config.poll_threads == 0)
+    config.poll_threads = 1;
+  config.connection_limit = env_uint("SERVER_CONNECTION_LIMIT", 0);
+  config.per_ip_limit = env_uint("SERVER_PER_IP_LIMIT", 0);
+  config.connection_timeout = env_uint("SERVER_CONNECTION_TIMEOUT", 30);
+  config.connection_memory =
+      (size_t)env_uint("SERVER_CONNECTION_MEMORY_KB", 0) * 1024;
+  config.listen_backlog = env_uint("SERVER_LISTEN_BACKLOG", 0);
+  config.tcp_fastopen = env_uint("SERVER_TCP_FASTOPEN", 0);
+}
+
+const ServerConfig *config_get(void) { return &config; }
+
+char *config_render(PluginManager *pm, unsigned int connections,
+                    size_t *len) {
+  cJSON *root = cJSON_CreateObject();
+  if (root == NULL)
+    return NULL;
+
+  cJSON_AddNumberToObject(root, "uptime_seconds",
+                          (double)(time(NULL) - started_at));
+  cJSON_AddNumberToObject(root, "connections", connections);
+  if (config_file[0])
+    cJSON_AddStringToObject(root, "config_file", config_file);
+  else
+    cJSON_AddItemToObject(root, "config_file", cJSON_CreateNull());
+
+  // Only the parsed ServerConfig: /_status is unauthenticated, and the
+  // environment can hold secrets
+  cJSON *http = cJSON_AddObjectToObject(root, "http");
+  cJSON_AddNumberToObject(http, "port", config.port);
+  cJSON_AddStringToObject(http, "bind",
+                          config.bind_address[0] ? config.bind_address : "*");
+  cJSON_AddStringToObject(http, "poll", poll_mode_name(config.poll));
+  cJSON_AddNumberToObject(http, "poll_threads",
+                          config.poll == POLL_THREAD_PER_CONNECTION
+                              ? 0
+                              : config.poll_threads);
+  cJSON_AddNumberToObject(http, "connection_limit", config.connection_limit);
+  cJSON_AddNumberToObject(http, "per_ip_limit", config.per_ip_limit);
+  cJSON_AddNumberToObject(http, "connection_timeout",
+                          config.connection_timeout);
+  cJSON_AddNumberToObject(http, "connection_memory",
+                          (double)config.connection_memory);
+  cJSON_AddNumberToObject(http, "listen_backlog", config.listen_backlog);
+  cJSON_AddNumberToObject(http, "tcp_fastopen", config.tcp_fastopen);
+
+  cJSON *plugins = cJSON_AddArrayToObject(root, "plugins");
+  for (int i = 0; pm && i < pm->plugin_count; i++)
+    cJSON_AddItemToArray(plugins,
+                         cJSON_CreateString(pm->plugin_list[i]->name));
+
+  char *text = cJSON_Print(root);
+  cJSON_Delete(root);
+  if (text)
+    *len = strlen(text);
+  return text;
+}
@@ -0,0 +1,667 @@
+#include "db_executor.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include <ctype.h>
+#include <errno.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define DB_DEFAULT_READERS 2
+#define DB_DEFAULT_BATCH 64
+#define DB_BUSY_TIMEOUT_MS 5000
+#define DB_DEFAULT_TXN_TIMEOUT_MS 5000
+
+struct DbTxn {
+  atomic_int refs;
+};
+
+typedef struct {
+  DbRequest *head;
+  DbRequest *tail;
+} DbQueue;
+
+struct DbExecutor {
+  char *path;
+  char *name;
+
+  pthread_mutex_t lock;
+  pthread_cond_t read_cond;
+  pthread_cond_t write_cond;
+  DbQueue reads;
+  DbQueue writes;
+  DbTxn *active;     // transaction owning the writer, if any
+  DbQueue txn_queue; // statements of the active transaction
+  bool started;
+  bool stopping;
+
+  pthread_t writer;
+  pthread_t *readers;
+  int reader_count;
+  int readers_alive; // the writer outlives them, they may hand it work
+  int batch_max;
+  int txn_timeout_ms;
+};
+
+static int env_int(const char *name, int fallback) {
+  const char *v = getenv(name);
+  return v && atoi(v) > 0 ? atoi(v) : fallback;
+}
+
+static void queue_push(DbQueue *q, DbRequest *req) {
+  req->next = NULL;
+  if (q->tail)
+    q->tail->next = req;
+  else
+    q->head = req;
+  q->tail = req;
+}
+
+static DbRequest *queue_pop(DbQueue *q) {
+  DbRequest *req = q->head;
+  if (req) {
+    q->head = req->next;
+    if (q->head == NULL)
+      q->tail = NULL;
+  }
+  return req;
+}
+
+// --- Requests ---
+
+void db_result_free(DbResult *r) {
+  for (size_t i = 0; r->values && i < r->nrows * (size_t)r->ncols; i++)
+    free(r->values[i].s);
+  for (int i = 0; r->names && i < r->ncols; i++)
+    free(r->names[i]);
+  free(r->values);
+  free(r->names);
+  free(r->error);
+  memset(r, 0, sizeof(*r));
+}
+
+DbTxn *db_txn_create(void) {
+  DbTxn *txn = malloc(sizeof(DbTxn));
+  if (txn)
+    atomic_init(&txn->refs, 1);
+  return txn;
+}
+
+void db_txn_release(DbTxn *txn) {
+  if (txn && atomic_fetch_sub(&txn->refs, 1) == 1)
+    free(txn);
+}
+
+void db_request_release(DbRequest *req) {
+  if (req == NULL || atomic_fetch_sub(&req->refs, 1) != 1)
+    return;
+  free(req->sql);
+  db_txn_release(req->txn);
+  db_result_free(&req->params);
+  db_result_free(&req->result);
+  pthread_mutex_destroy(&req->lock);
+  pthread_cond_destroy(&req->cond);
+  free(req);
+}
+
+bool db_request_set_notify(DbRequest *req, void (*notify)(void *),
+                           void *arg) {
+  pthread_mutex_lock(&req->lock);
+  bool pending = !req->done;
+  if (pending) {
+    req->notify = notify;
+    req->notify_arg = arg;
+  }
+  pthread_mutex_unlock(&req->lock);
+  return pending;
+}
+
+void db_request_wait(DbRequest *req) {
+  pthread_mutex_lock(&req->lock);
+  while (!req->done)
+    pthread_cond_wait(&req->cond, &req->lock);
+  pthread_mutex_unlock(&req->lock);
+}
+
+bool db_request_done(DbRequest *req) {
+  pthread_mutex_lock(&req->lock);
+  bool done = req->done;
+  pthread_mutex_unlock(&req->lock);
+  return done;
+}
+
+static void complete(DbRequest *req) {
+  pthread_mutex_lock(&req->lock);
+  req->done = true;
+  void (*notify)(void *) = req->notify;
+  void *arg = req->notify_arg;
+  pthread_cond_broadcast(&req->cond);
+  pthread_mutex_unlock(&req->lock);
+  if (notify)
+    notify(arg);
+  db_request_release(req); // the executor's reference
+}
+
+static void fail(DbRequest *req, const char *error, bool open_failed) {
+  db_result_free(&req->result);
+  req->result.error = strdup(error ? error : "unknown error");
+  req->result.open_failed = open_failed;
+}
+
+// --- Statements ---
+
+static sqlite3 *open_connection(DbExecutor *ex, bool writer) {
+  sqlite3 *db;
+  if (sqlite3_open(ex->path, &db) != SQLITE_OK) {
+    log_write(LOG_ERROR, ex->name, "DB Open Error: %s", sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return NULL;
+  }
+  sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT_MS);
+  // WAL lets the readers run while the writer commits
+  sqlite3_exec(db,
+               writer ? "PRAGMA journal_mode=WAL;" : "PRAGMA query_only=1;",
+               NULL, NULL, NULL);
+  return db;
+}
+
+// Runs a query and materializes every row. Returns false without
+// touching the request when `readonly` is set and the statement writes.
+static bool run_query(sqlite3 *db, DbRequest *req, bool readonly) {
+  DbResult *out = &req->result;
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, req->sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fail(req, sqlite3_errmsg(db), false);
+    return true;
+  }
+  if (readonly && stmt && !sqlite3_stmt_readonly(stmt)) {
+    sqlite3_finalize(stmt);
+    return false;
+  }
+
+  // Values are owned by the result, not SQLite
+  out->ncols = stmt ? sqlite3_column_count(stmt) : 0;
+  out->names = calloc(out->ncols ? out->ncols : 1, sizeof(char *));
+  for (int i = 0; out->names && i < out->ncols; i++)
+    out->names[i] = strdup(sqlite3_column_name(stmt, i));
+
+  size_t cap = 0;
+  int rc = SQLITE_DONE;
+  while (stmt && out->names && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if (out->nrows == cap) {
+      cap = cap ? cap * 2 : 16;
+      size_t width = out->ncols ? (size_t)out->ncols : 1;
+      DbValue *grown = realloc(out->values, sizeof(DbValue) * cap * width);
+      if (grown == NULL)
+        break;
+      out->values = grown;
+    }
+    DbValue *row = out->values + out->nrows * out->ncols;
+    for (int i = 0; i < out->ncols; i++) {
+      DbValue *v = &row[i];
+      memset(v, 0, sizeof(*v));
+      v->type = sqlite3_column_type(stmt, i);
+      if (v->type == SQLITE_INTEGER) {
+        v->i = sqlite3_column_int64(stmt, i);
+      } else if (v->type == SQLITE_FLOAT) {
+        v->d = sqlite3_column_double(stmt, i);
+      } else if (v->type == SQLITE_TEXT) {
+        const unsigned char *text = sqlite3_column_text(stmt, i);
+        v->len = (size_t)sqlite3_column_bytes(stmt, i);
+        v->s = malloc(v->len + 1);
+        if (v->s) {
+          memcpy(v->s, text, v->len);
+          v->s[v->len] = '\0';
+        }
+      }
+    }
+    out->nrows++;
+  }
+  if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+    fail(req, sqlite3_errmsg(db), false);
+  else
+    out->ok = true;
+  sqlite3_finalize(stmt);
+  return true;
+}
+
+static void run_exec(sqlite3 *db, DbRequest *req, const char *sql) {
+  char *err_msg = NULL;
+  if (sqlite3_exec(db, sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+    fail(req, err_msg, false);
+  } else {
+    req->result.ok = true;
+    req->result.changes = sqlite3_changes(db);
+  }
+  sqlite3_free(err_msg);
+}
+
+static void bind_value(sqlite3_stmt *stmt, int i, const DbValue *v) {
+  if (v->type == SQLITE_INTEGER)
+    sqlite3_bind_int64(stmt, i, v->i);
+  else if (v->type == SQLITE_FLOAT)
+    sqlite3_bind_double(stmt, i, v->d);
+  else if (v->type == SQLITE_TEXT && v->s)
+    sqlite3_bind_text(stmt, i, v->s, (int)v->len, SQLITE_STATIC);
+  else
+    sqlite3_bind_null(stmt, i);
+}
+
+// Every row through one prepared statement. The savepoint makes the
+// rows all-or-nothing and, outside a transaction, is the transaction,
+// so the whole import costs a single sync.
+static void run_bulk(sqlite3 *db, DbRequest *req) {
+  const DbResult *in = &req->params;
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, req->sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fail(req, sqlite3_errmsg(db), false);
+    return;
+  }
+  sqlite3_exec(db, "SAVEPOINT bulk;", NULL, NULL, NULL);
+  int rc = SQLITE_DONE;
+  for (size_t row = 0; row < in->nrows && rc == SQLITE_DONE; row++) {
+    const DbValue *values = in->values + row * in->ncols;
+    for (int i = 0; i < in->ncols; i++)
+      bind_value(stmt, i + 1, &values[i]);
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE)
+      fail(req, sqlite3_errmsg(db), false);
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+
+  if (rc == SQLITE_DONE) {
+    req->result.ok = true;
+    req->result.changes = (int64_t)in->nrows;
+  } else {
+    sqlite3_exec(db, "ROLLBACK TO bulk;", NULL, NULL, NULL);
+  }
+  sqlite3_exec(db, "RELEASE bulk;", NULL, NULL, NULL);
+}
+
+static const char *op_names[] = {
+    [DB_EXEC] = "exec",   [DB_QUERY] = "query",   [DB_BULK] = "bulk",
+    [DB_BEGIN] = "begin", [DB_COMMIT] = "commit", [DB_ROLLBACK] = "rollback",
+};
+
+static bool run_statement(DbExecutor *ex, sqlite3 *db, DbRequest *req,
+                          bool readonly) {
+  uint64_t started_ns = metrics_now_ns();
+  switch (req->op) {
+  case DB_QUERY:
+    if (!run_query(db, req, readonly))
+      return false;
+    break;
+  case DB_BULK:
+    run_bulk(db, req);
+    break;
+  case DB_BEGIN:
+    run_exec(db, req, "BEGIN IMMEDIATE;");
+    break;
+  case DB_COMMIT:
+    run_exec(db, req, "COMMIT;");
+    if (!req->result.ok) // e.g. a deferred constraint: do not leave it open
+      sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    break;
+  case DB_ROLLBACK:
+    run_exec(db, req, "ROLLBACK;");
+    break;
+  default:
+    run_exec(db, req, req->sql);
+    break;
+  }
+  metrics_observe(METRIC_SQLITE_SECONDS, ex->name, op_names[req->op],
+                  metrics_now_ns() - started_ns);
+  metrics_count(METRIC_SQLITE_STATEMENTS_TOTAL, ex->name,
+                readonly ? "reader" : "writer");
+  return true;
+}
+
+// Statements that manage transactions themselves (or refuse to run
+// inside one) are never grouped with others
+static bool must_run_alone(const DbRequest *req) {
+  if (req->txn || req->op >= DB_BEGIN)
+    return true;
+  const char *sql = req->sql;
+  static const char *keywords[] = {
+      "BEGIN",   "COMMIT", "END",    "ROLLBACK", "SAVEPOINT",
+      "RELEASE", "VACUUM", "PRAGMA", "ATTACH",   "DETACH"};
+  while (isspace((unsigned char)*sql))
+    sql++;
+  for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+    size_t len = strlen(keywords[i]);
+    if (strncasecmp(sql, keywords[i], len) == 0 &&
+        !isalnum((unsigned char)sql[len]) && sql[len] != '_')
+      return true;
+  }
+  return false;
+}
+
+// --- Threads ---
+
+static void *reader_thread(void *arg) {
+  DbExecutor *ex = (DbExecutor *)arg;
+  sqlite3 *db = NULL;
+  for (;;) {
+    pthread_mutex_lock(&ex->lock);
+    while (ex->reads.head == NULL && !ex->stopping)
+      pthread_cond_wait(&ex->read_cond, &ex->lock);
+    DbRequest *req = queue_pop(&ex->reads);
+    pthread_mutex_unlock(&ex->lock);
+    if (req == NULL)
+      break; // stopping and drained
+
+    if (db == NULL && (db = open_connection(ex, false)) == NULL) {
+      fail(req, "could not open database", true);
+      complete(req);
+      continue;
+    }
+    if (!run_statement(ex, db, req, true)) {
+      // It writes after all: the writer's turn
+      pthread_mutex_lock(&ex->lock);
+      queue_push(&ex->writes, req);
+      pthread_cond_signal(&ex->write_cond);
+      pthread_mutex_unlock(&ex->lock);
+      continue;
+    }
+    complete(req);
+  }
+  sqlite3_close(db);
+
+  pthread_mutex_lock(&ex->lock);
+  ex->readers_alive--;
+  pthread_cond_signal(&ex->write_cond);
+  pthread_mutex_unlock(&ex->lock);
+  return NULL;
+}
+
+// Commits everything in `batch` as one transaction. Savepoints keep a
+// failing statement from undoing the ones around it.
+static void commit_batch(DbExecutor *ex, sqlite3 *db, DbRequest *batch,
+                         int count) {
+  if (count == 1 ||
+      sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK) {
+    for (DbRequest *req = batch; req; req = req->next)
+      run_statement(ex, db, req, false);
+    return;
+  }
+
+  for (DbRequest *req = batch; req; req = req->next) {
+    sqlite3_exec(db, "SAVEPOINT stmt;", NULL, NULL, NULL);
+    run_statement(ex, db, req, false);
+    if (!req->result.ok)
+      sqlite3_exec(db, "ROLLBACK TO stmt;", NULL, NULL, NULL);
+    sqlite3_exec(db, "RELEASE stmt;", NULL, NULL, NULL);
+  }
+
+  uint64_t started_ns = metrics_now_ns();
+  if (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+    const char *error = sqlite3_errmsg(db);
+    for (DbRequest *req = batch; req; req = req->next) {
+      if (req->result.ok)
+        fail(req, error, false);
+    }
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+  }
+  metrics_observe(METRIC_SQLITE_SECONDS, ex->name, "commit",
+                  metrics_now_ns() - started_ns);
+}
+
+// Caller holds ex->lock. Whatever queued up while the last commit was
+// running, up to batch_max; NULL once stopping and drained.
+static DbRequest *take_batch(DbExecutor *ex, int *count) {
+  while (ex->writes.head == NULL && !(ex->stopping && ex->readers_alive == 0))
+    pthread_cond_wait(&ex->write_cond, &ex->lock);
+  DbRequest *batch = NULL, *tail = NULL;
+  *count = 0;
+  while (ex->writes.head && *count < ex->batch_max) {
+    bool alone = must_run_alone(ex->writes.head);
+    if (alone && *count > 0)
+      break;
+    DbRequest *req = queue_pop(&ex->writes);
+    req->next = NULL;
+    if (tail)
+      tail->next = req;
+    else
+      batch = req;
+    tail = req;
+    (*count)++;
+    if (alone)
+      break;
+  }
+  return batch;
+}
+
+// Caller holds ex->lock. The active transaction's next statement, or
+// NULL when it stayed idle for txn_timeout_ms or the executor stops.
+static DbRequest *take_txn_statement(DbExecutor *ex) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += ex->txn_timeout_ms / 1000;
+  deadline.tv_nsec += (long)(ex->txn_timeout_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  while (ex->txn_queue.head == NULL && !ex->stopping) {
+    if (pthread_cond_timedwait(&ex->write_cond, &ex->lock, &deadline) ==
+        ETIMEDOUT)
+      break;
+  }
+  return queue_pop(&ex->txn_queue);
+}
+
+// Caller holds ex->lock
+static void set_active(DbExecutor *ex, DbTxn *txn) {
+  if (txn)
+    atomic_fetch_add(&txn->refs, 1);
+  db_txn_release(ex->active);
+  ex->active = txn;
+}
+
+// One statement of (or addressed to) a transaction
+static void run_txn_statement(DbExecutor *ex, sqlite3 *db, DbRequest *req) {
+  pthread_mutex_lock(&ex->lock);
+  bool active = req->txn == ex->active;
+  pthread_mutex_unlock(&ex->lock);
+
+  if (req->op == DB_BEGIN ? active : !active) {
+    fail(req, "transaction is no longer active", false);
+    return;
+  }
+  run_statement(ex, db, req, false);
+
+  pthread_mutex_lock(&ex->lock);
+  if (req->op == DB_BEGIN && req->result.ok)
+    set_active(ex, req->txn);
+  else if (req->op == DB_COMMIT || req->op == DB_ROLLBACK)
+    set_active(ex, NULL);
+  pthread_mutex_unlock(&ex->lock);
+}
+
+static void *writer_thread(void *arg) {
+  DbExecutor *ex = (DbExecutor *)arg;
+  sqlite3 *db = NULL;
+  for (;;) {
+    // 1. A transaction owns the connection until it ends; otherwise take
+    //    whatever queued up while the last commit was running
+    pthread_mutex_lock(&ex->lock);
+    DbRequest *batch;
+    int count = 1;
+    if (ex->active) {
+      batch = take_txn_statement(ex);
+      if (batch == NULL) {
+        set_active(ex, NULL);
+        pthread_mutex_unlock(&ex->lock);
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        log_write(LOG_WARN, ex->name,
+                  "transaction idle for %d ms, rolled back",
+                  ex->txn_timeout_ms);
+        continue;
+      }
+    } else {
+      batch = take_batch(ex, &count);
+    }
+    pthread_mutex_unlock(&ex->lock);
+    if (batch == NULL)
+      break; // stopping and drained
+
+    // 2. Run and commit them together
+    if (db == NULL)
+      db = open_connection(ex, true);
+    if (db == NULL) {
+      for (DbRequest *req = batch; req; req = req->next)
+        fail(req, "could not open database", true);
+    } else if (batch->txn) {
+      run_txn_statement(ex, db, batch);
+    } else {
+      commit_batch(ex, db, batch, count);
+    }
+
+    // 3. Only now are the results durable
+    while (batch) {
+      DbRequest *next = batch->next;
+      complete(batch);
+      batch = next;
+    }
+  }
+  sqlite3_close(db);
+  return NULL;
+}
+
+// --- Executor ---
+
+DbExecutor *db_executor_create(const char *db_path, const char *plugin_name) {
+  DbExecutor *ex = calloc(1, sizeof(DbExecutor));
+  if (ex == NULL)
+    return NULL;
+  ex->path = strdup(db_path);
+  ex->name = strdup(plugin_name);
+  if (ex->path == NULL || ex->name == NULL) {
+    free(ex->path);
+    free(ex->name);
+    free(ex);
+    return NULL;
+  }
+  pthread_mutex_init(&ex->lock, NULL);
+  pthread_cond_init(&ex->read_cond, NULL);
+  pthread_cond_init(&ex->write_cond, NULL);
+  ex->reader_count = env_int("SERVER_DB_READERS", DB_DEFAULT_READERS);
+  ex->batch_max = env_int("SERVER_DB_BATCH", DB_DEFAULT_BATCH);
+  ex->txn_timeout_ms =
+      env_int("SERVER_DB_TXN_TIMEOUT_MS", DB_DEFAULT_TXN_TIMEOUT_MS);
+  return ex;
+}
+
+// Caller holds ex->lock
+static bool start_threads(DbExecutor *ex) {
+  ex->readers = calloc(ex->reader_count, sizeof(pthread_t));
+  if (ex->readers == NULL)
+    return false;
+  if (pthread_create(&ex->writer, NULL, writer_thread, ex) != 0) {
+    free(ex->readers);
+    ex->readers = NULL;
+    return false;
+  }
+  int started = 0;
+  while (started < ex->reader_count &&
+         pthread_create(&ex->readers[started], NULL, reader_thread, ex) == 0)
+    started++;
+  ex->reader_count = started;
+  ex->readers_alive = started;
+  ex->started = true;
+  return true;
+}
+
+DbRequest *db_submit(DbExecutor *ex, DbTxn *txn, DbOp op, const char *sql,
+                     DbResult *params) {
+  DbRequest *req = ex ? calloc(1, sizeof(DbRequest)) : NULL;
+  if (req && op == DB_BULK) {
+    req->params = *params;
+    memset(params, 0, sizeof(*params));
+  }
+  if (req == NULL || (req->sql = strdup(sql ? sql : "")) == NULL) {
+    if (op == DB_BULK)
+      db_result_free(req ? &req->params : params);
+    free(req);
+    return NULL;
+  }
+  req->op = op;
+  req->txn = txn;
+  if (txn)
+    atomic_fetch_add(&txn->refs, 1);
+  req->trace_start = trace_now();
+  pthread_mutex_init(&req->lock, NULL);
+  pthread_cond_init(&req->cond, NULL);
+  atomic_init(&req->refs, 2); // submitter + executor
+
+  pthread_mutex_lock(&ex->lock);
+  // A draining executor takes nothing new: it comes back already failed
+  if (ex->stopping) {
+    pthread_mutex_unlock(&ex->lock);
+    fail(req, "DB Error: database is shutting down", false);
+    complete(req);
+    return req;
+  }
+  if (!ex->started && !start_threads(ex)) {
+    pthread_mutex_unlock(&ex->lock);
+    atomic_init(&req->refs, 1);
+    db_request_release(req);
+    return NULL;
+  }
+  // Inside a transaction everything runs on the writer, in order.
+  // Without readers, the writer serves queries too.
+  if (txn && op != DB_BEGIN && ex->active == txn) {
+    queue_push(&ex->txn_queue, req);
+    pthread_cond_signal(&ex->write_cond);
+  } else if (op == DB_QUERY && !txn && ex->reader_count > 0) {
+    queue_push(&ex->reads, req);
+    pthread_cond_signal(&ex->read_cond);
+  } else {
+    queue_push(&ex->writes, req);
+    pthread_cond_signal(&ex->write_cond);
+  }
+  pthread_mutex_unlock(&ex->lock);
+  return req;
+}
+
+void db_execute(DbExecutor *ex, const char *sql, bool query, DbResult *out) {
+  memset(out, 0, sizeof(*out));
+  DbRequest *req =
+      db_submit(ex, NULL, query ? DB_QUERY : DB_EXEC, sql, NULL);
+  if (req == NULL) {
+    out->error = strdup("out of memory");
+    return;
+  }
+  db_request_wait(req);
+  *out = req->result;
+  memset(&req->result, 0, sizeof(req->result));
+  db_request_release(req);
+}
+
+void db_executor_destroy(DbExecutor *ex) {
+  if (ex == NULL)
+    return;
+  pthread_mutex_lock(&ex->lock);
+  ex->stopping = true;
+  pthread_cond_broadcast(&ex->read_cond);
+  pthread_cond_broadcast(&ex->write_cond);
+  bool started = ex->started;
+  pthread_mutex_unlock(&ex->lock);
+
+  if (started) {
+    for (int i = 0; i < ex->reader_count; i++)
+      pthread_join(ex->readers[i], NULL);
+    pthread_join(ex->writer, NULL);
+  }
+  free(ex->readers);
+  pthread_mutex_destroy(&ex->lock);
+  pthread_cond_destroy(&ex->read_cond);
+  pthread_cond_destroy(&ex->write_cond);
+  free(ex->path);
+  free(ex->name);
+  free(ex);
+}
@@ -0,0 +1,420 @@
+#include "event_loop.h"
+#include "config.h"
+#include "log.h"
+#include "metrics.h"
+#include "response_cache.h"
+#include "trace.h"
+#include <lauxlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+typedef struct EventLoop EventLoop;
+
+typedef enum {
+  WAIT_NONE, // runnable as soon as the plugin lock is free
+  WAIT_DB,   // statement queued on the plugin's DB executor
+  WAIT_JOB,  // job spawned onto the worker pool
+  WAIT_LOG,  // job log record not yet synced
+} TaskWait;
+
+// One in-flight request. The coroutine lives in its plugin's state and
+// is anchored in that state's registry until the handler finishes.
+typedef struct LoopTask {
+  RequestContext *ctx;
+  EventLoop *loop;
+  Plugin *p;
+  const char *rel_url;
+  bool tried_default;
+
+  lua_State *co;
+  int co_ref;
+  RequestView *req; // closed when the handler finishes
+  int nargs; // values to pass to the next resume
+
+  TaskWait wait;
+  JobLogWaiter log_waiter;
+  Plugin *lock_also; // must also be locked before the next resume
+  Plugin *held_also; // locked for the current slice only
+
+  char cache_key[1024];
+  size_t cache_key_len;
+  uint64_t cache_epoch;
+  uint64_t started_ns;
+  uint64_t trace_start;
+
+  struct LoopTask *next;
+} LoopTask;
+
+struct EventLoop {
+  pthread_t thread;
+  int epoll_fd;
+  int wake_fd;
+  PluginManager *pm;
+
+  // Filled by respond(), DB executors and plugin unlocks, drained by the
+  // loop
+  pthread_mutex_t inbox_lock;
+  LoopTask *inbox;
+};
+
+static EventLoop *loops = NULL;
+static int loop_count = 0;
+static atomic_uint next_loop = 0;
+static atomic_bool stopping = false;
+static bool enabled = false;
+
+static _Thread_local LoopTask *tls_task = NULL;
+
+bool event_loop_enabled(void) { return enabled; }
+
+// --- Mailboxes ---
+
+static void post_task(EventLoop *loop, LoopTask *task) {
+  pthread_mutex_lock(&loop->inbox_lock);
+  task->next = loop->inbox;
+  loop->inbox = task;
+  pthread_mutex_unlock(&loop->inbox_lock);
+
+  uint64_t one = 1;
+  ssize_t n = write(loop->wake_fd, &one, sizeof(one));
+  (void)n; // counter overflow just means a wakeup is already pending
+}
+
+void event_loop_submit(RequestContext *ctx) {
+  LoopTask *task = calloc(1, sizeof(LoopTask));
+  if (task == NULL) {
+    finish_request(ctx, 0);
+    return;
+  }
+  task->ctx = ctx;
+  task->co_ref = LUA_NOREF;
+  task->loop = &loops[atomic_fetch_add(&next_loop, 1) % loop_count];
+  post_task(task->loop, task);
+}
+
+// --- Yield points used by C functions ---
+
+bool event_loop_can_yield(lua_State *L) {
+  return tls_task && tls_task->co == L && lua_isyieldable(L);
+}
+
+bool event_loop_on_loop_thread(void) { return tls_task != NULL; }
+
+// Executor, worker or job log flusher thread: the statement, job or sync
+// a parked coroutine waits on finished
+static void wake_task(void *arg) {
+  LoopTask *task = (LoopTask *)arg;
+  if (atomic_load(&stopping))
+    return; // the loops are going away; the request is abandoned
+  post_task(task->loop, task);
+}
+
+int event_loop_yield_db(lua_State *L, DbRequest *req, lua_KContext kctx,
+                        lua_KFunction k) {
+  if (!db_request_set_notify(req, wake_task, tls_task))
+    return k(L, LUA_OK, kctx);
+  tls_task->wait = WAIT_DB;
+  return lua_yieldk(L, 0, kctx, k);
+}
+
+int event_loop_yield_job(lua_State *L, JobFuture *f, lua_KContext kctx,
+                         lua_KFunction k) {
+  if (!job_future_set_notify(f, wake_task, tls_task))
+    return k(L, LUA_OK, kctx);
+  tls_task->wait = WAIT_JOB;
+  return lua_yieldk(L, 0, kctx, k);
+}
+
+int event_loop_yield_log(lua_State *L, JobLog *log, uint64_t seq,
+                         lua_KContext kctx, lua_KFunction k) {
+  if (!job_log_set_notify(log, seq, &tls_task->log_waiter, wake_task,
+                          tls_task))
+    return k(L, LUA_OK, kctx);
+  tls_task->wait = WAIT_LOG;
+  return lua_yieldk(L, 0, kctx, k);
+}
+
+int event_loop_yield_for_lock(lua_State *L, Plugin *target, lua_KContext kctx,
+                              lua_KFunction k) {
+  if (tls_task->held_also == target)
+    return k(L, LUA_YIELD, kctx); // already held for this slice
+  tls_task->lock_also = target;
+  return lua_yieldk(L, 0, kctx, k);
+}
+
+// --- Running tasks (loop thread) ---
+
+static void task_finish(LoopTask *task) {
+  finish_request(task->ctx, task->trace_start);
+  free(task);
+}
+
+void event_loop_unlock_plugin(Plugin *p) {
+  pthread_mutex_unlock(&p->lock);
+  if (!enabled)
+    return; // nothing parks in thread mode
+  pthread_mutex_lock(&p->park_lock);
+  LoopTask *woken = p->parked;
+  p->parked = NULL;
+  pthread_mutex_unlock(&p->park_lock);
+  while (woken) {
+    LoopTask *next = woken->next;
+    wake_task(woken);
+    woken = next;
+  }
+}
+
+// Both locks or neither, so two coroutines can never hold one each.
+// Returns NULL once held, else the plugin whose lock is busy.
+static Plugin *task_try_lock(LoopTask *task) {
+  if (pthread_mutex_trylock(&task->p->lock) != 0)
+    return task->p;
+  if (task->lock_also && task->lock_also != task->p) {
+    if (pthread_mutex_trylock(&task->lock_also->lock) != 0) {
+      event_loop_unlock_plugin(task->p);
+      return task->lock_also;
+    }
+    task->held_also = task->lock_also;
+  }
+  task->lock_also = NULL;
+  return NULL;
+}
+
+static void task_unlock(LoopTask *task) {
+  if (task->held_also)
+    event_loop_unlock_plugin(task->held_also);
+  task->held_also = NULL;
+  event_loop_unlock_plugin(task->p);
+}
+
+static void task_release_coroutine(LoopTask *task) {
+  request_view_close(task->p->L, task->req);
+  task->req = NULL;
+  if (task->co_ref != LUA_NOREF)
+    luaL_unref(task->p->L, LUA_REGISTRYINDEX, task->co_ref);
+  task->co_ref = LUA_NOREF;
+  task->co = NULL;
+}
+
+// Picks the plugin, serves whatever needs no Lua. Returns false when the
+// request is already answered.
+static bool task_route(LoopTask *task) {
+  RequestContext *ctx = task->ctx;
+  trace_begin_request();
+  task->trace_start = trace_now();
+  task->started_ns = metrics_now_ns();
+
+  ctx->response = resolve_request(ctx, &task->p, &task->rel_url);
+  trace_span("http", "route", task->trace_start);
+  if (ctx->response || task->p == NULL)
+    return false;
+  ctx->response =
+      lookup_cached_response(ctx, task->p, task->rel_url, task->cache_key,
+                             sizeof(task->cache_key), &task->cache_key_len);
+  return ctx->response == NULL;
+}
+
+// Retries on the default plugin's handler, like async_worker does
+static bool task_fall_back(LoopTask *task) {
+  Plugin *fallback = find_default_plugin(task->ctx->pm);
+  if (task->tried_default || fallback == NULL || fallback == task->p)
+    return false;
+  task->tried_default = true;
+  task->p = fallback;
+  task->rel_url = task->ctx->url;
+  task->ctx->response = lookup_cached_response(
+      task->ctx, task->p, task->rel_url, task->cache_key,
+      sizeof(task->cache_key), &task->cache_key_len);
+  return task->ctx->response == NULL;
+}
+
+// Waits on `busy`'s list until its holder unlocks. The lock is checked
+// again under park_lock, which every unlock takes before waking the list,
+// so a release in between is never missed.
+static void task_park(LoopTask *task, Plugin *busy) {
+  pthread_mutex_lock(&busy->park_lock);
+  bool held = pthread_mutex_trylock(&busy->lock) != 0;
+  if (held) {
+    task->next = busy->parked;
+    busy->parked = task;
+  } else {
+    // Nobody can park while park_lock is ours, so there is no one to wake
+    pthread_mutex_unlock(&busy->lock);
+  }
+  pthread_mutex_unlock(&busy->park_lock);
+  if (!held)
+    post_task(task->loop, task); // released meanwhile: try again
+}
+
+static void task_step(LoopTask *task) {
+  RequestContext *ctx = task->ctx;
+
+  // 1. First sight: route, and answer static files / cache hits directly
+  if (task->started_ns == 0 && !task_route(task)) {
+    task_finish(task);
+    return;
+  }
+
+  // 2. The plugin state is shared with other loops: never block on it
+  Plugin *busy = task_try_lock(task);
+  if (busy) {
+    task_park(task, busy);
+    return;
+  }
+
+  // 3. Start the handler coroutine
+  if (task->co == NULL) {
+    task->cache_epoch = response_cache_epoch();
+    task->co = lua_newthread(task->p->L);
+    task->co_ref = luaL_ref(task->p->L, LUA_REGISTRYINDEX);
+    task->req = push_plugin_request(task->co, ctx, task->rel_url);
+    if (task->req == NULL) {
+      task_release_coroutine(task);
+      task_unlock(task);
+      if (task_fall_back(task))
+        task_step(task);
+      else
+        task_finish(task);
+      return;
+    }
+    task->nargs = 1;
+  }
+
+  // 4. Run until the handler returns or yields
+  int nres = 0;
+  uint64_t span_start = trace_now();
+  tls_task = task;
+  int status = lua_resume(task->co, task->p->L, task->nargs, &nres);
+  tls_task = NULL;
+  trace_span("lua", "lua_handler", span_start);
+  task->nargs = 0;
+
+  if (status == LUA_YIELD) {
+    lua_pop(task->co, nres);
+    task_unlock(task);
+
+    // A finished statement may already have posted the task back; it
+    // is only picked up after this step returns
+    TaskWait wait = task->wait;
+    task->wait = WAIT_NONE;
+    if (wait != WAIT_NONE)
+      return;
+    if (task->lock_also)
+      task_park(task, task->lock_also);
+    else
+      post_task(task->loop, task); // plain coroutine.yield(): run later
+    return;
+  }
+
+  if (status == LUA_OK && nres >= 1) {
+    lua_settop(task->co, lua_gettop(task->co) - nres + 1);
+    ctx->response = plugin_response_from_result(
+        task->p, task->co, &ctx->status_code,
+        task->cache_key_len ? task->cache_key : NULL, task->cache_key_len,
+        task->cache_epoch, task->started_ns);
+  } else if (status != LUA_OK) {
+    log_write(LOG_ERROR, task->p->name, "Lua Error: %s",
+              lua_tostring(task->co, -1));
+  }
+  task_release_coroutine(task);
+  task_unlock(task);
+
+  if (!ctx->response && task_fall_back(task)) {
+    task_step(task);
+    return;
+  }
+  task_finish(task);
+}
+
+static void *loop_thread(void *arg) {
+  EventLoop *loop = (EventLoop *)arg;
+  struct epoll_event events[4];
+
+  while (!atomic_load(&stopping)) {
+    // Sleep until a request, an I/O completion or a released plugin lock
+    // posts a task
+    int n = epoll_wait(loop->epoll_fd, events, 4, -1);
+    for (int i = 0; i < n; i++) {
+      uint64_t count;
+      if (events[i].data.fd == loop->wake_fd)
+        (void)!read(loop->wake_fd, &count, sizeof(count));
+    }
+
+    pthread_mutex_lock(&loop->inbox_lock);
+    LoopTask *inbox = loop->inbox;
+    loop->inbox = NULL;
+    pthread_mutex_unlock(&loop->inbox_lock);
+
+    // The inbox is a stack; reverse it so requests start in arrival order
+    LoopTask *fifo = NULL;
+    while (inbox) {
+      LoopTask *next = inbox->next;
+      inbox->next = fifo;
+      fifo = inbox;
+      inbox = next;
+    }
+    for (LoopTask *task = fifo; task;) {
+      LoopTask *next = task->next;
+      task_step(task);
+      task = next;
+    }
+  }
+  return NULL;
+}
+
+static int env_int(const char *name, int fallback) {
+  const char *v = getenv(name);
+  return v && atoi(v) > 0 ? atoi(v) : fallback;
+}
+
+void event_loop_start(PluginManager *pm) {
+  const char *mode = getenv("SERVER_MODE");
+  if (mode == NULL || strcmp(mode, "loop") != 0)
+    return;
+
+  loop_count = env_int("SERVER_LOOP_THREADS", cpu_budget());
+
+  loops = calloc(loop_count, sizeof(EventLoop));
+  if (loops == NULL) {
+    log_write(LOG_ERROR, "server", "event loop: out of memory, using threads");
+    return;
+  }
+
+  for (int i = 0; i < loop_count; i++) {
+    EventLoop *loop = &loops[i];
+    loop->pm = pm;
+    pthread_mutex_init(&loop->inbox_lock, NULL);
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = loop->wake_fd};
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev);
+    pthread_create(&loop->thread, NULL, loop_thread, loop);
+  }
+
+  enabled = true;
+  log_write(LOG_INFO, "server", "event loop mode: %d loop threads",
+            loop_count);
+}
+
+void event_loop_stop(void) {
+  if (!enabled)
+    return;
+  atomic_store(&stopping, true);
+
+  for (int i = 0; i < loop_count; i++) {
+    uint64_t one = 1;
+    (void)!write(loops[i].wake_fd, &one, sizeof(one));
+    pthread_join(loops[i].thread, NULL);
+    close(loops[i].wake_fd);
+    close(loops[i].epoll_fd);
+    pthread_mutex_destroy(&loops[i].inbox_lock);
+  }
+  free(loops);
+  loops = NULL;
+  enabled = false;
+}
@@ -0,0 +1,79 @@
+#include "job_future.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+JobFuture *job_future_create(void) {
+  JobFuture *f = calloc(1, sizeof(JobFuture));
+  if (f == NULL)
+    return NULL;
+  pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->cond, NULL);
+  atomic_init(&f->refs, 2);
+  return f;
+}
+
+void job_future_release(JobFuture *f) {
+  if (f == NULL || atomic_fetch_sub(&f->refs, 1) != 1)
+    return;
+  free(f->result);
+  pthread_mutex_destroy(&f->lock);
+  pthread_cond_destroy(&f->cond);
+  free(f);
+}
+
+void job_future_complete(JobFuture *f, bool ok, char *result) {
+  pthread_mutex_lock(&f->lock);
+  f->ok = ok;
+  f->result = result;
+  f->done = true;
+  void (*notify)(void *) = f->notify;
+  void *arg = f->notify_arg;
+  pthread_cond_broadcast(&f->cond);
+  pthread_mutex_unlock(&f->lock);
+  if (notify)
+    notify(arg);
+  job_future_release(f); // the job's reference
+}
+
+bool job_future_set_notify(JobFuture *f, void (*notify)(void *), void *arg) {
+  pthread_mutex_lock(&f->lock);
+  bool pending = !f->done;
+  if (pending) {
+    f->notify = notify;
+    f->notify_arg = arg;
+  }
+  pthread_mutex_unlock(&f->lock);
+  return pending;
+}
+
+void job_future_wait(JobFuture *f) {
+  pthread_mutex_lock(&f->lock);
+  while (!f->done)
+    pthread_cond_wait(&f->cond, &f->lock);
+  pthread_mutex_unlock(&f->lock);
+}
+
+bool job_future_wait_for(JobFuture *f, int timeout_ms) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += (long)timeout_ms * 1000000;
+  deadline.tv_sec += deadline.tv_nsec / 1000000000;
+  deadline.tv_nsec %= 1000000000;
+
+  pthread_mutex_lock(&f->lock);
+  while (!f->done) {
+    if (pthread_cond_timedwait(&f->cond, &f->lock, &deadline) == ETIMEDOUT)
+      break;
+  }
+  bool done = f->done;
+  pthread_mutex_unlock(&f->lock);
+  return done;
+}
+
+bool job_future_done(JobFuture *f) {
+  pthread_mutex_lock(&f->lock);
+  bool done = f->done;
+  pthread_mutex_unlock(&f->lock);
+  return done;
+}
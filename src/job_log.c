@@ -0,0 +1,719 @@
+#include "job_log.h"
+#include "log.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RECORD_JOB 1
+#define RECORD_ACK 2
+
+// A record is this header plus `len` payload bytes, padded to 8. A zero
+// type marks the end of the written part of a segment; it is stored last
+// so a reader never sees a half-written record as complete.
+typedef struct {
+  uint32_t type;
+  uint32_t len;
+  uint64_t seq; // the job's, for both kinds
+  uint32_t crc; // over seq and payload, catches records torn by a crash
+  uint32_t reserved;
+} RecordHeader;
+
+typedef struct {
+  uint64_t first_seq;
+  uint64_t last_seq;
+  char path[600];
+  int fd;
+  uint8_t *map;
+  size_t end; // bytes written
+  int pending; // jobs appended here and not yet acknowledged
+} Segment;
+
+struct JobLog {
+  char dir[512];
+  int lock_fd;
+  size_t segment_size;
+
+  pthread_mutex_t lock;
+  pthread_cond_t appended; // wakes the flusher
+  pthread_cond_t synced;   // wakes job_log_wait
+  JobLogWaiter *waiters;   // woken like job_log_wait, without a thread
+  Segment **segments;      // oldest first; the last one is written to
+  int nsegments, capacity;
+  uint64_t next_seq;
+  uint64_t written_seq;
+  uint64_t synced_seq;
+  size_t synced_end;  // of the active segment
+  Segment *syncing;   // being msynced by the flusher, must stay mapped
+  bool stopping;
+  pthread_t flusher;
+
+  // Next spilled record to hand back
+  bool spilling;
+  Segment *spill_segment;
+  size_t spill_offset;
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    crc_table[i] = c;
+  }
+}
+
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+  const uint8_t *p = data;
+  crc = ~crc;
+  while (len--)
+    crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+static uint32_t record_crc(uint64_t seq, const void *payload, size_t len) {
+  return crc32_update(crc32_update(0, &seq, sizeof(seq)), payload, len);
+}
+
+static size_t record_size(size_t len) {
+  return (sizeof(RecordHeader) + len + 7) & ~(size_t)7;
+}
+
+// The header at `off` when it holds a complete record, else NULL
+static const RecordHeader *record_at(const uint8_t *map, size_t size,
+                                     size_t off) {
+  if (off + sizeof(RecordHeader) > size)
+    return NULL;
+  const RecordHeader *h = (const RecordHeader *)(map + off);
+  uint32_t type = __atomic_load_n(&h->type, __ATOMIC_ACQUIRE);
+  if (type != RECORD_JOB && type != RECORD_ACK)
+    return NULL;
+  if (off + record_size(h->len) > size ||
+      h->crc != record_crc(h->seq, h + 1, h->len))
+    return NULL;
+  return h;
+}
+
+// Splits a job payload into its strings; the partition is optional
+static bool parse_job(const RecordHeader *h, JobRecord *out) {
+  const char *p = (const char *)(h + 1);
+  if (h->len < 3 || p[h->len - 1] != '\0')
+    return false;
+  const char *end = p + h->len;
+  out->seq = h->seq;
+  out->plugin = p;
+  out->func = p + strlen(p) + 1;
+  if (out->func >= end)
+    return false;
+  out->payload = out->func + strlen(out->func) + 1;
+  if (out->payload >= end)
+    return false;
+  out->partition = out->payload + strlen(out->payload) + 1;
+  if (out->partition >= end)
+    out->partition = "";
+  return true;
+}
+
+static void sync_dir(const char *path) {
+  int fd = open(path, O_RDONLY | O_DIRECTORY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Segments
+// ---------------------------------------------------------------------------
+
+static Segment *active(JobLog *log) {
+  return log->segments[log->nsegments - 1];
+}
+
+static Segment *segment_create(JobLog *log) {
+  if (log->nsegments == log->capacity) {
+    int cap = log->capacity ? log->capacity * 2 : 8;
+    Segment **grown = realloc(log->segments, cap * sizeof(Segment *));
+    if (grown == NULL)
+      return NULL;
+    log->segments = grown;
+    log->capacity = cap;
+  }
+  Segment *s = calloc(1, sizeof(Segment));
+  if (s == NULL)
+    return NULL;
+  s->first_seq = log->next_seq;
+  snprintf(s->path, sizeof(s->path), "%s/seg-%016llx.log", log->dir,
+           (unsigned long long)s->first_seq);
+  s->fd = open(s->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (s->fd < 0 || ftruncate(s->fd, (off_t)log->segment_size) != 0) {
+    log_write(LOG_ERROR, "server", "job log %s: %s", s->path,
+              strerror(errno));
+    if (s->fd >= 0)
+      close(s->fd);
+    free(s);
+    return NULL;
+  }
+  s->map = mmap(NULL, log->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                s->fd, 0);
+  if (s->map == MAP_FAILED) {
+    log_write(LOG_ERROR, "server", "job log mmap: %s", strerror(errno));
+    close(s->fd);
+    unlink(s->path);
+    free(s);
+    return NULL;
+  }
+  sync_dir(log->dir);
+  log->segments[log->nsegments++] = s;
+  return s;
+}
+
+static void segment_destroy(JobLog *log, Segment *s, bool remove) {
+  munmap(s->map, log->segment_size);
+  close(s->fd);
+  if (remove)
+    unlink(s->path);
+  free(s);
+}
+
+// Deletes leading segments without unfinished jobs. A newer segment is
+// never deleted first: its acknowledgements may cover older jobs.
+static void collect(JobLog *log) {
+  int drop = 0;
+  while (drop < log->nsegments - 1) {
+    Segment *s = log->segments[drop];
+    if (s->pending > 0 || s == log->syncing || s == log->spill_segment)
+      break;
+    segment_destroy(log, s, true);
+    drop++;
+  }
+  if (drop > 0) {
+    memmove(log->segments, log->segments + drop,
+            (log->nsegments - drop) * sizeof(Segment *));
+    log->nsegments -= drop;
+  }
+}
+
+static Segment *segment_of(JobLog *log, uint64_t seq) {
+  int lo = 0, hi = log->nsegments - 1, found = -1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (log->segments[mid]->first_seq <= seq) {
+      found = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  if (found < 0 || seq > log->segments[found]->last_seq)
+    return NULL;
+  return log->segments[found];
+}
+
+// Calls back the waiters whose record is synced now (all of them once the
+// log stops). Called with the lock held.
+static void notify_synced(JobLog *log) {
+  JobLogWaiter **link = &log->waiters;
+  while (*link) {
+    JobLogWaiter *w = *link;
+    if (w->seq <= log->synced_seq || log->stopping) {
+      *link = w->next;
+      w->notify(w->arg); // the owner may reuse w from here on
+    } else {
+      link = &w->next;
+    }
+  }
+}
+
+// Appends one record, rotating to a new segment when it does not fit.
+// Called with the lock held.
+static Segment *append_record(JobLog *log, uint32_t type, uint64_t seq,
+                              const char *const parts[], int nparts,
+                              size_t *offset) {
+  size_t lens[4], len = 0;
+  for (int i = 0; i < nparts; i++) {
+    lens[i] = strlen(parts[i]) + 1;
+    len += lens[i];
+  }
+  size_t size = record_size(len);
+  if (size > log->segment_size)
+    return NULL;
+
+  Segment *s = active(log);
+  if (s->end + size > log->segment_size) {
+    // The full segment is synced here; the flusher only follows the
+    // active one
+    msync(s->map, s->end, MS_SYNC);
+    log->synced_seq = log->written_seq;
+    s = segment_create(log);
+    if (s == NULL)
+      return NULL;
+    log->synced_end = 0;
+    pthread_cond_broadcast(&log->synced);
+    notify_synced(log);
+  }
+
+  RecordHeader *h = (RecordHeader *)(s->map + s->end);
+  uint8_t *p = (uint8_t *)(h + 1);
+  for (int i = 0; i < nparts; i++) {
+    memcpy(p, parts[i], lens[i]);
+    p += lens[i];
+  }
+  h->len = (uint32_t)len;
+  h->seq = seq;
+  h->crc = record_crc(seq, h + 1, len);
+  h->reserved = 0;
+  __atomic_store_n(&h->type, type, __ATOMIC_RELEASE);
+
+  *offset = s->end;
+  s->end += size;
+  pthread_cond_signal(&log->appended);
+  return s;
+}
+
+// ---------------------------------------------------------------------------
+// Group commit
+// ---------------------------------------------------------------------------
+
+static void *flusher_main(void *arg) {
+  JobLog *log = arg;
+  long page = sysconf(_SC_PAGESIZE);
+  pthread_mutex_lock(&log->lock);
+  for (;;) {
+    while (!log->stopping && active(log)->end == log->synced_end)
+      pthread_cond_wait(&log->appended, &log->lock);
+    Segment *s = active(log);
+    if (s->end == log->synced_end)
+      break; // stopping with nothing left
+
+    // Everything appended since the last pass goes out in one msync
+    size_t from = log->synced_end & ~(size_t)(page - 1);
+    size_t to = s->end;
+    uint64_t target = log->written_seq;
+    log->syncing = s;
+    pthread_mutex_unlock(&log->lock);
+
+    if (msync(s->map + from, to - from, MS_SYNC) != 0)
+      log_write(LOG_ERROR, "server", "job log msync: %s", strerror(errno));
+
+    pthread_mutex_lock(&log->lock);
+    log->syncing = NULL;
+    if (s == active(log) && to > log->synced_end)
+      log->synced_end = to;
+    if (target > log->synced_seq)
+      log->synced_seq = target;
+    pthread_cond_broadcast(&log->synced);
+    notify_synced(log);
+  }
+  pthread_mutex_unlock(&log->lock);
+  return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// API
+// ---------------------------------------------------------------------------
+
+JobLog *job_log_open(const char *dir) {
+  pthread_once(&crc_once, crc_init);
+  if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+    log_write(LOG_ERROR, "server", "job log %s: %s", dir, strerror(errno));
+    return NULL;
+  }
+  JobLog *log = calloc(1, sizeof(JobLog));
+  if (log == NULL)
+    return NULL;
+  const char *mb = getenv("SERVER_JOB_LOG_SEGMENT_MB");
+  log->segment_size = (size_t)(mb && atoi(mb) > 0 ? atoi(mb) : 16) << 20;
+  log->next_seq = 1;
+  log->lock_fd = -1;
+  // A fresh directory per run: a restart that gets the old PID back (PID
+  // 1 in a container) must not reuse, and truncate, the dead run's log
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t started = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  for (;; started++) {
+    snprintf(log->dir, sizeof(log->dir), "%s/%d-%llx", dir, (int)getpid(),
+             (unsigned long long)started);
+    if (mkdir(log->dir, 0700) == 0)
+      break;
+    if (errno != EEXIST)
+      goto fail;
+  }
+
+  char lock_path[600];
+  snprintf(lock_path, sizeof(lock_path), "%s/lock", log->dir);
+  log->lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (log->lock_fd < 0 || flock(log->lock_fd, LOCK_EX | LOCK_NB) != 0)
+    goto fail;
+
+  pthread_mutex_init(&log->lock, NULL);
+  pthread_cond_init(&log->appended, NULL);
+  pthread_cond_init(&log->synced, NULL);
+  if (segment_create(log) == NULL) {
+    close(log->lock_fd);
+    free(log);
+    return NULL;
+  }
+  pthread_create(&log->flusher, NULL, flusher_main, log);
+  log_write(LOG_INFO, "server", "durable job log in %s", log->dir);
+  return log;
+
+fail:
+  log_write(LOG_ERROR, "server", "job log %s: %s", log->dir, strerror(errno));
+  if (log->lock_fd >= 0)
+    close(log->lock_fd);
+  free(log);
+  return NULL;
+}
+
+void job_log_close(JobLog *log) {
+  if (log == NULL)
+    return;
+  pthread_mutex_lock(&log->lock);
+  log->stopping = true;
+  pthread_cond_broadcast(&log->appended);
+  notify_synced(log);
+  pthread_mutex_unlock(&log->lock);
+  pthread_join(log->flusher, NULL);
+
+  int pending = 0;
+  for (int i = 0; i < log->nsegments; i++)
+    pending += log->segments[i]->pending;
+  for (int i = 0; i < log->nsegments; i++)
+    segment_destroy(log, log->segments[i], pending == 0);
+  free(log->segments);
+
+  char lock_path[600];
+  snprintf(lock_path, sizeof(lock_path), "%s/lock", log->dir);
+  if (pending == 0) {
+    unlink(lock_path);
+    rmdir(log->dir);
+  } else {
+    log_write(LOG_INFO, "server", "%d unfinished jobs kept in %s", pending,
+              log->dir);
+  }
+  close(log->lock_fd); // lets the next start claim what is left
+  pthread_mutex_destroy(&log->lock);
+  pthread_cond_destroy(&log->appended);
+  pthread_cond_destroy(&log->synced);
+  free(log);
+}
+
+uint64_t job_log_append(JobLog *log, const char *plugin, const char *func,
+                        const char *payload, const char *partition,
+                        bool spill) {
+  const char *parts[4] = {plugin, func, payload ? payload : "",
+                          partition ? partition : ""};
+  pthread_mutex_lock(&log->lock);
+  uint64_t seq = log->next_seq;
+  size_t offset;
+  Segment *s = append_record(log, RECORD_JOB, seq, parts, 4, &offset);
+  if (s == NULL) {
+    pthread_mutex_unlock(&log->lock);
+    return 0;
+  }
+  log->next_seq++;
+  log->written_seq = seq;
+  s->last_seq = seq;
+  s->pending++;
+  if (spill && !log->spilling) {
+    log->spilling = true;
+    log->spill_segment = s;
+    log->spill_offset = offset;
+  }
+  pthread_mutex_unlock(&log->lock);
+  return seq;
+}
+
+void job_log_wait(JobLog *log, uint64_t seq) {
+  pthread_mutex_lock(&log->lock);
+  while (log->synced_seq < seq && !log->stopping)
+    pthread_cond_wait(&log->synced, &log->lock);
+  pthread_mutex_unlock(&log->lock);
+}
+
+bool job_log_set_notify(JobLog *log, uint64_t seq, JobLogWaiter *w,
+                        void (*notify)(void *), void *arg) {
+  pthread_mutex_lock(&log->lock);
+  bool pending = log->synced_seq < seq && !log->stopping;
+  if (pending) {
+    w->seq = seq;
+    w->notify = notify;
+    w->arg = arg;
+    w->next = log->waiters;
+    log->waiters = w;
+  }
+  pthread_mutex_unlock(&log->lock);
+  return pending;
+}
+
+void job_log_ack(JobLog *log, uint64_t seq) {
+  static const char *const none[1] = {""};
+  pthread_mutex_lock(&log->lock);
+  size_t offset;
+  if (append_record(log, RECORD_ACK, seq, none, 1, &offset) == NULL)
+    log_write(LOG_WARN, "server", "job %llu could not be acknowledged and "
+              "may run again after a crash", (unsigned long long)seq);
+  Segment *s = segment_of(log, seq);
+  if (s && s->pending > 0)
+    s->pending--;
+  collect(log);
+  pthread_mutex_unlock(&log->lock);
+}
+
+int job_log_read_spilled(JobLog *log, int max, JobRecordFn fn, void *arg) {
+  int n = 0;
+  pthread_mutex_lock(&log->lock);
+  while (log->spilling && n < max) {
+    Segment *s = log->spill_segment;
+    if (log->spill_offset >= s->end) {
+      if (s == active(log)) {
+        log->spilling = false; // caught up with the writer
+        log->spill_segment = NULL;
+        break;
+      }
+      int i = 0;
+      while (log->segments[i] != s)
+        i++;
+      log->spill_segment = log->segments[i + 1];
+      log->spill_offset = 0;
+      continue;
+    }
+    const RecordHeader *h =
+        record_at(s->map, log->segment_size, log->spill_offset);
+    if (h == NULL) {
+      log->spill_offset = s->end; // cannot happen for our own records
+      continue;
+    }
+    log->spill_offset += record_size(h->len);
+    JobRecord job;
+    if (h->type == RECORD_JOB && parse_job(h, &job)) {
+      fn(arg, &job);
+      n++;
+    }
+  }
+  pthread_mutex_unlock(&log->lock);
+  return n;
+}
+
+// ---------------------------------------------------------------------------
+// Replay
+// ---------------------------------------------------------------------------
+
+static int compare_seq(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+typedef struct {
+  uint8_t *map;
+  size_t size;
+} MappedFile;
+
+// "dir/name" into out; false when it does not fit
+static bool join_path(char *out, size_t size, const char *dir,
+                      const char *name) {
+  int n = snprintf(out, size, "%s/%s", dir, name);
+  return n >= 0 && (size_t)n < size;
+}
+
+// Replays one dead process's directory, whose lock we hold. Returns -1,
+// before handing back any job, when a segment cannot be read: the
+// directory must then be kept, not deleted with jobs never replayed.
+static int replay_dir(const char *path, JobRecordFn fn, void *arg) {
+  DIR *dir = opendir(path);
+  if (dir == NULL)
+    return -1;
+  char **names = NULL;
+  int count = 0, cap = 0;
+  bool ok = true;
+  struct dirent *e;
+  while (ok && (e = readdir(dir)) != NULL) {
+    if (strncmp(e->d_name, "seg-", 4) != 0)
+      continue;
+    if (count == cap) {
+      cap = cap ? cap * 2 : 64;
+      char **grown = realloc(names, cap * sizeof(char *));
+      if (grown == NULL) {
+        ok = false;
+        break;
+      }
+      names = grown;
+    }
+    if ((names[count] = strdup(e->d_name)) == NULL)
+      ok = false;
+    else
+      count++;
+  }
+  closedir(dir);
+  if (count > 0)
+    qsort(names, count, sizeof(char *), compare_names); // fixed-width hex
+
+  MappedFile *files = calloc(count ? count : 1, sizeof(MappedFile));
+  uint64_t *acked = NULL;
+  size_t nacked = 0, acked_cap = 0;
+  if (files == NULL)
+    ok = false;
+
+  // 1. Map every segment and collect the acknowledgements
+  for (int i = 0; ok && i < count; i++) {
+    char file[PATH_MAX];
+    if (!join_path(file, sizeof(file), path, names[i])) {
+      ok = false;
+      break;
+    }
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      if (fd >= 0)
+        close(fd);
+      ok = false;
+      break;
+    }
+    if (st.st_size == 0) {
+      close(fd);
+      continue;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      ok = false;
+      break;
+    }
+    files[i] = (MappedFile){map, (size_t)st.st_size};
+
+    const RecordHeader *h;
+    for (size_t off = 0; (h = record_at(map, st.st_size, off)) != NULL;
+         off += record_size(h->len)) {
+      if (h->type != RECORD_ACK)
+        continue;
+      if (nacked == acked_cap) {
+        acked_cap = acked_cap ? acked_cap * 2 : 1024;
+        uint64_t *grown = realloc(acked, acked_cap * sizeof(uint64_t));
+        if (grown == NULL) {
+          ok = false; // a missing ack would replay a finished job
+          break;
+        }
+        acked = grown;
+      }
+      acked[nacked++] = h->seq;
+    }
+  }
+  if (nacked > 0)
+    qsort(acked, nacked, sizeof(uint64_t), compare_seq);
+
+  // 2. Hand back the jobs nobody acknowledged
+  int replayed = ok ? 0 : -1;
+  for (int i = 0; ok && i < count; i++) {
+    if (files[i].map == NULL)
+      continue;
+    const RecordHeader *h;
+    for (size_t off = 0;
+         (h = record_at(files[i].map, files[i].size, off)) != NULL;
+         off += record_size(h->len)) {
+      JobRecord job;
+      if (h->type != RECORD_JOB ||
+          (nacked > 0 &&
+           bsearch(&h->seq, acked, nacked, sizeof(uint64_t), compare_seq)) ||
+          !parse_job(h, &job))
+        continue;
+      fn(arg, &job);
+      replayed++;
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (files && files[i].map)
+      munmap(files[i].map, files[i].size);
+    free(names[i]);
+  }
+  free(names);
+  free(files);
+  free(acked);
+  return replayed;
+}
+
+static void remove_dir(const char *path) {
+  DIR *dir = opendir(path);
+  if (dir) {
+    struct dirent *e;
+    while ((e = readdir(dir)) != NULL) {
+      if (e->d_name[0] == '.')
+        continue;
+      char file[PATH_MAX];
+      if (join_path(file, sizeof(file), path, e->d_name))
+        unlink(file);
+    }
+    closedir(dir);
+  }
+  rmdir(path);
+}
+
+int job_log_replay_orphans(JobLog *log, JobRecordFn fn, void *arg) {
+  // The parent of our own <dir>/<pid>-<start>
+  char root[512];
+  snprintf(root, sizeof(root), "%s", log->dir);
+  char *slash = strrchr(root, '/');
+  if (slash == NULL)
+    return 0;
+  *slash = '\0';
+  const char *own = slash + 1;
+
+  DIR *dir = opendir(root);
+  if (dir == NULL)
+    return 0;
+  int total = 0;
+  struct dirent *e;
+  while ((e = readdir(dir)) != NULL) {
+    if (e->d_name[0] == '.' || strcmp(e->d_name, own) == 0)
+      continue;
+    char path[PATH_MAX], lock_path[PATH_MAX];
+    if (!join_path(path, sizeof(path), root, e->d_name) ||
+        !join_path(lock_path, sizeof(lock_path), path, "lock"))
+      continue;
+    int fd = open(lock_path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+      continue;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+      close(fd); // its process is still running
+      continue;
+    }
+
+    int n = replay_dir(path, fn, arg);
+    if (n < 0) {
+      log_write(LOG_ERROR, "server", "job log %s could not be read; kept "
+                "for the next start", path);
+      close(fd);
+      continue;
+    }
+    // Only drop the old log once the copies are durable in ours
+    pthread_mutex_lock(&log->lock);
+    uint64_t written = log->written_seq;
+    pthread_mutex_unlock(&log->lock);
+    job_log_wait(log, written);
+    remove_dir(path);
+    close(fd);
+    if (n > 0)
+      log_write(LOG_INFO, "server", "replayed %d unfinished jobs from %s", n,
+                path);
+    total += n;
+  }
+  closedir(dir);
+  return total;
+}
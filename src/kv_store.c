@@ -0,0 +1,676 @@
+#include "kv_store.h"
+#include "metrics.h"
+#include <lauxlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KV_STRIPES 64 // power of two
+#define KV_INITIAL_BUCKETS 64
+#define KV_MAX_DEPTH 32
+#define KV_INLINE_COPY 256 // values up to this size are decoded from the C stack
+
+// Value encoding: one tag byte, then
+//   KV_INT     zigzag varint
+//   KV_FLOAT   8 raw bytes
+//   KV_STRING  varint length + bytes
+//   KV_TABLE   varint pair count + (key, value) encodings
+enum { KV_NIL, KV_FALSE, KV_TRUE, KV_INT, KV_FLOAT, KV_STRING, KV_TABLE };
+
+// Key bytes followed by the encoded value, in one allocation
+typedef struct KvEntry {
+  struct KvEntry *next;
+  uint64_t hash;
+  uint64_t expires_ns; // 0 = no expiry
+  uint32_t key_len;
+  uint32_t value_len;
+  char data[];
+} KvEntry;
+
+typedef struct {
+  pthread_mutex_t lock;
+  KvEntry **buckets;
+  size_t bucket_count;
+  size_t count;
+} KvStripe;
+
+struct KvStore {
+  KvStripe stripes[KV_STRIPES];
+  _Atomic size_t bytes;
+  _Atomic size_t keys;
+  size_t max_bytes;
+  size_t max_value;
+};
+
+static uint64_t hash_key(const char *s, size_t len) {
+  uint64_t h = 1469598103934665603ull;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+static size_t entry_bytes(const KvEntry *e) {
+  return sizeof(KvEntry) + e->key_len + e->value_len;
+}
+
+KvStore *kv_store_create(void) {
+  KvStore *kv = calloc(1, sizeof(KvStore));
+  if (kv == NULL)
+    return NULL;
+
+  const char *mb = getenv("SERVER_KV_MB");
+  const char *value_kb = getenv("SERVER_KV_MAX_VALUE_KB");
+  kv->max_bytes = (size_t)(mb && atol(mb) > 0 ? atol(mb) : 64) * 1024 * 1024;
+  kv->max_value =
+      (size_t)(value_kb && atol(value_kb) > 0 ? atol(value_kb) : 64) * 1024;
+
+  for (int i = 0; i < KV_STRIPES; i++) {
+    KvStripe *s = &kv->stripes[i];
+    pthread_mutex_init(&s->lock, NULL);
+    s->buckets = calloc(KV_INITIAL_BUCKETS, sizeof(KvEntry *));
+    s->bucket_count = s->buckets ? KV_INITIAL_BUCKETS : 0;
+  }
+  return kv;
+}
+
+void kv_store_destroy(KvStore *kv) {
+  if (kv == NULL)
+    return;
+  for (int i = 0; i < KV_STRIPES; i++) {
+    KvStripe *s = &kv->stripes[i];
+    for (size_t b = 0; b < s->bucket_count; b++) {
+      KvEntry *e = s->buckets[b];
+      while (e) {
+        KvEntry *next = e->next;
+        free(e);
+        e = next;
+      }
+    }
+    free(s->buckets);
+    pthread_mutex_destroy(&s->lock);
+  }
+  free(kv);
+}
+
+void kv_store_stats(KvStore *kv, size_t *keys_out, size_t *bytes_out) {
+  *keys_out = atomic_load_explicit(&kv->keys, memory_order_relaxed);
+  *bytes_out = atomic_load_explicit(&kv->bytes, memory_order_relaxed);
+}
+
+// --- Stripe operations (caller holds the stripe lock) ---
+
+static KvStripe *stripe_for(KvStore *kv, uint64_t hash) {
+  return &kv->stripes[(hash >> 40) & (KV_STRIPES - 1)];
+}
+
+static KvEntry **stripe_find(KvStripe *s, const char *key, size_t key_len,
+                             uint64_t hash) {
+  KvEntry **link = &s->buckets[hash & (s->bucket_count - 1)];
+  while (*link && !((*link)->hash == hash && (*link)->key_len == key_len &&
+                    memcmp((*link)->data, key, key_len) == 0))
+    link = &(*link)->next;
+  return link;
+}
+
+static void stripe_unlink(KvStore *kv, KvStripe *s, KvEntry **link) {
+  KvEntry *e = *link;
+  *link = e->next;
+  s->count--;
+  atomic_fetch_sub_explicit(&kv->bytes, entry_bytes(e), memory_order_relaxed);
+  atomic_fetch_sub_explicit(&kv->keys, 1, memory_order_relaxed);
+  free(e);
+}
+
+// Finds a live entry, dropping it first if its TTL has passed
+static KvEntry **stripe_lookup(KvStore *kv, KvStripe *s, const char *key,
+                               size_t key_len, uint64_t hash, uint64_t now) {
+  KvEntry **link = stripe_find(s, key, key_len, hash);
+  if (*link && (*link)->expires_ns && (*link)->expires_ns <= now) {
+    stripe_unlink(kv, s, link);
+    return stripe_find(s, key, key_len, hash);
+  }
+  return link;
+}
+
+static void stripe_grow(KvStripe *s) {
+  size_t new_count = s->bucket_count * 2;
+  KvEntry **grown = calloc(new_count, sizeof(KvEntry *));
+  if (grown == NULL)
+    return; // keep the longer chains
+  for (size_t b = 0; b < s->bucket_count; b++) {
+    KvEntry *e = s->buckets[b];
+    while (e) {
+      KvEntry *next = e->next;
+      KvEntry **slot = &grown[e->hash & (new_count - 1)];
+      e->next = *slot;
+      *slot = e;
+      e = next;
+    }
+  }
+  free(s->buckets);
+  s->buckets = grown;
+  s->bucket_count = new_count;
+}
+
+static void stripe_sweep(KvStore *kv, KvStripe *s, uint64_t now) {
+  for (size_t b = 0; b < s->bucket_count; b++) {
+    KvEntry **link = &s->buckets[b];
+    while (*link) {
+      if ((*link)->expires_ns && (*link)->expires_ns <= now)
+        stripe_unlink(kv, s, link);
+      else
+        link = &(*link)->next;
+    }
+  }
+}
+
+// Replaces whatever `link` points at with a new entry holding `value`.
+// Returns false when the store is over its byte budget.
+static bool stripe_put(KvStore *kv, KvStripe *s, KvEntry **link,
+                       const char *key, size_t key_len, uint64_t hash,
+                       const char *value, size_t value_len,
+                       uint64_t expires_ns, uint64_t now) {
+  size_t need = sizeof(KvEntry) + key_len + value_len;
+  size_t freed = *link ? entry_bytes(*link) : 0;
+  if (atomic_load_explicit(&kv->bytes, memory_order_relaxed) + need - freed >
+      kv->max_bytes) {
+    stripe_sweep(kv, s, now);
+    link = stripe_find(s, key, key_len, hash);
+    freed = *link ? entry_bytes(*link) : 0;
+    if (atomic_load_explicit(&kv->bytes, memory_order_relaxed) + need -
+            freed >
+        kv->max_bytes)
+      return false;
+  }
+
+  KvEntry *e = malloc(need);
+  if (e == NULL)
+    return false;
+  e->hash = hash;
+  e->expires_ns = expires_ns;
+  e->key_len = (uint32_t)key_len;
+  e->value_len = (uint32_t)value_len;
+  memcpy(e->data, key, key_len);
+  memcpy(e->data + key_len, value, value_len);
+
+  if (*link) {
+    e->next = (*link)->next;
+    atomic_fetch_sub_explicit(&kv->bytes, entry_bytes(*link),
+                              memory_order_relaxed);
+    free(*link);
+    *link = e;
+  } else {
+    e->next = NULL;
+    *link = e;
+    s->count++;
+    atomic_fetch_add_explicit(&kv->keys, 1, memory_order_relaxed);
+  }
+  atomic_fetch_add_explicit(&kv->bytes, need, memory_order_relaxed);
+  if (s->count > s->bucket_count * 2)
+    stripe_grow(s);
+  return true;
+}
+
+// --- Encoding ---
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+  size_t limit;
+  const char *error;
+} EncBuf;
+
+static bool enc_reserve(EncBuf *b, size_t n) {
+  if (b->len + n > b->limit) {
+    b->error = "value too large";
+    return false;
+  }
+  if (b->len + n <= b->cap)
+    return true;
+  size_t cap = b->cap ? b->cap * 2 : 64;
+  while (cap < b->len + n)
+    cap *= 2;
+  char *grown = realloc(b->data, cap);
+  if (grown == NULL) {
+    b->error = "out of memory";
+    return false;
+  }
+  b->data = grown;
+  b->cap = cap;
+  return true;
+}
+
+static bool enc_byte(EncBuf *b, uint8_t v) {
+  if (!enc_reserve(b, 1))
+    return false;
+  b->data[b->len++] = (char)v;
+  return true;
+}
+
+static bool enc_varint(EncBuf *b, uint64_t v) {
+  if (!enc_reserve(b, 10))
+    return false;
+  while (v >= 0x80) {
+    b->data[b->len++] = (char)(v | 0x80);
+    v >>= 7;
+  }
+  b->data[b->len++] = (char)v;
+  return true;
+}
+
+static bool enc_bytes(EncBuf *b, const char *s, size_t n) {
+  if (!enc_varint(b, n) || !enc_reserve(b, n))
+    return false;
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+  return true;
+}
+
+static bool encode_value(lua_State *L, int idx, EncBuf *b, int depth) {
+  switch (lua_type(L, idx)) {
+  case LUA_TNIL:
+  case LUA_TNONE:
+    return enc_byte(b, KV_NIL);
+  case LUA_TBOOLEAN:
+    return enc_byte(b, lua_toboolean(L, idx) ? KV_TRUE : KV_FALSE);
+  case LUA_TNUMBER:
+    if (lua_isinteger(L, idx)) {
+      int64_t v = (int64_t)lua_tointeger(L, idx);
+      return enc_byte(b, KV_INT) &&
+             enc_varint(b, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+    } else {
+      double d = lua_tonumber(L, idx);
+      if (!enc_byte(b, KV_FLOAT) || !enc_reserve(b, sizeof(d)))
+        return false;
+      memcpy(b->data + b->len, &d, sizeof(d));
+      b->len += sizeof(d);
+      return true;
+    }
+  case LUA_TSTRING: {
+    size_t len;
+    const char *s = lua_tolstring(L, idx, &len);
+    return enc_byte(b, KV_STRING) && enc_bytes(b, s, len);
+  }
+  case LUA_TTABLE: {
+    if (depth >= KV_MAX_DEPTH) {
+      b->error = "table nested too deeply";
+      return false;
+    }
+    idx = lua_absindex(L, idx);
+    uint64_t pairs = 0;
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+      pairs++;
+      lua_pop(L, 1);
+    }
+    if (!enc_byte(b, KV_TABLE) || !enc_varint(b, pairs))
+      return false;
+    if (!lua_checkstack(L, 3)) {
+      b->error = "stack overflow";
+      return false;
+    }
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+      if (!encode_value(L, -2, b, depth + 1) ||
+          !encode_value(L, -1, b, depth + 1)) {
+        lua_pop(L, 2);
+        return false;
+      }
+      lua_pop(L, 1);
+    }
+    return true;
+  }
+  default:
+    b->error = "unsupported value type (functions, userdata and threads "
+               "cannot be stored)";
+    return false;
+  }
+}
+
+// Encodes the value at idx into a malloc'd buffer, or raises a Lua error
+static EncBuf encode_or_error(lua_State *L, int idx, KvStore *kv) {
+  EncBuf b = {.limit = kv->max_value};
+  if (!encode_value(L, idx, &b, 0)) {
+    free(b.data);
+    luaL_error(L, "kv: %s", b.error);
+  }
+  return b;
+}
+
+// --- Decoding ---
+
+typedef struct {
+  const char *p;
+  const char *end;
+} DecBuf;
+
+static bool dec_varint(DecBuf *d, uint64_t *out) {
+  uint64_t v = 0;
+  for (int shift = 0; d->p < d->end && shift < 64; shift += 7) {
+    uint8_t byte = (uint8_t)*d->p++;
+    v |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      *out = v;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool decode_value(lua_State *L, DecBuf *d, int depth) {
+  if (d->p >= d->end || depth > KV_MAX_DEPTH)
+    return false;
+  luaL_checkstack(L, 3, "kv: value nested too deeply");
+  uint64_t v;
+  switch ((uint8_t)*d->p++) {
+  case KV_NIL:
+    lua_pushnil(L);
+    return true;
+  case KV_FALSE:
+  case KV_TRUE:
+    lua_pushboolean(L, d->p[-1] == KV_TRUE);
+    return true;
+  case KV_INT:
+    if (!dec_varint(d, &v))
+      return false;
+    lua_pushinteger(L, (lua_Integer)((v >> 1) ^ (~(v & 1) + 1)));
+    return true;
+  case KV_FLOAT: {
+    double f;
+    if (d->end - d->p < (ptrdiff_t)sizeof(f))
+      return false;
+    memcpy(&f, d->p, sizeof(f));
+    d->p += sizeof(f);
+    lua_pushnumber(L, f);
+    return true;
+  }
+  case KV_STRING:
+    if (!dec_varint(d, &v) || (uint64_t)(d->end - d->p) < v)
+      return false;
+    lua_pushlstring(L, d->p, (size_t)v);
+    d->p += v;
+    return true;
+  case KV_TABLE:
+    if (!dec_varint(d, &v))
+      return false;
+    lua_createtable(L, 0, v < 64 ? (int)v : 64);
+    for (uint64_t i = 0; i < v; i++) {
+      if (!decode_value(L, d, depth + 1))
+        return false;
+      if (!decode_value(L, d, depth + 1))
+        return false;
+      lua_rawset(L, -3);
+    }
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void push_decoded(lua_State *L, const char *data, size_t len) {
+  DecBuf d = {data, data + len};
+  int top = lua_gettop(L);
+  if (!decode_value(L, &d, 0)) {
+    lua_settop(L, top);
+    luaL_error(L, "kv: corrupt value");
+  }
+}
+
+// --- Lua bindings ---
+
+static KvStore *upvalue_store(lua_State *L) {
+  return (KvStore *)lua_touserdata(L, lua_upvalueindex(1));
+}
+
+static const char *check_key(lua_State *L, size_t *len) {
+  const char *key = luaL_checklstring(L, 1, len);
+  luaL_argcheck(L, *len > 0 && *len <= KV_MAX_KEY, 1,
+                "key must be 1-256 bytes");
+  return key;
+}
+
+static uint64_t ttl_deadline(lua_State *L, int idx, uint64_t now) {
+  if (lua_isnoneornil(L, idx))
+    return 0;
+  double ttl = luaL_checknumber(L, idx);
+  if (ttl <= 0)
+    return now; // already expired
+  return now + (uint64_t)(ttl * 1e9);
+}
+
+// kv.get(key)
+static int l_kv_get(lua_State *L) {
+  KvStore *kv = upvalue_store(L);
+  size_t key_len;
+  const char *key = check_key(L, &key_len);
+  uint64_t hash = hash_key(key, key_len);
+  KvStripe *s = stripe_for(kv, hash);
+
+  // Copy out under the lock and decode after it, since decoding may
+  // allocate and raise. Large values go into a GC-owned userdata sized
+  // outside the lock, retrying if the value grew in between.
+  char inline_copy[KV_INLINE_COPY];
+  char *copy = inline_copy;
+  size_t cap = sizeof(inline_copy);
+  size_t len;
+  for (;;) {
+    pthread_mutex_lock(&s->lock);
+    KvEntry **link =
+        stripe_lookup(kv, s, key, key_len, hash, metrics_now_ns());
+    if (*link == NULL) {
+      pthread_mutex_unlock(&s->lock);
+      lua_pushnil(L);
+      return 1;
+    }
+    len = (*link)->value_len;
+    if (len <= cap) {
+      memcpy(copy, (*link)->data + key_len, len);
+      pthread_mutex_unlock(&s->lock);
+      break;
+    }
+    pthread_mutex_unlock(&s->lock);
+    cap = len;
+    copy = lua_newuserdatauv(L, cap, 0);
+  }
+  push_decoded(L, copy, len);
+  return 1;
+}
+
+// kv.set(key, value [, ttl])
+static int l_kv_set(lua_State *L) {
+  KvStore *kv = upvalue_store(L);
+  size_t key_len;
+  const char *key = check_key(L, &key_len);
+  uint64_t now = metrics_now_ns();
+  uint64_t expires = ttl_deadline(L, 3, now);
+  uint64_t hash = hash_key(key, key_len);
+  KvStripe *s = stripe_for(kv, hash);
+
+  if (lua_isnil(L, 2)) {
+    pthread_mutex_lock(&s->lock);
+    KvEntry **link = stripe_find(s, key, key_len, hash);
+    if (*link)
+      stripe_unlink(kv, s, link);
+    pthread_mutex_unlock(&s->lock);
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+
+  EncBuf b = encode_or_error(L, 2, kv);
+  pthread_mutex_lock(&s->lock);
+  KvEntry **link = stripe_find(s, key, key_len, hash);
+  bool ok = stripe_put(kv, s, link, key, key_len, hash, b.data, b.len,
+                       expires, now);
+  pthread_mutex_unlock(&s->lock);
+  free(b.data);
+
+  if (!ok) {
+    lua_pushnil(L);
+    lua_pushstring(L, "kv store full");
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// kv.incr(key [, by [, ttl]]): missing keys start at 0; the ttl only
+// applies when the key is created, so a rate-limit window is not
+// extended by every hit
+static int l_kv_incr(lua_State *L) {
+  KvStore *kv = upvalue_store(L);
+  size_t key_len;
+  const char *key = check_key(L, &key_len);
+  lua_Integer by = luaL_optinteger(L, 2, 1);
+  uint64_t now = metrics_now_ns();
+  uint64_t expires = ttl_deadline(L, 3, now);
+  uint64_t hash = hash_key(key, key_len);
+  KvStripe *s = stripe_for(kv, hash);
+
+  pthread_mutex_lock(&s->lock);
+  KvEntry **link = stripe_lookup(kv, s, key, key_len, hash, now);
+  int64_t value = 0;
+  if (*link) {
+    DecBuf d = {(*link)->data + key_len,
+                (*link)->data + key_len + (*link)->value_len};
+    uint64_t raw;
+    if ((*link)->value_len == 0 || (uint8_t)*d.p++ != KV_INT ||
+        !dec_varint(&d, &raw)) {
+      pthread_mutex_unlock(&s->lock);
+      return luaL_error(L, "kv.incr: value at '%s' is not an integer", key);
+    }
+    value = (int64_t)((raw >> 1) ^ (~(raw & 1) + 1));
+    expires = (*link)->expires_ns;
+  }
+  value = (int64_t)((uint64_t)value + (uint64_t)by);
+
+  char enc[11];
+  uint64_t zz = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+  size_t n = 0;
+  enc[n++] = KV_INT;
+  while (zz >= 0x80) {
+    enc[n++] = (char)(zz | 0x80);
+    zz >>= 7;
+  }
+  enc[n++] = (char)zz;
+  bool ok = stripe_put(kv, s, link, key, key_len, hash, enc, n, expires, now);
+  pthread_mutex_unlock(&s->lock);
+
+  if (!ok)
+    return luaL_error(L, "kv.incr: kv store full");
+  lua_pushinteger(L, (lua_Integer)value);
+  return 1;
+}
+
+// kv.cas(key, old, new [, ttl]): compares encoded forms, so it is meant
+// for scalars; old = nil means "only if absent", new = nil deletes
+static int l_kv_cas(lua_State *L) {
+  KvStore *kv = upvalue_store(L);
+  size_t key_len;
+  const char *key = check_key(L, &key_len);
+  uint64_t now = metrics_now_ns();
+  uint64_t expires = ttl_deadline(L, 4, now);
+  uint64_t hash = hash_key(key, key_len);
+  KvStripe *s = stripe_for(kv, hash);
+
+  EncBuf expected = {0};
+  EncBuf desired = {0};
+  if (!lua_isnoneornil(L, 2))
+    expected = encode_or_error(L, 2, kv);
+  if (!lua_isnoneornil(L, 3)) {
+    EncBuf b = {.limit = kv->max_value};
+    if (!encode_value(L, 3, &b, 0)) {
+      free(expected.data);
+      free(b.data);
+      return luaL_error(L, "kv: %s", b.error);
+    }
+    desired = b;
+  }
+
+  pthread_mutex_lock(&s->lock);
+  KvEntry **link = stripe_lookup(kv, s, key, key_len, hash, now);
+  bool matches;
+  if (*link == NULL)
+    matches = expected.data == NULL;
+  else
+    matches = expected.data != NULL && (*link)->value_len == expected.len &&
+              memcmp((*link)->data + key_len, expected.data, expected.len) ==
+                  0;
+
+  bool ok = matches;
+  if (matches) {
+    if (desired.data)
+      ok = stripe_put(kv, s, link, key, key_len, hash, desired.data,
+                      desired.len, expires, now);
+    else if (*link)
+      stripe_unlink(kv, s, link);
+  }
+  pthread_mutex_unlock(&s->lock);
+  free(expected.data);
+  free(desired.data);
+
+  lua_pushboolean(L, ok);
+  return 1;
+}
+
+// kv.expire(key, ttl)
+static int l_kv_expire(lua_State *L) {
+  KvStore *kv = upvalue_store(L);
+  size_t key_len;
+  const char *key = check_key(L, &key_len);
+  uint64_t now = metrics_now_ns();
+  uint64_t expires = ttl_deadline(L, 2, now);
+  uint64_t hash = hash_key(key, key_len);
+  KvStripe *s = stripe_for(kv, hash);
+
+  pthread_mutex_lock(&s->lock);
+  KvEntry **link = stripe_lookup(kv, s, key, key_len, hash, now);
+  bool found = *link != NULL;
+  if (found) {
+    if (expires == now)
+      stripe_unlink(kv, s, link);
+    else
+      (*link)->expires_ns = expires;
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  lua_pushboolean(L, found);
+  return 1;
+}
+
+// kv.del(key)
+static int l_kv_del(lua_State *L) {
+  KvStore *kv = upvalue_store(L);
+  size_t key_len;
+  const char *key = check_key(L, &key_len);
+  uint64_t hash = hash_key(key, key_len);
+  KvStripe *s = stripe_for(kv, hash);
+
+  pthread_mutex_lock(&s->lock);
+  KvEntry **link =
+      stripe_lookup(kv, s, key, key_len, hash, metrics_now_ns());
+  bool found = *link != NULL;
+  if (found)
+    stripe_unlink(kv, s, link);
+  pthread_mutex_unlock(&s->lock);
+
+  lua_pushboolean(L, found);
+  return 1;
+}
+
+void kv_store_setup_lua(lua_State *L, KvStore *kv) {
+  static const luaL_Reg funcs[] = {
+      {"get", l_kv_get},       {"set", l_kv_set}, {"incr", l_kv_incr},
+      {"cas", l_kv_cas},       {"expire", l_kv_expire},
+      {"del", l_kv_del},       {NULL, NULL},
+  };
+  if (kv == NULL)
+    return;
+  lua_newtable(L);
+  lua_pushlightuserdata(L, kv);
+  luaL_setfuncs(L, funcs, 1);
+  lua_setglobal(L, "kv");
+}
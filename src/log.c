@@ -0,0 +1,470 @@
+#include "log.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+// Producers copy the message into a fixed-size record in their own
+// single-producer ring and bump `head`; the writer thread is the only
+// consumer and bumps `tail`. Nothing is formatted on the request path.
+// Like the trace rings, a ring outlives its thread (request threads are
+// short-lived) and is handed to the next new thread once it exits.
+#define LOG_RING_SIZE 512 // records per thread, power of two
+#define LOG_MSG_LEN 448
+#define LOG_SOURCE_LEN 32
+#define LOG_BATCH 4096          // records formatted per writer pass
+#define LOG_IDLE_SLEEP_NS 5000000 // writer poll interval when rings are idle
+#define LOG_OUT_BUF (64 * 1024) // bytes handed to fwrite at once
+
+typedef enum { LOG_FORMAT_TEXT, LOG_FORMAT_JSON, LOG_FORMAT_LOGFMT } LogFormat;
+
+typedef struct {
+  uint64_t ts_ns; // CLOCK_REALTIME
+  uint16_t len;
+  uint8_t level;
+  bool truncated;
+  char source[LOG_SOURCE_LEN];
+  char msg[LOG_MSG_LEN];
+} LogRecord;
+
+typedef struct LogRing {
+  LogRecord records[LOG_RING_SIZE];
+  _Atomic uint64_t head; // written by the producing thread
+  _Atomic uint64_t tail; // written by the writer thread
+  uint64_t batch_end;    // writer-only: consumed up to here this pass
+  struct LogRing *next_all;
+  struct LogRing *next_free;
+} LogRing;
+
+static _Atomic int min_level = LOG_INFO;
+static LogFormat format = LOG_FORMAT_TEXT;
+static const char *file_path = NULL;
+static long max_bytes = 64L * 1024 * 1024;
+static int keep_files = 5;
+
+static FILE *out = NULL;
+static long out_bytes = 0;
+static pthread_t writer;
+static atomic_bool running = false;
+static atomic_bool stopping = false;
+static _Atomic uint64_t dropped = 0;
+static pthread_mutex_t inline_lock = PTHREAD_MUTEX_INITIALIZER;
+// Only used to cut the writer's idle sleep short when a ring fills up
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+
+static _Atomic(LogRing *) all_rings = NULL;
+static LogRing *free_rings = NULL;
+static pthread_mutex_t free_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static _Thread_local LogRing *tls_ring = NULL;
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+static const char *level_lower[] = {"debug", "info", "warn", "error"};
+
+LogLevel log_level_from_string(const char *name) {
+  if (name == NULL)
+    return LOG_INFO;
+  if (strcasecmp(name, "debug") == 0)
+    return LOG_DEBUG;
+  if (strcasecmp(name, "warn") == 0 || strcasecmp(name, "warning") == 0)
+    return LOG_WARN;
+  if (strcasecmp(name, "error") == 0)
+    return LOG_ERROR;
+  if (strcasecmp(name, "off") == 0)
+    return LOG_OFF;
+  return LOG_INFO;
+}
+
+bool log_enabled(LogLevel level) {
+  return (int)level >= atomic_load_explicit(&min_level, memory_order_relaxed);
+}
+
+uint64_t log_dropped(void) {
+  return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+static void release_ring(void *arg) {
+  LogRing *ring = (LogRing *)arg;
+  pthread_mutex_lock(&free_rings_lock);
+  ring->next_free = free_rings;
+  free_rings = ring;
+  pthread_mutex_unlock(&free_rings_lock);
+}
+
+static LogRing *acquire_ring(void) {
+  pthread_mutex_lock(&free_rings_lock);
+  LogRing *ring = free_rings;
+  if (ring)
+    free_rings = ring->next_free;
+  pthread_mutex_unlock(&free_rings_lock);
+
+  if (ring == NULL) {
+    ring = calloc(1, sizeof(LogRing));
+    if (ring == NULL)
+      return NULL;
+    // Publish so the writer starts draining it
+    LogRing *head = atomic_load(&all_rings);
+    do {
+      ring->next_all = head;
+    } while (!atomic_compare_exchange_weak(&all_rings, &head, ring));
+  }
+  pthread_setspecific(ring_key, ring);
+  return ring;
+}
+
+// --- Formatting (writer thread only) ---
+
+typedef struct {
+  char data[LOG_OUT_BUF];
+  size_t len;
+} OutBuf;
+
+static void open_output(void) {
+  out = file_path ? fopen(file_path, "a") : stdout;
+  if (out == NULL) {
+    fprintf(stderr, "log: cannot open %s, using stdout\n", file_path);
+    file_path = NULL;
+    out = stdout;
+  }
+  out_bytes = out == stdout ? 0 : ftell(out);
+}
+
+// app.log -> app.log.1 -> ... -> app.log.<keep>, oldest is removed
+static void rotate_output(void) {
+  fclose(out);
+  char from[1024], to[1024];
+  for (int i = keep_files - 1; i >= 1; i--) {
+    snprintf(from, sizeof(from), "%s.%d", file_path, i);
+    snprintf(to, sizeof(to), "%s.%d", file_path, i + 1);
+    rename(from, to);
+  }
+  snprintf(to, sizeof(to), "%s.1", file_path);
+  rename(file_path, to);
+  open_output();
+}
+
+static void out_flush(OutBuf *b) {
+  if (b->len == 0)
+    return;
+  fwrite(b->data, 1, b->len, out);
+  out_bytes += (long)b->len;
+  b->len = 0;
+  if (file_path && max_bytes > 0 && out_bytes >= max_bytes) {
+    fflush(out);
+    rotate_output();
+  }
+}
+
+static void out_append(OutBuf *b, const char *s, size_t n) {
+  if (b->len + n > sizeof(b->data))
+    out_flush(b);
+  if (n > sizeof(b->data)) {
+    fwrite(s, 1, n, out);
+    out_bytes += (long)n;
+    return;
+  }
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+}
+
+static void out_str(OutBuf *b, const char *s) { out_append(b, s, strlen(s)); }
+
+// JSON string body; logfmt uses the same escapes inside its quotes
+static void out_escaped(OutBuf *b, const char *s, size_t n) {
+  size_t run = 0;
+  for (size_t i = 0; i < n; i++) {
+    unsigned char c = (unsigned char)s[i];
+    if (c >= 0x20 && c != '"' && c != '\\')
+      continue;
+    out_append(b, s + run, i - run);
+    run = i + 1;
+    char esc[8];
+    switch (c) {
+    case '"': out_append(b, "\\\"", 2); break;
+    case '\\': out_append(b, "\\\\", 2); break;
+    case '\n': out_append(b, "\\n", 2); break;
+    case '\r': out_append(b, "\\r", 2); break;
+    case '\t': out_append(b, "\\t", 2); break;
+    default:
+      snprintf(esc, sizeof(esc), "\\u%04x", c);
+      out_append(b, esc, 6);
+    }
+  }
+  out_append(b, s + run, n - run);
+}
+
+// Timestamp formatting is cached per second; only the millis change
+typedef struct {
+  time_t sec;
+  char text[32];
+} TimeCache;
+
+static const char *format_time(TimeCache *cache, uint64_t ts_ns, char *buf,
+                               size_t size) {
+  time_t sec = (time_t)(ts_ns / 1000000000ull);
+  if (sec != cache->sec) {
+    struct tm tm_info;
+    cache->sec = sec;
+    if (format == LOG_FORMAT_TEXT) {
+      localtime_r(&sec, &tm_info);
+      strftime(cache->text, sizeof(cache->text), "%Y-%m-%d %H:%M:%S",
+               &tm_info);
+    } else {
+      gmtime_r(&sec, &tm_info);
+      strftime(cache->text, sizeof(cache->text), "%Y-%m-%dT%H:%M:%S",
+               &tm_info);
+    }
+  }
+  if (format == LOG_FORMAT_TEXT)
+    return cache->text;
+  snprintf(buf, size, "%s.%03uZ", cache->text,
+           (unsigned)((ts_ns / 1000000ull) % 1000));
+  return buf;
+}
+
+static void format_record(OutBuf *b, TimeCache *cache, const LogRecord *r) {
+  char ts[48];
+  const char *when = format_time(cache, r->ts_ns, ts, sizeof(ts));
+
+  switch (format) {
+  case LOG_FORMAT_JSON:
+    out_str(b, "{\"ts\":\"");
+    out_str(b, when);
+    out_str(b, "\",\"level\":\"");
+    out_str(b, level_lower[r->level]);
+    out_str(b, "\",\"source\":\"");
+    out_escaped(b, r->source, strlen(r->source));
+    out_str(b, "\",\"msg\":\"");
+    out_escaped(b, r->msg, r->len);
+    out_str(b, r->truncated ? "\",\"truncated\":true}\n" : "\"}\n");
+    break;
+  case LOG_FORMAT_LOGFMT:
+    out_str(b, "ts=");
+    out_str(b, when);
+    out_str(b, " level=");
+    out_str(b, level_lower[r->level]);
+    out_str(b, " source=");
+    out_str(b, r->source);
+    out_str(b, " msg=\"");
+    out_escaped(b, r->msg, r->len);
+    out_str(b, r->truncated ? "\" truncated=true\n" : "\"\n");
+    break;
+  default:
+    // The original "[time] [LEVEL] message" console format
+    out_str(b, "[");
+    out_str(b, when);
+    out_str(b, "] [");
+    out_str(b, level_names[r->level]);
+    out_str(b, "] ");
+    if (r->source[0] && strcmp(r->source, "server") != 0) {
+      out_str(b, "[");
+      out_str(b, r->source);
+      out_str(b, "] ");
+    }
+    out_append(b, r->msg, r->len);
+    out_str(b, "\n");
+  }
+}
+
+static int compare_records(const void *a, const void *b) {
+  uint64_t ta = (*(const LogRecord *const *)a)->ts_ns;
+  uint64_t tb = (*(const LogRecord *const *)b)->ts_ns;
+  return (ta > tb) - (ta < tb);
+}
+
+// One writer pass: gather what every ring holds, order it by time,
+// format it into one buffer, write it, then hand the slots back.
+static size_t drain_rings(LogRecord **batch, OutBuf *b, TimeCache *cache) {
+  size_t n = 0;
+  for (LogRing *ring = atomic_load(&all_rings); ring; ring = ring->next_all) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t i = tail;
+    for (; i < head && n < LOG_BATCH; i++)
+      batch[n++] = &ring->records[i & (LOG_RING_SIZE - 1)];
+    ring->batch_end = i;
+  }
+  if (n == 0)
+    return 0;
+
+  qsort(batch, n, sizeof(LogRecord *), compare_records);
+  for (size_t i = 0; i < n; i++)
+    format_record(b, cache, batch[i]);
+  out_flush(b);
+  fflush(out);
+
+  for (LogRing *ring = atomic_load(&all_rings); ring; ring = ring->next_all)
+    atomic_store_explicit(&ring->tail, ring->batch_end, memory_order_release);
+  return n;
+}
+
+static void *writer_thread(void *arg) {
+  (void)arg;
+  LogRecord **batch = malloc(sizeof(LogRecord *) * LOG_BATCH);
+  OutBuf *b = malloc(sizeof(OutBuf));
+  TimeCache cache = {0};
+  if (batch == NULL || b == NULL) {
+    free(batch);
+    free(b);
+    return NULL;
+  }
+  b->len = 0;
+
+  for (;;) {
+    bool stop = atomic_load(&stopping);
+    size_t n = drain_rings(batch, b, &cache);
+    if (n == 0 && stop)
+      break; // last pass after shutdown found nothing left
+    if (n < LOG_BATCH) {
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_nsec += LOG_IDLE_SLEEP_NS;
+      if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+      }
+      pthread_mutex_lock(&wake_lock);
+      pthread_cond_timedwait(&wake_cond, &wake_lock, &until);
+      pthread_mutex_unlock(&wake_lock);
+    }
+  }
+  free(batch);
+  free(b);
+  return NULL;
+}
+
+void log_init(void) {
+  atomic_store(&min_level, log_level_from_string(getenv("SERVER_LOG_LEVEL")));
+  const char *fmt = getenv("SERVER_LOG_FORMAT");
+  if (fmt && strcmp(fmt, "json") == 0)
+    format = LOG_FORMAT_JSON;
+  else if (fmt && strcmp(fmt, "logfmt") == 0)
+    format = LOG_FORMAT_LOGFMT;
+  file_path = getenv("SERVER_LOG_FILE");
+  if (file_path && *file_path == '\0')
+    file_path = NULL;
+  const char *max_mb = getenv("SERVER_LOG_MAX_MB");
+  if (max_mb)
+    max_bytes = atol(max_mb) * 1024L * 1024L;
+  const char *keep = getenv("SERVER_LOG_KEEP");
+  if (keep && atoi(keep) > 0)
+    keep_files = atoi(keep);
+
+  pthread_key_create(&ring_key, release_ring);
+  open_output();
+  atomic_store(&stopping, false);
+  if (pthread_create(&writer, NULL, writer_thread, NULL) == 0)
+    atomic_store(&running, true);
+}
+
+void log_shutdown(void) {
+  if (!atomic_load(&running))
+    return;
+  atomic_store(&stopping, true);
+  pthread_cond_signal(&wake_cond);
+  pthread_join(writer, NULL);
+  atomic_store(&running, false);
+
+  uint64_t lost = log_dropped();
+  if (lost)
+    fprintf(out, "[log] %llu records dropped (producer rings full)\n",
+            (unsigned long long)lost);
+  fflush(out);
+  if (out != stdout)
+    fclose(out);
+  out = NULL;
+}
+
+// Without a writer thread there is no one to drain rings: write directly
+static void write_inline(LogLevel level, const char *source, const char *msg,
+                         size_t len) {
+  LogRecord r = {0};
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  r.ts_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+  r.level = (uint8_t)level;
+  snprintf(r.source, sizeof(r.source), "%s", source ? source : "");
+  r.len = (uint16_t)(len < LOG_MSG_LEN ? len : LOG_MSG_LEN);
+  r.truncated = len > LOG_MSG_LEN;
+  memcpy(r.msg, msg, r.len);
+
+  FILE *saved = out;
+  OutBuf *b = malloc(sizeof(OutBuf));
+  if (b == NULL)
+    return;
+  b->len = 0;
+  TimeCache cache = {0};
+  pthread_mutex_lock(&inline_lock);
+  if (out == NULL)
+    out = stdout;
+  format_record(b, &cache, &r);
+  fwrite(b->data, 1, b->len, out);
+  fflush(out);
+  out = saved;
+  pthread_mutex_unlock(&inline_lock);
+  free(b);
+}
+
+void log_message(LogLevel level, const char *source, const char *msg,
+                 size_t len) {
+  if (!log_enabled(level) || level >= LOG_OFF)
+    return;
+  if (!atomic_load_explicit(&running, memory_order_acquire)) {
+    write_inline(level, source, msg, len);
+    return;
+  }
+  if (tls_ring == NULL && (tls_ring = acquire_ring()) == NULL) {
+    atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  // 1. Reserve a slot or count the drop; never wait for the writer
+  uint64_t head = atomic_load_explicit(&tls_ring->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&tls_ring->tail, memory_order_acquire);
+  if (head - tail >= LOG_RING_SIZE) {
+    atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  // 2. Copy the raw message; formatting happens on the writer thread
+  LogRecord *r = &tls_ring->records[head & (LOG_RING_SIZE - 1)];
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  r->ts_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+  r->level = (uint8_t)level;
+  r->truncated = len > LOG_MSG_LEN;
+  r->len = (uint16_t)(r->truncated ? LOG_MSG_LEN : len);
+  memcpy(r->msg, msg, r->len);
+  size_t src_len = source ? strnlen(source, LOG_SOURCE_LEN - 1) : 0;
+  memcpy(r->source, source, src_len);
+  r->source[src_len] = '\0';
+
+  // 3. Publish, and wake the writer early once the ring is half full
+  atomic_store_explicit(&tls_ring->head, head + 1, memory_order_release);
+  if (head - tail == LOG_RING_SIZE / 2)
+    pthread_cond_signal(&wake_cond);
+}
+
+void log_vwrite(LogLevel level, const char *source, const char *fmt,
+                va_list args) {
+  if (!log_enabled(level))
+    return;
+  char msg[LOG_MSG_LEN + 1];
+  int n = vsnprintf(msg, sizeof(msg), fmt, args);
+  if (n < 0)
+    return;
+  log_message(level, source, msg, (size_t)n);
+}
+
+void log_write(LogLevel level, const char *source, const char *fmt, ...) {
+  if (!log_enabled(level))
+    return;
+  va_list args;
+  va_start(args, fmt);
+  log_vwrite(level, source, fmt, args);
+  va_end(args);
+}
@@ -2,6 +2,13 @@
 #include "applua_src.h"
 #include "cJSON.h"
 #include "etlua_src.h"
+#include "event_loop.h"
+#include "lua_json.h"
+#include "lua_strbuf.h"
+#include "lua_text.h"
+#include "metrics.h"
+#include "response_cache.h"
+#include "trace.h"
 #include "plugin_manager.h"
 #include <dirent.h>
 #include <lauxlib.h>
@@ -88,6 +95,7 @@ int l_register_hook(lua_State *L) {
   const char *hook_name = luaL_checkstring(L, 1);
   const char *func_name = luaL_checkstring(L, 2);
   int priority = (int)luaL_optinteger(L, 3, 100);
+  const char *merge_name = luaL_optstring(L, 4, NULL);
 
   pthread_mutex_lock(&pm->lock);
 
@@ -98,6 +106,8 @@ int l_register_hook(lua_State *L) {
 
       free(pm->hook_list[i]->lua_func_name);
       pm->hook_list[i]->lua_func_name = strdup(func_name);
+      free(pm->hook_list[i]->merge_func_name);
+      pm->hook_list[i]->merge_func_name = merge_name ? strdup(merge_name) : NULL;
       pm->hook_list[i]->priority = priority;
 
       sort_hooks(pm);
@@ -122,6 +132,7 @@ int l_register_hook(lua_State *L) {
 
   hr->hook_name = strdup(hook_name);
   hr->lua_func_name = strdup(func_name);
+  hr->merge_func_name = merge_name ? strdup(merge_name) : NULL;
   hr->plugin = p;
   hr->priority = priority;
 
@@ -135,70 +146,13 @@ int l_register_hook(lua_State *L) {
 }
 
 // call register_logger before running any plugin scripts
-void register_logger(lua_State *L) {
-  lua_pushcfunction(L, l_log);
+// `p` names the plugin in each log record
+void register_logger(lua_State *L, Plugin *p) {
+  lua_pushlightuserdata(L, p);
+  lua_pushcclosure(L, l_log, 1);
   lua_setglobal(L, "c_log"); // Expose to Lua as a global
 }
 
-void apply_plugin_schema(lua_State *L, Plugin *p) {
-  // check if 'schema' table exists in the plugin's Lua state
-  lua_getglobal(L, "schema");
-  if (!lua_istable(L, -1)) {
-    lua_pop(L, 1);
-    // no schema found, skip DB init
-    return; 
-  }
-
-  // TODO: make it dynamic
-  char db_path[1024];
-  snprintf(db_path, sizeof(db_path), "%s/plugin.db", p->path);
-  sqlite3 *db;
-  if (sqlite3_open(db_path, &db) != SQLITE_OK) {
-    lua_pop(L, 1);
-    return;
-  }
-
-  // iterate through the schema table: { table_name = { col = "type" } }
-  lua_pushnil(L);
-  while (lua_next(L, -2) != 0) {
-    const char *table_name = lua_tostring(L, -2);
-
-    if (lua_istable(L, -1)) {
-      char sql[2048];
-      snprintf(sql, sizeof(sql), "CREATE TABLE IF NOT EXISTS %s (", table_name);
-
-      lua_pushnil(L);
-      int first = 1;
-      while (lua_next(L, -2) != 0) {
-        const char *col_name = lua_tostring(L, -2);
-        const char *col_def = lua_tostring(L, -1);
-
-        if (!first)
-          strncat(sql, ", ", sizeof(sql) - strlen(sql) - 1);
-        strncat(sql, col_name, sizeof(sql) - strlen(sql) - 1);
-        strncat(sql, " ", sizeof(sql) - strlen(sql) - 1);
-        strncat(sql, col_def, sizeof(sql) - strlen(sql) - 1);
-
-        first = 0;
-        lua_pop(L, 1);
-      }
-      strncat(sql, ");", sizeof(sql) - strlen(sql) - 1);
-
-      char *err_msg = NULL;
-      if (sqlite3_exec(db, sql, NULL, NULL, &err_msg) != SQLITE_OK) {
-        fprintf(stderr, "Migration error in %s: %s\n", p->name, err_msg);
-        sqlite3_free(err_msg);
-      }
-    }
-    lua_pop(L, 1);
-  }
-
-  // close it immediately
-  sqlite3_close(db); 
-  // pop 'schema' table
-  lua_pop(L, 1);     
-}
-
 void preload_module(lua_State *L, const char *name, const char *source) {
   // get package.preload table
   lua_getglobal(L, "package");
@@ -270,13 +224,16 @@ cJSON *lua_table_to_json(lua_State *L, int index) {
 }
 
 void setup_lua_environment(lua_State *L, Plugin *p, PluginManager *pm) {
-  // 1. std libs
+  // 1. std libs, and the native json, text and strbuf modules
   luaL_openlibs(L);
+  json_open(L);
+  text_open(L);
+  strbuf_open(L);
   preload_module(L, "etlua", etlua_source);
   preload_module(L, "core", app_lua_source);
 
   // 2. get_memory function
-  register_logger(L);
+  register_logger(L, p);
   lua_pushcfunction(L, l_get_mem_usage);
   lua_setglobal(L, "c_get_memory");
 
@@ -304,6 +261,34 @@ void setup_lua_environment(lua_State *L, Plugin *p, PluginManager *pm) {
   lua_pushcclosure(L, l_trigger_async_event, 2);
   lua_setglobal(L, "c_trigger_async_event");
 
+  // Spawned jobs the caller can await
+  lua_pushlightuserdata(L, p);
+  lua_pushlightuserdata(L, pm);
+  lua_pushcclosure(L, l_spawn, 2);
+  lua_setglobal(L, "c_spawn");
+  lua_pushlightuserdata(L, p);
+  lua_pushlightuserdata(L, pm);
+  lua_pushcclosure(L, l_spawn_map, 2);
+  lua_setglobal(L, "c_spawn_map");
+  lua_pushlightuserdata(L, p);
+  lua_pushlightuserdata(L, pm);
+  lua_pushcclosure(L, l_job_workers, 2);
+  lua_setglobal(L, "c_job_workers");
+
+  // Delayed and periodic jobs
+  lua_pushlightuserdata(L, p);
+  lua_pushlightuserdata(L, pm);
+  lua_pushcclosure(L, l_defer_in, 2);
+  lua_setglobal(L, "c_defer_in");
+  lua_pushlightuserdata(L, p);
+  lua_pushlightuserdata(L, pm);
+  lua_pushcclosure(L, l_every, 2);
+  lua_setglobal(L, "c_every");
+  lua_pushlightuserdata(L, p);
+  lua_pushlightuserdata(L, pm);
+  lua_pushcclosure(L, l_cancel_timer, 2);
+  lua_setglobal(L, "c_cancel_timer");
+
   // 7. db_exec function
   lua_pushlightuserdata(L, p);
   lua_pushcclosure(L, l_db_exec, 1);
@@ -313,93 +298,507 @@ void setup_lua_environment(lua_State *L, Plugin *p, PluginManager *pm) {
   lua_pushlightuserdata(L, p);
   lua_pushcclosure(L, l_db_query, 1);
   lua_setglobal(L, "db_query");
+
+  // Awaitable variants: several statements can be in flight at once
+  lua_pushlightuserdata(L, p);
+  lua_pushcclosure(L, l_db_query_async, 1);
+  lua_setglobal(L, "db_query_async");
+  lua_pushlightuserdata(L, p);
+  lua_pushcclosure(L, l_db_exec_async, 1);
+  lua_setglobal(L, "db_exec_async");
+
+  // Transactions and bulk inserts
+  lua_pushlightuserdata(L, p);
+  lua_pushcclosure(L, l_db_transaction, 1);
+  lua_setglobal(L, "db_transaction");
+  lua_pushlightuserdata(L, p);
+  lua_pushcclosure(L, l_db_insert_many, 1);
+  lua_setglobal(L, "db_insert_many");
+
+  // 9. tracing bindings and the sampling profiler hook
+  trace_setup_lua(L);
+
+  // 10. response cache registration and invalidation
+  response_cache_setup_lua(L, p->name);
+
+  // 11. shared key-value store
+  kv_store_setup_lua(L, pm->kv);
 }
 
-static void get_plugin_db_path(Plugin *p, char *buffer, size_t size) {
-  snprintf(buffer, size, "%s/plugin.db", p->path);
+// Pushes what db_exec / db_query / db_insert_many return to Lua and
+// frees the result. A failed query raises, a failed write returns
+// false + message.
+int db_result_return(lua_State *L, Plugin *p, DbResult *r, DbOp op) {
+  if (op != DB_QUERY) {
+    if (!r->ok) {
+      lua_pushboolean(L, 0);
+      lua_pushstring(L, r->error);
+      db_result_free(r);
+      return 2;
+    }
+    // Cached pages of this plugin may show what was just written
+    response_cache_invalidate(p->name);
+    if (op == DB_BULK)
+      lua_pushinteger(L, (lua_Integer)r->changes);
+    else
+      lua_pushboolean(L, 1);
+    db_result_free(r);
+    return 1;
+  }
+
+  if (!r->ok) {
+    lua_pushfstring(L, r->open_failed ? "DB Open Error: %s" : "SQL Error: %s",
+                    r->error);
+    db_result_free(r);
+    return lua_error(L);
+  }
+
+  // The main result table
+  lua_createtable(L, (int)r->nrows, 0);
+  for (size_t row = 0; row < r->nrows; row++) {
+    // Table for this row
+    lua_createtable(L, 0, r->ncols);
+    for (int i = 0; i < r->ncols; i++) {
+      DbValue *v = &r->values[row * r->ncols + i];
+      lua_pushstring(L, r->names[i]);
+      if (v->type == SQLITE_INTEGER)
+        lua_pushinteger(L, (lua_Integer)v->i);
+      else if (v->type == SQLITE_FLOAT)
+        lua_pushnumber(L, v->d);
+      else if (v->type == SQLITE_TEXT && v->s)
+        lua_pushlstring(L, v->s, v->len);
+      else
+        lua_pushnil(L);
+      lua_settable(L, -3);
+    }
+    lua_rawseti(L, -2, (lua_Integer)row + 1);
+  }
+  db_result_free(r);
+  return 1;
 }
 
-// db_exec("INSERT INTO...")
-int l_db_exec(lua_State *L) {
-  Plugin *p = (Plugin *)lua_touserdata(L, lua_upvalueindex(1));
-  const char *sql = luaL_checkstring(L, 1);
+// Waits for a submitted statement, drops our reference and hands the
+// result to Lua
+static int db_finish(lua_State *L, Plugin *p, DbRequest *req) {
+  db_request_wait(req);
+  DbOp op = req->op;
+  DbResult r = req->result;
+  memset(&req->result, 0, sizeof(req->result));
+  trace_span("db", op == DB_QUERY ? "db_query" : "db_exec", req->trace_start);
+  db_request_release(req);
+  return db_result_return(L, p, &r, op);
+}
 
-  // TODO: make dynamic
-  char db_path[1024];
-  get_plugin_db_path(p, db_path, sizeof(db_path));
+// --- Transactions ---
+
+// Per-coroutine transaction state, kept in a weak-keyed registry table
+// so coroutines interleaving on one plugin state never share a
+// transaction
+typedef struct {
+  DbExecutor *executor;
+  DbTxn *txn;
+  int depth;           // open levels: BEGIN, then one SAVEPOINT per nesting
+  DbRequest *pending;  // the BEGIN / COMMIT / SAVEPOINT being waited on
+} DbTxnBox;
+
+#define DB_TXN_REGISTRY "host.db_txn"
+#define DB_TXN_MT "host.DbTxn"
+
+// A coroutine abandoned inside db_transaction must not pin the writer
+static int l_db_txn_gc(lua_State *L) {
+  DbTxnBox *box = (DbTxnBox *)lua_touserdata(L, 1);
+  db_request_release(box->pending);
+  if (box->depth > 0)
+    db_request_release(
+        db_submit(box->executor, box->txn, DB_ROLLBACK, NULL, NULL));
+  db_txn_release(box->txn);
+  memset(box, 0, sizeof(*box));
+  return 0;
+}
 
-  sqlite3 *db;
-  if (sqlite3_open(db_path, &db) != SQLITE_OK) {
-    lua_pushboolean(L, 0);
-    lua_pushstring(L, sqlite3_errmsg(db));
-    sqlite3_close(db);
-    return 2;
+// The running coroutine's box, or NULL when it has none and `create`
+// is not set
+static DbTxnBox *txn_box(lua_State *L, Plugin *p, bool create) {
+  if (lua_getfield(L, LUA_REGISTRYINDEX, DB_TXN_REGISTRY) != LUA_TTABLE) {
+    lua_pop(L, 1);
+    if (!create)
+      return NULL;
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, DB_TXN_REGISTRY);
+  }
+  lua_pushthread(L);
+  lua_rawget(L, -2);
+  DbTxnBox *box = (DbTxnBox *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (box == NULL && create) {
+    box = (DbTxnBox *)lua_newuserdatauv(L, sizeof(DbTxnBox), 0);
+    memset(box, 0, sizeof(*box));
+    box->executor = p->db_executor;
+    if (luaL_newmetatable(L, DB_TXN_MT)) {
+      lua_pushcfunction(L, l_db_txn_gc);
+      lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    lua_pushthread(L);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+    lua_pop(L, 1);
   }
+  lua_pop(L, 1); // registry table; it keeps the box alive
+  return box;
+}
+
+// Statements of the running coroutine join its open transaction
+DbTxn *db_current_txn(lua_State *L, Plugin *p) {
+  DbTxnBox *box = txn_box(L, p, false);
+  return box && box->depth > 0 ? box->txn : NULL;
+}
+
+typedef enum {
+  TXN_OPENED,     // BEGIN / SAVEPOINT finished: run the body
+  TXN_BODY_DONE,  // body returned or raised: commit or roll back
+  TXN_COMMITTED,  // COMMIT / RELEASE finished: return the body's results
+  TXN_ROLLED_BACK // ROLLBACK finished: re-raise the body's error
+} TxnPhase;
+
+static int txn_continue(lua_State *L, int status, lua_KContext ctx);
+
+// Submits a transaction-control statement and continues with `phase`
+// once it finishes, yielding to the event loop meanwhile when possible
+static int txn_submit(lua_State *L, DbTxnBox *box, DbOp op, const char *sql,
+                      TxnPhase phase) {
+  box->pending = db_submit(box->executor, box->txn, op, sql, NULL);
+  if (box->pending == NULL)
+    return luaL_error(L, "DB Error: could not queue statement");
+  if (event_loop_can_yield(L))
+    return event_loop_yield_db(L, box->pending, phase, txn_continue);
+  return txn_continue(L, LUA_OK, phase);
+}
+
+// Takes the finished control statement's result. Returns false with
+// the error message pushed when it failed.
+static bool txn_collect(lua_State *L, DbTxnBox *box) {
+  DbRequest *req = box->pending;
+  box->pending = NULL;
+  db_request_wait(req);
+  bool ok = req->result.ok;
+  if (!ok)
+    lua_pushfstring(L, "SQL Error: %s", req->result.error);
+  db_request_release(req);
+  return ok;
+}
+
+static int txn_continue(lua_State *L, int status, lua_KContext ctx) {
+  Plugin *p = (Plugin *)lua_touserdata(L, lua_upvalueindex(1));
+  DbTxnBox *box = txn_box(L, p, false);
+  char sql[64];
+
+  switch ((TxnPhase)ctx) {
+  case TXN_OPENED:
+    if (!txn_collect(L, box))
+      return lua_error(L);
+    box->depth++;
+    status = lua_pcallk(L, lua_gettop(L) - 1, LUA_MULTRET, 0, TXN_BODY_DONE,
+                        txn_continue);
+    // The body finished without yielding
+    __attribute__((fallthrough));
+  case TXN_BODY_DONE:
+    box->depth--;
+    if (status == LUA_OK || status == LUA_YIELD) {
+      if (box->depth == 0)
+        return txn_submit(L, box, DB_COMMIT, NULL, TXN_COMMITTED);
+      snprintf(sql, sizeof(sql), "RELEASE sp_%d;", box->depth);
+      return txn_submit(L, box, DB_EXEC, sql, TXN_COMMITTED);
+    }
+    if (box->depth == 0)
+      return txn_submit(L, box, DB_ROLLBACK, NULL, TXN_ROLLED_BACK);
+    snprintf(sql, sizeof(sql), "ROLLBACK TO sp_%d; RELEASE sp_%d;",
+             box->depth, box->depth);
+    return txn_submit(L, box, DB_EXEC, sql, TXN_ROLLED_BACK);
+  case TXN_COMMITTED:
+    if (!txn_collect(L, box))
+      return lua_error(L);
+    if (box->depth == 0) // the commit is what other requests can see
+      response_cache_invalidate(p->name);
+    return lua_gettop(L);
+  case TXN_ROLLED_BACK:
+    // The body's error matters more than a failed rollback
+    if (!txn_collect(L, box))
+      lua_pop(L, 1);
+    return lua_error(L);
+  }
+  return 0;
+}
 
-  char *err_msg = NULL;
-  if (sqlite3_exec(db, sql, NULL, NULL, &err_msg) != SQLITE_OK) {
-    lua_pushboolean(L, 0);
-    lua_pushstring(L, err_msg);
-    sqlite3_free(err_msg);
-    sqlite3_close(db);
-    return 2;
+// db_transaction(fn, ...) calls fn(...) inside a transaction: committed
+// when fn returns (its results are passed through), rolled back when it
+// raises (the error is re-raised). Nested calls become savepoints.
+int l_db_transaction(lua_State *L) {
+  Plugin *p = (Plugin *)lua_touserdata(L, lua_upvalueindex(1));
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  DbTxnBox *box = txn_box(L, p, true);
+  if (box->depth > 0) {
+    char sql[32];
+    snprintf(sql, sizeof(sql), "SAVEPOINT sp_%d;", box->depth);
+    return txn_submit(L, box, DB_EXEC, sql, TXN_OPENED);
   }
 
-  sqlite3_close(db);
-  lua_pushboolean(L, 1);
-  return 1;
+  db_txn_release(box->txn);
+  box->txn = db_txn_create();
+  if (box->txn == NULL)
+    return luaL_error(L, "DB Error: out of memory");
+  return txn_submit(L, box, DB_BEGIN, NULL, TXN_OPENED);
+}
+
+// Continuation once the event loop resumes a coroutine parked on a
+// statement (the request travels in the continuation context)
+static int db_continue(lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  Plugin *p = (Plugin *)lua_touserdata(L, lua_upvalueindex(1));
+  return db_finish(L, p, (DbRequest *)ctx);
+}
+
+static int db_call(lua_State *L, bool query) {
+  Plugin *p = (Plugin *)lua_touserdata(L, lua_upvalueindex(1));
+  const char *sql = luaL_checkstring(L, 1);
+  DbRequest *req = db_submit(p->db_executor, db_current_txn(L, p),
+                             query ? DB_QUERY : DB_EXEC, sql, NULL);
+  if (req == NULL)
+    return luaL_error(L, "DB Error: could not queue statement");
+
+  // Request coroutines in event-loop mode yield instead of blocking the
+  // loop thread while the executor runs the statement
+  if (event_loop_can_yield(L))
+    return event_loop_yield_db(L, req, (lua_KContext)req, db_continue);
+  return db_finish(L, p, req);
 }
 
+// db_exec("INSERT INTO...")
+int l_db_exec(lua_State *L) { return db_call(L, false); }
+
 // results = db_query("SELECT * FROM...")
-int l_db_query(lua_State *L) {
+int l_db_query(lua_State *L) { return db_call(L, true); }
+
+// Handle returned by db_query_async / db_exec_async
+typedef struct {
+  Plugin *p;
+  DbRequest *req; // NULL once awaited
+} DbPending;
+
+#define DB_PENDING_MT "host.DbPending"
+
+static int db_await_continue(lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  (void)ctx;
+  DbPending *h = (DbPending *)luaL_checkudata(L, 1, DB_PENDING_MT);
+  DbRequest *req = h->req;
+  h->req = NULL;
+  return db_finish(L, h->p, req);
+}
+
+// rows = handle:await()
+static int l_db_await(lua_State *L) {
+  DbPending *h = (DbPending *)luaL_checkudata(L, 1, DB_PENDING_MT);
+  if (h->req == NULL)
+    return luaL_error(L, "DB Error: statement already awaited");
+  if (event_loop_can_yield(L) && !db_request_done(h->req))
+    return event_loop_yield_db(L, h->req, 0, db_await_continue);
+  return db_await_continue(L, LUA_OK, 0);
+}
+
+// handle:done() -> true once await() would not wait
+static int l_db_pending_done(lua_State *L) {
+  DbPending *h = (DbPending *)luaL_checkudata(L, 1, DB_PENDING_MT);
+  lua_pushboolean(L, h->req == NULL || db_request_done(h->req));
+  return 1;
+}
+
+static int l_db_pending_gc(lua_State *L) {
+  DbPending *h = (DbPending *)luaL_checkudata(L, 1, DB_PENDING_MT);
+  db_request_release(h->req); // the executor still finishes it
+  h->req = NULL;
+  return 0;
+}
+
+// Creates the handle metatable on first use and leaves it on the stack
+static void push_db_pending_metatable(lua_State *L) {
+  if (!luaL_newmetatable(L, DB_PENDING_MT))
+    return;
+  static const luaL_Reg methods[] = {{"await", l_db_await},
+                                     {"done", l_db_pending_done},
+                                     {NULL, NULL}};
+  luaL_newlib(L, methods);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, l_db_pending_gc);
+  lua_setfield(L, -2, "__gc");
+}
+
+static int db_call_async(lua_State *L, bool query) {
   Plugin *p = (Plugin *)lua_touserdata(L, lua_upvalueindex(1));
   const char *sql = luaL_checkstring(L, 1);
+  DbPending *h = (DbPending *)lua_newuserdatauv(L, sizeof(DbPending), 0);
+  h->p = p;
+  h->req = NULL;
+  push_db_pending_metatable(L);
+  lua_setmetatable(L, -2);
+  h->req = db_submit(p->db_executor, db_current_txn(L, p),
+                     query ? DB_QUERY : DB_EXEC, sql, NULL);
+  if (h->req == NULL)
+    return luaL_error(L, "DB Error: could not queue statement");
+  return 1;
+}
+
+// local a = db_query_async("SELECT ..."); local rows = a:await()
+int l_db_query_async(lua_State *L) { return db_call_async(L, true); }
 
-  // TODO: make dynamic
-  char db_path[1024];
-  get_plugin_db_path(p, db_path, sizeof(db_path));
+// local w = db_exec_async("INSERT ..."); local ok, err = w:await()
+int l_db_exec_async(lua_State *L) { return db_call_async(L, false); }
 
-  sqlite3 *db;
-  sqlite3_stmt *stmt;
-  if (sqlite3_open(db_path, &db) != SQLITE_OK) {
-    return luaL_error(L, "DB Open Error: %s", sqlite3_errmsg(db));
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Appends "name" as a quoted SQL identifier
+static char *append_identifier(char *out, const char *name) {
+  *out++ = '"';
+  for (; *name; name++) {
+    if (*name == '"')
+      *out++ = '"';
+    *out++ = *name;
   }
+  *out++ = '"';
+  return out;
+}
+
+// Copies rows[i][names[c]] into `params`. Returns NULL, or an error
+// message left on the stack.
+static const char *collect_bulk_rows(lua_State *L, int rows_idx,
+                                     DbResult *params) {
+  for (size_t row = 0; row < params->nrows; row++) {
+    if (lua_rawgeti(L, rows_idx, (lua_Integer)row + 1) != LUA_TTABLE)
+      return lua_pushfstring(L, "row %d is not a table", (int)row + 1);
+
+    // Every key must be one of the columns taken from the first row
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+      lua_pop(L, 1);
+      const char *key = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1)
+                                                       : NULL;
+      if (key == NULL || bsearch(&key, params->names, params->ncols,
+                                 sizeof(char *), compare_names) == NULL)
+        return lua_pushfstring(L, "row %d has a column the first row lacks",
+                               (int)row + 1);
+    }
 
-  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-    const char *err = sqlite3_errmsg(db);
-    sqlite3_close(db);
-    return luaL_error(L, "SQL Error: %s", err);
+    DbValue *values = params->values + row * params->ncols;
+    for (int c = 0; c < params->ncols; c++) {
+      DbValue *v = &values[c];
+      int type = lua_getfield(L, -1, params->names[c]);
+      if (type == LUA_TNUMBER && lua_isinteger(L, -1)) {
+        v->type = SQLITE_INTEGER;
+        v->i = (int64_t)lua_tointeger(L, -1);
+      } else if (type == LUA_TNUMBER) {
+        v->type = SQLITE_FLOAT;
+        v->d = (double)lua_tonumber(L, -1);
+      } else if (type == LUA_TBOOLEAN) {
+        v->type = SQLITE_INTEGER;
+        v->i = lua_toboolean(L, -1);
+      } else if (type == LUA_TSTRING) {
+        const char *s = lua_tolstring(L, -1, &v->len);
+        v->type = SQLITE_TEXT;
+        v->s = malloc(v->len + 1);
+        if (v->s == NULL)
+          return lua_pushliteral(L, "out of memory");
+        memcpy(v->s, s, v->len + 1);
+      } else if (type == LUA_TNIL) {
+        v->type = SQLITE_NULL;
+      } else {
+        return lua_pushfstring(L, "row %d column '%s' has unsupported type %s",
+                               (int)row + 1, params->names[c],
+                               lua_typename(L, type));
+      }
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
   }
-  // The main result table
-  lua_newtable(L); 
-  int row_idx = 1;
+  return NULL;
+}
 
-  while (sqlite3_step(stmt) == SQLITE_ROW) {
-    lua_pushinteger(L, row_idx++);
-    // Table for this row
-    lua_newtable(L); 
-
-    int col_count = sqlite3_column_count(stmt);
-    for (int i = 0; i < col_count; i++) {
-      const char *col_name = sqlite3_column_name(stmt, i);
-      lua_pushstring(L, col_name);
-
-      int type = sqlite3_column_type(stmt, i);
-      if (type == SQLITE_INTEGER)
-        lua_pushinteger(L, sqlite3_column_int(stmt, i));
-      else if (type == SQLITE_FLOAT)
-        lua_pushnumber(L, sqlite3_column_double(stmt, i));
-      else if (type == SQLITE_TEXT)
-        lua_pushstring(L, (const char *)sqlite3_column_text(stmt, i));
-      else
-        lua_pushnil(L);
+// n = db_insert_many("products", {{sku = "a", name = "A"}, ...})
+// Columns are the keys of the first row; later rows may leave some out
+// (NULL). All rows go through one prepared statement in one savepoint,
+// so they are inserted together or not at all. Returns the row count,
+// or false + message.
+int l_db_insert_many(lua_State *L) {
+  Plugin *p = (Plugin *)lua_touserdata(L, lua_upvalueindex(1));
+  const char *table = luaL_checkstring(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  lua_Integer nrows = luaL_len(L, 2);
+  if (nrows <= 0) {
+    lua_pushinteger(L, 0);
+    return 1;
+  }
+  if (lua_rawgeti(L, 2, 1) != LUA_TTABLE)
+    return luaL_error(L, "db_insert_many: row 1 is not a table");
 
-      lua_settable(L, -3);
+  // 1. Columns from the first row, sorted so the statement is stable
+  DbResult params = {0};
+  params.nrows = (size_t)nrows;
+  size_t sql_len = strlen(table) * 2 + 64;
+  lua_pushnil(L);
+  while (lua_next(L, 3) != 0) {
+    lua_pop(L, 1);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+      char **grown =
+          realloc(params.names, sizeof(char *) * (params.ncols + 1));
+      if (grown == NULL)
+        break;
+      params.names = grown;
+      params.names[params.ncols++] = strdup(lua_tostring(L, -1));
+      sql_len += lua_rawlen(L, -1) * 2 + 8;
     }
-    lua_settable(L, -3);
+  }
+  lua_settop(L, 2);
+  if (params.ncols == 0) {
+    db_result_free(&params);
+    return luaL_error(L, "db_insert_many: row 1 has no columns");
+  }
+  qsort(params.names, params.ncols, sizeof(char *), compare_names);
+
+  // 2. Marshal every row into C so the executor can bind them
+  params.values = calloc(params.nrows * params.ncols, sizeof(DbValue));
+  const char *error = params.values ? collect_bulk_rows(L, 2, &params)
+                                    : lua_pushliteral(L, "out of memory");
+  char *sql = error ? NULL : malloc(sql_len);
+  if (error || sql == NULL) {
+    db_result_free(&params);
+    return luaL_error(L, "db_insert_many: %s",
+                      error ? error : "out of memory");
   }
 
-  sqlite3_finalize(stmt);
-  sqlite3_close(db);
-  return 1;
-}
\ No newline at end of file
+  // 3. INSERT INTO "table" ("a", "b") VALUES (?, ?)
+  char *out = sql + sprintf(sql, "INSERT INTO ");
+  out = append_identifier(out, table);
+  out += sprintf(out, " (");
+  for (int c = 0; c < params.ncols; c++) {
+    out = append_identifier(out, params.names[c]);
+    out += sprintf(out, c + 1 < params.ncols ? ", " : ") VALUES (");
+  }
+  for (int c = 0; c < params.ncols; c++)
+    out += sprintf(out, c + 1 < params.ncols ? "?, " : "?)");
+
+  DbRequest *req =
+      db_submit(p->db_executor, db_current_txn(L, p), DB_BULK, sql, &params);
+  free(sql);
+  if (req == NULL)
+    return luaL_error(L, "DB Error: could not queue statement");
+  if (event_loop_can_yield(L))
+    return event_loop_yield_db(L, req, (lua_KContext)req, db_continue);
+  return db_finish(L, p, req);
+}
@@ -0,0 +1,617 @@
+#include "lua_json.h"
+#include <lauxlib.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Deeper nesting than this is refused in both directions; it also stops
+// the encoder on tables that contain themselves
+#define JSON_MAX_DEPTH 256
+
+// --- Encoding -----------------------------------------------------------
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+  const char *error;
+} JsonBuf;
+
+static bool buf_reserve(JsonBuf *b, size_t extra) {
+  if (b->len + extra < b->cap)
+    return true;
+  size_t cap = b->cap ? b->cap : 256;
+  while (cap <= b->len + extra)
+    cap *= 2;
+  char *data = realloc(b->data, cap);
+  if (data == NULL) {
+    b->error = "out of memory";
+    return false;
+  }
+  b->data = data;
+  b->cap = cap;
+  return true;
+}
+
+static bool buf_add(JsonBuf *b, const char *s, size_t n) {
+  if (!buf_reserve(b, n))
+    return false;
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+  return true;
+}
+
+static bool buf_char(JsonBuf *b, char c) {
+  if (!buf_reserve(b, 1))
+    return false;
+  b->data[b->len++] = c;
+  return true;
+}
+
+// Bytes that cannot appear unescaped in a JSON string
+static bool needs_escape(unsigned char c) {
+  return c < 0x20 || c == '"' || c == '\\';
+}
+
+static bool encode_string(JsonBuf *b, const char *s, size_t n) {
+  // Worst case every byte becomes \u00XX; reserving it once keeps the
+  // loop free of checks
+  if (!buf_reserve(b, n * 6 + 2))
+    return false;
+  char *out = b->data + b->len;
+  *out++ = '"';
+  size_t i = 0;
+  while (i < n) {
+    // Copy the run of bytes that need no escaping in one go
+    size_t run = i;
+    while (run < n && !needs_escape((unsigned char)s[run]))
+      run++;
+    memcpy(out, s + i, run - i);
+    out += run - i;
+    if (run == n)
+      break;
+
+    unsigned char c = (unsigned char)s[run];
+    *out++ = '\\';
+    switch (c) {
+    case '"':
+      *out++ = '"';
+      break;
+    case '\\':
+      *out++ = '\\';
+      break;
+    case '\n':
+      *out++ = 'n';
+      break;
+    case '\r':
+      *out++ = 'r';
+      break;
+    case '\t':
+      *out++ = 't';
+      break;
+    case '\b':
+      *out++ = 'b';
+      break;
+    case '\f':
+      *out++ = 'f';
+      break;
+    default:
+      *out++ = 'u';
+      *out++ = '0';
+      *out++ = '0';
+      *out++ = "0123456789abcdef"[c >> 4];
+      *out++ = "0123456789abcdef"[c & 15];
+      break;
+    }
+    i = run + 1;
+  }
+  *out++ = '"';
+  b->len = (size_t)(out - b->data);
+  return true;
+}
+
+static bool encode_number(JsonBuf *b, lua_State *L, int idx, bool as_key) {
+  char num[32];
+  int n;
+  if (lua_isinteger(L, idx)) {
+    n = snprintf(num, sizeof(num), "%lld", (long long)lua_tointeger(L, idx));
+  } else {
+    double d = lua_tonumber(L, idx);
+    if (!isfinite(d)) {
+      if (as_key) {
+        b->error = "cannot use NaN or infinity as a key";
+        return false;
+      }
+      return buf_add(b, "null", 4);
+    }
+    // The shortest of the two precisions that reads back the same
+    n = snprintf(num, sizeof(num), "%.14g", d);
+    if (strtod(num, NULL) != d)
+      n = snprintf(num, sizeof(num), "%.17g", d);
+  }
+  if (as_key)
+    return encode_string(b, num, (size_t)n);
+  return buf_add(b, num, (size_t)n);
+}
+
+static bool encode_value(JsonBuf *b, lua_State *L, int idx, int depth);
+
+// Array when the keys are exactly 1..n; returns n, or -1 for an object
+static lua_Integer array_length(lua_State *L, int idx) {
+  lua_Integer n = (lua_Integer)lua_rawlen(L, idx);
+  lua_Integer keys = 0;
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    lua_pop(L, 1);
+    if (!lua_isinteger(L, -1) || lua_tointeger(L, -1) < 1 ||
+        lua_tointeger(L, -1) > n) {
+      lua_pop(L, 1);
+      return -1;
+    }
+    keys++;
+  }
+  return keys > 0 && keys == n ? n : -1;
+}
+
+static bool encode_table(JsonBuf *b, lua_State *L, int idx, int depth) {
+  if (depth >= JSON_MAX_DEPTH) {
+    b->error = "nested too deeply (or the table contains itself)";
+    return false;
+  }
+  if (!lua_checkstack(L, 3)) {
+    b->error = "out of memory";
+    return false;
+  }
+
+  lua_Integer n = array_length(L, idx);
+  if (n > 0) {
+    if (!buf_char(b, '['))
+      return false;
+    for (lua_Integer i = 1; i <= n; i++) {
+      if (i > 1 && !buf_char(b, ','))
+        return false;
+      lua_rawgeti(L, idx, i);
+      bool ok = encode_value(b, L, lua_gettop(L), depth + 1);
+      lua_pop(L, 1);
+      if (!ok)
+        return false;
+    }
+    return buf_char(b, ']');
+  }
+
+  if (!buf_char(b, '{'))
+    return false;
+  bool first = true;
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    int key = lua_gettop(L) - 1;
+    bool ok = first || buf_char(b, ',');
+    first = false;
+    // Number keys are formatted here: lua_tolstring would turn the key
+    // into a string in place and confuse lua_next
+    if (ok && lua_type(L, key) == LUA_TSTRING) {
+      size_t len;
+      const char *s = lua_tolstring(L, key, &len);
+      ok = encode_string(b, s, len);
+    } else if (ok && lua_type(L, key) == LUA_TNUMBER) {
+      ok = encode_number(b, L, key, true);
+    } else if (ok) {
+      b->error = "object keys must be strings or numbers";
+      ok = false;
+    }
+    ok = ok && buf_char(b, ':') && encode_value(b, L, key + 1, depth + 1);
+    lua_pop(L, 1);
+    if (!ok) {
+      lua_pop(L, 1);
+      return false;
+    }
+  }
+  return buf_char(b, '}');
+}
+
+static bool encode_value(JsonBuf *b, lua_State *L, int idx, int depth) {
+  switch (lua_type(L, idx)) {
+  case LUA_TNIL:
+    return buf_add(b, "null", 4);
+  case LUA_TBOOLEAN:
+    return lua_toboolean(L, idx) ? buf_add(b, "true", 4)
+                                 : buf_add(b, "false", 5);
+  case LUA_TNUMBER:
+    return encode_number(b, L, idx, false);
+  case LUA_TSTRING: {
+    size_t len;
+    const char *s = lua_tolstring(L, idx, &len);
+    return encode_string(b, s, len);
+  }
+  case LUA_TTABLE:
+    return encode_table(b, L, idx, depth);
+  case LUA_TLIGHTUSERDATA:
+    if (lua_touserdata(L, idx) == NULL) // json.null
+      return buf_add(b, "null", 4);
+    // fall through
+  default:
+    b->error = "cannot encode functions, userdata or threads";
+    return false;
+  }
+}
+
+char *json_encode(lua_State *L, int idx, size_t *len, const char **err) {
+  JsonBuf b = {0};
+  idx = lua_absindex(L, idx);
+  if (!encode_value(&b, L, idx, 0) || !buf_char(&b, '\0')) {
+    free(b.data);
+    *err = b.error ? b.error : "out of memory";
+    return NULL;
+  }
+  *len = b.len - 1;
+  return b.data;
+}
+
+// --- Decoding -----------------------------------------------------------
+
+typedef struct {
+  const char *start;
+  const char *p;
+  const char *end;
+  const char *error;
+} JsonReader;
+
+static bool fail(JsonReader *r, const char *error) {
+  r->error = error;
+  return false;
+}
+
+static void skip_space(JsonReader *r) {
+  while (r->p < r->end &&
+         (*r->p == ' ' || *r->p == '\n' || *r->p == '\r' || *r->p == '\t'))
+    r->p++;
+}
+
+static bool literal(JsonReader *r, const char *word, size_t n) {
+  if ((size_t)(r->end - r->p) < n || memcmp(r->p, word, n) != 0)
+    return fail(r, "invalid literal");
+  r->p += n;
+  return true;
+}
+
+static int hex4(const char *s) {
+  int v = 0;
+  for (int i = 0; i < 4; i++) {
+    char c = s[i];
+    v <<= 4;
+    if (c >= '0' && c <= '9')
+      v |= c - '0';
+    else if (c >= 'a' && c <= 'f')
+      v |= c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      v |= c - 'A' + 10;
+    else
+      return -1;
+  }
+  return v;
+}
+
+static void add_utf8(luaL_Buffer *lb, uint32_t cp) {
+  char out[4];
+  int n;
+  if (cp < 0x80) {
+    out[0] = (char)cp;
+    n = 1;
+  } else if (cp < 0x800) {
+    out[0] = (char)(0xc0 | (cp >> 6));
+    out[1] = (char)(0x80 | (cp & 0x3f));
+    n = 2;
+  } else if (cp < 0x10000) {
+    out[0] = (char)(0xe0 | (cp >> 12));
+    out[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+    out[2] = (char)(0x80 | (cp & 0x3f));
+    n = 3;
+  } else {
+    out[0] = (char)(0xf0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+    out[3] = (char)(0x80 | (cp & 0x3f));
+    n = 4;
+  }
+  luaL_addlstring(lb, out, n);
+}
+
+// Reads the escape after a backslash into the buffer
+static bool read_escape(JsonReader *r, luaL_Buffer *lb) {
+  if (r->p >= r->end)
+    return fail(r, "unterminated string");
+  char c = *r->p++;
+  switch (c) {
+  case '"':
+  case '\\':
+  case '/':
+    luaL_addchar(lb, c);
+    return true;
+  case 'n':
+    luaL_addchar(lb, '\n');
+    return true;
+  case 'r':
+    luaL_addchar(lb, '\r');
+    return true;
+  case 't':
+    luaL_addchar(lb, '\t');
+    return true;
+  case 'b':
+    luaL_addchar(lb, '\b');
+    return true;
+  case 'f':
+    luaL_addchar(lb, '\f');
+    return true;
+  case 'u':
+    break;
+  default:
+    return fail(r, "invalid escape");
+  }
+
+  if (r->end - r->p < 4 || hex4(r->p) < 0)
+    return fail(r, "invalid \\u escape");
+  uint32_t cp = (uint32_t)hex4(r->p);
+  r->p += 4;
+  if (cp >= 0xd800 && cp < 0xdc00) {
+    // A high surrogate pairs with the low one that must follow
+    int low = r->end - r->p >= 6 && r->p[0] == '\\' && r->p[1] == 'u'
+                  ? hex4(r->p + 2)
+                  : -1;
+    if (low >= 0xdc00 && low < 0xe000) {
+      cp = 0x10000 + ((cp - 0xd800) << 10) + ((uint32_t)low - 0xdc00);
+      r->p += 6;
+    } else {
+      cp = 0xfffd;
+    }
+  } else if (cp >= 0xdc00 && cp < 0xe000) {
+    cp = 0xfffd; // lone low surrogate
+  }
+  add_utf8(lb, cp);
+  return true;
+}
+
+// Pushes the string starting after the opening quote
+static bool read_string(lua_State *L, JsonReader *r) {
+  const char *s = r->p;
+  while (r->p < r->end && *r->p != '"' && *r->p != '\\') {
+    if ((unsigned char)*r->p < 0x20)
+      return fail(r, "control character in string");
+    r->p++;
+  }
+  if (r->p >= r->end)
+    return fail(r, "unterminated string");
+  if (*r->p == '"') {
+    // No escapes: straight from the input
+    lua_pushlstring(L, s, (size_t)(r->p - s));
+    r->p++;
+    return true;
+  }
+
+  luaL_Buffer lb;
+  luaL_buffinit(L, &lb);
+  luaL_addlstring(&lb, s, (size_t)(r->p - s));
+  while (r->p < r->end && *r->p != '"') {
+    const char *run = r->p;
+    while (r->p < r->end && *r->p != '"' && *r->p != '\\') {
+      if ((unsigned char)*r->p < 0x20)
+        return fail(r, "control character in string");
+      r->p++;
+    }
+    luaL_addlstring(&lb, run, (size_t)(r->p - run));
+    if (r->p < r->end && *r->p == '\\') {
+      r->p++;
+      if (!read_escape(r, &lb))
+        return false;
+    }
+  }
+  if (r->p >= r->end)
+    return fail(r, "unterminated string");
+  r->p++;
+  luaL_pushresult(&lb);
+  return true;
+}
+
+static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+static bool read_number(lua_State *L, JsonReader *r) {
+  const char *s = r->p;
+  // Checked against the JSON grammar first: lua_stringtonumber alone
+  // would also take hex, "inf" and leading '+'
+  if (r->p < r->end && *r->p == '-')
+    r->p++;
+  if (r->p >= r->end || !is_digit(*r->p))
+    return fail(r, "invalid number");
+  if (*r->p == '0')
+    r->p++;
+  else
+    while (r->p < r->end && is_digit(*r->p))
+      r->p++;
+  if (r->p < r->end && *r->p == '.') {
+    r->p++;
+    if (r->p >= r->end || !is_digit(*r->p))
+      return fail(r, "invalid number");
+    while (r->p < r->end && is_digit(*r->p))
+      r->p++;
+  }
+  if (r->p < r->end && (*r->p == 'e' || *r->p == 'E')) {
+    r->p++;
+    if (r->p < r->end && (*r->p == '+' || *r->p == '-'))
+      r->p++;
+    if (r->p >= r->end || !is_digit(*r->p))
+      return fail(r, "invalid number");
+    while (r->p < r->end && is_digit(*r->p))
+      r->p++;
+  }
+
+  // Integers stay integers, as in Lua source
+  char num[64];
+  size_t n = (size_t)(r->p - s);
+  if (n < sizeof(num)) {
+    memcpy(num, s, n);
+    num[n] = '\0';
+    if (lua_stringtonumber(L, num) != 0)
+      return true;
+  }
+  char *copy = strndup(s, n);
+  if (copy == NULL)
+    return fail(r, "out of memory");
+  lua_pushnumber(L, strtod(copy, NULL));
+  free(copy);
+  return true;
+}
+
+static bool read_value(lua_State *L, JsonReader *r, int depth);
+
+static bool read_array(lua_State *L, JsonReader *r, int depth) {
+  lua_newtable(L);
+  skip_space(r);
+  if (r->p < r->end && *r->p == ']') {
+    r->p++;
+    return true;
+  }
+  for (lua_Integer i = 1;; i++) {
+    if (!read_value(L, r, depth + 1))
+      return false;
+    lua_rawseti(L, -2, i);
+    skip_space(r);
+    if (r->p < r->end && *r->p == ',') {
+      r->p++;
+      continue;
+    }
+    if (r->p < r->end && *r->p == ']') {
+      r->p++;
+      return true;
+    }
+    return fail(r, "expected ',' or ']'");
+  }
+}
+
+static bool read_object(lua_State *L, JsonReader *r, int depth) {
+  lua_newtable(L);
+  skip_space(r);
+  if (r->p < r->end && *r->p == '}') {
+    r->p++;
+    return true;
+  }
+  for (;;) {
+    skip_space(r);
+    if (r->p >= r->end || *r->p != '"')
+      return fail(r, "expected a string key");
+    r->p++;
+    if (!read_string(L, r))
+      return false;
+    skip_space(r);
+    if (r->p >= r->end || *r->p != ':')
+      return fail(r, "expected ':'");
+    r->p++;
+    if (!read_value(L, r, depth + 1))
+      return false;
+    lua_rawset(L, -3);
+    skip_space(r);
+    if (r->p < r->end && *r->p == ',') {
+      r->p++;
+      continue;
+    }
+    if (r->p < r->end && *r->p == '}') {
+      r->p++;
+      return true;
+    }
+    return fail(r, "expected ',' or '}'");
+  }
+}
+
+static bool read_value(lua_State *L, JsonReader *r, int depth) {
+  if (depth >= JSON_MAX_DEPTH)
+    return fail(r, "nested too deeply");
+  luaL_checkstack(L, 3, "json.decode");
+  skip_space(r);
+  if (r->p >= r->end)
+    return fail(r, "unexpected end of input");
+  switch (*r->p) {
+  case '{':
+    r->p++;
+    return read_object(L, r, depth);
+  case '[':
+    r->p++;
+    return read_array(L, r, depth);
+  case '"':
+    r->p++;
+    return read_string(L, r);
+  case 't':
+    if (!literal(r, "true", 4))
+      return false;
+    lua_pushboolean(L, 1);
+    return true;
+  case 'f':
+    if (!literal(r, "false", 5))
+      return false;
+    lua_pushboolean(L, 0);
+    return true;
+  case 'n':
+    if (!literal(r, "null", 4))
+      return false;
+    lua_pushlightuserdata(L, NULL); // json.null
+    return true;
+  default:
+    return read_number(L, r);
+  }
+}
+
+bool json_decode(lua_State *L, const char *text, size_t len, char *err,
+                 size_t err_size) {
+  JsonReader r = {text, text, text + len, NULL};
+  int top = lua_gettop(L);
+  bool ok = read_value(L, &r, 0);
+  if (ok) {
+    skip_space(&r);
+    if (r.p < r.end)
+      ok = fail(&r, "trailing characters");
+  }
+  if (!ok) {
+    lua_settop(L, top); // drops the partly built value
+    snprintf(err, err_size, "%s at byte %zu", r.error,
+             (size_t)(r.p - r.start) + 1);
+  }
+  return ok;
+}
+
+// --- Lua module ---------------------------------------------------------
+
+static int l_json_encode(lua_State *L) {
+  luaL_checkany(L, 1);
+  size_t len;
+  const char *err = NULL;
+  char *text = json_encode(L, 1, &len, &err);
+  if (text == NULL)
+    return luaL_error(L, "json.encode: %s", err);
+  lua_pushlstring(L, text, len);
+  free(text);
+  return 1;
+}
+
+static int l_json_decode(lua_State *L) {
+  size_t len;
+  const char *text = luaL_checklstring(L, 1, &len);
+  char err[128];
+  if (json_decode(L, text, len, err, sizeof(err)))
+    return 1;
+  lua_pushnil(L);
+  lua_pushstring(L, err);
+  return 2;
+}
+
+static int luaopen_json(lua_State *L) {
+  static const luaL_Reg funcs[] = {
+      {"encode", l_json_encode}, {"decode", l_json_decode}, {NULL, NULL}};
+  luaL_newlib(L, funcs);
+  lua_pushlightuserdata(L, NULL);
+  lua_setfield(L, -2, "null");
+  return 1;
+}
+
+void json_open(lua_State *L) {
+  luaL_requiref(L, "json", luaopen_json, 1);
+  lua_pop(L, 1);
+}
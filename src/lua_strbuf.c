@@ -0,0 +1,157 @@
+#include "lua_strbuf.h"
+#include <lauxlib.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STRBUF_MT "host.StrBuf"
+#define STRBUF_MIN 256
+
+StrBuf *strbuf_test(lua_State *L, int idx) {
+  return (StrBuf *)luaL_testudata(L, idx, STRBUF_MT);
+}
+
+// Methods and metamethods carry the metatable as upvalue 1: etlua
+// appends through __newindex once per chunk, and comparing against the
+// upvalue saves the registry lookup of luaL_checkudata
+static StrBuf *check_buf(lua_State *L, int idx) {
+  void *b = lua_touserdata(L, idx);
+  if (b == NULL || !lua_getmetatable(L, idx) ||
+      !lua_rawequal(L, -1, lua_upvalueindex(1)))
+    luaL_typeerror(L, idx, "strbuf");
+  lua_pop(L, 1);
+  return (StrBuf *)b;
+}
+
+// Doubles the capacity (at least to `need`), so appends are amortized O(1)
+static void reserve(lua_State *L, StrBuf *b, size_t need) {
+  if (need <= b->cap)
+    return;
+  size_t cap = b->cap < STRBUF_MIN ? STRBUF_MIN : b->cap;
+  while (cap < need)
+    cap = cap > SIZE_MAX / 2 ? need : cap * 2;
+  char *grown = realloc(b->data, cap);
+  if (grown == NULL)
+    luaL_error(L, "strbuf: out of memory");
+  b->data = grown;
+  b->cap = cap;
+}
+
+static void append(lua_State *L, StrBuf *b, int idx) {
+  size_t n;
+  const char *s = luaL_checklstring(L, idx, &n);
+  if (n > SIZE_MAX - b->len)
+    luaL_error(L, "strbuf: too large");
+  reserve(L, b, b->len + n);
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+}
+
+char *strbuf_detach(StrBuf *b, size_t *len) {
+  char *data = b->data;
+  if (data == NULL && (data = malloc(1)) == NULL)
+    return NULL;
+  *len = b->len;
+  *b->hint = b->len;
+  b->data = NULL;
+  b->len = b->cap = 0;
+  return data;
+}
+
+// strbuf.new([size]); upvalue 1 holds the state's size hint
+static int l_new(lua_State *L) {
+  size_t *hint = (size_t *)lua_touserdata(L, lua_upvalueindex(1));
+  lua_Integer size = luaL_optinteger(L, 1, -1);
+  StrBuf *b = (StrBuf *)lua_newuserdatauv(L, sizeof(StrBuf), 0);
+  *b = (StrBuf){.hint = hint};
+  luaL_setmetatable(L, STRBUF_MT);
+  // The last page plus an eighth, so one that grew a little still fits
+  size_t want = size >= 0 ? (size_t)size : *hint + *hint / 8;
+  if (want > 0)
+    reserve(L, b, want);
+  return 1;
+}
+
+static int l_put(lua_State *L) {
+  StrBuf *b = check_buf(L, 1);
+  int top = lua_gettop(L);
+  for (int i = 2; i <= top; i++)
+    append(L, b, i);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int l_reset(lua_State *L) {
+  check_buf(L, 1)->len = 0;
+  return 0;
+}
+
+static int l_newindex(lua_State *L) {
+  append(L, check_buf(L, 1), 3);
+  return 0;
+}
+
+static int l_len(lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)check_buf(L, 1)->len);
+  return 1;
+}
+
+static int l_tostring(lua_State *L) {
+  StrBuf *b = check_buf(L, 1);
+  lua_pushlstring(L, b->data ? b->data : "", b->len);
+  return 1;
+}
+
+static int l_concat(lua_State *L) {
+  for (int i = 1; i <= 2; i++) {
+    StrBuf *b = strbuf_test(L, i);
+    if (b) {
+      lua_pushlstring(L, b->data ? b->data : "", b->len);
+      lua_replace(L, i);
+    } else {
+      luaL_checkstring(L, i);
+    }
+  }
+  lua_concat(L, 2);
+  return 1;
+}
+
+static int l_gc(lua_State *L) {
+  StrBuf *b = check_buf(L, 1);
+  free(b->data);
+  b->data = NULL;
+  b->len = b->cap = 0;
+  return 0;
+}
+
+static int luaopen_strbuf(lua_State *L) {
+  static const luaL_Reg methods[] = {{"put", l_put},
+                                     {"reset", l_reset},
+                                     {NULL, NULL}};
+  static const luaL_Reg meta[] = {{"__newindex", l_newindex},
+                                  {"__len", l_len},
+                                  {"__tostring", l_tostring},
+                                  {"__concat", l_concat},
+                                  {"__gc", l_gc},
+                                  {NULL, NULL}};
+  luaL_newmetatable(L, STRBUF_MT);
+  lua_pushvalue(L, -1);
+  luaL_setfuncs(L, meta, 1);
+  luaL_newlibtable(L, methods);
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, methods, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+  size_t *hint = (size_t *)lua_newuserdatauv(L, sizeof(size_t), 0);
+  *hint = 0;
+  lua_pushcclosure(L, l_new, 1);
+  lua_setfield(L, -2, "new");
+  return 1;
+}
+
+void strbuf_open(lua_State *L) {
+  luaL_requiref(L, "strbuf", luaopen_strbuf, 1);
+  lua_pop(L, 1);
+}
@@ -0,0 +1,361 @@
+#include "lua_text.h"
+#include <lauxlib.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define TEXT_X86 1
+#include <immintrin.h>
+#endif
+
+// Returns the index of the first byte the kernel has to change, or n
+typedef size_t (*ScanFn)(const unsigned char *s, size_t n);
+
+// --- Byte classes (scalar scans and tails) --------------------------------
+
+enum { HTML_SPECIAL = 1, URL_ESCAPED = 2, URL_UNRESERVED = 4 };
+
+static uint8_t classes[256];
+
+static void init_classes(void) {
+  for (const char *c = "&<>\"'"; *c; c++)
+    classes[(unsigned char)*c] |= HTML_SPECIAL;
+  classes['%'] |= URL_ESCAPED;
+  classes['+'] |= URL_ESCAPED;
+  for (int c = 0; c < 256; c++) {
+    if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') ||
+        (c >= 'a' && c <= 'z') || c == '-' || c == '_' || c == '.' ||
+        c == '~')
+      classes[c] |= URL_UNRESERVED;
+  }
+}
+
+static size_t html_scan_scalar(const unsigned char *s, size_t n) {
+  size_t i = 0;
+  while (i < n && !(classes[s[i]] & HTML_SPECIAL))
+    i++;
+  return i;
+}
+
+static size_t url_decode_scan_scalar(const unsigned char *s, size_t n) {
+  size_t i = 0;
+  while (i < n && !(classes[s[i]] & URL_ESCAPED))
+    i++;
+  return i;
+}
+
+static size_t url_encode_scan_scalar(const unsigned char *s, size_t n) {
+  size_t i = 0;
+  while (i < n && (classes[s[i]] & URL_UNRESERVED))
+    i++;
+  return i;
+}
+
+// --- SSE2: 16 bytes per step, always there on x86-64 ----------------------
+
+#ifdef TEXT_X86
+// Also the tail of the AVX2 scans: inlined there, it is VEX-encoded like
+// the rest of the function; a call into legacy SSE code with the upper
+// halves of the registers dirty costs more than the scan itself
+#define SSE2_STEP static inline __attribute__((always_inline))
+
+static inline __m128i in_range16(__m128i v, char lo, char hi) {
+  // Signed compares: bytes >= 0x80 are negative and never in an ASCII range
+  return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((char)(lo - 1))),
+                       _mm_cmplt_epi8(v, _mm_set1_epi8((char)(hi + 1))));
+}
+
+SSE2_STEP size_t html_scan_sse2(const unsigned char *s, size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i hit = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('&')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('<'))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('>')),
+                     _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                  _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')))));
+    unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
+  }
+  return i + html_scan_scalar(s + i, n - i);
+}
+
+SSE2_STEP size_t url_decode_scan_sse2(const unsigned char *s, size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('%')),
+                               _mm_cmpeq_epi8(v, _mm_set1_epi8('+')));
+    unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
+  }
+  return i + url_decode_scan_scalar(s + i, n - i);
+}
+
+SSE2_STEP size_t url_encode_scan_sse2(const unsigned char *s, size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20)); // folds A-Z
+    __m128i ok = _mm_or_si128(
+        _mm_or_si128(in_range16(v, '0', '9'), in_range16(lower, 'a', 'z')),
+        _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('-')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('_'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('.')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('~')))));
+    unsigned mask = (unsigned)_mm_movemask_epi8(ok) ^ 0xffffu;
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
+  }
+  return i + url_encode_scan_scalar(s + i, n - i);
+}
+
+// --- AVX2: 32 bytes per step, when the CPU has it -------------------------
+
+__attribute__((target("avx2"))) static inline __m256i
+in_range32(__m256i v, char lo, char hi) {
+  return _mm256_and_si256(
+      _mm256_cmpgt_epi8(v, _mm256_set1_epi8((char)(lo - 1))),
+      _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(hi + 1)), v));
+}
+
+__attribute__((target("avx2"))) static size_t
+html_scan_avx2(const unsigned char *s, size_t n) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i hit = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<'))),
+        _mm256_or_si256(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')))));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
+  }
+  return i + html_scan_sse2(s + i, n - i);
+}
+
+__attribute__((target("avx2"))) static size_t
+url_decode_scan_avx2(const unsigned char *s, size_t n) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('%')),
+                                  _mm256_cmpeq_epi8(v, _mm256_set1_epi8('+')));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
+  }
+  return i + url_decode_scan_sse2(s + i, n - i);
+}
+
+__attribute__((target("avx2"))) static size_t
+url_encode_scan_avx2(const unsigned char *s, size_t n) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i ok = _mm256_or_si256(
+        _mm256_or_si256(in_range32(v, '0', '9'), in_range32(lower, 'a', 'z')),
+        _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('-')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('.')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('~')))));
+    unsigned mask = ~(unsigned)_mm256_movemask_epi8(ok);
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
+  }
+  return i + url_encode_scan_sse2(s + i, n - i);
+}
+#endif
+
+// --- Dispatch -------------------------------------------------------------
+
+static ScanFn html_scan = html_scan_scalar;
+static ScanFn url_decode_scan = url_decode_scan_scalar;
+static ScanFn url_encode_scan = url_encode_scan_scalar;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void pick_kernels(void) {
+  init_classes();
+#ifdef TEXT_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    html_scan = html_scan_avx2;
+    url_decode_scan = url_decode_scan_avx2;
+    url_encode_scan = url_encode_scan_avx2;
+  } else {
+    html_scan = html_scan_sse2;
+    url_decode_scan = url_decode_scan_sse2;
+    url_encode_scan = url_encode_scan_sse2;
+  }
+#endif
+}
+
+// --- Lua functions --------------------------------------------------------
+
+static const char *html_entity(unsigned char c) {
+  switch (c) {
+  case '&':
+    return "&amp;";
+  case '<':
+    return "&lt;";
+  case '>':
+    return "&gt;";
+  case '"':
+    return "&quot;";
+  default:
+    return "&#039;";
+  }
+}
+
+static int l_html_escape(lua_State *L) {
+  size_t n;
+  const unsigned char *s = (const unsigned char *)luaL_checklstring(L, 1, &n);
+  size_t i = html_scan(s, n);
+  if (i == n) {
+    lua_settop(L, 1); // nothing to escape: no copy
+    return 1;
+  }
+
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  size_t start = 0;
+  while (i < n) {
+    luaL_addlstring(&b, (const char *)s + start, i - start);
+    luaL_addstring(&b, html_entity(s[i]));
+    start = i + 1;
+    i = start + html_scan(s + start, n - start);
+  }
+  luaL_addlstring(&b, (const char *)s + start, n - start);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+static int hex_value(unsigned char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+// Pushes s decoded; a '%' without two hex digits stays as it is
+static void push_url_decoded(lua_State *L, const unsigned char *s, size_t n) {
+  size_t i = url_decode_scan(s, n);
+  if (i == n) {
+    lua_pushlstring(L, (const char *)s, n);
+    return;
+  }
+
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  size_t start = 0;
+  while (i < n) {
+    luaL_addlstring(&b, (const char *)s + start, i - start);
+    int hi, lo;
+    if (s[i] == '+') {
+      luaL_addchar(&b, ' ');
+      start = i + 1;
+    } else if (i + 2 < n && (hi = hex_value(s[i + 1])) >= 0 &&
+               (lo = hex_value(s[i + 2])) >= 0) {
+      luaL_addchar(&b, (char)(hi << 4 | lo));
+      start = i + 3;
+    } else {
+      luaL_addchar(&b, '%');
+      start = i + 1;
+    }
+    i = start + url_decode_scan(s + start, n - start);
+  }
+  luaL_addlstring(&b, (const char *)s + start, n - start);
+  luaL_pushresult(&b);
+}
+
+static int l_url_decode(lua_State *L) {
+  size_t n;
+  const unsigned char *s = (const unsigned char *)luaL_checklstring(L, 1, &n);
+  if (url_decode_scan(s, n) == n) {
+    lua_settop(L, 1);
+    return 1;
+  }
+  push_url_decoded(L, s, n);
+  return 1;
+}
+
+static int l_url_encode(lua_State *L) {
+  size_t n;
+  const unsigned char *s = (const unsigned char *)luaL_checklstring(L, 1, &n);
+  size_t i = url_encode_scan(s, n);
+  if (i == n) {
+    lua_settop(L, 1);
+    return 1;
+  }
+
+  static const char hex[] = "0123456789ABCDEF";
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  size_t start = 0;
+  while (i < n) {
+    luaL_addlstring(&b, (const char *)s + start, i - start);
+    char esc[3] = {'%', hex[s[i] >> 4], hex[s[i] & 15]};
+    luaL_addlstring(&b, esc, 3);
+    start = i + 1;
+    i = start + url_encode_scan(s + start, n - start);
+  }
+  luaL_addlstring(&b, (const char *)s + start, n - start);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+// a=1&b=2 -> {a = "1", b = "2"}. Keys and values are decoded, a key
+// without '=' gets "", empty keys are skipped and the last of repeated
+// keys wins.
+static int l_parse_query(lua_State *L) {
+  size_t n;
+  const char *s = luaL_optlstring(L, 1, "", &n);
+  const char *end = s + n;
+  lua_newtable(L);
+  while (s < end) {
+    const char *amp = memchr(s, '&', (size_t)(end - s));
+    const char *stop = amp ? amp : end;
+    const char *eq = memchr(s, '=', (size_t)(stop - s));
+    const char *key_end = eq ? eq : stop;
+    if (key_end > s) {
+      push_url_decoded(L, (const unsigned char *)s, (size_t)(key_end - s));
+      if (eq)
+        push_url_decoded(L, (const unsigned char *)eq + 1,
+                         (size_t)(stop - eq - 1));
+      else
+        lua_pushliteral(L, "");
+      lua_rawset(L, -3);
+    }
+    s = amp ? amp + 1 : end;
+  }
+  return 1;
+}
+
+static int luaopen_text(lua_State *L) {
+  static const luaL_Reg funcs[] = {{"html_escape", l_html_escape},
+                                   {"url_decode", l_url_decode},
+                                   {"url_encode", l_url_encode},
+                                   {"parse_query", l_parse_query},
+                                   {NULL, NULL}};
+  luaL_newlib(L, funcs);
+  return 1;
+}
+
+void text_open(lua_State *L) {
+  pthread_once(&kernels_once, pick_kernels);
+  luaL_requiref(L, "text", luaopen_text, 1);
+  lua_pop(L, 1);
+}
@@ -1,44 +1,118 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
 #include <microhttpd.h>
+#include "config.h"
+#include "event_loop.h"
+#include "log.h"
 #include "plugin_manager.h"
+#include "response_cache.h"
 #include "server.h"
+#include "supervisor.h"
+#include "trace.h"
 
 
+// Single-process mode: 'r' on stdin reloads the plugins, so does SIGHUP;
+// SIGTERM or SIGINT returns to start the shutdown
+static void wait_for_shutdown(PluginManager *pm, const sigset_t *signals) {
+    int sfd = signalfd(-1, signals, SFD_CLOEXEC);
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {sfd, POLLIN, 0}};
+    bool reload = false;
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(sfd, &info, sizeof(info)) != sizeof(info)) continue;
+            if (info.ssi_signo != SIGHUP) break;
+            reload = true;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            char buf[64];
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            // Without a terminal (a service), only signals stop the server
+            if (n <= 0) fds[0].fd = -1;
+            for (ssize_t i = 0; i < n; i++) {
+                if (buf[i] == 'r') reload = true;
+            }
+        }
+        if (reload) {
+            printf("Refreshing plugins...\n");
+            refresh_plugins(pm);
+            printf("Plugins refreshed!\n");
+            reload = false;
+        }
+    }
+    if (sfd >= 0) close(sfd);
+}
 
 int main() {
 
     printf("libmicrohttpd version: %s\n", MHD_get_version());
+    config_load();
+    int worker = supervisor_start();
+
+    // Taken by wait_for_shutdown() / worker_wait(); blocked before any
+    // thread starts so no other thread receives them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+
+    log_init();
+    trace_init();
+    response_cache_init();
     
     PluginManager *pm = create_manager();
     if (pm == NULL) {
         printf("create_manager returned null");
     }
     
-    start_worker_pool(pm, 4);
+    start_worker_pool(pm, 0);
     refresh_plugins(pm);
+    job_queue_restore(pm);
     
 
     for (int i = 0; i < pm->plugin_count ; i++) {
         printf("%s\t%s\n", pm->plugin_list[i]->name, pm->plugin_list[i]->path);
     }
 
+    event_loop_start(pm);
+
     struct MHD_Daemon *daemon;
     daemon = start_server(pm);
 
     if (NULL == daemon) return 1;
 
-    char c;
-    while ((c = getchar()) != EOF) {
-        if (c == 'r') {
-            printf("Refreshing plugins...\n");
-            refresh_plugins(pm);
-            printf("Plugins refreshed!\n");
-        }
+    if (worker >= 0) {
+        worker_ready();
+        worker_wait(pm);
+    } else {
+        wait_for_shutdown(pm, &signals);
     }
 
-    MHD_stop_daemon(daemon);
-    destroy_manager(pm);
-    pm = NULL;
+    // Stop accepting, answer what was accepted, then let the background
+    // jobs finish (or spool them) before anything is freed
+    int running = server_drain(daemon);
+    bool jobs_idle = job_queue_drain(pm);
+    if (running == 0 && jobs_idle) {
+        MHD_stop_daemon(daemon);
+        event_loop_stop();
+        destroy_manager(pm);
+        pm = NULL;
+    } else {
+        // Lua states are still in use; the OS reclaims them on exit
+        log_write(LOG_WARN, "server", "exiting without teardown");
+    }
+    trace_shutdown();
+    log_shutdown();
 
 
     return 0;
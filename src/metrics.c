@@ -0,0 +1,462 @@
+#include "metrics.h"
+#include "event_loop.h"
+#include "log.h"
+#include "plugin_manager.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Each series keeps one copy of its counters per shard. A thread picks a
+// shard once and only ever touches that copy, so the hot path is a relaxed
+// atomic add on a cache line no other thread is writing. The scrape sums
+// the shards.
+#define METRICS_SHARDS 8
+
+// HDR-style log-linear histogram over microseconds: every power of two is
+// split into 8 linear sub-buckets, which keeps relative error under 12.5%
+// from 1us up to ~9.5 hours with 264 buckets.
+#define HIST_SUB_BITS 3
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_MSB 34
+#define HIST_BUCKETS ((HIST_MAX_MSB - HIST_SUB_BITS + 2) * HIST_SUB_COUNT)
+
+// Open addressing table of every series ever created. Series are never
+// removed, so readers can probe it without taking a lock.
+#define SERIES_CAPACITY 4096
+
+typedef struct {
+  _Alignas(64) _Atomic uint64_t count;
+  _Atomic uint64_t sum_ns;
+  _Atomic uint64_t buckets[HIST_BUCKETS];
+} HistShard;
+
+typedef struct {
+  _Alignas(64) _Atomic uint64_t value;
+} CounterShard;
+
+struct MetricSeries {
+  MetricFamilyId family;
+  char *label1;
+  char *label2;
+  uint64_t hash;
+  HistShard *hist;                       // histogram families
+  CounterShard counters[METRICS_SHARDS]; // counter families
+};
+
+typedef struct {
+  const char *name;
+  const char *help;
+  bool histogram;
+  const char *label1;
+  const char *label2;
+} MetricFamily;
+
+static const MetricFamily families[METRIC_FAMILY_COUNT] = {
+    [METRIC_HTTP_REQUEST_SECONDS] = {"plugin_http_request_duration_seconds",
+                                     "Time from dispatch to response built, "
+                                     "including plugin lock wait",
+                                     true, "plugin", "route"},
+    [METRIC_HTTP_RESPONSES_TOTAL] = {"plugin_http_responses_total",
+                                     "Responses by plugin and status code",
+                                     false, "plugin", "code"},
+    [METRIC_JOB_WAIT_SECONDS] = {"plugin_job_wait_seconds",
+                                 "Time a job spent queued before a worker "
+                                 "picked it up",
+                                 true, "plugin", NULL},
+    [METRIC_JOB_RUN_SECONDS] = {"plugin_job_run_seconds",
+                                "Time a worker spent executing a job", true,
+                                "plugin", NULL},
+    [METRIC_HOOK_CALLS_TOTAL] = {"plugin_hook_calls_total",
+                                 "Hook invocations by hook name and kind",
+                                 false, "hook", "kind"},
+    [METRIC_SQLITE_SECONDS] = {"plugin_sqlite_seconds",
+                               "Time spent in SQLite per plugin and operation",
+                               true, "plugin", "op"},
+    [METRIC_SQLITE_STATEMENTS_TOTAL] = {"plugin_sqlite_statements_total",
+                                        "Statements run per plugin on the "
+                                        "reader or writer connections",
+                                        false, "plugin", "conn"},
+    [METRIC_LUA_GC_FREED_BYTES] = {"plugin_lua_gc_freed_bytes_total",
+                                   "Drops in the Lua heap between requests, "
+                                   "a lower bound on what the GC freed",
+                                   false, "plugin", NULL},
+    [METRIC_CACHE_LOOKUPS_TOTAL] = {"plugin_cache_lookups_total",
+                                    "Response cache lookups by result "
+                                    "(hit or miss)",
+                                    false, "plugin", "result"},
+    [METRIC_JOBS_COALESCED_TOTAL] = {"plugin_jobs_coalesced_total",
+                                     "Async events folded into a pending "
+                                     "job with the same key",
+                                     false, "hook", NULL},
+};
+
+// Exported bucket boundaries in microseconds. The fine buckets are folded
+// into this ladder at scrape time.
+static const uint64_t export_bounds_us[] = {
+    100,    250,    500,     1000,    2500,    5000,    10000,   25000,
+    50000,  100000, 250000,  500000,  1000000, 2500000, 5000000, 10000000};
+#define EXPORT_BOUND_COUNT                                                     \
+  (sizeof(export_bounds_us) / sizeof(export_bounds_us[0]))
+
+static _Atomic(MetricSeries *) series_table[SERIES_CAPACITY];
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static int series_count = 0;
+
+static _Thread_local int tls_shard = -1;
+static atomic_int next_shard = 0;
+
+static inline int current_shard(void) {
+  if (tls_shard < 0)
+    tls_shard = atomic_fetch_add(&next_shard, 1) % METRICS_SHARDS;
+  return tls_shard;
+}
+
+uint64_t metrics_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t hash_labels(MetricFamilyId family, const char *l1,
+                            const char *l2) {
+  // FNV-1a over family id and both labels (with separators)
+  uint64_t h = 1469598103934665603ull ^ (uint64_t)family;
+  h *= 1099511628211ull;
+  for (const char *s = l1; s && *s; s++) {
+    h ^= (unsigned char)*s;
+    h *= 1099511628211ull;
+  }
+  h ^= 0xff;
+  h *= 1099511628211ull;
+  for (const char *s = l2; s && *s; s++) {
+    h ^= (unsigned char)*s;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+static bool label_eq(const char *a, const char *b) {
+  if (a == NULL || b == NULL)
+    return a == b;
+  return strcmp(a, b) == 0;
+}
+
+static bool series_matches(MetricSeries *s, uint64_t hash,
+                           MetricFamilyId family, const char *l1,
+                           const char *l2) {
+  return s->hash == hash && s->family == family && label_eq(s->label1, l1) &&
+         label_eq(s->label2, l2);
+}
+
+static MetricSeries *series_create(MetricFamilyId family, const char *l1,
+                                   const char *l2, uint64_t hash) {
+  MetricSeries *s = aligned_alloc(64, sizeof(MetricSeries));
+  if (s == NULL)
+    return NULL;
+  memset(s, 0, sizeof(MetricSeries));
+  s->family = family;
+  s->hash = hash;
+  s->label1 = l1 ? strdup(l1) : NULL;
+  s->label2 = l2 ? strdup(l2) : NULL;
+  if (families[family].histogram) {
+    s->hist = aligned_alloc(64, sizeof(HistShard) * METRICS_SHARDS);
+    if (s->hist == NULL) {
+      free(s->label1);
+      free(s->label2);
+      free(s);
+      return NULL;
+    }
+    memset(s->hist, 0, sizeof(HistShard) * METRICS_SHARDS);
+  }
+  return s;
+}
+
+MetricSeries *metrics_series(MetricFamilyId family, const char *label1,
+                             const char *label2) {
+  uint64_t hash = hash_labels(family, label1, label2);
+  size_t slot = hash & (SERIES_CAPACITY - 1);
+
+  // 1. Fast path: probe without locking
+  for (size_t i = 0; i < SERIES_CAPACITY; i++) {
+    MetricSeries *s = atomic_load_explicit(
+        &series_table[(slot + i) & (SERIES_CAPACITY - 1)],
+        memory_order_acquire);
+    if (s == NULL)
+      break;
+    if (series_matches(s, hash, family, label1, label2))
+      return s;
+  }
+
+  // 2. Slow path: first time we see this label set
+  pthread_mutex_lock(&registry_lock);
+  MetricSeries *found = NULL;
+  // Keep the table at most 3/4 full so probes stay short
+  if (series_count < SERIES_CAPACITY / 4 * 3) {
+    for (size_t i = 0; i < SERIES_CAPACITY; i++) {
+      size_t idx = (slot + i) & (SERIES_CAPACITY - 1);
+      MetricSeries *s =
+          atomic_load_explicit(&series_table[idx], memory_order_relaxed);
+      if (s == NULL) {
+        found = series_create(family, label1, label2, hash);
+        if (found) {
+          atomic_store_explicit(&series_table[idx], found,
+                                memory_order_release);
+          series_count++;
+        }
+        break;
+      }
+      if (series_matches(s, hash, family, label1, label2)) {
+        found = s; // another thread beat us to it
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&registry_lock);
+  return found;
+}
+
+static inline int hist_bucket(uint64_t us) {
+  if (us < HIST_SUB_COUNT)
+    return (int)us;
+  int msb = 63 - __builtin_clzll(us);
+  if (msb > HIST_MAX_MSB)
+    return HIST_BUCKETS - 1;
+  int shift = msb - HIST_SUB_BITS;
+  return ((shift + 1) << HIST_SUB_BITS) + (int)((us >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+// Exclusive upper bound of a fine bucket, in microseconds
+static uint64_t hist_bucket_upper(int idx) {
+  if (idx < HIST_SUB_COUNT)
+    return (uint64_t)idx + 1;
+  int shift = (idx >> HIST_SUB_BITS) - 1;
+  uint64_t sub = (uint64_t)(idx & (HIST_SUB_COUNT - 1));
+  return (HIST_SUB_COUNT + sub + 1) << shift;
+}
+
+void metrics_observe_ns(MetricSeries *s, uint64_t ns) {
+  if (s == NULL || s->hist == NULL)
+    return;
+  HistShard *shard = &s->hist[current_shard()];
+  atomic_fetch_add_explicit(&shard->buckets[hist_bucket(ns / 1000)], 1,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&shard->sum_ns, ns, memory_order_relaxed);
+  atomic_fetch_add_explicit(&shard->count, 1, memory_order_relaxed);
+}
+
+void metrics_add(MetricSeries *s, uint64_t n) {
+  if (s == NULL)
+    return;
+  atomic_fetch_add_explicit(&s->counters[current_shard()].value, n,
+                            memory_order_relaxed);
+}
+
+void metrics_observe(MetricFamilyId family, const char *label1,
+                     const char *label2, uint64_t ns) {
+  metrics_observe_ns(metrics_series(family, label1, label2), ns);
+}
+
+void metrics_count(MetricFamilyId family, const char *label1,
+                   const char *label2) {
+  metrics_add(metrics_series(family, label1, label2), 1);
+}
+
+// --- Text exposition ---
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} TextBuf;
+
+static void buf_printf(TextBuf *b, const char *fmt, ...) {
+  va_list args;
+  while (1) {
+    va_start(args, fmt);
+    int n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, args);
+    va_end(args);
+    if (n < 0)
+      return;
+    if (b->len + (size_t)n < b->cap) {
+      b->len += (size_t)n;
+      return;
+    }
+    size_t new_cap = b->cap * 2;
+    while (new_cap <= b->len + (size_t)n)
+      new_cap *= 2;
+    char *grown = realloc(b->data, new_cap);
+    if (grown == NULL)
+      return;
+    b->data = grown;
+    b->cap = new_cap;
+  }
+}
+
+// Writes name="value" with Prometheus label escaping
+static void buf_label(TextBuf *b, const char *name, const char *value) {
+  buf_printf(b, "%s=\"", name);
+  for (const char *c = value ? value : ""; *c; c++) {
+    if (*c == '\\' || *c == '"')
+      buf_printf(b, "\\%c", *c);
+    else if (*c == '\n')
+      buf_printf(b, "\\n");
+    else
+      buf_printf(b, "%c", *c);
+  }
+  buf_printf(b, "\"");
+}
+
+static void buf_labels(TextBuf *b, const MetricFamily *f, MetricSeries *s,
+                       const char *le) {
+  buf_printf(b, "{");
+  buf_label(b, f->label1, s->label1);
+  if (f->label2) {
+    buf_printf(b, ",");
+    buf_label(b, f->label2, s->label2);
+  }
+  if (le)
+    buf_printf(b, ",le=\"%s\"", le);
+  buf_printf(b, "}");
+}
+
+static void render_histogram(TextBuf *b, const MetricFamily *f,
+                             MetricSeries *s) {
+  uint64_t fine[HIST_BUCKETS] = {0};
+  uint64_t sum_ns = 0;
+  for (int sh = 0; sh < METRICS_SHARDS; sh++) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+      fine[i] += atomic_load_explicit(&s->hist[sh].buckets[i],
+                                      memory_order_relaxed);
+    sum_ns += atomic_load_explicit(&s->hist[sh].sum_ns, memory_order_relaxed);
+  }
+
+  // Fold fine buckets into the exported ladder (cumulative)
+  uint64_t cumulative = 0;
+  int fine_idx = 0;
+  char le[32];
+  for (size_t e = 0; e < EXPORT_BOUND_COUNT; e++) {
+    while (fine_idx < HIST_BUCKETS &&
+           hist_bucket_upper(fine_idx) <= export_bounds_us[e]) {
+      cumulative += fine[fine_idx++];
+    }
+    snprintf(le, sizeof(le), "%g", export_bounds_us[e] / 1e6);
+    buf_printf(b, "%s_bucket", f->name);
+    buf_labels(b, f, s, le);
+    buf_printf(b, " %llu\n", (unsigned long long)cumulative);
+  }
+  while (fine_idx < HIST_BUCKETS)
+    cumulative += fine[fine_idx++];
+
+  buf_printf(b, "%s_bucket", f->name);
+  buf_labels(b, f, s, "+Inf");
+  buf_printf(b, " %llu\n", (unsigned long long)cumulative);
+  buf_printf(b, "%s_sum", f->name);
+  buf_labels(b, f, s, NULL);
+  buf_printf(b, " %.9f\n", sum_ns / 1e9);
+  buf_printf(b, "%s_count", f->name);
+  buf_labels(b, f, s, NULL);
+  buf_printf(b, " %llu\n", (unsigned long long)cumulative);
+}
+
+static void render_counter(TextBuf *b, const MetricFamily *f,
+                           MetricSeries *s) {
+  uint64_t total = 0;
+  for (int sh = 0; sh < METRICS_SHARDS; sh++)
+    total += atomic_load_explicit(&s->counters[sh].value, memory_order_relaxed);
+  buf_printf(b, "%s", f->name);
+  buf_labels(b, f, s, NULL);
+  buf_printf(b, " %llu\n", (unsigned long long)total);
+}
+
+static void render_gauges(TextBuf *b, PluginManager *pm) {
+  if (pm->queue) {
+    pthread_mutex_lock(&pm->queue->lock);
+    int depth = pm->queue->count + pm->queue->spilled + pm->queue->parked;
+    int spilled = pm->queue->spilled;
+    pthread_mutex_unlock(&pm->queue->lock);
+    buf_printf(b, "# HELP plugin_job_queue_depth Jobs waiting for a worker\n");
+    buf_printf(b, "# TYPE plugin_job_queue_depth gauge\n");
+    buf_printf(b, "plugin_job_queue_depth %d\n", depth);
+    if (pm->queue->log) {
+      buf_printf(b, "# HELP plugin_job_spilled Queued jobs held only in the "
+                    "job log\n");
+      buf_printf(b, "# TYPE plugin_job_spilled gauge\n");
+      buf_printf(b, "plugin_job_spilled %d\n", spilled);
+    }
+  }
+
+  buf_printf(b, "# HELP plugin_job_workers Background worker threads\n");
+  buf_printf(b, "# TYPE plugin_job_workers gauge\n");
+  buf_printf(b, "plugin_job_workers %d\n", pm->num_workers);
+
+  buf_printf(b, "# HELP plugin_timers_pending Timers not yet fired\n");
+  buf_printf(b, "# TYPE plugin_timers_pending gauge\n");
+  buf_printf(b, "plugin_timers_pending %zu\n", timer_count(pm));
+
+  if (pm->kv) {
+    size_t keys, bytes;
+    kv_store_stats(pm->kv, &keys, &bytes);
+    buf_printf(b, "# HELP plugin_kv_keys Keys in the shared kv store\n");
+    buf_printf(b, "# TYPE plugin_kv_keys gauge\n");
+    buf_printf(b, "plugin_kv_keys %zu\n", keys);
+    buf_printf(b, "# HELP plugin_kv_bytes Memory held by the shared kv store\n");
+    buf_printf(b, "# TYPE plugin_kv_bytes gauge\n");
+    buf_printf(b, "plugin_kv_bytes %zu\n", bytes);
+  }
+
+  buf_printf(b, "# HELP plugin_log_dropped_total Log records dropped because "
+                "a producer ring was full\n");
+  buf_printf(b, "# TYPE plugin_log_dropped_total counter\n");
+  buf_printf(b, "plugin_log_dropped_total %llu\n",
+             (unsigned long long)log_dropped());
+
+  buf_printf(b, "# HELP plugin_lua_heap_bytes Lua heap size of each plugin "
+                "state\n");
+  buf_printf(b, "# TYPE plugin_lua_heap_bytes gauge\n");
+  for (int i = 0; i < pm->plugin_count; i++) {
+    Plugin *p = pm->plugin_list[i];
+    pthread_mutex_lock(&p->lock);
+    long bytes = (long)lua_gc(p->L, LUA_GCCOUNT, 0) * 1024 +
+                 lua_gc(p->L, LUA_GCCOUNTB, 0);
+    event_loop_unlock_plugin(p);
+    buf_printf(b, "plugin_lua_heap_bytes{");
+    buf_label(b, "plugin", p->name);
+    buf_printf(b, "} %ld\n", bytes);
+  }
+}
+
+char *metrics_render(PluginManager *pm, size_t *len_out) {
+  TextBuf b = {.data = malloc(8192), .len = 0, .cap = 8192};
+  if (b.data == NULL)
+    return NULL;
+  b.data[0] = '\0';
+
+  for (int fam = 0; fam < METRIC_FAMILY_COUNT; fam++) {
+    const MetricFamily *f = &families[fam];
+    buf_printf(&b, "# HELP %s %s\n", f->name, f->help);
+    buf_printf(&b, "# TYPE %s %s\n", f->name,
+               f->histogram ? "histogram" : "counter");
+
+    for (size_t i = 0; i < SERIES_CAPACITY; i++) {
+      MetricSeries *s =
+          atomic_load_explicit(&series_table[i], memory_order_acquire);
+      if (s == NULL || (int)s->family != fam)
+        continue;
+      if (f->histogram)
+        render_histogram(&b, f, s);
+      else
+        render_counter(&b, f, s);
+    }
+  }
+
+  if (pm)
+    render_gauges(&b, pm);
+
+  *len_out = b.len;
+  return b.data;
+}
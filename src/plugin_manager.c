@@ -1,16 +1,42 @@
+#define _GNU_SOURCE // pthread_setaffinity_np
 #include "plugin_manager.h"
+#include "config.h"
 #include "lua_helpers.h"
+#include "event_loop.h"
+#include "log.h"
+#include "metrics.h"
+#include "response_cache.h"
+#include "schema.h"
+#include "timer_wheel.h"
+#include "trace.h"
 #include <cJSON.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <lauxlib.h>
 #include <lua.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+// Timer service, defined with the bindings at the end of this file
+static TimerService *timers_create(PluginManager *pm);
+static void timers_start(PluginManager *pm);
+static void timers_stop(PluginManager *pm);
+static void timers_destroy(PluginManager *pm);
+static void timers_cancel_plugin(PluginManager *pm, Plugin *p);
+// Worker pool, defined after the timers
+static void pool_stop(PluginManager *pm);
+static void pool_join(PluginManager *pm);
+static uint64_t timer_hold_job(PluginManager *pm, Job *job, uint64_t delay_ms);
+static void free_job(Job *job);
+static Job *unpark_all(JobQueue *jq);
+
 PluginManager *create_manager() {
   // 1. Allocate the manager structure itself
   PluginManager *pm = calloc(1, sizeof(PluginManager));
@@ -31,6 +57,8 @@ PluginManager *create_manager() {
   }
 
   pm->queue = job_queue_init();
+  pm->kv = kv_store_create();
+  pm->timers = timers_create(pm);
   pthread_mutex_init(&pm->lock, NULL);
 
   pm->hook_capacity = 5;
@@ -44,8 +72,12 @@ PluginManager *create_manager() {
 static void destroy_plugin(Plugin *p) {
   if (p == NULL)
     return;
+  // The state goes first: a coroutine left inside db_transaction rolls
+  // back from its __gc, which needs the executor. Statements still
+  // queued hold their own reference and finish when it drains.
   if (p->L)
     lua_close(p->L);
+  db_executor_destroy(p->db_executor);
   free(p->name);
   free(p->path);
   free(p);
@@ -57,6 +89,7 @@ void destroy_hook(HookRegistration *h) {
   }
   free(h->hook_name);
   free(h->lua_func_name);
+  free(h->merge_func_name);
   free(h);
 }
 
@@ -66,6 +99,10 @@ void destroy_manager(PluginManager *pm) {
 
   // 1. SHUTDOWN THE WORKERS FIRST
   // We must stop the threads before we start freeing the data they use!
+  // Timers go first, they feed the queue; then the pool scaler, so no
+  // worker starts while they are stopping.
+  timers_destroy(pm);
+  pool_stop(pm);
   if (pm->queue) {
     pthread_mutex_lock(&pm->queue->lock);
     pm->queue->shutdown = true;
@@ -73,22 +110,22 @@ void destroy_manager(PluginManager *pm) {
     pthread_mutex_unlock(&pm->queue->lock);
 
     // Wait for every worker thread to finish its current job and exit
-    for (int i = 0; i < pm->num_workers; i++) {
-      pthread_join(pm->worker_threads[i], NULL);
-    }
-    free(pm->worker_threads);
+    pool_join(pm);
   }
 
   // 2. CLEAN UP THE REMAINING JOBS
   // If there were jobs still in the queue, free them now
-  Job *curr = pm->queue->head;
-  while (curr) {
-    Job *next = curr->next;
-    free(curr->lua_func_name);
-    free(curr->payload);
-    free(curr);
-    curr = next;
+  for (int list = 0; list < 2; list++) {
+    Job *curr = list == 0 ? pm->queue->head : unpark_all(pm->queue);
+    while (curr) {
+      Job *next = curr->next;
+      free_job(curr);
+      curr = next;
+    }
   }
+  job_log_close(pm->queue->log);
+  free(pm->queue->coalesce);
+  free(pm->queue->partitions);
   pthread_mutex_destroy(&pm->queue->lock);
   pthread_cond_destroy(&pm->queue->cond);
   free(pm->queue);
@@ -106,6 +143,7 @@ void destroy_manager(PluginManager *pm) {
   free(pm->hook_list);
 
   // 5. FINAL CLEANUP
+  kv_store_destroy(pm->kv);
   pthread_mutex_destroy(&pm->lock);
   free(pm);
 }
@@ -116,11 +154,19 @@ Plugin *create_plugin(char *name, char *path) {
   pthread_mutex_init(&p->lock, NULL);
   if (p == NULL)
     return NULL;
+  pthread_mutex_init(&p->park_lock, NULL);
   p->name = strdup(name);
   p->path = strdup(path);
   p->L = luaL_newstate();
-
-  if (p->name == NULL || p->path == NULL || p->L == NULL) {
+  char db_path[1024];
+  snprintf(db_path, sizeof(db_path), "%s/plugin.db", path);
+  p->db_executor = db_executor_create(db_path, name);
+
+  if (p->name == NULL || p->path == NULL || p->L == NULL ||
+      p->db_executor == NULL) {
+    if (p->L)
+      lua_close(p->L);
+    db_executor_destroy(p->db_executor);
     free(p->name);
     free(p->path);
     free(p);
@@ -133,10 +179,11 @@ Plugin *create_plugin(char *name, char *path) {
   sprintf(plugin_file_path, "%s/%s", path, "plugin.lua");
   if (luaL_loadfile(p->L, plugin_file_path) != LUA_OK) {
     printf("Syntax Error: %s\n", lua_tostring(p->L, -1));
+    lua_close(p->L);
+    db_executor_destroy(p->db_executor);
     free(p->name);
     free(p->path);
     free(p);
-    lua_close(p->L);
     free(plugin_file_path);
     return NULL;
   }
@@ -203,9 +250,11 @@ void refresh_plugins(PluginManager *pm) {
     }
   }
   pm->hook_count = 0;
-  // 2. Clean up plugins
+  // 2. Clean up plugins (and pages their old code rendered)
   for (int i = 0; i < pm->plugin_count; i++) {
     if (pm->plugin_list[i]) {
+      response_cache_invalidate(pm->plugin_list[i]->name);
+      timers_cancel_plugin(pm, pm->plugin_list[i]);
       destroy_plugin(pm->plugin_list[i]);
       pm->plugin_list[i] = NULL;
     }
@@ -242,6 +291,7 @@ void refresh_plugins(PluginManager *pm) {
       snprintf(script_path, sizeof(script_path), "%s/plugin.lua", path_buffer);
       if (luaL_dofile(p->L, script_path) != LUA_OK) {
         fprintf(stderr, "Lua Error: %s\n", lua_tostring(p->L, -1));
+        timers_cancel_plugin(pm, p);
         destroy_plugin(p);
       } else {
         apply_plugin_schema(p->L, p);
@@ -252,49 +302,24 @@ void refresh_plugins(PluginManager *pm) {
   closedir(dp);
 }
 
-#include <time.h>
-
-static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
-// 1. The C function that does the actual logging
+// 1. The C function behind core.log. The level is checked before the
+// message is even read, and the record is queued for the log writer.
 int l_log(lua_State *L) {
-  const char *level = luaL_checkstring(L, 1);
-  const char *msg = luaL_checkstring(L, 2);
-
-  // Generate timestamp
-  time_t now;
-  time(&now);
-  char timestamp[20];
-  struct tm *tm_info = localtime(&now);
-  strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
-
-  // --- CRITICAL SECTION START ---
-  pthread_mutex_lock(&log_mutex);
-
-  fprintf(stdout, "[%s] [%s] %s\n", timestamp, level, msg);
-  fflush(stdout); // Force output so logs appear in real-time
-
-  pthread_mutex_unlock(&log_mutex);
-  // --- CRITICAL SECTION END ---
+  LogLevel level = log_level_from_string(luaL_checkstring(L, 1));
+  if (!log_enabled(level))
+    return 0;
 
+  size_t len = 0;
+  const char *msg = luaL_checklstring(L, 2, &len);
+  Plugin *p = (Plugin *)lua_touserdata(L, lua_upvalueindex(1));
+  log_message(level, p ? p->name : "lua", msg, len);
   return 0;
 }
 
 void server_log(const char *level, const char *fmt, ...) {
   va_list args;
   va_start(args, fmt);
-
-  time_t now;
-  time(&now);
-  char timestamp[20];
-  strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
-
-  pthread_mutex_lock(&log_mutex);
-  printf("[%s] [%s] ", timestamp, level);
-  vprintf(fmt, args);
-  printf("\n");
-  fflush(stdout);
-  pthread_mutex_unlock(&log_mutex);
-
+  log_vwrite(log_level_from_string(level), "server", fmt, args);
   va_end(args);
 }
 
@@ -319,21 +344,22 @@ void monitor_plugin_memory(PluginManager *pm) {
 static int call_stack_depth = 0;
 #define MAX_CALL_STACK_DEPTH 10
 
-int l_call_hook(lua_State *L) {
+static int run_sync_hook(lua_State *L) {
   if (call_stack_depth >= MAX_CALL_STACK_DEPTH) {
     return luaL_error(L,
                       "Critical Error: Max event recursion depth (%d) reached!",
                       MAX_CALL_STACK_DEPTH);
   }
-  Plugin *p = (Plugin *)lua_touserdata(L, lua_upvalueindex(1));
   PluginManager *pm = (PluginManager *)lua_touserdata(L, lua_upvalueindex(2));
 
   call_stack_depth++; // Enter
   const char *event_name = luaL_checkstring(L, 1);
+  uint64_t span_start = trace_now();
   int return_count = 0; // How many values we are returning to Lua
 
   for (int i = 0; i < pm->hook_count; i++) {
     if (strcmp(pm->hook_list[i]->hook_name, event_name) == 0) {
+      metrics_count(METRIC_HOOK_CALLS_TOTAL, event_name, "sync");
       lua_State *targetL = pm->hook_list[i]->plugin->L;
 
       lua_getglobal(targetL, pm->hook_list[i]->lua_func_name);
@@ -354,12 +380,58 @@ int l_call_hook(lua_State *L) {
       goto exit;        // JUMP TO CLEANUP
     }
   }
+  // Event names come from Lua, so only registered hooks get a series
+  metrics_count(METRIC_HOOK_CALLS_TOTAL, "other", "sync");
 
 exit:
+  trace_span("hook", event_name, span_start);
   call_stack_depth--; // ALWAYS DECREMENT BEFORE LEAVING
   return return_count;
 }
 
+// Resumed by the event loop once the hook target's lock is held
+static int call_hook_continue(lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  (void)ctx;
+  return run_sync_hook(L);
+}
+
+int l_call_hook(lua_State *L) {
+  Plugin *p = (Plugin *)lua_touserdata(L, lua_upvalueindex(1));
+  PluginManager *pm = (PluginManager *)lua_touserdata(L, lua_upvalueindex(2));
+  const char *event_name = luaL_checkstring(L, 1);
+
+  // A request coroutine must not block its loop thread on another
+  // plugin's state: take the target's lock if it is free, else yield
+  if (event_loop_can_yield(L)) {
+    Plugin *target = NULL;
+    for (int i = 0; i < pm->hook_count && !target; i++) {
+      if (strcmp(pm->hook_list[i]->hook_name, event_name) == 0)
+        target = pm->hook_list[i]->plugin;
+    }
+    if (target && target != p) {
+      if (pthread_mutex_trylock(&target->lock) != 0)
+        return event_loop_yield_for_lock(L, target, 0, call_hook_continue);
+      // Protected, so an error still releases the target's lock (and
+      // leaves the recursion depth as it was) before it propagates
+      int depth = call_stack_depth;
+      int nargs = lua_gettop(L);
+      lua_pushvalue(L, lua_upvalueindex(1));
+      lua_pushvalue(L, lua_upvalueindex(2));
+      lua_pushcclosure(L, run_sync_hook, 2);
+      lua_insert(L, 1);
+      int status = lua_pcall(L, nargs, LUA_MULTRET, 0);
+      event_loop_unlock_plugin(target);
+      if (status != LUA_OK) {
+        call_stack_depth = depth;
+        return lua_error(L);
+      }
+      return lua_gettop(L);
+    }
+  }
+  return run_sync_hook(L);
+}
+
 void json_to_lua_table(lua_State *L, cJSON *item) {
   if (item->type == cJSON_Object) {
     lua_newtable(L);
@@ -392,24 +464,164 @@ void json_to_lua_table(lua_State *L, cJSON *item) {
     lua_pushnil(L);
   }
 }
-void enqueue_job(JobQueue *jq, Job *new_job) {
-  // 1. Lock the queue so no other thread can modify it
-  pthread_mutex_lock(&jq->lock);
+static void free_job(Job *job) {
+  // A caller may be waiting on it
+  if (job->future)
+    job_future_complete(job->future, false,
+                        strdup("the job was dropped before it ran"));
+  free(job->lua_func_name);
+  free(job->payload);
+  free(job->coalesce_key);
+  free(job->merge_func);
+  free(job->batch);
+  free(job->acks);
+  free(job->partition);
+  free(job);
+}
 
-  new_job->next = NULL;
+static uint64_t hash_key(const char *key) {
+  uint64_t h = 1469598103934665603ULL;
+  for (const char *c = key; *c; c++)
+    h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+  return h;
+}
 
-  // 2. Add the job to the end of the linked list
+typedef struct Partition {
+  char *key;
+  Job *head, *tail; // parked jobs, in arrival order
+  struct Partition *next;
+} Partition;
+
+// The partition helpers are called with the queue locked
+static Partition **partition_link(JobQueue *jq, const char *key) {
+  Partition **pp =
+      &jq->partitions[hash_key(key) & (jq->partition_buckets - 1)];
+  while (*pp && strcmp((*pp)->key, key) != 0)
+    pp = &(*pp)->next;
+  return pp;
+}
+
+// Parks the job when another job of its partition is queued or running;
+// otherwise opens the partition for it and returns false
+static bool park_job(JobQueue *jq, Job *job) {
+  Partition **pp = partition_link(jq, job->partition);
+  Partition *part = *pp;
+  if (part == NULL) {
+    part = calloc(1, sizeof(Partition));
+    if (part == NULL || (part->key = strdup(job->partition)) == NULL) {
+      free(part);
+      return false; // runs unordered rather than not at all
+    }
+    *pp = part;
+    return false;
+  }
+  job->next = NULL;
+  if (part->tail)
+    part->tail->next = job;
+  else
+    part->head = job;
+  part->tail = job;
+  jq->parked++;
+  return true;
+}
+
+// Adds to the end of the list, past the partition gate
+static void list_append(JobQueue *jq, Job *new_job) {
+  new_job->ready_ns = metrics_now_ns();
   if (jq->tail == NULL) {
-    // Queue was empty
     jq->head = new_job;
     jq->tail = new_job;
   } else {
-    // Link the old tail to the new job
     jq->tail->next = new_job;
     jq->tail = new_job;
   }
-
   jq->count++;
+}
+
+// Adds to the end of the list, unless the job has to wait for its
+// partition; called with the queue locked
+static void append_job(JobQueue *jq, Job *new_job) {
+  if (new_job->partition && park_job(jq, new_job))
+    return;
+  list_append(jq, new_job);
+}
+
+// A job of the partition finished: the next parked one may run, or the
+// partition closes
+static void partition_done(JobQueue *jq, const char *key) {
+  pthread_mutex_lock(&jq->lock);
+  Partition **pp = partition_link(jq, key);
+  Partition *part = *pp;
+  if (part && part->head) {
+    Job *job = part->head;
+    part->head = job->next;
+    if (part->head == NULL)
+      part->tail = NULL;
+    job->next = NULL;
+    jq->parked--;
+    list_append(jq, job);
+    pthread_cond_signal(&jq->cond);
+  } else if (part) {
+    *pp = part->next;
+    free(part->key);
+    free(part);
+  }
+  pthread_mutex_unlock(&jq->lock);
+}
+
+// Closes every partition; returns their parked jobs as one list
+static Job *unpark_all(JobQueue *jq) {
+  Job *head = NULL, **tail = &head;
+  for (size_t i = 0; i < jq->partition_buckets; i++) {
+    while (jq->partitions[i]) {
+      Partition *part = jq->partitions[i];
+      jq->partitions[i] = part->next;
+      *tail = part->head;
+      if (part->tail)
+        tail = &part->tail->next;
+      free(part->key);
+      free(part);
+    }
+  }
+  jq->parked = 0;
+  return head;
+}
+
+static uint64_t log_job(JobQueue *jq, Job *job, bool spill) {
+  return job_log_append(jq->log, job->plugin->name, job->lua_func_name,
+                        job->payload, job->partition, spill);
+}
+
+// Queues a job and returns its log sequence number (0 when not logged).
+// Never waits for the sync: callers that hold other locks wait after
+// releasing them, see enqueue_job.
+static uint64_t push_job(JobQueue *jq, Job *new_job) {
+  // 1. Lock the queue so no other thread can modify it
+  pthread_mutex_lock(&jq->lock);
+
+  new_job->next = NULL;
+  new_job->enqueued_ns = metrics_now_ns();
+  new_job->seq = 0;
+
+  // Durable mode: log it under the queue lock, so log order is queue
+  // order. Once the list is full, jobs wait in the log (in order) until
+  // the workers have room; the log is then their only copy.
+  if (jq->log && new_job->future == NULL) {
+    bool spill = jq->spilled > 0 || jq->count >= jq->high_water;
+    new_job->seq = log_job(jq, new_job, spill);
+    if (new_job->seq && spill) {
+      uint64_t seq = new_job->seq;
+      jq->spilled++;
+      pthread_cond_signal(&jq->cond);
+      pthread_mutex_unlock(&jq->lock);
+      free_job(new_job);
+      return seq;
+    }
+  }
+  uint64_t seq = new_job->seq;
+
+  // 2. Add the job to the end of the linked list
+  append_job(jq, new_job);
 
   // 3. Signal ONE worker thread that is waiting in pthread_cond_wait
   // This wakes up a worker to process the job
@@ -417,6 +629,193 @@ void enqueue_job(JobQueue *jq, Job *new_job) {
 
   // 4. Unlock
   pthread_mutex_unlock(&jq->lock);
+  return seq;
+}
+
+void enqueue_job(JobQueue *jq, Job *new_job) {
+  // Group commit: concurrent enqueues share one sync
+  uint64_t seq = push_job(jq, new_job);
+  if (seq && jq->wait_sync && !event_loop_on_loop_thread())
+    job_log_wait(jq->log, seq);
+}
+
+static int logged_continue(lua_State *L, int status, lua_KContext ctx) {
+  (void)L;
+  (void)status;
+  return (int)ctx;
+}
+
+// Returns `nret` results to Lua once the log holds `seq`. Only threaded
+// callers block on the sync: a request coroutine yields to its loop until
+// the flusher wakes it, and other code on a loop thread does not wait.
+static int return_when_logged(lua_State *L, JobQueue *jq, uint64_t seq,
+                              int nret) {
+  if (seq == 0 || !jq->wait_sync)
+    return nret;
+  if (event_loop_can_yield(L))
+    return event_loop_yield_log(L, jq->log, seq, nret, logged_continue);
+  if (!event_loop_on_loop_thread())
+    job_log_wait(jq->log, seq);
+  return nret;
+}
+
+static size_t coalesce_slot(JobQueue *jq, const char *key) {
+  return hash_key(key) & (jq->coalesce_buckets - 1);
+}
+
+// The three helpers below are called with the queue locked
+static Job *coalesce_find(JobQueue *jq, const char *key) {
+  Job *job = jq->coalesce[coalesce_slot(jq, key)];
+  while (job && strcmp(job->coalesce_key, key) != 0)
+    job = job->coalesce_next;
+  return job;
+}
+
+static void coalesce_remove(JobQueue *jq, Job *job) {
+  if (job->coalesce_key == NULL)
+    return;
+  Job **pp = &jq->coalesce[coalesce_slot(jq, job->coalesce_key)];
+  while (*pp && *pp != job)
+    pp = &(*pp)->coalesce_next;
+  if (*pp)
+    *pp = job->coalesce_next;
+}
+
+// Folds `job` into `into`, pending under the same key, and frees it.
+// Returns the log record of the new payload, if any.
+static uint64_t coalesce_into(JobQueue *jq, Job *into, Job *job) {
+  uint64_t seq = 0;
+  if (jq->log)
+    seq = log_job(jq, job, false);
+
+  if (into->merge_func) {
+    // Every payload is kept; the worker folds them in order. The extra
+    // byte leaves room for the closing bracket.
+    size_t n = strlen(job->payload);
+    char *batch = realloc(into->batch, into->batch_len + n + 3);
+    uint64_t *acks = seq ? realloc(into->acks, (into->nacks + 1) *
+                                                   sizeof(uint64_t))
+                         : into->acks;
+    if (batch)
+      into->batch = batch;
+    if (acks)
+      into->acks = acks;
+    if (batch == NULL || acks == NULL) {
+      log_write(LOG_ERROR, "server", "out of memory: dropped an event for %s",
+                into->lua_func_name);
+      if (seq)
+        job_log_ack(jq->log, seq);
+    } else {
+      batch[into->batch_len] = into->batch_len ? ',' : '[';
+      memcpy(batch + into->batch_len + 1, job->payload, n + 1);
+      into->batch_len += n + 1;
+      if (seq)
+        into->acks[into->nacks++] = seq;
+    }
+  } else {
+    // Last one wins, in memory and in the log
+    free(into->payload);
+    into->payload = job->payload;
+    job->payload = NULL;
+    if (seq) {
+      if (into->seq)
+        job_log_ack(jq->log, into->seq);
+      into->seq = seq;
+    }
+  }
+  free_job(job);
+  return seq;
+}
+
+// Makes a job that waited out its debounce window available to workers
+static void release_held(JobQueue *jq, Job *job) {
+  pthread_mutex_lock(&jq->lock);
+  job->held = false;
+  append_job(jq, job);
+  pthread_cond_signal(&jq->cond);
+  pthread_mutex_unlock(&jq->lock);
+}
+
+// A held job whose plugin is being destroyed
+static void drop_held(JobQueue *jq, Job *job) {
+  pthread_mutex_lock(&jq->lock);
+  coalesce_remove(jq, job);
+  if (job->seq)
+    job_log_ack(jq->log, job->seq);
+  for (int i = 0; i < job->nacks; i++)
+    job_log_ack(jq->log, job->acks[i]);
+  pthread_mutex_unlock(&jq->lock);
+  free_job(job);
+}
+
+// Queues a keyed job, or folds it into the one still pending for its
+// key. The first job of a key is held for debounce_ms before workers can
+// take it, so the events of that window become one job. Keyed jobs are
+// never spilled: there are at most as many as there are keys. Returns
+// true when the job was folded into a pending one. Like push_job it does
+// not wait for the sync; *seq_out gets the record to wait for (or 0).
+static bool enqueue_keyed(PluginManager *pm, Job *job, uint64_t debounce_ms,
+                          uint64_t *seq_out) {
+  JobQueue *jq = pm->queue;
+  bool hold = false, coalesced = false;
+  uint64_t seq = 0;
+
+  pthread_mutex_lock(&jq->lock);
+  Job *pending = coalesce_find(jq, job->coalesce_key);
+  if (pending) {
+    seq = coalesce_into(jq, pending, job);
+    coalesced = true;
+  } else {
+    job->next = NULL;
+    job->enqueued_ns = metrics_now_ns();
+    if (jq->log)
+      job->seq = seq = log_job(jq, job, false);
+    size_t slot = coalesce_slot(jq, job->coalesce_key);
+    job->coalesce_next = jq->coalesce[slot];
+    jq->coalesce[slot] = job;
+    if (debounce_ms > 0 && pm->timers) {
+      job->held = true;
+      hold = true;
+    } else {
+      append_job(jq, job);
+      pthread_cond_signal(&jq->cond);
+    }
+  }
+  pthread_mutex_unlock(&jq->lock);
+
+  // Outside the queue lock: the timer thread takes its own lock first.
+  // Until the timer fires the job is in no list, so nothing frees it.
+  if (hold && timer_hold_job(pm, job, debounce_ms) == 0)
+    release_held(jq, job);
+  *seq_out = seq;
+  return coalesced;
+}
+
+// A merged job's later payloads as a cJSON array, or NULL
+static cJSON *job_batch(Job *job) {
+  if (job->batch == NULL)
+    return NULL;
+  job->batch[job->batch_len] = ']';
+  job->batch[job->batch_len + 1] = '\0';
+  return cJSON_Parse(job->batch);
+}
+
+// opts.partition of an emit / defer, scoped to the plugin that runs the
+// job (malloc'd), or NULL
+static char *partition_of(lua_State *L, int opts, Plugin *target) {
+  if (!lua_istable(L, opts))
+    return NULL;
+  lua_getfield(L, opts, "partition");
+  char *partition = NULL;
+  if (lua_type(L, -1) == LUA_TSTRING || lua_type(L, -1) == LUA_TNUMBER) {
+    const char *key = lua_tostring(L, -1);
+    size_t n = strlen(target->name) + strlen(key) + 2;
+    partition = malloc(n);
+    if (partition)
+      snprintf(partition, n, "%s\x1f%s", target->name, key);
+  }
+  lua_pop(L, 1);
+  return partition;
 }
 
 int l_trigger_async_event(lua_State *L) {
@@ -426,6 +825,19 @@ int l_trigger_async_event(lua_State *L) {
   const char *event_name = luaL_checkstring(L, 1);
   luaL_checktype(L, 2, LUA_TTABLE);
 
+  // Optional { key = ..., debounce = ms }: pending jobs for the same key
+  // are merged instead of queued again
+  const char *key = NULL;
+  lua_Integer debounce_ms = 0;
+  if (lua_istable(L, 3)) {
+    lua_getfield(L, 3, "key");
+    if (lua_type(L, -1) == LUA_TSTRING || lua_type(L, -1) == LUA_TNUMBER)
+      key = lua_tostring(L, -1); // stays on the stack, so stays valid
+    lua_getfield(L, 3, "debounce");
+    debounce_ms = lua_isinteger(L, -1) ? lua_tointeger(L, -1) : 0;
+    lua_pop(L, 1);
+  }
+
   // 1. Serialize the data ONCE.
   // We do this here so we don't repeat the work for every listener.
   cJSON *json = lua_table_to_json(L, 2);
@@ -433,6 +845,7 @@ int l_trigger_async_event(lua_State *L) {
   cJSON_Delete(json);
 
   int listeners_found = 0;
+  uint64_t last_seq = 0; // the newest log record of these jobs
 
   // 2. Lock the manager to safely scan the hooks
   pthread_mutex_lock(&pm->lock);
@@ -440,27 +853,50 @@ int l_trigger_async_event(lua_State *L) {
   for (int i = 0; i < pm->hook_count; i++) {
     if (strcmp(pm->hook_list[i]->hook_name, event_name) == 0) {
       // 3. Create a NEW job for EVERY plugin listening to this event
-      Job *new_job = malloc(sizeof(Job));
+      Job *new_job = calloc(1, sizeof(Job));
       new_job->plugin = pm->hook_list[i]->plugin;
       new_job->lua_func_name = strdup(pm->hook_list[i]->lua_func_name);
       new_job->payload = strdup(json_payload); // Each job gets its own copy
+      new_job->partition = partition_of(L, 3, new_job->plugin);
       new_job->next = NULL;
 
-      // 4. Push directly to the queue
-      enqueue_job(pm->queue, new_job);
+      // 4. Push directly to the queue, or fold into the pending job
       listeners_found++;
+      uint64_t seq;
+      if (key == NULL) {
+        seq = push_job(pm->queue, new_job);
+        if (seq > last_seq)
+          last_seq = seq;
+        continue;
+      }
+      size_t n = strlen(event_name) + strlen(new_job->plugin->name) +
+                 strlen(key) + 3;
+      new_job->coalesce_key = malloc(n);
+      snprintf(new_job->coalesce_key, n, "%s\x1f%s\x1f%s", event_name,
+               new_job->plugin->name, key);
+      if (pm->hook_list[i]->merge_func_name)
+        new_job->merge_func = strdup(pm->hook_list[i]->merge_func_name);
+      if (enqueue_keyed(pm, new_job,
+                        debounce_ms > 0 ? (uint64_t)debounce_ms : 0, &seq))
+        metrics_count(METRIC_JOBS_COALESCED_TOTAL, event_name, NULL);
+      if (seq > last_seq)
+        last_seq = seq;
     }
   }
 
   pthread_mutex_unlock(&pm->lock);
+  // Event names come from Lua, so only registered hooks get a series
+  metrics_count(METRIC_HOOK_CALLS_TOTAL,
+                listeners_found ? event_name : "other", "async");
 
   // Cleanup the local JSON string
   free(json_payload);
 
   // Return the number of workers notified to Lua (optional but helpful for
-  // debugging)
+  // debugging), after one sync for every listener's job. It is waited for
+  // outside pm->lock so other emits are not held up behind it.
   lua_pushinteger(L, listeners_found);
-  return 1;
+  return return_when_logged(L, pm->queue, last_seq, 1);
 }
 
 JobQueue *job_queue_init() {
@@ -469,6 +905,22 @@ JobQueue *job_queue_init() {
   jq->tail = NULL;
   jq->count = 0;
   jq->shutdown = false;
+  jq->draining = false;
+  jq->running = 0;
+  jq->spilled = 0;
+  jq->coalesce_buckets = 4096;
+  jq->coalesce = calloc(jq->coalesce_buckets, sizeof(Job *));
+  jq->partition_buckets = 4096;
+  jq->partitions = calloc(jq->partition_buckets, sizeof(Partition *));
+  jq->parked = 0;
+
+  // Durable mode
+  const char *dir = getenv("SERVER_JOB_LOG");
+  const char *max = getenv("SERVER_JOB_QUEUE_MAX");
+  const char *sync = getenv("SERVER_JOB_LOG_SYNC");
+  jq->log = dir && *dir ? job_log_open(dir) : NULL;
+  jq->high_water = max && atoi(max) > 0 ? atoi(max) : 10000;
+  jq->wait_sync = sync == NULL || strcmp(sync, "0") != 0;
 
   // Initialize the thread primitives
   pthread_mutex_init(&jq->lock, NULL);
@@ -484,7 +936,7 @@ int l_enqueue_job(lua_State *L) {
   const char *func_name = luaL_checkstring(L, 1);
   luaL_checktype(L, 2, LUA_TTABLE);
 
-  Job *new_job = malloc(sizeof(Job));
+  Job *new_job = calloc(1, sizeof(Job));
   new_job->plugin = p; // Just copy the pointer address
   new_job->lua_func_name = strdup(func_name);
 
@@ -492,29 +944,74 @@ int l_enqueue_job(lua_State *L) {
   cJSON *json = lua_table_to_json(L, 2);
   new_job->payload = cJSON_PrintUnformatted(json);
   cJSON_Delete(json);
+  new_job->partition = partition_of(L, 3, p);
 
-  enqueue_job(pm->queue, new_job);
-  return 0;
+  return return_when_logged(L, pm->queue, push_job(pm->queue, new_job), 0);
 }
 
-Job *job_queue_pop(JobQueue *jq) {
-  pthread_mutex_lock(&jq->lock);
+static Plugin *find_plugin(PluginManager *pm, const char *name) {
+  for (int i = 0; i < pm->plugin_count; i++)
+    if (strcmp(pm->plugin_list[i]->name, name) == 0)
+      return pm->plugin_list[i];
+  return NULL;
+}
+
+static Job *job_from_record(PluginManager *pm, const JobRecord *r) {
+  Plugin *p = find_plugin(pm, r->plugin);
+  if (p == NULL)
+    return NULL;
+  Job *job = calloc(1, sizeof(Job));
+  job->plugin = p;
+  job->lua_func_name = strdup(r->func);
+  job->payload = strdup(r->payload);
+  job->partition = r->partition[0] ? strdup(r->partition) : NULL;
+  job->enqueued_ns = metrics_now_ns();
+  job->seq = r->seq;
+  job->next = NULL;
+  return job;
+}
 
-  // 1. Wait while the queue is empty AND we aren't shutting down
-  // We use a 'while' loop to protect against "spurious wakeups"
-  while (jq->count == 0 && !jq->shutdown) {
-    // This atomically releases the lock and pauses the thread.
-    // It will only wake up when enqueue_job calls pthread_cond_signal.
-    pthread_cond_wait(&jq->cond, &jq->lock);
+typedef struct {
+  PluginManager *pm;
+  uint64_t *orphans; // spilled jobs of plugins that are gone
+  int norphans, cap;
+} Refill;
+
+static void refill_one(void *arg, const JobRecord *r) {
+  Refill *rf = arg;
+  Job *job = job_from_record(rf->pm, r);
+  if (job) {
+    append_job(rf->pm->queue, job);
+    return;
+  }
+  if (rf->norphans == rf->cap) {
+    rf->cap = rf->cap ? rf->cap * 2 : 16;
+    rf->orphans = realloc(rf->orphans, rf->cap * sizeof(uint64_t));
   }
+  rf->orphans[rf->norphans++] = r->seq;
+}
 
-  // 2. If we woke up because of a shutdown, return NULL
-  if (jq->shutdown) {
-    pthread_mutex_unlock(&jq->lock);
-    return NULL;
+// Moves spilled jobs back into the list once it is half empty. Called
+// with the queue locked.
+static void refill_from_log(PluginManager *pm) {
+  JobQueue *jq = pm->queue;
+  if (jq->spilled == 0 || jq->count >= jq->high_water / 2)
+    return;
+  Refill rf = {pm, NULL, 0, 0};
+  int n = job_log_read_spilled(jq->log, jq->high_water - jq->count,
+                               refill_one, &rf);
+  // Nothing read means the log has caught up, whatever the count says
+  jq->spilled = n > 0 && n < jq->spilled ? jq->spilled - n : 0;
+  for (int i = 0; i < rf.norphans; i++) {
+    log_write(LOG_WARN, "server", "dropping spilled job %llu: its plugin is "
+              "gone", (unsigned long long)rf.orphans[i]);
+    job_log_ack(jq->log, rf.orphans[i]);
   }
+  free(rf.orphans);
+}
 
-  // 3. Extract the job from the head of the list
+// Unlinks the first job; called with the queue locked and count > 0
+static Job *take_head(JobQueue *jq) {
   Job *job = jq->head;
   jq->head = job->next;
 
@@ -523,84 +1020,1209 @@ Job *job_queue_pop(JobQueue *jq) {
   }
 
   jq->count--;
+  // From here on, events with its key start a new job
+  coalesce_remove(jq, job);
+  // Only time spent runnable counts: a parked or held job waits for its
+  // partition or debounce window, which more workers would not shorten
+  jq->wait_ns += metrics_now_ns() - job->ready_ns;
+  jq->waited++;
+  return job;
+}
+
+Job *job_queue_pop(PluginManager *pm) {
+  JobQueue *jq = pm->queue;
+  pthread_mutex_lock(&jq->lock);
 
+  for (;;) {
+    // 1. Wait while the queue is empty AND we aren't shutting down
+    // We use a 'while' loop to protect against "spurious wakeups"
+    while (jq->count == 0 && jq->spilled == 0 && !jq->shutdown &&
+           !jq->draining && jq->retire == 0) {
+      // This atomically releases the lock and pauses the thread.
+      // It will only wake up when enqueue_job calls pthread_cond_signal.
+      pthread_cond_wait(&jq->cond, &jq->lock);
+    }
+    if (jq->shutdown)
+      break;
+    if (jq->retire > 0) {
+      // The pool scaler only retires workers while the queue is empty
+      jq->retire--;
+      pthread_mutex_unlock(&jq->lock);
+      return NULL;
+    }
+    refill_from_log(pm);
+    // Spilled jobs whose plugins are gone leave nothing to run yet
+    if (jq->count > 0 || jq->spilled == 0)
+      break;
+  }
+
+  // 2. If we woke up because of a shutdown, or a drain emptied the
+  // queue, return NULL
+  if (jq->shutdown || jq->count == 0) {
+    pthread_mutex_unlock(&jq->lock);
+    return NULL;
+  }
+
+  // 3. Extract the job from the head of the list
+  Job *job = take_head(jq);
   pthread_mutex_unlock(&jq->lock);
   return job;
 }
 
-void *worker_thread(void *arg) {
-  PluginManager *pm = (PluginManager *)arg;
+// job_queue_pop without waiting: NULL when nothing is queued
+static Job *job_queue_try_pop(PluginManager *pm) {
+  JobQueue *jq = pm->queue;
+  pthread_mutex_lock(&jq->lock);
+  Job *job = NULL;
+  if (!jq->shutdown) {
+    refill_from_log(pm);
+    if (jq->count > 0)
+      job = take_head(jq);
+  }
+  pthread_mutex_unlock(&jq->lock);
+  return job;
+}
 
-  while (1) {
-    Job *job = job_queue_pop(pm->queue);
-    if (!job)
-      break; // Shutdown signal
+// With the first payload on top of the stack, folds in the payloads
+// coalesced after it: acc = merge(acc, next) for each, in order
+static bool fold_batch(lua_State *L, Job *job) {
+  cJSON *batch = job_batch(job);
+  if (batch == NULL)
+    return true;
+  int acc = lua_gettop(L);
+  bool ok = true;
+  for (cJSON *item = batch->child; item && ok; item = item->next) {
+    lua_getglobal(L, job->merge_func);
+    lua_pushvalue(L, acc);
+    json_to_lua_table(L, item);
+    if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
+      log_write(LOG_ERROR, job->plugin->name, "Async Error: merge %s: %s",
+                job->merge_func, lua_tostring(L, -1));
+      lua_pop(L, 1);
+      ok = false;
+    } else {
+      lua_replace(L, acc);
+    }
+  }
+  cJSON_Delete(batch);
+  return ok;
+}
+
+// A Lua return value as JSON; functions and other userdata become null
+static cJSON *lua_value_to_json(lua_State *L, int idx) {
+  switch (lua_type(L, idx)) {
+  case LUA_TTABLE:
+    return lua_table_to_json(L, idx);
+  case LUA_TNUMBER:
+    return cJSON_CreateNumber(lua_tonumber(L, idx));
+  case LUA_TSTRING:
+    return cJSON_CreateString(lua_tostring(L, idx));
+  case LUA_TBOOLEAN:
+    return cJSON_CreateBool(lua_toboolean(L, idx));
+  default:
+    return cJSON_CreateNull();
+  }
+}
 
-    // 1. Create a fresh, isolated state for this specific job
-    lua_State *L = luaL_newstate();
+// malloc'd, for job_future_complete
+static char *error_text(const char *fmt, ...) {
+  char text[1024];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(text, sizeof(text), fmt, args);
+  va_end(args);
+  return strdup(text);
+}
 
-    // 2. Setup the environment (Libs, C-functions, and this job's identity)
-    setup_lua_environment(L, job->plugin, pm);
+// Calls a spawned job's function, which is on top of the stack: once
+// with the payload, or once per item of a parallel_map chunk. Completes
+// the future with the return values as JSON, or with the first error.
+static void run_spawned(lua_State *L, Job *job) {
+  int fn = lua_gettop(L);
+  cJSON *payload = cJSON_Parse(job->payload);
+  cJSON *out = NULL;
+  char *error = NULL;
+
+  if (!lua_isfunction(L, fn)) {
+    error = error_text("function '%s' not found in %s", job->lua_func_name,
+                       job->plugin->name);
+  } else if (payload == NULL) {
+    error = error_text("%s: bad payload", job->lua_func_name);
+  } else if (!job->map_items) {
+    json_to_lua_table(L, payload);
+    if (lua_pcall(L, 1, 1, 0) == LUA_OK)
+      out = lua_value_to_json(L, -1);
+    else
+      error = error_text("%s", lua_tostring(L, -1));
+  } else {
+    cJSON *first = cJSON_GetObjectItem(payload, "first");
+    cJSON *items = cJSON_GetObjectItem(payload, "items");
+    int index = first ? first->valueint : 1;
+    out = cJSON_CreateArray();
+    for (cJSON *item = items ? items->child : NULL; item && !error;
+         item = item->next, index++) {
+      lua_pushvalue(L, fn);
+      json_to_lua_table(L, item);
+      if (lua_pcall(L, 1, 1, 0) != LUA_OK)
+        error = error_text("%s (item %d)", lua_tostring(L, -1), index);
+      else
+        cJSON_AddItemToArray(out, lua_value_to_json(L, -1));
+      lua_pop(L, 1);
+    }
+  }
+  lua_settop(L, fn - 1);
+
+  char *result = error ? error : out ? cJSON_PrintUnformatted(out) : NULL;
+  job_future_complete(job->future, error == NULL && result != NULL,
+                      result ? result : strdup("out of memory"));
+  job->future = NULL;
+  cJSON_Delete(out);
+  cJSON_Delete(payload);
+}
 
-    // 3. Load the specific plugin's code
-    // TODO: make dynamic
-    char script_path[1024];
-    snprintf(script_path, sizeof(script_path), "%s/plugin.lua",
-             job->plugin->path);
+static void run_job(PluginManager *pm, Job *job) {
+  uint64_t started_ns = metrics_now_ns();
+  metrics_observe(METRIC_JOB_WAIT_SECONDS, job->plugin->name, NULL,
+                  started_ns - job->enqueued_ns);
+  trace_begin_request();
+  uint64_t span_start = trace_now();
 
-    if (luaL_dofile(L, script_path) == LUA_OK) {
-      // 4. Look up the function and execute
-      lua_getglobal(L, job->lua_func_name);
+  // 1. Create a fresh, isolated state for this specific job
+  lua_State *L = luaL_newstate();
 
-      if (lua_isfunction(L, -1)) {
-        cJSON *json = cJSON_Parse(job->payload);
-        if (json) {
-          json_to_lua_table(L, json);
-          cJSON_Delete(json);
+  // 2. Setup the environment (Libs, C-functions, and this job's identity)
+  setup_lua_environment(L, job->plugin, pm);
 
-          if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
-            fprintf(stderr, "Async Error (Plugin: %s): %s\n", job->plugin->name,
+  // 3. Load the specific plugin's code
+  // TODO: make dynamic
+  char script_path[1024];
+  snprintf(script_path, sizeof(script_path), "%s/plugin.lua",
+           job->plugin->path);
+
+  if (luaL_dofile(L, script_path) == LUA_OK) {
+    // 4. Look up the function and execute
+    lua_getglobal(L, job->lua_func_name);
+
+    if (job->future) {
+      run_spawned(L, job);
+    } else if (lua_isfunction(L, -1)) {
+      cJSON *json = cJSON_Parse(job->payload);
+      if (json) {
+        json_to_lua_table(L, json);
+        cJSON_Delete(json);
+
+        if (!fold_batch(L, job)) {
+          lua_pop(L, 2);
+        } else if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+          log_write(LOG_ERROR, job->plugin->name, "Async Error: %s",
                     lua_tostring(L, -1));
-          }
         }
-      } else {
-        fprintf(stderr, "Async Error: Function '%s' not found in %s\n",
-                job->lua_func_name, job->plugin->name);
       }
     } else {
-      fprintf(stderr, "Async Error: Could not load script %s: %s\n",
+      log_write(LOG_ERROR, job->plugin->name,
+                "Async Error: Function '%s' not found in %s",
+                job->lua_func_name, job->plugin->name);
+    }
+  } else {
+    log_write(LOG_ERROR, job->plugin->name,
+              "Async Error: Could not load script %s: %s",
               script_path, lua_tostring(L, -1));
+    if (job->future) {
+      job_future_complete(job->future, false,
+                          error_text("could not load %s", script_path));
+      job->future = NULL;
     }
+  }
+
+  // 5. Destroy the state completely - memory is fully reclaimed
+  lua_close(L);
+  metrics_observe(METRIC_JOB_RUN_SECONDS, job->plugin->name, NULL,
+                  metrics_now_ns() - started_ns);
+  trace_span("job", job->lua_func_name, span_start);
+
+  // 6. Done, successful or not: it must not run again after a restart
+  if (job->seq)
+    job_log_ack(pm->queue->log, job->seq);
+  for (int i = 0; i < job->nacks; i++)
+    job_log_ack(pm->queue->log, job->acks[i]);
+  if (job->partition)
+    partition_done(pm->queue, job->partition);
+  free_job(job);
+}
+
+// Set on worker threads, for job_await
+static _Thread_local PluginManager *tls_worker_pm = NULL;
+
+enum { SLOT_FREE, SLOT_RUNNING, SLOT_EXITED };
+
+// One possible worker thread; state is guarded by the queue lock
+typedef struct {
+  PluginManager *pm;
+  pthread_t thread;
+  int cpu; // pinned to this CPU, or -1
+  int state;
+} WorkerSlot;
+
+struct WorkerPool {
+  WorkerSlot *slots; // max of them
+  int min, max;
+  bool fixed;        // no scaler thread
+  int *cpus;         // CPUs to pin to, NUMA nodes interleaved
+  int ncpus;
+  int interval_ms;
+  uint64_t up_ns, down_ns; // average queue wait thresholds
+  int busy, idle;    // consecutive samples past each threshold
+  pthread_mutex_t lock;
+  pthread_cond_t cond; // on CLOCK_MONOTONIC
+  pthread_t thread;
+  bool running;
+  bool stop;
+};
+
+void *worker_thread(void *arg) {
+  WorkerSlot *slot = arg;
+  PluginManager *pm = slot->pm;
+  tls_worker_pm = pm;
+  if (slot->cpu >= 0) {
+    // Every job builds its Lua state on this thread, so with the thread
+    // pinned the kernel's first-touch policy keeps that memory on the
+    // CPU's own NUMA node
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(slot->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+
+  while (1) {
+    Job *job = job_queue_pop(pm);
+    if (!job)
+      break; // Shutdown signal, or retired by the scaler
+    run_job(pm, job);
+  }
+
+  pthread_mutex_lock(&pm->queue->lock);
+  pm->queue->running--;
+  pm->num_workers--;
+  slot->state = SLOT_EXITED; // the scaler or pool_join joins it
+  pthread_cond_broadcast(&pm->queue->cond); // job_queue_drain waits on it
+  pthread_mutex_unlock(&pm->queue->lock);
+  return NULL;
+}
+
+void job_await(JobFuture *f) {
+  if (tls_worker_pm == NULL) {
+    job_future_wait(f);
+    return;
+  }
+  // A job that waits keeps its worker busy; if every worker waited, no
+  // one would be left to run what they wait for. So it runs queued jobs
+  // itself until its own is done.
+  while (!job_future_done(f)) {
+    Job *job = job_queue_try_pop(tls_worker_pm);
+    if (job)
+      run_job(tls_worker_pm, job);
+    else
+      job_future_wait_for(f, 1);
+  }
+}
+
+// Handle returned by app.spawn, and for each parallel_map chunk
+typedef struct {
+  JobFuture *f;
+} JobHandle;
+
+#define JOB_HANDLE_MT "host.JobHandle"
+
+static int job_await_continue(lua_State *L, int status, lua_KContext ctx) {
+  (void)status;
+  (void)ctx;
+  JobHandle *h = (JobHandle *)luaL_checkudata(L, 1, JOB_HANDLE_MT);
+  // The job's error becomes the caller's
+  if (!h->f->ok)
+    return luaL_error(L, "%s", h->f->result);
+  cJSON *json = cJSON_Parse(h->f->result);
+  if (json == NULL)
+    return luaL_error(L, "spawned job returned malformed JSON");
+  json_to_lua_table(L, json);
+  cJSON_Delete(json);
+  return 1;
+}
+
+// result = handle:await(); raises what the job raised
+static int l_job_await(lua_State *L) {
+  JobHandle *h = (JobHandle *)luaL_checkudata(L, 1, JOB_HANDLE_MT);
+  if (event_loop_can_yield(L) && !job_future_done(h->f))
+    return event_loop_yield_job(L, h->f, 0, job_await_continue);
+  job_await(h->f);
+  return job_await_continue(L, LUA_OK, 0);
+}
+
+// handle:done() -> true once await() would not wait
+static int l_job_done(lua_State *L) {
+  JobHandle *h = (JobHandle *)luaL_checkudata(L, 1, JOB_HANDLE_MT);
+  lua_pushboolean(L, job_future_done(h->f));
+  return 1;
+}
+
+static int l_job_handle_gc(lua_State *L) {
+  JobHandle *h = (JobHandle *)luaL_checkudata(L, 1, JOB_HANDLE_MT);
+  job_future_release(h->f); // the job still runs
+  h->f = NULL;
+  return 0;
+}
 
-    // 5. Destroy the state completely - memory is fully reclaimed
-    lua_close(L);
+// Creates the handle metatable on first use and leaves it on the stack
+static void push_job_handle_metatable(lua_State *L) {
+  if (!luaL_newmetatable(L, JOB_HANDLE_MT))
+    return;
+  static const luaL_Reg methods[] = {
+      {"await", l_job_await}, {"done", l_job_done}, {NULL, NULL}};
+  luaL_newlib(L, methods);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, l_job_handle_gc);
+  lua_setfield(L, -2, "__gc");
+}
 
-    // 6. Cleanup Job
-    free(job->lua_func_name);
-    free(job->payload);
+// Queues func(payload) for the worker pool and pushes its handle. Takes
+// ownership of payload.
+static int spawn_job(lua_State *L, const char *func, char *payload,
+                     bool map_items) {
+  Plugin *p = (Plugin *)lua_touserdata(L, lua_upvalueindex(1));
+  PluginManager *pm = (PluginManager *)lua_touserdata(L, lua_upvalueindex(2));
+  JobHandle *h = (JobHandle *)lua_newuserdatauv(L, sizeof(JobHandle), 0);
+  h->f = NULL;
+  push_job_handle_metatable(L);
+  lua_setmetatable(L, -2);
+
+  Job *job = calloc(1, sizeof(Job));
+  JobFuture *f = job_future_create();
+  if (job)
+    job->lua_func_name = strdup(func);
+  if (job == NULL || f == NULL || payload == NULL ||
+      job->lua_func_name == NULL) {
+    if (job)
+      free(job->lua_func_name);
     free(job);
+    free(payload);
+    job_future_release(f);
+    job_future_release(f);
+    return luaL_error(L, "could not spawn %s", func);
+  }
+  job->plugin = p;
+  job->payload = payload;
+  job->future = f;
+  job->map_items = map_items;
+  h->f = f;
+  enqueue_job(pm->queue, job);
+  return 1;
+}
+
+// local h = app.spawn("func", data); local result = h:await()
+int l_spawn(lua_State *L) {
+  const char *func_name = luaL_checkstring(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  cJSON *json = lua_table_to_json(L, 2);
+  char *payload = cJSON_PrintUnformatted(json);
+  cJSON_Delete(json);
+  return spawn_job(L, func_name, payload, false);
+}
+
+// One parallel_map chunk: c_spawn_map("func", items, index of items[1])
+int l_spawn_map(lua_State *L) {
+  const char *func_name = luaL_checkstring(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_Integer first = luaL_optinteger(L, 3, 1);
+  cJSON *json = cJSON_CreateObject();
+  cJSON_AddNumberToObject(json, "first", (double)first);
+  cJSON_AddItemToObject(json, "items", lua_table_to_json(L, 2));
+  char *payload = cJSON_PrintUnformatted(json);
+  cJSON_Delete(json);
+  return spawn_job(L, func_name, payload, true);
+}
+
+int l_job_workers(lua_State *L) {
+  PluginManager *pm = (PluginManager *)lua_touserdata(L, lua_upvalueindex(2));
+  lua_pushinteger(L, pm->num_workers > 0 ? pm->num_workers : 1);
+  return 1;
+}
+
+// --- Worker pool ------------------------------------------------------------
+// Without a fixed size the pool starts at cpu_budget() workers and a
+// scaler thread samples the queue every SERVER_JOB_SCALE_INTERVAL_MS. Jobs
+// waiting longer than SERVER_JOB_SCALE_UP_MS on average for two samples
+// in a row add a quarter more workers; an empty queue with waits under
+// SERVER_JOB_SCALE_DOWN_MS for ten samples retires one. The gap between
+// the two keeps it from flapping.
+
+static int pool_env(const char *name, int fallback) {
+  const char *v = getenv(name);
+  return v && atoi(v) > 0 ? atoi(v) : fallback;
+}
+
+// Starts up to n workers in free slots; called with the queue locked
+static int pool_spawn(PluginManager *pm, int n) {
+  WorkerPool *pool = pm->pool;
+  int started = 0;
+  for (int i = 0; i < pool->max && started < n; i++) {
+    WorkerSlot *slot = &pool->slots[i];
+    if (slot->state != SLOT_FREE)
+      continue;
+    slot->pm = pm;
+    slot->cpu = pool->ncpus > 0 ? pool->cpus[i % pool->ncpus] : -1;
+    if (pthread_create(&slot->thread, NULL, worker_thread, slot) != 0)
+      break;
+    slot->state = SLOT_RUNNING;
+    pm->queue->running++;
+    pm->num_workers++;
+    started++;
+  }
+  return started;
+}
+
+// Joins the workers that retired; called with the queue locked
+static void pool_reap(WorkerPool *pool) {
+  for (int i = 0; i < pool->max; i++) {
+    if (pool->slots[i].state == SLOT_EXITED) {
+      pthread_join(pool->slots[i].thread, NULL); // it has already returned
+      pool->slots[i].state = SLOT_FREE;
+    }
+  }
+}
+
+static void pool_sample(PluginManager *pm) {
+  WorkerPool *pool = pm->pool;
+  JobQueue *jq = pm->queue;
+  pthread_mutex_lock(&jq->lock);
+  pool_reap(pool);
+  if (jq->draining || jq->shutdown) {
+    pthread_mutex_unlock(&jq->lock);
+    return;
   }
+  uint64_t avg = jq->waited ? jq->wait_ns / jq->waited : 0;
+  int depth = jq->count + jq->spilled;
+  // Nothing taken while jobs queue up: every worker is stuck in a long job
+  bool busy = avg >= pool->up_ns || (jq->waited == 0 && depth > 0);
+  bool idle = depth == 0 && avg < pool->down_ns;
+  jq->wait_ns = 0;
+  jq->waited = 0;
+
+  pool->busy = busy ? pool->busy + 1 : 0;
+  pool->idle = idle ? pool->idle + 1 : 0;
+  int workers = pm->num_workers - jq->retire;
+  if (pool->busy >= 2 && workers < pool->max) {
+    int add = workers / 4 > 1 ? workers / 4 : 1;
+    if (add > pool->max - workers)
+      add = pool->max - workers;
+    add = pool_spawn(pm, add);
+    pool->busy = 0;
+    if (add > 0)
+      log_write(LOG_INFO, "server", "job queue wait %llu ms: %d workers",
+                (unsigned long long)(avg / 1000000), workers + add);
+  } else if (pool->idle >= 10 && workers > pool->min) {
+    jq->retire++;
+    pthread_cond_broadcast(&jq->cond); // an idle worker takes it
+    pool->idle = 0;
+  }
+  pthread_mutex_unlock(&jq->lock);
+}
 
+static void *pool_thread(void *arg) {
+  PluginManager *pm = arg;
+  WorkerPool *pool = pm->pool;
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->stop) {
+    struct timespec at;
+    clock_gettime(CLOCK_MONOTONIC, &at);
+    at.tv_sec += pool->interval_ms / 1000;
+    at.tv_nsec += (long)(pool->interval_ms % 1000) * 1000000;
+    if (at.tv_nsec >= 1000000000) {
+      at.tv_sec++;
+      at.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&pool->cond, &pool->lock, &at);
+    if (pool->stop)
+      break;
+    pthread_mutex_unlock(&pool->lock);
+    pool_sample(pm);
+    pthread_mutex_lock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
   return NULL;
 }
 
 void start_worker_pool(PluginManager *pm, int num_workers) {
-  pm->worker_threads = malloc(sizeof(pthread_t) * num_workers);
-  pm->num_workers = num_workers;
+  WorkerPool *pool = calloc(1, sizeof(WorkerPool));
+  if (pool == NULL)
+    return;
+  int cpus = cpu_budget();
+  int fixed = num_workers > 0 ? num_workers : pool_env("SERVER_JOB_WORKERS", 0);
+  pool->fixed = fixed > 0;
+  pool->min = pool->fixed ? fixed : pool_env("SERVER_JOB_WORKERS_MIN", 1);
+  pool->max = pool->fixed ? fixed : pool_env("SERVER_JOB_WORKERS_MAX", cpus * 4);
+  if (pool->max < pool->min)
+    pool->max = pool->min;
+  pool->interval_ms = pool_env("SERVER_JOB_SCALE_INTERVAL_MS", 1000);
+  pool->up_ns = (uint64_t)pool_env("SERVER_JOB_SCALE_UP_MS", 100) * 1000000;
+  pool->down_ns = (uint64_t)pool_env("SERVER_JOB_SCALE_DOWN_MS", 10) * 1000000;
+  pool->slots = calloc(pool->max, sizeof(WorkerSlot));
+  if (pool->slots == NULL) {
+    free(pool);
+    return;
+  }
+  const char *affinity = getenv("SERVER_JOB_AFFINITY");
+  if (affinity && atoi(affinity) == 1)
+    pool->ncpus = cpu_list(&pool->cpus);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&pool->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&pool->lock, NULL);
+  pm->pool = pool;
+
+  int initial = pool->fixed ? fixed : cpus;
+  if (initial < pool->min)
+    initial = pool->min;
+  if (initial > pool->max)
+    initial = pool->max;
+  pthread_mutex_lock(&pm->queue->lock);
+  pool_spawn(pm, initial);
+  pthread_mutex_unlock(&pm->queue->lock);
+  if (!pool->fixed)
+    pool->running = pthread_create(&pool->thread, NULL, pool_thread, pm) == 0;
+  log_write(LOG_INFO, "server", "%d job workers (%d-%d)%s", initial,
+            pool->min, pool->max, pool->ncpus > 0 ? ", pinned" : "");
+  timers_start(pm);
+}
+
+// The pool keeps its current size after this returns
+static void pool_stop(PluginManager *pm) {
+  WorkerPool *pool = pm->pool;
+  if (pool == NULL || !pool->running)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = true;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  pthread_join(pool->thread, NULL);
+  pool->running = false;
+}
 
-  for (int i = 0; i < num_workers; i++) {
-    pthread_create(&pm->worker_threads[i], NULL, worker_thread, pm);
+// Waits for every worker once shutdown is set, then frees the pool
+static void pool_join(PluginManager *pm) {
+  WorkerPool *pool = pm->pool;
+  if (pool == NULL)
+    return;
+  pool_stop(pm);
+  for (int i = 0; i < pool->max; i++) {
+    if (pool->slots[i].state != SLOT_FREE)
+      pthread_join(pool->slots[i].thread, NULL);
   }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->cond);
+  free(pool->slots);
+  free(pool->cpus);
+  free(pool);
+  pm->pool = NULL;
 }
 
 void job_queue_shutdown(PluginManager *pm) {
+  pool_stop(pm);
   pthread_mutex_lock(&pm->queue->lock);
   pm->queue->shutdown = true;
   // Wake up everyone so they see the shutdown flag
   pthread_cond_broadcast(&pm->queue->cond);
   pthread_mutex_unlock(&pm->queue->lock);
 
-  for (int i = 0; i < pm->num_workers; i++) {
-    pthread_join(pm->worker_threads[i], NULL);
+  pool_join(pm);
+}
+
+static const char *spool_path(void) {
+  const char *path = getenv("SERVER_JOB_SPOOL");
+  return path ? path : "jobs.spool";
+}
+
+// One JSON line per job; the lock keeps lines from other worker
+// processes (and job_queue_restore) from interleaving
+static int spool_jobs(Job *head) {
+  bool any = false;
+  for (Job *job = head; job && !any; job = job->next)
+    any = job->seq == 0 && job->future == NULL;
+  if (!any)
+    return 0;
+  int fd = open(spool_path(), O_WRONLY | O_APPEND | O_CREAT, 0600);
+  if (fd < 0) {
+    log_write(LOG_ERROR, "server", "job spool %s: %s", spool_path(),
+              strerror(errno));
+    return 0;
+  }
+  flock(fd, LOCK_EX);
+  FILE *f = fdopen(fd, "a");
+  int n = 0;
+  for (Job *job = head; job; job = job->next) {
+    if (job->seq || job->future)
+      continue; // the job log still has it, or its caller is gone
+    cJSON *line = cJSON_CreateObject();
+    cJSON_AddStringToObject(line, "plugin", job->plugin->name);
+    cJSON_AddStringToObject(line, "func", job->lua_func_name);
+    cJSON_AddStringToObject(line, "payload", job->payload ? job->payload : "");
+    if (job->partition)
+      cJSON_AddStringToObject(line, "partition", job->partition);
+    char *text = cJSON_PrintUnformatted(line);
+    if (text && fprintf(f, "%s\n", text) > 0)
+      n++;
+    free(text);
+    // Coalesced payloads come back as separate jobs
+    cJSON *batch = job_batch(job);
+    for (cJSON *item = batch ? batch->child : NULL; item; item = item->next) {
+      char *payload = cJSON_PrintUnformatted(item);
+      cJSON_ReplaceItemInObject(line, "payload", cJSON_CreateString(payload));
+      text = cJSON_PrintUnformatted(line);
+      if (text && fprintf(f, "%s\n", text) > 0)
+        n++;
+      free(text);
+      free(payload);
+    }
+    cJSON_Delete(batch);
+    cJSON_Delete(line);
+  }
+  fflush(f);
+  flock(fd, LOCK_UN);
+  fclose(f);
+  return n;
+}
+
+bool job_queue_drain(PluginManager *pm) {
+  JobQueue *jq = pm->queue;
+  const char *v = getenv("SERVER_JOB_DRAIN_MS");
+  int timeout_ms = v && atoi(v) >= 0 ? atoi(v) : 10000;
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  // 1. No timer fires and no worker starts from here on; workers keep
+  // popping until the queue is empty, then exit
+  timers_stop(pm);
+  pool_stop(pm);
+  pthread_mutex_lock(&jq->lock);
+  log_write(LOG_INFO, "server", "finishing %d queued jobs (up to %d ms)",
+            jq->count + jq->spilled, timeout_ms);
+  jq->draining = true;
+  pthread_cond_broadcast(&jq->cond);
+  while (jq->running > 0) {
+    if (pthread_cond_timedwait(&jq->cond, &jq->lock, &deadline) == ETIMEDOUT)
+      break;
+  }
+
+  // 2. Out of time: stop taking jobs and keep the rest for the next start
+  jq->shutdown = true;
+  pthread_cond_broadcast(&jq->cond);
+  Job *left = jq->head;
+  Job *parked = unpark_all(jq); // after the queued ones, still in order
+  if (jq->tail)
+    jq->tail->next = parked;
+  else
+    left = parked;
+  jq->head = jq->tail = NULL;
+  jq->count = 0;
+  memset(jq->coalesce, 0, jq->coalesce_buckets * sizeof(Job *));
+  bool idle = jq->running == 0;
+  pthread_mutex_unlock(&jq->lock);
+
+  int spooled = spool_jobs(left);
+  if (spooled > 0)
+    log_write(LOG_WARN, "server", "spooled %d unfinished jobs to %s", spooled,
+              spool_path());
+  while (left) {
+    Job *next = left->next;
+    free_job(left);
+    left = next;
+  }
+  if (!idle)
+    log_write(LOG_WARN, "server", "a background job is still running");
+  return idle;
+}
+
+static void replay_one(void *arg, const JobRecord *r) {
+  PluginManager *pm = arg;
+  Job *job = job_from_record(pm, r);
+  if (job)
+    push_job(pm->queue, job); // job_log_replay_orphans syncs once
+  else
+    log_write(LOG_WARN, "server", "dropping job %s for unknown plugin %s",
+              r->func, r->plugin);
+}
+
+void job_queue_restore(PluginManager *pm) {
+  if (pm->queue->log)
+    job_log_replay_orphans(pm->queue->log, replay_one, pm);
+
+  int fd = open(spool_path(), O_RDWR);
+  if (fd < 0)
+    return;
+  flock(fd, LOCK_EX);
+  FILE *f = fdopen(fd, "r");
+  char *line = NULL;
+  size_t cap = 0;
+  int restored = 0, dropped = 0;
+  while (getline(&line, &cap, f) > 0) {
+    cJSON *json = cJSON_Parse(line);
+    cJSON *plugin = cJSON_GetObjectItem(json, "plugin");
+    cJSON *func = cJSON_GetObjectItem(json, "func");
+    cJSON *payload = cJSON_GetObjectItem(json, "payload");
+    cJSON *partition = cJSON_GetObjectItem(json, "partition");
+    Plugin *p = NULL;
+    for (int i = 0; plugin && plugin->valuestring && i < pm->plugin_count; i++)
+      if (strcmp(pm->plugin_list[i]->name, plugin->valuestring) == 0)
+        p = pm->plugin_list[i];
+
+    if (p && func && func->valuestring && payload && payload->valuestring) {
+      Job *job = calloc(1, sizeof(Job));
+      job->plugin = p;
+      job->lua_func_name = strdup(func->valuestring);
+      job->payload = strdup(payload->valuestring);
+      if (partition && partition->valuestring)
+        job->partition = strdup(partition->valuestring);
+      enqueue_job(pm->queue, job);
+      restored++;
+    } else {
+      dropped++;
+    }
+    cJSON_Delete(json);
+  }
+  free(line);
+  // Claimed: other processes must not run these again
+  if (ftruncate(fd, 0) != 0)
+    log_write(LOG_ERROR, "server", "job spool %s: %s", spool_path(),
+              strerror(errno));
+  flock(fd, LOCK_UN);
+  fclose(f);
+
+  if (restored || dropped)
+    log_write(LOG_INFO, "server",
+              "restored %d spooled jobs (%d for unknown plugins dropped)",
+              restored, dropped);
+}
+
+// --- Timers ---------------------------------------------------------------
+// app.defer_in / app.every. Timers sit on a hierarchical wheel ticking
+// every SERVER_TIMER_TICK_MS (default 10); a timer that fires becomes an
+// ordinary job for the worker pool. Timers live in memory only: periodic
+// ones are set up again when plugin.lua loads.
+
+typedef struct PluginTimer {
+  WheelEntry entry;  // first member: the wheel hands this back
+  uint64_t id;
+  uint64_t interval; // in ticks, 0 for a one-shot timer
+  Plugin *plugin;
+  char *func;
+  char *payload;
+  Job *held;         // a debounced job to release instead, see enqueue_keyed
+  struct PluginTimer *id_next;   // chain in by_id
+  struct PluginTimer *func_next; // chain in by_func (periodic timers only)
+} PluginTimer;
+
+struct TimerService {
+  PluginManager *pm;
+  TimerWheel wheel;
+  uint64_t tick_ms;
+  uint64_t next_id;
+  size_t count;
+  // Both tables have `buckets` chains, a power of two grown with count
+  PluginTimer **by_id;
+  PluginTimer **by_func;
+  size_t buckets;
+  pthread_mutex_t lock;
+  pthread_cond_t cond; // on CLOCK_MONOTONIC
+  pthread_t thread;
+  bool running;
+  bool stop;
+};
+
+static uint64_t timer_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t current_tick(TimerService *ts) {
+  return timer_now_ms() / ts->tick_ms;
+}
+
+static size_t func_slot(TimerService *ts, Plugin *p, const char *func) {
+  uint64_t h = 1469598103934665603ULL ^ (uintptr_t)p;
+  for (const char *c = func; *c; c++)
+    h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+  return (size_t)h & (ts->buckets - 1);
+}
+
+static void link_timer(TimerService *ts, PluginTimer *t) {
+  size_t i = (size_t)t->id & (ts->buckets - 1);
+  t->id_next = ts->by_id[i];
+  ts->by_id[i] = t;
+  if (t->interval) {
+    size_t f = func_slot(ts, t->plugin, t->func);
+    t->func_next = ts->by_func[f];
+    ts->by_func[f] = t;
+  }
+}
+
+static void unlink_timer(TimerService *ts, PluginTimer *t) {
+  PluginTimer **pp = &ts->by_id[(size_t)t->id & (ts->buckets - 1)];
+  while (*pp != t)
+    pp = &(*pp)->id_next;
+  *pp = t->id_next;
+  if (t->interval) {
+    pp = &ts->by_func[func_slot(ts, t->plugin, t->func)];
+    while (*pp != t)
+      pp = &(*pp)->func_next;
+    *pp = t->func_next;
+  }
+}
+
+static void free_timer(TimerService *ts, PluginTimer *t) {
+  wheel_remove(&ts->wheel, &t->entry);
+  unlink_timer(ts, t);
+  ts->count--;
+  free(t->func);
+  free(t->payload);
+  free(t);
+}
+
+// Keeps chains short as timers pile up; ids are sequential, so the id
+// table spreads evenly
+static void grow_tables(TimerService *ts) {
+  size_t old = ts->buckets;
+  PluginTimer **by_id = calloc(old * 2, sizeof(PluginTimer *));
+  PluginTimer **by_func = calloc(old * 2, sizeof(PluginTimer *));
+  if (by_id == NULL || by_func == NULL) {
+    free(by_id);
+    free(by_func);
+    return; // longer chains, still correct
+  }
+  PluginTimer **old_id = ts->by_id;
+  free(ts->by_func);
+  ts->by_id = by_id;
+  ts->by_func = by_func;
+  ts->buckets = old * 2;
+  for (size_t i = 0; i < old; i++) {
+    PluginTimer *t = old_id[i];
+    while (t) {
+      PluginTimer *next = t->id_next;
+      link_timer(ts, t);
+      t = next;
+    }
+  }
+  free(old_id);
+}
+
+// Called by the wheel, with ts->lock held
+static void fire_timer(WheelEntry *e, void *arg) {
+  TimerService *ts = arg;
+  PluginTimer *t = (PluginTimer *)e;
+  if (t->held) {
+    release_held(ts->pm->queue, t->held);
+    free_timer(ts, t);
+    return;
+  }
+
+  Job *job = calloc(1, sizeof(Job));
+  job->plugin = t->plugin;
+  job->lua_func_name = strdup(t->func);
+  job->payload = strdup(t->payload);
+  push_job(ts->pm->queue, job);
+
+  if (t->interval == 0) {
+    free_timer(ts, t);
+    return;
+  }
+  // Ticks missed while the process was stalled are skipped, not fired
+  // in a burst
+  t->entry.expires += t->interval;
+  if (t->entry.expires <= ts->wheel.now)
+    t->entry.expires = ts->wheel.now + t->interval;
+  wheel_add(&ts->wheel, &t->entry);
+}
+
+static void *timer_thread(void *arg) {
+  TimerService *ts = arg;
+  pthread_mutex_lock(&ts->lock);
+  while (!ts->stop) {
+    wheel_advance(&ts->wheel, current_tick(ts), fire_timer, ts);
+    if (ts->wheel.count == 0) {
+      pthread_cond_wait(&ts->cond, &ts->lock); // timer_schedule signals
+      continue;
+    }
+    // Sleep until the next tick starts
+    uint64_t at_ms = (ts->wheel.now + 1) * ts->tick_ms;
+    struct timespec at = {(time_t)(at_ms / 1000),
+                          (long)(at_ms % 1000) * 1000000};
+    pthread_cond_timedwait(&ts->cond, &ts->lock, &at);
+  }
+  pthread_mutex_unlock(&ts->lock);
+  return NULL;
+}
+
+static TimerService *timers_create(PluginManager *pm) {
+  TimerService *ts = calloc(1, sizeof(TimerService));
+  if (ts == NULL)
+    return NULL;
+  ts->buckets = 1024;
+  ts->by_id = calloc(ts->buckets, sizeof(PluginTimer *));
+  ts->by_func = calloc(ts->buckets, sizeof(PluginTimer *));
+  if (ts->by_id == NULL || ts->by_func == NULL) {
+    free(ts->by_id);
+    free(ts->by_func);
+    free(ts);
+    return NULL;
+  }
+  const char *tick = getenv("SERVER_TIMER_TICK_MS");
+  ts->pm = pm;
+  ts->tick_ms = tick && atoi(tick) > 0 ? (uint64_t)atoi(tick) : 10;
+  ts->next_id = 1;
+  wheel_init(&ts->wheel, current_tick(ts));
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&ts->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&ts->lock, NULL);
+  return ts;
+}
+
+static void timers_start(PluginManager *pm) {
+  TimerService *ts = pm->timers;
+  if (ts && !ts->running)
+    ts->running = pthread_create(&ts->thread, NULL, timer_thread, ts) == 0;
+}
+
+// Nothing fires after this returns; pending timers are kept until
+// timers_destroy
+static void timers_stop(PluginManager *pm) {
+  TimerService *ts = pm->timers;
+  if (ts == NULL)
+    return;
+  if (ts->running) {
+    pthread_mutex_lock(&ts->lock);
+    ts->stop = true;
+    pthread_cond_signal(&ts->cond);
+    pthread_mutex_unlock(&ts->lock);
+    pthread_join(ts->thread, NULL);
+    ts->running = false;
+  }
+
+  // Debounced jobs do not wait for the rest of their window
+  pthread_mutex_lock(&ts->lock);
+  for (size_t i = 0; i < ts->buckets; i++) {
+    PluginTimer *t = ts->by_id[i];
+    while (t) {
+      PluginTimer *next = t->id_next;
+      if (t->held) {
+        release_held(pm->queue, t->held);
+        free_timer(ts, t);
+      }
+      t = next;
+    }
+  }
+  pthread_mutex_unlock(&ts->lock);
+}
+
+static void timers_destroy(PluginManager *pm) {
+  TimerService *ts = pm->timers;
+  if (ts == NULL)
+    return;
+  timers_stop(pm);
+  for (size_t i = 0; i < ts->buckets; i++) {
+    while (ts->by_id[i])
+      free_timer(ts, ts->by_id[i]);
+  }
+  free(ts->by_id);
+  free(ts->by_func);
+  pthread_mutex_destroy(&ts->lock);
+  pthread_cond_destroy(&ts->cond);
+  free(ts);
+  pm->timers = NULL;
+}
+
+// Drops every timer of a plugin about to be destroyed
+static void timers_cancel_plugin(PluginManager *pm, Plugin *p) {
+  TimerService *ts = pm->timers;
+  if (ts == NULL)
+    return;
+  pthread_mutex_lock(&ts->lock);
+  for (size_t i = 0; i < ts->buckets; i++) {
+    PluginTimer *t = ts->by_id[i];
+    while (t) {
+      PluginTimer *next = t->id_next;
+      if (t->plugin == p && t->held)
+        drop_held(pm->queue, t->held);
+      if (t->plugin == p)
+        free_timer(ts, t);
+      t = next;
+    }
+  }
+  pthread_mutex_unlock(&ts->lock);
+}
+
+uint64_t timer_schedule(PluginManager *pm, Plugin *p, const char *func,
+                        const char *payload, uint64_t delay_ms,
+                        uint64_t interval_ms) {
+  TimerService *ts = pm->timers;
+  if (ts == NULL)
+    return 0;
+  // Never early: round up to whole ticks
+  uint64_t delay = (delay_ms + ts->tick_ms - 1) / ts->tick_ms;
+  uint64_t interval = (interval_ms + ts->tick_ms - 1) / ts->tick_ms;
+
+  pthread_mutex_lock(&ts->lock);
+  // 1. Bring the wheel up to date so the delay counts from now
+  wheel_advance(&ts->wheel, current_tick(ts), fire_timer, ts);
+
+  // 2. A periodic timer replaces the one already set for this function:
+  // plugin.lua runs again for every background job
+  PluginTimer *t = NULL;
+  if (interval) {
+    t = ts->by_func[func_slot(ts, p, func)];
+    while (t && (t->plugin != p || strcmp(t->func, func) != 0))
+      t = t->func_next;
+  }
+  if (t) {
+    char *copy = strdup(payload);
+    if (copy) {
+      free(t->payload);
+      t->payload = copy;
+    }
+    // Same interval: keep its place on the wheel. Re-arming it at now +
+    // delay on every job would keep pushing it back, and a plugin with
+    // steady job traffic would never see it fire.
+    if (t->interval == interval) {
+      uint64_t id = t->id;
+      pthread_mutex_unlock(&ts->lock);
+      return id;
+    }
+    t->interval = interval;
+    wheel_remove(&ts->wheel, &t->entry);
+  } else {
+    t = calloc(1, sizeof(PluginTimer));
+    if (t)
+      t->func = strdup(func);
+    if (t)
+      t->payload = strdup(payload);
+    if (t == NULL || t->func == NULL || t->payload == NULL) {
+      if (t) {
+        free(t->func);
+        free(t->payload);
+      }
+      free(t);
+      pthread_mutex_unlock(&ts->lock);
+      return 0;
+    }
+    t->id = ts->next_id++;
+    t->plugin = p;
+    t->interval = interval;
+    link_timer(ts, t);
+    if (++ts->count > ts->buckets)
+      grow_tables(ts);
   }
-}
\ No newline at end of file
+
+  // 3. Onto the wheel; wake the thread in case it was idle
+  t->entry.expires = ts->wheel.now + delay;
+  wheel_add(&ts->wheel, &t->entry);
+  uint64_t id = t->id;
+  pthread_cond_signal(&ts->cond);
+  pthread_mutex_unlock(&ts->lock);
+  return id;
+}
+
+// Releases a keyed job into the queue after delay_ms
+static uint64_t timer_hold_job(PluginManager *pm, Job *job,
+                               uint64_t delay_ms) {
+  TimerService *ts = pm->timers;
+  PluginTimer *t = calloc(1, sizeof(PluginTimer));
+  if (t == NULL)
+    return 0;
+  t->held = job;
+  t->plugin = job->plugin;
+  pthread_mutex_lock(&ts->lock);
+  wheel_advance(&ts->wheel, current_tick(ts), fire_timer, ts);
+  t->id = ts->next_id++;
+  link_timer(ts, t);
+  if (++ts->count > ts->buckets)
+    grow_tables(ts);
+  t->entry.expires = ts->wheel.now + (delay_ms + ts->tick_ms - 1) / ts->tick_ms;
+  wheel_add(&ts->wheel, &t->entry);
+  uint64_t id = t->id;
+  pthread_cond_signal(&ts->cond);
+  pthread_mutex_unlock(&ts->lock);
+  return id;
+}
+
+bool timer_cancel(PluginManager *pm, Plugin *p, uint64_t id) {
+  TimerService *ts = pm->timers;
+  if (ts == NULL)
+    return false;
+  pthread_mutex_lock(&ts->lock);
+  PluginTimer *t = ts->by_id[(size_t)id & (ts->buckets - 1)];
+  while (t && t->id != id)
+    t = t->id_next;
+  // A plugin only cancels its own timers, and not the debounce windows
+  bool found = t && t->plugin == p && t->held == NULL;
+  if (found)
+    free_timer(ts, t);
+  pthread_mutex_unlock(&ts->lock);
+  return found;
+}
+
+size_t timer_count(PluginManager *pm) {
+  TimerService *ts = pm->timers;
+  if (ts == NULL)
+    return 0;
+  pthread_mutex_lock(&ts->lock);
+  size_t n = ts->count;
+  pthread_mutex_unlock(&ts->lock);
+  return n;
+}
+
+static int push_timer(lua_State *L, uint64_t delay_ms, uint64_t interval_ms) {
+  Plugin *p = (Plugin *)lua_touserdata(L, lua_upvalueindex(1));
+  PluginManager *pm = (PluginManager *)lua_touserdata(L, lua_upvalueindex(2));
+  const char *func_name = luaL_checkstring(L, 2);
+  luaL_checktype(L, 3, LUA_TTABLE);
+
+  cJSON *json = lua_table_to_json(L, 3);
+  char *payload = cJSON_PrintUnformatted(json);
+  cJSON_Delete(json);
+  uint64_t id = timer_schedule(pm, p, func_name, payload ? payload : "{}",
+                               delay_ms, interval_ms);
+  free(payload);
+  if (id == 0)
+    return luaL_error(L, "could not schedule %s", func_name);
+  lua_pushinteger(L, (lua_Integer)id);
+  return 1;
+}
+
+int l_defer_in(lua_State *L) {
+  lua_Integer ms = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, ms >= 0, 1, "delay must not be negative");
+  return push_timer(L, (uint64_t)ms, 0);
+}
+
+int l_every(lua_State *L) {
+  lua_Integer ms = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, ms > 0, 1, "interval must be positive");
+  return push_timer(L, (uint64_t)ms, (uint64_t)ms);
+}
+
+int l_cancel_timer(lua_State *L) {
+  Plugin *p = (Plugin *)lua_touserdata(L, lua_upvalueindex(1));
+  PluginManager *pm = (PluginManager *)lua_touserdata(L, lua_upvalueindex(2));
+  lua_Integer id = luaL_checkinteger(L, 1);
+  lua_pushboolean(L, id > 0 && timer_cancel(pm, p, (uint64_t)id));
+  return 1;
+}
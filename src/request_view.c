@@ -0,0 +1,241 @@
+#include "request_view.h"
+#include "lua_json.h"
+#include <lauxlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define REQUEST_MT "host.Request"
+#define REQUEST_VALUES_MT "host.RequestValues"
+
+struct RequestView {
+  struct MHD_Connection *conn; // NULL once closed
+  const char *url;
+  const char *method;
+  const char *body;
+  size_t body_len;
+  int ref; // registry anchor while open
+};
+
+// req.headers / req.query / req.cookies. User value 1 caches the values
+// read so far, user value 2 keeps the req alive.
+typedef struct {
+  RequestView *view;
+  enum MHD_ValueKind kind;
+} RequestValues;
+
+static const struct {
+  const char *name;
+  enum MHD_ValueKind kind;
+} value_kinds[] = {{"headers", MHD_HEADER_KIND},
+                   {"query", MHD_GET_ARGUMENT_KIND},
+                   {"cookies", MHD_COOKIE_KIND}};
+
+// Copies every value of the kind into the cache table on top of the
+// stack, keeping the ones already there
+static enum MHD_Result fill_cache(void *cls, enum MHD_ValueKind kind,
+                                  const char *key, const char *value) {
+  (void)kind;
+  lua_State *L = cls;
+  if (lua_getfield(L, -1, key) == LUA_TNIL) {
+    lua_pushstring(L, value ? value : ""); // "?flag" has no value
+    lua_setfield(L, -3, key);
+  }
+  lua_pop(L, 1);
+  return MHD_YES;
+}
+
+static int l_values_index(lua_State *L) {
+  RequestValues *rv = (RequestValues *)luaL_checkudata(L, 1, REQUEST_VALUES_MT);
+  lua_getiuservalue(L, 1, 1);
+  lua_pushvalue(L, 2);
+  if (lua_rawget(L, -2) != LUA_TNIL || rv->view->conn == NULL ||
+      lua_type(L, 2) != LUA_TSTRING)
+    return 1;
+  lua_pop(L, 1);
+
+  // Header names are matched without regard to case; the cache keeps the
+  // spelling the handler used
+  const char *value =
+      MHD_lookup_connection_value(rv->view->conn, rv->kind, lua_tostring(L, 2));
+  if (value == NULL) {
+    lua_pushnil(L); // misses are not cached: they cost one lookup
+    return 1;
+  }
+  lua_pushstring(L, value);
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -4);
+  return 1;
+}
+
+// Read-only: writes go to a table the handler makes itself
+static int l_values_newindex(lua_State *L) {
+  return luaL_error(L, "request values are read-only");
+}
+
+// `next` for the __pairs of both types, which iterate their cache tables
+static int l_next(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 2);
+  if (lua_next(L, 1))
+    return 2;
+  lua_pushnil(L);
+  return 1;
+}
+
+static int l_values_pairs(lua_State *L) {
+  RequestValues *rv = (RequestValues *)luaL_checkudata(L, 1, REQUEST_VALUES_MT);
+  lua_pushcfunction(L, l_next);
+  lua_getiuservalue(L, 1, 1);
+  if (rv->view->conn)
+    MHD_get_connection_values(rv->view->conn, rv->kind, fill_cache, L);
+  lua_pushnil(L);
+  return 3;
+}
+
+static void push_values_metatable(lua_State *L) {
+  if (!luaL_newmetatable(L, REQUEST_VALUES_MT))
+    return;
+  static const luaL_Reg meta[] = {{"__index", l_values_index},
+                                  {"__newindex", l_values_newindex},
+                                  {"__pairs", l_values_pairs},
+                                  {NULL, NULL}};
+  luaL_setfuncs(L, meta, 0);
+}
+
+// application/json and the "+json" types (application/problem+json)
+static bool is_json_body(RequestView *view) {
+  const char *type =
+      MHD_lookup_connection_value(view->conn, MHD_HEADER_KIND, "Content-Type");
+  if (type == NULL)
+    return false;
+  size_t len = strcspn(type, ";");
+  return (len == 16 && strncasecmp(type, "application/json", 16) == 0) ||
+         (len > 5 && strncasecmp(type + len - 5, "+json", 5) == 0);
+}
+
+// Pushes the value of one of the fields req is built from, or nothing
+// when the name is not one of them
+static int push_field(lua_State *L, int req, RequestView *view,
+                      const char *name) {
+  if (strcmp(name, "url") == 0) {
+    lua_pushstring(L, view->url);
+    return 1;
+  }
+  if (strcmp(name, "method") == 0) {
+    lua_pushstring(L, view->method);
+    return 1;
+  }
+  if (strcmp(name, "body") == 0) {
+    // lstring for binary safety
+    lua_pushlstring(L, view->body ? view->body : "", view->body_len);
+    return 1;
+  }
+  if (strcmp(name, "json") == 0) {
+    // nil unless the body is JSON and parses; json.decode(req.body) tells
+    // why it did not
+    char err[128];
+    if (!view->body || !is_json_body(view) ||
+        !json_decode(L, view->body, view->body_len, err, sizeof(err)))
+      lua_pushnil(L);
+    return 1;
+  }
+  for (size_t i = 0; i < sizeof(value_kinds) / sizeof(value_kinds[0]); i++) {
+    if (strcmp(name, value_kinds[i].name) != 0)
+      continue;
+    RequestValues *rv =
+        (RequestValues *)lua_newuserdatauv(L, sizeof(RequestValues), 2);
+    rv->view = view;
+    rv->kind = value_kinds[i].kind;
+    push_values_metatable(L);
+    lua_setmetatable(L, -2);
+    lua_newtable(L);
+    lua_setiuservalue(L, -2, 1);
+    lua_pushvalue(L, req);
+    lua_setiuservalue(L, -2, 2);
+    return 1;
+  }
+  return 0;
+}
+
+static int l_request_index(lua_State *L) {
+  RequestView *view = (RequestView *)luaL_checkudata(L, 1, REQUEST_MT);
+  lua_getiuservalue(L, 1, 1);
+  lua_pushvalue(L, 2);
+  if (lua_rawget(L, -2) != LUA_TNIL || view->conn == NULL ||
+      lua_type(L, 2) != LUA_TSTRING)
+    return 1;
+  lua_pop(L, 1);
+
+  if (!push_field(L, 1, view, lua_tostring(L, 2))) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -4);
+  return 1;
+}
+
+// req.form = ... and the like land in the same cache, so they can also
+// replace a field the host provides
+static int l_request_newindex(lua_State *L) {
+  luaL_checkudata(L, 1, REQUEST_MT);
+  lua_getiuservalue(L, 1, 1);
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, 3);
+  lua_rawset(L, -3);
+  return 0;
+}
+
+static int l_request_pairs(lua_State *L) {
+  luaL_checkudata(L, 1, REQUEST_MT);
+  static const char *fields[] = {"url",   "method",  "body", "json",
+                                 "headers", "query", "cookies"};
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    lua_getfield(L, 1, fields[i]); // through __index, which caches it
+    lua_pop(L, 1);
+  }
+  lua_pushcfunction(L, l_next);
+  lua_getiuservalue(L, 1, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+static void push_request_metatable(lua_State *L) {
+  if (!luaL_newmetatable(L, REQUEST_MT))
+    return;
+  static const luaL_Reg meta[] = {{"__index", l_request_index},
+                                  {"__newindex", l_request_newindex},
+                                  {"__pairs", l_request_pairs},
+                                  {NULL, NULL}};
+  luaL_setfuncs(L, meta, 0);
+}
+
+RequestView *request_view_push(lua_State *L, struct MHD_Connection *conn,
+                               const char *url, const char *method,
+                               const char *body, size_t body_len) {
+  RequestView *view = (RequestView *)lua_newuserdatauv(L, sizeof(RequestView), 1);
+  view->conn = conn;
+  view->url = url;
+  view->method = method;
+  view->body = body;
+  view->body_len = body_len;
+  push_request_metatable(L);
+  lua_setmetatable(L, -2);
+  lua_newtable(L);
+  lua_setiuservalue(L, -2, 1);
+  lua_pushvalue(L, -1);
+  view->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return view;
+}
+
+void request_view_close(lua_State *L, RequestView *view) {
+  if (view == NULL)
+    return;
+  view->conn = NULL;
+  view->url = view->method = view->body = NULL;
+  view->body_len = 0;
+  luaL_unref(L, LUA_REGISTRYINDEX, view->ref);
+  view->ref = LUA_NOREF;
+}
@@ -0,0 +1,395 @@
+#include "response_cache.h"
+#include "metrics.h"
+#include <lauxlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// Sharded hash map; each shard has its own lock, LRU list and byte
+// budget, so concurrent hits on different keys rarely contend.
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 1024 // per shard, power of two
+#define CACHE_MAX_TAGS 8
+#define CACHE_MAX_PLUGINS 64
+// Invalidation bumps a per-tag epoch instead of walking the shards.
+// Tags hash into these slots; a collision only invalidates extra entries.
+#define CACHE_TAG_SLOTS 4096
+
+typedef struct CacheEntry {
+  char *key;
+  size_t key_len;
+  uint64_t hash;
+  int status;
+  char *body;
+  size_t body_len;
+  char **headers; // name, value, name, value, ...
+  int header_count;
+  uint32_t tag_slots[CACHE_MAX_TAGS];
+  int tag_count;
+  uint64_t epoch;
+  uint64_t expires_ns;
+  size_t bytes;
+  struct CacheEntry *chain;
+  struct CacheEntry *lru_prev; // towards most recently used
+  struct CacheEntry *lru_next;
+} CacheEntry;
+
+typedef struct {
+  pthread_mutex_t lock;
+  CacheEntry *buckets[CACHE_BUCKETS];
+  CacheEntry *lru_head; // most recently used
+  CacheEntry *lru_tail;
+  size_t bytes;
+} CacheShard;
+
+typedef struct {
+  char *plugin;
+  const char *names[CACHE_MAX_VARY];
+  int count;
+} VaryEntry;
+
+static CacheShard *shards = NULL;
+static size_t shard_budget = 0;
+
+static _Atomic uint64_t current_epoch = 1;
+static _Atomic uint64_t tag_epochs[CACHE_TAG_SLOTS];
+
+static VaryEntry vary_table[CACHE_MAX_PLUGINS];
+static int vary_count = 0;
+static pthread_rwlock_t vary_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static uint64_t hash_bytes(const char *s, size_t len) {
+  uint64_t h = 1469598103934665603ull;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+static uint32_t tag_slot(const char *tag) {
+  return (uint32_t)(hash_bytes(tag, strlen(tag)) & (CACHE_TAG_SLOTS - 1));
+}
+
+void response_cache_init(void) {
+  long mb = 64;
+  const char *env = getenv("SERVER_CACHE_MB");
+  if (env)
+    mb = atol(env);
+  if (mb <= 0)
+    return;
+
+  shards = calloc(CACHE_SHARDS, sizeof(CacheShard));
+  if (shards == NULL)
+    return;
+  for (int i = 0; i < CACHE_SHARDS; i++)
+    pthread_mutex_init(&shards[i].lock, NULL);
+  shard_budget = (size_t)mb * 1024 * 1024 / CACHE_SHARDS;
+}
+
+// --- Vary registry ---
+
+int response_cache_vary(const char *plugin, const char **names_out) {
+  if (shards == NULL)
+    return -1;
+  int count = -1;
+  pthread_rwlock_rdlock(&vary_lock);
+  for (int i = 0; i < vary_count; i++) {
+    if (strcmp(vary_table[i].plugin, plugin) == 0) {
+      count = vary_table[i].count;
+      memcpy(names_out, vary_table[i].names, sizeof(char *) * count);
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&vary_lock);
+  return count;
+}
+
+// Plugin scripts also run in every background job's fresh state, so the
+// same route registers many times; names are deduplicated and kept for
+// the life of the process.
+static void vary_register(const char *plugin, const char **names, int n) {
+  pthread_rwlock_wrlock(&vary_lock);
+  VaryEntry *v = NULL;
+  for (int i = 0; i < vary_count; i++) {
+    if (strcmp(vary_table[i].plugin, plugin) == 0) {
+      v = &vary_table[i];
+      break;
+    }
+  }
+  if (v == NULL && vary_count < CACHE_MAX_PLUGINS) {
+    v = &vary_table[vary_count++];
+    v->plugin = strdup(plugin);
+  }
+  for (int i = 0; v && i < n; i++) {
+    bool seen = false;
+    for (int j = 0; j < v->count && !seen; j++)
+      seen = strcasecmp(v->names[j], names[i]) == 0;
+    if (!seen && v->count < CACHE_MAX_VARY)
+      v->names[v->count++] = strdup(names[i]);
+  }
+  pthread_rwlock_unlock(&vary_lock);
+}
+
+// --- Entries ---
+
+static void entry_free(CacheEntry *e) {
+  for (int i = 0; i < e->header_count * 2; i++)
+    free(e->headers[i]);
+  free(e->headers);
+  free(e->body);
+  free(e->key);
+  free(e);
+}
+
+static void lru_unlink(CacheShard *s, CacheEntry *e) {
+  if (e->lru_prev)
+    e->lru_prev->lru_next = e->lru_next;
+  else
+    s->lru_head = e->lru_next;
+  if (e->lru_next)
+    e->lru_next->lru_prev = e->lru_prev;
+  else
+    s->lru_tail = e->lru_prev;
+  e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(CacheShard *s, CacheEntry *e) {
+  e->lru_prev = NULL;
+  e->lru_next = s->lru_head;
+  if (s->lru_head)
+    s->lru_head->lru_prev = e;
+  s->lru_head = e;
+  if (s->lru_tail == NULL)
+    s->lru_tail = e;
+}
+
+// Caller holds the shard lock
+static void entry_remove(CacheShard *s, CacheEntry *e) {
+  CacheEntry **link = &s->buckets[e->hash & (CACHE_BUCKETS - 1)];
+  while (*link && *link != e)
+    link = &(*link)->chain;
+  if (*link)
+    *link = e->chain;
+  lru_unlink(s, e);
+  s->bytes -= e->bytes;
+  entry_free(e);
+}
+
+static bool entry_live(const CacheEntry *e, uint64_t now) {
+  if (now >= e->expires_ns)
+    return false;
+  for (int i = 0; i < e->tag_count; i++) {
+    if (atomic_load_explicit(&tag_epochs[e->tag_slots[i]],
+                             memory_order_acquire) > e->epoch)
+      return false;
+  }
+  return true;
+}
+
+static CacheEntry *shard_find(CacheShard *s, const char *key, size_t key_len,
+                              uint64_t hash) {
+  CacheEntry *e = s->buckets[hash & (CACHE_BUCKETS - 1)];
+  while (e && !(e->hash == hash && e->key_len == key_len &&
+                memcmp(e->key, key, key_len) == 0))
+    e = e->chain;
+  return e;
+}
+
+struct MHD_Response *response_cache_lookup(const char *key, size_t key_len,
+                                           int *status_out) {
+  if (shards == NULL)
+    return NULL;
+  uint64_t hash = hash_bytes(key, key_len);
+  CacheShard *s = &shards[(hash >> 32) % CACHE_SHARDS];
+  uint64_t now = metrics_now_ns();
+  struct MHD_Response *response = NULL;
+
+  pthread_mutex_lock(&s->lock);
+  CacheEntry *e = shard_find(s, key, key_len, hash);
+  if (e && !entry_live(e, now)) {
+    entry_remove(s, e);
+    e = NULL;
+  }
+  if (e) {
+    lru_unlink(s, e);
+    lru_push_front(s, e);
+    response = MHD_create_response_from_buffer(e->body_len, e->body,
+                                               MHD_RESPMEM_MUST_COPY);
+    for (int i = 0; response && i < e->header_count; i++)
+      MHD_add_response_header(response, e->headers[2 * i],
+                              e->headers[2 * i + 1]);
+    *status_out = e->status;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return response;
+}
+
+uint64_t response_cache_epoch(void) {
+  return atomic_load_explicit(&current_epoch, memory_order_acquire);
+}
+
+void response_cache_invalidate(const char *tag) {
+  uint64_t e = atomic_fetch_add(&current_epoch, 1) + 1;
+  _Atomic uint64_t *slot = &tag_epochs[tag_slot(tag)];
+  uint64_t seen = atomic_load(slot);
+  // Keep the slot monotonic when invalidations race
+  while (seen < e && !atomic_compare_exchange_weak(slot, &seen, e))
+    ;
+}
+
+static void add_tag(CacheEntry *e, const char *tag) {
+  if (e->tag_count < CACHE_MAX_TAGS)
+    e->tag_slots[e->tag_count++] = tag_slot(tag);
+}
+
+void response_cache_store(lua_State *L, int idx, const char *plugin,
+                          const char *key, size_t key_len, uint64_t epoch) {
+  if (shards == NULL || !lua_istable(L, idx))
+    return;
+  idx = lua_absindex(L, idx);
+
+  // 1. Only successful responses of routes that opted in
+  lua_getfield(L, idx, "status");
+  int status = (int)luaL_optinteger(L, -1, 200);
+  lua_pop(L, 1);
+  lua_getfield(L, idx, "cache");
+  if (status != 200 || !lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    return;
+  }
+  int cache_idx = lua_gettop(L);
+  lua_getfield(L, cache_idx, "ttl");
+  double ttl = lua_tonumber(L, -1);
+  lua_pop(L, 1);
+  if (ttl <= 0) {
+    lua_pop(L, 1);
+    return;
+  }
+
+  CacheEntry *e = calloc(1, sizeof(CacheEntry));
+  if (e == NULL) {
+    lua_pop(L, 1);
+    return;
+  }
+  e->status = status;
+  e->epoch = epoch;
+  e->expires_ns = metrics_now_ns() + (uint64_t)(ttl * 1e9);
+  add_tag(e, plugin);
+
+  // 2. Tags
+  lua_getfield(L, cache_idx, "tags");
+  if (lua_istable(L, -1)) {
+    int n = (int)lua_rawlen(L, -1);
+    for (int i = 1; i <= n; i++) {
+      lua_rawgeti(L, -1, i);
+      if (lua_isstring(L, -1))
+        add_tag(e, lua_tostring(L, -1));
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 2); // tags, cache
+
+  // 3. Body and headers
+  lua_getfield(L, idx, "body");
+  size_t body_len = 0;
+  const char *body = lua_tolstring(L, -1, &body_len);
+  e->body = malloc(body_len + 1);
+  if (e->body && body)
+    memcpy(e->body, body, body_len);
+  e->body_len = body ? body_len : 0;
+  lua_pop(L, 1);
+
+  lua_getfield(L, idx, "headers");
+  if (lua_istable(L, -1)) {
+    int cap = 0;
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      if (lua_type(L, -2) == LUA_TSTRING && lua_isstring(L, -1)) {
+        if (e->header_count == cap) {
+          cap = cap ? cap * 2 : 4;
+          char **grown = realloc(e->headers, sizeof(char *) * 2 * cap);
+          if (grown == NULL) {
+            lua_pop(L, 2);
+            break;
+          }
+          e->headers = grown;
+        }
+        e->headers[2 * e->header_count] = strdup(lua_tostring(L, -2));
+        e->headers[2 * e->header_count + 1] = strdup(lua_tostring(L, -1));
+        e->bytes += lua_rawlen(L, -2) + lua_rawlen(L, -1);
+        e->header_count++;
+      }
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+
+  e->key = malloc(key_len);
+  if (e->key == NULL || e->body == NULL) {
+    entry_free(e);
+    return;
+  }
+  memcpy(e->key, key, key_len);
+  e->key_len = key_len;
+  e->hash = hash_bytes(key, key_len);
+  e->bytes += sizeof(CacheEntry) + key_len + e->body_len;
+  // One oversized page must not flush the whole shard
+  if (e->bytes > shard_budget / 4) {
+    entry_free(e);
+    return;
+  }
+
+  // 4. Insert (replacing any older copy) and evict from the LRU tail
+  CacheShard *s = &shards[(e->hash >> 32) % CACHE_SHARDS];
+  pthread_mutex_lock(&s->lock);
+  CacheEntry *old = shard_find(s, key, key_len, e->hash);
+  if (old)
+    entry_remove(s, old);
+  CacheEntry **bucket = &s->buckets[e->hash & (CACHE_BUCKETS - 1)];
+  e->chain = *bucket;
+  *bucket = e;
+  lru_push_front(s, e);
+  s->bytes += e->bytes;
+  while (s->bytes > shard_budget && s->lru_tail && s->lru_tail != e)
+    entry_remove(s, s->lru_tail);
+  pthread_mutex_unlock(&s->lock);
+}
+
+// --- Lua bindings ---
+
+// c_cache_route({"Accept-Language", ...})
+static int l_cache_route(lua_State *L) {
+  const char *plugin = lua_tostring(L, lua_upvalueindex(1));
+  const char *names[CACHE_MAX_VARY];
+  int n = 0;
+  if (lua_istable(L, 1)) {
+    int len = (int)lua_rawlen(L, 1);
+    for (int i = 1; i <= len && n < CACHE_MAX_VARY; i++) {
+      lua_rawgeti(L, 1, i);
+      if (lua_isstring(L, -1))
+        names[n++] = lua_tostring(L, -1); // anchored in the vary table
+      lua_pop(L, 1);
+    }
+  }
+  vary_register(plugin, names, n);
+  return 0;
+}
+
+// c_cache_invalidate("products")
+static int l_cache_invalidate(lua_State *L) {
+  response_cache_invalidate(luaL_checkstring(L, 1));
+  return 0;
+}
+
+void response_cache_setup_lua(lua_State *L, const char *plugin) {
+  lua_pushstring(L, plugin);
+  lua_pushcclosure(L, l_cache_route, 1);
+  lua_setglobal(L, "c_cache_route");
+  lua_pushcfunction(L, l_cache_invalidate);
+  lua_setglobal(L, "c_cache_invalidate");
+}
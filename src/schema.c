@@ -0,0 +1,320 @@
+#include "schema.h"
+#include "db_executor.h"
+#include "log.h"
+#include "lua_helpers.h"
+#include <lauxlib.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Managed indexes are named ix_<table>_<name>; anything else is left alone
+#define INDEX_PREFIX "ix_"
+
+// Runs `sql` (from sqlite3_mprintf, freed here) in the migration's
+// transaction. A query leaves its rows table on the stack; any failure
+// raises, which rolls the whole migration back.
+static void schema_sql(lua_State *L, Plugin *p, DbOp op, char *sql) {
+  if (sql == NULL)
+    luaL_error(L, "out of memory");
+  if (op == DB_EXEC)
+    log_write(LOG_INFO, p->name, "migrate: %s", sql);
+
+  DbRequest *req = db_submit(p->db_executor, db_current_txn(L, p), op, sql,
+                             NULL);
+  sqlite3_free(sql);
+  if (req == NULL)
+    luaL_error(L, "could not queue statement");
+  db_request_wait(req);
+  DbResult r = req->result;
+  memset(&req->result, 0, sizeof(req->result));
+  db_request_release(req);
+
+  if (!r.ok) {
+    lua_pushstring(L, r.error);
+    db_result_free(&r);
+    lua_error(L);
+  }
+  if (op == DB_QUERY)
+    db_result_return(L, p, &r, DB_QUERY);
+  else
+    db_result_free(&r);
+}
+
+// Pushes a set of rows[i][key] from the rows table on top, popping it
+static void rows_to_set(lua_State *L, const char *key, const char *value) {
+  lua_newtable(L);
+  lua_Integer n = luaL_len(L, -2);
+  for (lua_Integer i = 1; i <= n; i++) {
+    lua_rawgeti(L, -2, i);
+    lua_getfield(L, -1, key);
+    if (value)
+      lua_getfield(L, -2, value);
+    else
+      lua_pushboolean(L, 1);
+    lua_settable(L, -4);
+    lua_pop(L, 1);
+  }
+  lua_remove(L, -2);
+}
+
+// CREATE [UNIQUE] INDEX "ix_t_name" ON "t" ("a", "b") [WHERE ...], built
+// from { "a", "b", unique = true, where = "..." } at the top of the stack
+static char *index_sql(lua_State *L, const char *table, const char *name) {
+  lua_getfield(L, -1, "unique");
+  bool unique = lua_toboolean(L, -1);
+  lua_getfield(L, -2, "where");
+  const char *where = lua_tostring(L, -1);
+
+  char *sql = sqlite3_mprintf("CREATE %sINDEX \"" INDEX_PREFIX "%w_%w\" ON "
+                              "\"%w\" (",
+                              unique ? "UNIQUE " : "", table, name, table);
+  lua_Integer n = luaL_len(L, -3);
+  for (lua_Integer i = 1; sql && i <= n; i++) {
+    lua_rawgeti(L, -3, i);
+    const char *column = lua_tostring(L, -1);
+    char *next = sqlite3_mprintf("%s%s\"%w\"", sql, i > 1 ? ", " : "",
+                                 column ? column : "");
+    sqlite3_free(sql);
+    sql = next;
+    lua_pop(L, 1);
+  }
+  if (sql) {
+    char *next = where ? sqlite3_mprintf("%s) WHERE %s", sql, where)
+                       : sqlite3_mprintf("%s)", sql);
+    sqlite3_free(sql);
+    sql = next;
+  }
+  lua_pop(L, 2);
+  if (n == 0) {
+    sqlite3_free(sql);
+    luaL_error(L, "index %s on %s lists no columns", name, table);
+  }
+  return sql;
+}
+
+// Creates, rebuilds or drops the managed indexes of `table` to match
+// its `indexes` entry (at `def`)
+static bool reconcile_indexes(lua_State *L, Plugin *p, const char *table,
+                              int def) {
+  bool changed = false;
+  schema_sql(L, p, DB_QUERY,
+             sqlite3_mprintf("SELECT name, sql FROM sqlite_master WHERE "
+                             "type = 'index' AND tbl_name = %Q AND "
+                             "substr(name, 1, %d) = '" INDEX_PREFIX "'",
+                             table, (int)strlen(INDEX_PREFIX)));
+  rows_to_set(L, "name", "sql");
+  int existing = lua_gettop(L);
+
+  lua_getfield(L, def, "indexes");
+  if (lua_istable(L, -1)) {
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+      if (lua_type(L, -2) != LUA_TSTRING || !lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        continue;
+      }
+      // Keep SQL text on the Lua stack so a failing statement leaks nothing
+      const char *name = lua_tostring(L, -2);
+      char *built = index_sql(L, table, name);
+      const char *sql = lua_pushstring(L, built);
+      sqlite3_free(built);
+      const char *full =
+          lua_pushfstring(L, INDEX_PREFIX "%s_%s", table, name);
+      lua_pushvalue(L, -1);
+      lua_gettable(L, existing);
+      const char *current = lua_tostring(L, -1);
+      bool present = current != NULL;
+      bool same = present && strcmp(current, sql) == 0;
+      lua_pop(L, 1);
+
+      // Mark as declared so it survives the sweep below
+      lua_pushvalue(L, -1);
+      lua_pushboolean(L, 0);
+      lua_settable(L, existing);
+
+      if (!same) {
+        if (present)
+          schema_sql(L, p, DB_EXEC,
+                     sqlite3_mprintf("DROP INDEX \"%w\"", full));
+        schema_sql(L, p, DB_EXEC, sqlite3_mprintf("%s", sql));
+        changed = true;
+      }
+      lua_pop(L, 3);
+    }
+  }
+  lua_pop(L, 1);
+
+  // Managed indexes no longer declared
+  lua_pushnil(L);
+  while (lua_next(L, existing) != 0) {
+    if (lua_toboolean(L, -1)) {
+      schema_sql(L, p, DB_EXEC,
+                 sqlite3_mprintf("DROP INDEX \"%w\"", lua_tostring(L, -2)));
+      changed = true;
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return changed;
+}
+
+// Creates `table` or adds its missing columns. Column definitions are
+// the string entries of the table at `def`.
+static bool reconcile_table(lua_State *L, Plugin *p, const char *table,
+                            int def) {
+  bool changed = false;
+  schema_sql(L, p, DB_QUERY,
+             sqlite3_mprintf("SELECT name FROM pragma_table_info(%Q)", table));
+  rows_to_set(L, "name", NULL);
+  int existing = lua_gettop(L);
+  bool exists = false;
+  lua_pushnil(L);
+  if (lua_next(L, existing) != 0) {
+    exists = true;
+    lua_pop(L, 2);
+  }
+
+  char *create =
+      exists ? NULL : sqlite3_mprintf("CREATE TABLE \"%w\" (", table);
+  bool first = true;
+  lua_pushnil(L);
+  while (lua_next(L, def) != 0) {
+    if (lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TSTRING) {
+      lua_pop(L, 1);
+      continue;
+    }
+    const char *column = lua_tostring(L, -2);
+    const char *type = lua_tostring(L, -1);
+    if (!exists) {
+      char *next = create ? sqlite3_mprintf("%s%s\"%w\" %s", create,
+                                            first ? "" : ", ", column, type)
+                          : NULL;
+      sqlite3_free(create);
+      create = next;
+      first = false;
+    } else {
+      lua_getfield(L, existing, column);
+      bool present = lua_toboolean(L, -1);
+      lua_pop(L, 1);
+      if (!present) {
+        // SQLite only accepts additive definitions here (no PRIMARY KEY
+        // or UNIQUE, NOT NULL needs a default); anything else fails and
+        // rolls the migration back
+        schema_sql(L, p, DB_EXEC,
+                   sqlite3_mprintf("ALTER TABLE \"%w\" ADD COLUMN \"%w\" %s",
+                                   table, column, type));
+        changed = true;
+      }
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+
+  if (!exists) {
+    char *sql = create ? sqlite3_mprintf("%s)", create) : NULL;
+    sqlite3_free(create);
+    schema_sql(L, p, DB_EXEC, sql);
+    changed = true;
+  }
+  return reconcile_indexes(L, p, table, def) || changed;
+}
+
+// Runs the pending entries of `migrations` and bumps user_version
+static bool run_migrations(lua_State *L, Plugin *p) {
+  if (lua_getglobal(L, "migrations") != LUA_TTABLE) {
+    lua_pop(L, 1);
+    return false;
+  }
+  int migrations = lua_gettop(L);
+  schema_sql(L, p, DB_QUERY, sqlite3_mprintf("PRAGMA user_version"));
+  lua_rawgeti(L, -1, 1);
+  lua_getfield(L, -1, "user_version");
+  lua_Integer current = lua_tointeger(L, -1);
+  lua_pop(L, 3);
+
+  lua_Integer target = luaL_len(L, migrations);
+  if (target < current)
+    log_write(LOG_WARN, p->name,
+              "database is at version %lld, newer than the %lld migrations "
+              "the plugin declares",
+              (long long)current, (long long)target);
+
+  for (lua_Integer v = current + 1; v <= target; v++) {
+    int type = lua_rawgeti(L, migrations, v);
+    if (type == LUA_TSTRING) {
+      schema_sql(L, p, DB_EXEC, sqlite3_mprintf("%s", lua_tostring(L, -1)));
+      lua_pop(L, 1);
+    } else if (type == LUA_TFUNCTION) {
+      log_write(LOG_INFO, p->name, "migrate: running migration %lld",
+                (long long)v);
+      lua_call(L, 0, 0); // its db_exec calls join the transaction
+    } else {
+      luaL_error(L, "migration %d is neither SQL nor a function", (int)v);
+    }
+    schema_sql(L, p, DB_EXEC,
+               sqlite3_mprintf("PRAGMA user_version = %lld", (long long)v));
+  }
+  lua_pop(L, 1);
+  return target > current;
+}
+
+// Runs inside db_transaction; returns whether anything changed
+static int migrate(lua_State *L) {
+  Plugin *p = (Plugin *)lua_touserdata(L, lua_upvalueindex(1));
+  bool changed = false;
+
+  // 1. Declared tables, columns and indexes
+  if (lua_getglobal(L, "schema") == LUA_TTABLE) {
+    int schema = lua_gettop(L);
+    lua_pushnil(L);
+    while (lua_next(L, schema) != 0) {
+      if (lua_type(L, -2) == LUA_TSTRING && lua_istable(L, -1))
+        changed |= reconcile_table(L, p, lua_tostring(L, -2), lua_gettop(L));
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+
+  // 2. Versioned data migrations
+  changed |= run_migrations(L, p);
+
+  lua_pushboolean(L, changed);
+  return 1;
+}
+
+void apply_plugin_schema(lua_State *L, Plugin *p) {
+  int has_schema = lua_getglobal(L, "schema") == LUA_TTABLE;
+  int has_migrations = lua_getglobal(L, "migrations") == LUA_TTABLE;
+  bool analyze = false;
+  if (has_migrations) {
+    lua_getfield(L, -1, "analyze");
+    analyze = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 2);
+  if (!has_schema && !has_migrations)
+    return; // no schema found, skip DB init
+
+  lua_getglobal(L, "db_transaction");
+  lua_pushlightuserdata(L, p);
+  lua_pushcclosure(L, migrate, 1);
+  if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+    log_write(LOG_ERROR, p->name, "Migration error, rolled back: %s",
+              lua_tostring(L, -1));
+    lua_pop(L, 1);
+    return;
+  }
+  bool changed = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  // Fresh statistics so the planner picks up new indexes
+  if (changed) {
+    DbResult r;
+    if (analyze) {
+      db_execute(p->db_executor, "ANALYZE;", false, &r);
+      db_result_free(&r);
+    }
+    db_execute(p->db_executor, "PRAGMA optimize;", false, &r);
+    db_result_free(&r);
+  }
+}
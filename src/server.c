@@ -1,8 +1,20 @@
-// TODO: flamegraphs benchmarks
+// TODO: flamegraphs
 // TODO: changelog
 #include "server.h"
+#include "config.h"
 #include "plugin_manager.h"
+#include "event_loop.h"
+#include "log.h"
+#include "lua_json.h"
+#include "lua_strbuf.h"
+#include "metrics.h"
+#include "request_view.h"
+#include "response_cache.h"
+#include "supervisor.h"
+#include "trace.h"
+#include <arpa/inet.h>
 #include <fcntl.h>
+#include <stdatomic.h>
 #include <lauxlib.h>
 #include <lua.h>
 #include <lualib.h>
@@ -11,88 +23,175 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static struct MHD_Daemon *daemon_handle;
+// Requests between their first respond() call and request_completed()
+static atomic_int in_flight;
+
+// Serves the host-owned paths; returns NULL for anything else
+static struct MHD_Response *reserved_response(RequestContext *ctx) {
+  char *text = NULL;
+  size_t len = 0;
+  const char *type = "text/plain";
+
+  if (strcmp(ctx->url, STATUS_PATH) == 0) {
+    const union MHD_DaemonInfo *info = MHD_get_daemon_info(
+        daemon_handle, MHD_DAEMON_INFO_CURRENT_CONNECTIONS);
+    text = config_render(ctx->pm, info ? info->num_connections : 0, &len);
+    type = "application/json";
+  } else if (strcmp(ctx->url, METRICS_PATH) == 0) {
+    text = supervisor_metrics_render(ctx->pm, &len);
+    type = "text/plain; version=0.0.4";
+  } else if (strcmp(ctx->url, TRACE_PATH) == 0 && trace_enabled()) {
+    text = trace_render(&len);
+    type = "application/json";
+  } else if (strcmp(ctx->url, PROFILE_PATH) == 0 && profile_enabled()) {
+    text = profile_render(&len);
+  }
+  if (text == NULL)
+    return NULL;
+
+  struct MHD_Response *response =
+      MHD_create_response_from_buffer(len, text, MHD_RESPMEM_MUST_FREE);
+  MHD_add_response_header(response, "Content-Type", type);
+  return response;
+}
 
 typedef struct {
-  // Data from MHD
-  struct MHD_Connection *connection;
-  char *url;
-  char *method;
+  char *buf;
+  size_t size;
+  int len;
+} KeyWriter;
 
-  // Upload buffer logic
-  char *upload_data;
-  size_t upload_size;
+static enum MHD_Result append_query_arg(void *cls, enum MHD_ValueKind kind,
+                                        const char *key, const char *value) {
+  (void)kind;
+  KeyWriter *w = cls;
+  if (w->len <= 0 || (size_t)w->len >= w->size)
+    return MHD_NO;
+  // Decoded values may hold '&' or '=', so each part is length-prefixed
+  if (value == NULL)
+    value = "";
+  w->len += snprintf(w->buf + w->len, w->size - w->len, "%zu:%s%zu:%s",
+                     strlen(key), key, strlen(value), value);
+  return MHD_YES;
+}
 
-  // Result storage
-  struct MHD_Response *response;
-  int status_code;
-  bool processing_done;
+// "<plugin> <url>?<query>" plus one line per header the plugin's cached
+// routes vary on. Handlers read req.query, so every argument is part of
+// the key. Returns 0 when the request is not cacheable.
+static size_t build_cache_key(RequestContext *ctx, Plugin *p,
+                              const char *rel_url, char *buf, size_t size) {
+  if (strcmp(ctx->method, "GET") != 0)
+    return 0;
+  const char *vary[CACHE_MAX_VARY];
+  int n = response_cache_vary(p->name, vary);
+  if (n < 0)
+    return 0;
 
-  // References
-  PluginManager *pm;
-} RequestContext;
+  KeyWriter w = {buf, size, snprintf(buf, size, "%s %s?", p->name, rel_url)};
+  MHD_get_connection_values(ctx->connection, MHD_GET_ARGUMENT_KIND,
+                            append_query_arg, &w);
+  int len = w.len;
+  if (len > 0 && (size_t)len < size)
+    len += snprintf(buf + len, size - len, "\n");
+  for (int i = 0; i < n && len > 0 && (size_t)len < size; i++) {
+    const char *value =
+        MHD_lookup_connection_value(ctx->connection, MHD_HEADER_KIND, vary[i]);
+    len += snprintf(buf + len, size - len, "%s\n", value ? value : "");
+  }
+  if (len <= 0 || (size_t)len >= size)
+    return 0; // too long to key on, just run the handler
+  return (size_t)len;
+}
 
-void *async_worker(void *arg) {
-  RequestContext *ctx = (RequestContext *)arg;
+struct MHD_Response *lookup_cached_response(RequestContext *ctx, Plugin *p,
+                                            const char *rel_url, char *key,
+                                            size_t key_size,
+                                            size_t *key_len) {
+  *key_len = build_cache_key(ctx, p, rel_url, key, key_size);
+  if (*key_len == 0)
+    return NULL;
+
+  uint64_t started_ns = metrics_now_ns();
+  struct MHD_Response *cached =
+      response_cache_lookup(key, *key_len, &ctx->status_code);
+  metrics_count(METRIC_CACHE_LOOKUPS_TOTAL, p->name, cached ? "hit" : "miss");
+  if (cached)
+    metrics_observe(METRIC_HTTP_REQUEST_SECONDS, p->name, "_cached",
+                    metrics_now_ns() - started_ns);
+  return cached;
+}
 
-  // 1. TRY SPECIFIC PLUGINS
+static struct MHD_Response *static_response(RequestContext *ctx, Plugin *p,
+                                            const char *rel_url) {
+  if (strncmp(rel_url, "/static/", 8) != 0)
+    return NULL;
+  char path[512];
+  snprintf(path, sizeof(path), "%s/static/%s", p->path, rel_url + 8);
+
+  // FIX: Just get the response object, don't queue it yet!
+  uint64_t started_ns = metrics_now_ns();
+  struct MHD_Response *response = get_static_response(path);
+  if (response) {
+    ctx->status_code = 200;
+    metrics_observe(METRIC_HTTP_REQUEST_SECONDS, p->name, "_static",
+                    metrics_now_ns() - started_ns);
+  }
+  return response;
+}
+
+struct MHD_Response *resolve_request(RequestContext *ctx, Plugin **target,
+                                     const char **rel_url) {
+  *target = NULL;
+  *rel_url = ctx->url;
+
+  // 0. RESERVED HOST PATHS
+  struct MHD_Response *response = reserved_response(ctx);
+  if (response) {
+    ctx->status_code = 200;
+    return response;
+  }
+
+  // 1. TRY SPECIFIC PLUGINS, 2. FALLBACK TO DEFAULT
+  Plugin *fallback = NULL;
   for (int i = 0; i < ctx->pm->plugin_count; i++) {
     Plugin *p = ctx->pm->plugin_list[i];
     // TODO verify security of strcmp
-    if (strcmp(p->name, "default") == 0) continue;
+    if (strcmp(p->name, "default") == 0) {
+      fallback = p;
+      continue;
+    }
 
     size_t len = strlen(p->name);
     // Check if URL starts with /plugin_name
     if (ctx->url[0] == '/' && strncmp(ctx->url + 1, p->name, len) == 0) {
       const char *after = ctx->url + 1 + len;
-
-      // A. Static Check
-      if (strncmp(after, "/static/", 8) == 0) {
-        char path[512];
-        snprintf(path, sizeof(path), "%s/static/%s", p->path, after + 8);
-        
-        // FIX: Just get the response object, don't queue it yet!
-        ctx->response = get_static_response(path); 
-        if (ctx->response) {
-            ctx->status_code = 200;
-            break; // Found it, exit loop
-        }
-      }
-
-      // B. Lua Check
-      const char *rel_url = (*after == '\0') ? "/" : after;
-      ctx->response = call_plugin_logic(p, rel_url, ctx->method, &(ctx->status_code),
-                                        ctx->upload_data, ctx->upload_size);
-      // TODO: should check for ==NULL or like this?
-      if (ctx->response) break;
+      *target = p;
+      *rel_url = (*after == '\0') ? "/" : after;
+      break;
     }
   }
+  if (*target == NULL)
+    *target = fallback;
+  if (*target == NULL)
+    return NULL;
 
-  // 2. FALLBACK TO DEFAULT (If no response yet)
-  if (!ctx->response) {
-    for (int i = 0; i < ctx->pm->plugin_count; i++) {
-      if (strcmp(ctx->pm->plugin_list[i]->name, "default") == 0) {
-        
-        // Static Fallback
-        if (strncmp(ctx->url, "/static/", 8) == 0) {
-          char path[512];
-          snprintf(path, sizeof(path), "%s/static/%s", ctx->pm->plugin_list[i]->path,
-                   ctx->url + 8);
-          ctx->response = get_static_response(path);
-          if (ctx->response) {
-              ctx->status_code = 200;
-              break;
-          }
-        }
-        
-        // Lua Fallback
-        ctx->response = call_plugin_logic(ctx->pm->plugin_list[i], ctx->url,
-                                          ctx->method, &(ctx->status_code),
-                                          ctx->upload_data, ctx->upload_size);
-        break;
-      }
-    }
+  // A. Static Check, before any Lua runs
+  return static_response(ctx, *target, *rel_url);
+}
+
+Plugin *find_default_plugin(PluginManager *pm) {
+  for (int i = 0; i < pm->plugin_count; i++) {
+    if (strcmp(pm->plugin_list[i]->name, "default") == 0)
+      return pm->plugin_list[i];
   }
+  return NULL;
+}
 
+void finish_request(RequestContext *ctx, uint64_t trace_start) {
   // 3. 404 IF STILL NULL
   if (!ctx->response) {
     ctx->status_code = 404;
@@ -101,9 +200,46 @@ void *async_worker(void *arg) {
   }
 
   // 4. TELL MHD TO RESUME
+  if (trace_start) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s %s", ctx->method, ctx->url);
+    trace_span("http", name, trace_start);
+  }
   ctx->processing_done = true;
   MHD_resume_connection(ctx->connection);
+}
+
+// Serves a cached copy when there is one, otherwise runs the handler
+static struct MHD_Response *dispatch_to_plugin(RequestContext *ctx, Plugin *p,
+                                               const char *rel_url) {
+  char key[1024];
+  size_t key_len;
+  struct MHD_Response *cached =
+      lookup_cached_response(ctx, p, rel_url, key, sizeof(key), &key_len);
+  if (cached)
+    return cached;
+  return call_plugin_logic(p, ctx, rel_url, key_len ? key : NULL, key_len);
+}
+
+void *async_worker(void *arg) {
+  RequestContext *ctx = (RequestContext *)arg;
+  trace_begin_request();
+  uint64_t trace_start = trace_now();
+
+  Plugin *p;
+  const char *rel_url;
+  ctx->response = resolve_request(ctx, &p, &rel_url);
+  trace_span("http", "route", trace_start);
 
+  // B. Lua Check, falling back to the default plugin's handler
+  if (!ctx->response && p) {
+    ctx->response = dispatch_to_plugin(ctx, p, rel_url);
+    Plugin *fallback = find_default_plugin(ctx->pm);
+    if (!ctx->response && fallback && fallback != p)
+      ctx->response = dispatch_to_plugin(ctx, fallback, ctx->url);
+  }
+
+  finish_request(ctx, trace_start);
   return NULL; // FIX: Return NULL, not MHD_YES
 }
 
@@ -115,14 +251,123 @@ void request_completed(void *cls, struct MHD_Connection *connection,
     if (ctx->url) free(ctx->url);
     if (ctx->method) free(ctx->method);
     free(ctx);
+    atomic_fetch_sub(&in_flight, 1);
+  }
+}
+
+int server_drain(struct MHD_Daemon *daemon) {
+  // 1. Close the listening socket; open connections keep being served
+  MHD_socket fd = MHD_quiesce_daemon(daemon);
+  if (fd >= 0)
+    close(fd);
+
+  // 2. Wait for the requests already accepted
+  const char *v = getenv("SERVER_DRAIN_MS");
+  int timeout_ms = v && atoi(v) >= 0 ? atoi(v) : 10000;
+  int left = atomic_load(&in_flight);
+  log_write(LOG_INFO, "server", "draining %d requests (up to %d ms)", left,
+            timeout_ms);
+  for (int waited = 0; left > 0 && waited < timeout_ms; waited += 10) {
+    struct timespec ts = {0, 10 * 1000000};
+    nanosleep(&ts, NULL);
+    left = atomic_load(&in_flight);
   }
+  if (left > 0)
+    log_write(LOG_WARN, "server", "%d requests still running after %d ms",
+              left, timeout_ms);
+  return left;
 }
 
+static unsigned int poll_flags(PollMode mode) {
+  switch (mode) {
+  case POLL_EPOLL:
+    return MHD_USE_EPOLL_INTERNAL_THREAD;
+  case POLL_POLL:
+    return MHD_USE_POLL_INTERNAL_THREAD;
+  case POLL_SELECT:
+    return MHD_USE_INTERNAL_POLLING_THREAD;
+  case POLL_THREAD_PER_CONNECTION:
+    return MHD_USE_THREAD_PER_CONNECTION | MHD_USE_INTERNAL_POLLING_THREAD;
+  default:
+    return MHD_USE_AUTO_INTERNAL_THREAD;
+  }
+}
+
+// Keep-alive and pipelining are MHD's own (HTTP/1.1 connections are
+// reused, queued requests are answered in order); the config decides how
+// many connections there may be, how long an idle one lives and how many
+// threads poll them.
 struct MHD_Daemon *start_server(PluginManager *pm) {
-  return MHD_start_daemon(
-      MHD_USE_INTERNAL_POLLING_THREAD | MHD_ALLOW_SUSPEND_RESUME, 8888, NULL,
-      NULL, &respond, pm, MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL,
-      MHD_OPTION_END);
+  const ServerConfig *cfg = config_get();
+  unsigned int flags = poll_flags(cfg->poll) | MHD_ALLOW_SUSPEND_RESUME;
+
+  struct MHD_OptionItem ops[13];
+  int n = 0;
+  // 1. Listener threads, each accepting and polling its own connections
+  if (cfg->poll != POLL_THREAD_PER_CONNECTION && cfg->poll_threads > 1)
+    ops[n++] = (struct MHD_OptionItem){MHD_OPTION_THREAD_POOL_SIZE,
+                                       cfg->poll_threads, NULL};
+
+  // 2. Limits; zero keeps MHD's default
+  if (cfg->connection_limit)
+    ops[n++] = (struct MHD_OptionItem){MHD_OPTION_CONNECTION_LIMIT,
+                                       cfg->connection_limit, NULL};
+  if (cfg->per_ip_limit)
+    ops[n++] = (struct MHD_OptionItem){MHD_OPTION_PER_IP_CONNECTION_LIMIT,
+                                       cfg->per_ip_limit, NULL};
+  if (cfg->connection_timeout)
+    ops[n++] = (struct MHD_OptionItem){MHD_OPTION_CONNECTION_TIMEOUT,
+                                       cfg->connection_timeout, NULL};
+  if (cfg->connection_memory)
+    ops[n++] = (struct MHD_OptionItem){MHD_OPTION_CONNECTION_MEMORY_LIMIT,
+                                       (intptr_t)cfg->connection_memory, NULL};
+  if (cfg->listen_backlog)
+    ops[n++] = (struct MHD_OptionItem){MHD_OPTION_LISTEN_BACKLOG_SIZE,
+                                       cfg->listen_backlog, NULL};
+  if (cfg->tcp_fastopen) {
+    flags |= MHD_USE_TCP_FASTOPEN;
+    ops[n++] = (struct MHD_OptionItem){MHD_OPTION_TCP_FASTOPEN_QUEUE_SIZE,
+                                       cfg->tcp_fastopen, NULL};
+  }
+
+  // 3. Pre-fork workers share the port; the kernel balances accepts
+  if (supervisor_is_worker())
+    ops[n++] = (struct MHD_OptionItem){MHD_OPTION_LISTENING_ADDRESS_REUSE, 1,
+                                       NULL};
+
+  // 4. Bind address; MHD copies it while binding
+  struct sockaddr_in addr4 = {0};
+  struct sockaddr_in6 addr6 = {0};
+  if (cfg->bind_address[0]) {
+    if (inet_pton(AF_INET, cfg->bind_address, &addr4.sin_addr) == 1) {
+      addr4.sin_family = AF_INET;
+      addr4.sin_port = htons(cfg->port);
+      ops[n++] = (struct MHD_OptionItem){MHD_OPTION_SOCK_ADDR, 0, &addr4};
+    } else if (inet_pton(AF_INET6, cfg->bind_address, &addr6.sin6_addr) ==
+               1) {
+      addr6.sin6_family = AF_INET6;
+      addr6.sin6_port = htons(cfg->port);
+      flags |= MHD_USE_IPv6;
+      ops[n++] = (struct MHD_OptionItem){MHD_OPTION_SOCK_ADDR, 0, &addr6};
+    } else {
+      log_write(LOG_ERROR, "server", "bind: '%s' is not an IP address",
+                cfg->bind_address);
+      return NULL;
+    }
+  }
+  ops[n] = (struct MHD_OptionItem){MHD_OPTION_END, 0, NULL};
+
+  log_write(LOG_INFO, "server",
+            "listening on %s:%u (%s, %u polling threads, timeout %us)",
+            cfg->bind_address[0] ? cfg->bind_address : "*", cfg->port,
+            poll_mode_name(cfg->poll),
+            cfg->poll == POLL_THREAD_PER_CONNECTION ? 0 : cfg->poll_threads,
+            cfg->connection_timeout);
+  daemon_handle = MHD_start_daemon(
+      flags, (uint16_t)cfg->port, NULL, NULL, &respond, pm,
+      MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL,
+      MHD_OPTION_ARRAY, ops, MHD_OPTION_END);
+  return daemon_handle;
 }
 
 // This function is called for every incoming request
@@ -140,6 +385,7 @@ enum MHD_Result respond(void *closure, struct MHD_Connection *connection,
     ctx->url = strdup(url);
     ctx->method = strdup(method);
     *con_cls = ctx;
+    atomic_fetch_add(&in_flight, 1);
     return MHD_YES;
   }
 
@@ -163,9 +409,14 @@ enum MHD_Result respond(void *closure, struct MHD_Connection *connection,
   }
 
   // 4. SUSPEND AND DISPATCH
+  MHD_suspend_connection(connection);
+  if (event_loop_enabled()) {
+    event_loop_submit(ctx);
+    return MHD_YES;
+  }
+
   // In a real app, use a Thread Pool. For now, we'll show a simple pthread.
   pthread_t tid;
-  MHD_suspend_connection(connection);
   pthread_create(&tid, NULL, async_worker, ctx);
   pthread_detach(tid);
 
@@ -217,13 +468,65 @@ struct MHD_Response *build_response_from_lua(lua_State *L, int *status_out) {
   *status_out = (int)luaL_optinteger(L, -1, 200);
   lua_pop(L, 1);
 
-  // 2. Body
-  lua_getfield(L, -1, "body");
-  size_t body_len;
-  const char *body_str = lua_tolstring(L, -1, &body_len);
-  struct MHD_Response *response = MHD_create_response_from_buffer(
-      body_len, (void *)body_str, MHD_RESPMEM_MUST_COPY);
-  lua_pop(L, 1);
+  // 2. Body; a `json` value (app.json) is encoded straight into the
+  // buffer MHD sends, with no Lua string in between
+  struct MHD_Response *response;
+  lua_getfield(L, -1, "json");
+  if (!lua_isnil(L, -1)) {
+    size_t len;
+    const char *err;
+    char *text = json_encode(L, -1, &len, &err);
+    lua_pop(L, 1);
+    if (text == NULL) {
+      log_write(LOG_ERROR, "server", "response json: %s", err);
+      lua_pushnil(L);
+      lua_setfield(L, -2, "cache"); // nothing to store
+      *status_out = 500;
+      return MHD_create_response_from_buffer(21, "Internal Server Error",
+                                             MHD_RESPMEM_PERSISTENT);
+    }
+    // The cache stores the body from the result table
+    lua_getfield(L, -1, "cache");
+    if (lua_istable(L, -1)) {
+      lua_pushlstring(L, text, len);
+      lua_setfield(L, -3, "body");
+    }
+    lua_pop(L, 1);
+    response = MHD_create_response_from_buffer(len, text,
+                                               MHD_RESPMEM_MUST_FREE);
+  } else {
+    lua_pop(L, 1);
+    lua_getfield(L, -1, "body");
+    StrBuf *buf = strbuf_test(L, -1);
+    if (buf) {
+      // A rendered page (app.render): MHD takes the buffer's bytes
+      // as they are. The cache stores a string copy in the result table.
+      lua_getfield(L, -2, "cache");
+      if (lua_istable(L, -1)) {
+        lua_pushlstring(L, buf->data ? buf->data : "", buf->len);
+        lua_setfield(L, -4, "body");
+      }
+      lua_pop(L, 1);
+      size_t len;
+      char *page = strbuf_detach(buf, &len);
+      lua_pop(L, 1);
+      if (page == NULL) {
+        lua_pushnil(L);
+        lua_setfield(L, -2, "cache");
+        *status_out = 500;
+        return MHD_create_response_from_buffer(21, "Internal Server Error",
+                                               MHD_RESPMEM_PERSISTENT);
+      }
+      response = MHD_create_response_from_buffer(len, page,
+                                                 MHD_RESPMEM_MUST_FREE);
+    } else {
+      size_t body_len;
+      const char *body_str = lua_tolstring(L, -1, &body_len);
+      response = MHD_create_response_from_buffer(body_len, (void *)body_str,
+                                                 MHD_RESPMEM_MUST_COPY);
+      lua_pop(L, 1);
+    }
+  }
 
   // 3. Headers
   lua_getfield(L, -1, "headers");
@@ -239,45 +542,100 @@ struct MHD_Response *build_response_from_lua(lua_State *L, int *status_out) {
   return response;
 }
 
-// Helper: Sets up the 'req' table and calls handle_request
-struct MHD_Response *call_plugin_logic(Plugin *p, const char *url,
-                                       const char *method, int *status_out,
-                                       char *body_data, size_t body_len) {
-  pthread_mutex_lock(&p->lock); // <--- Lock before touching Lua
-  lua_State *L = p->L;
+// Helper: Pushes app.handle_request and the 'req' view onto L, ready
+// for a call (or a coroutine resume) with one argument
+RequestView *push_plugin_request(lua_State *L, RequestContext *ctx,
+                                 const char *url) {
   lua_getglobal(L, "app");
   if (!lua_istable(L, -1)) {
     lua_pop(L, 1);
-    pthread_mutex_unlock(&p->lock); // <--- Unlock after getting the response
     return NULL;
   }
 
   lua_getfield(L, -1, "handle_request");
-  lua_newtable(L);
-  lua_pushstring(L, "url");
-  lua_pushstring(L, url);
-  lua_settable(L, -3);
-  lua_pushstring(L, "method");
-  lua_pushstring(L, method);
-  lua_settable(L, -3);
-  lua_pushstring(L, "body");
-  if (body_data) {
-    // lstring for binary safety
-    lua_pushlstring(L, body_data, body_len);
-  } else {
-    lua_pushstring(L, "");
+  lua_remove(L, -2);
+  return request_view_push(L, ctx->connection, url, ctx->method,
+                           ctx->upload_data, ctx->upload_size);
+}
+
+// Helper: Turns the handle_request result on top of L into a response,
+// pops it and records the request. Caller holds p->lock.
+struct MHD_Response *plugin_response_from_result(Plugin *p, lua_State *L,
+                                                 int *status_out,
+                                                 const char *cache_key,
+                                                 size_t cache_key_len,
+                                                 uint64_t cache_epoch,
+                                                 uint64_t started_ns) {
+  uint64_t span_start = trace_now();
+  struct MHD_Response *res = build_response_from_lua(L, status_out);
+  if (res && cache_key)
+    response_cache_store(L, -1, p->name, cache_key, cache_key_len,
+                         cache_epoch);
+  trace_span("http", "response_build", span_start);
+
+  // Label by the declared route pattern, never the raw URL, so the
+  // series count stays bounded
+  char route[128] = "_unmatched";
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "route");
+    if (lua_isstring(L, -1))
+      snprintf(route, sizeof(route), "%s", lua_tostring(L, -1));
+    lua_pop(L, 1);
   }
-  lua_settable(L, -3);
+  lua_pop(L, 1);
 
-  if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
-    fprintf(stderr, "Lua Error: %s\n", lua_tostring(L, -1));
-    lua_pop(L, 2);
-    pthread_mutex_unlock(&p->lock); // <--- Unlock after getting the response
+  // The collector runs on its own schedule; reading the heap size is O(1),
+  // so a drop since the last request is counted as GC work without ever
+  // forcing a step here
+  size_t heap = (size_t)lua_gc(p->L, LUA_GCCOUNT, 0) * 1024 +
+                (size_t)lua_gc(p->L, LUA_GCCOUNTB, 0);
+  if (heap < p->heap_seen)
+    metrics_add(metrics_series(METRIC_LUA_GC_FREED_BYTES, p->name, NULL),
+                p->heap_seen - heap);
+  p->heap_seen = heap;
+
+  char code[8];
+  snprintf(code, sizeof(code), "%d", *status_out);
+  metrics_observe(METRIC_HTTP_REQUEST_SECONDS, p->name, route,
+                  metrics_now_ns() - started_ns);
+  metrics_count(METRIC_HTTP_RESPONSES_TOTAL, p->name, code);
+  return res;
+}
+
+// Helper: Sets up the 'req' view and calls handle_request
+// When `cache_key` is set, a result that opted into caching is stored
+// under it.
+struct MHD_Response *call_plugin_logic(Plugin *p, RequestContext *ctx,
+                                       const char *url, const char *cache_key,
+                                       size_t cache_key_len) {
+  int *status_out = &ctx->status_code;
+  uint64_t started_ns = metrics_now_ns();
+  uint64_t span_start = trace_now();
+  pthread_mutex_lock(&p->lock); // <--- Lock before touching Lua
+  trace_span("http", "lock_wait", span_start);
+  uint64_t cache_epoch = response_cache_epoch();
+  lua_State *L = p->L;
+  RequestView *req = push_plugin_request(L, ctx, url);
+  if (req == NULL) {
+    event_loop_unlock_plugin(p); // <--- Unlock after getting the response
     return NULL;
   }
 
-  struct MHD_Response *res = build_response_from_lua(L, status_out);
-  lua_pop(L, 2);
-  pthread_mutex_unlock(&p->lock); // <--- Unlock after getting the response
+  span_start = trace_now();
+  int status = lua_pcall(L, 1, 1, 0);
+  // A req kept by the handler must not reach the connection after this
+  request_view_close(L, req);
+  if (status != LUA_OK) {
+    log_write(LOG_ERROR, p->name, "Lua Error: %s", lua_tostring(L, -1));
+    lua_pop(L, 1);
+    event_loop_unlock_plugin(p); // <--- Unlock after getting the response
+    return NULL;
+  }
+  trace_span("lua", "lua_handler", span_start);
+
+  struct MHD_Response *res =
+      plugin_response_from_result(p, L, status_out, cache_key, cache_key_len,
+                                  cache_epoch, started_ns);
+  event_loop_unlock_plugin(p); // <--- Unlock after getting the response
   return res;
 }
@@ -0,0 +1,594 @@
+#include "supervisor.h"
+#include "log.h"
+#include "metrics.h"
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_WORKERS 256
+#define MAX_RESTART_DELAY_MS 30000
+#define QUICK_DEATH_MS 5000 // dying sooner than this counts as a crash loop
+#define PUBLISH_MS 1000
+
+typedef struct {
+  pid_t pid; // 0 while waiting to be restarted
+  int ready_read; // read end of the readiness pipe, -1 once consumed
+  int64_t started_ms;
+  int64_t restart_at_ms;
+  int crashes; // consecutive quick deaths
+} WorkerSlot;
+
+static WorkerSlot slots[MAX_WORKERS];
+static int worker_count;
+static int worker_index = -1;
+static int ready_fd = -1;
+static pid_t supervisor_pid;
+static char metrics_dir[64];
+static int ready_ms;
+static int stop_ms;
+
+static int env_int(const char *name, int fallback) {
+  const char *v = getenv(name);
+  return v && atoi(v) > 0 ? atoi(v) : fallback;
+}
+
+static int64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void sleep_ms(int ms) {
+  struct timespec ts = {ms / 1000, (long)(ms % 1000) * 1000000};
+  nanosleep(&ts, NULL);
+}
+
+static void published_path(char *buf, size_t size, pid_t pid) {
+  snprintf(buf, size, "%s/%d.prom", metrics_dir, (int)pid);
+}
+
+static void forget_worker(pid_t pid) {
+  char path[128];
+  published_path(path, sizeof(path), pid);
+  unlink(path);
+}
+
+bool supervisor_is_worker(void) { return worker_index >= 0; }
+
+// ---------------------------------------------------------------------------
+// Supervisor
+// ---------------------------------------------------------------------------
+
+// Returns the child's pid in the supervisor, 0 in the new worker and -1
+// when fork failed
+static pid_t spawn(int slot) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    log_write(LOG_ERROR, "supervisor", "pipe: %s", strerror(errno));
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    log_write(LOG_ERROR, "supervisor", "fork: %s", strerror(errno));
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+
+  if (pid == 0) {
+    close(fds[0]);
+    for (int i = 0; i < worker_count; i++)
+      if (slots[i].ready_read >= 0)
+        close(slots[i].ready_read);
+    ready_fd = fds[1];
+    worker_index = slot;
+    // Don't outlive the supervisor
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != supervisor_pid)
+      _exit(1);
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &chld, NULL);
+    return 0;
+  }
+
+  close(fds[1]);
+  if (slots[slot].ready_read >= 0)
+    close(slots[slot].ready_read);
+  slots[slot].ready_read = fds[0];
+  slots[slot].started_ms = now_ms();
+  log_write(LOG_INFO, "supervisor", "worker %d started (pid %d)", slot,
+            (int)pid);
+  return pid;
+}
+
+// Waits for the worker in `slot` to report ready. False when it exits or
+// takes longer than SERVER_WORKER_READY_MS.
+static bool wait_ready(int slot, pid_t pid) {
+  WorkerSlot *w = &slots[slot];
+  struct pollfd pfd = {w->ready_read, POLLIN, 0};
+  int64_t deadline = w->started_ms + ready_ms;
+  char c = 0;
+  bool ready = false;
+  for (;;) {
+    int left = (int)(deadline - now_ms());
+    if (left <= 0)
+      break;
+    int n = poll(&pfd, 1, left);
+    if (n < 0 && errno == EINTR)
+      continue;
+    ready = n > 0 && read(w->ready_read, &c, 1) == 1;
+    break;
+  }
+  close(w->ready_read);
+  w->ready_read = -1;
+  if (!ready)
+    log_write(LOG_ERROR, "supervisor", "worker %d (pid %d) never became ready",
+              slot, (int)pid);
+  return ready;
+}
+
+// Waits for `pid` to exit, killing it once `deadline` passes
+static void wait_exit(pid_t pid, int64_t deadline) {
+  while (waitpid(pid, NULL, WNOHANG) == 0) {
+    if (now_ms() >= deadline) {
+      log_write(LOG_WARN, "supervisor", "pid %d did not stop, killing it",
+                (int)pid);
+      kill(pid, SIGKILL);
+      waitpid(pid, NULL, 0);
+      break;
+    }
+    sleep_ms(10);
+  }
+  forget_worker(pid);
+}
+
+static void stop_worker(pid_t pid) {
+  kill(pid, SIGTERM);
+  wait_exit(pid, now_ms() + stop_ms);
+}
+
+// Collects exited workers and schedules their restart
+static void reap(void) {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    forget_worker(pid);
+    for (int i = 0; i < worker_count; i++) {
+      WorkerSlot *w = &slots[i];
+      if (w->pid != pid)
+        continue;
+      if (WIFSIGNALED(status))
+        log_write(LOG_ERROR, "supervisor", "worker %d (pid %d) killed by "
+                  "signal %d", i, (int)pid, WTERMSIG(status));
+      else
+        log_write(LOG_ERROR, "supervisor", "worker %d (pid %d) exited with "
+                  "status %d", i, (int)pid, WEXITSTATUS(status));
+
+      int64_t now = now_ms();
+      w->crashes = now - w->started_ms < QUICK_DEATH_MS ? w->crashes + 1 : 0;
+      int64_t delay = 0;
+      if (w->crashes > 0) {
+        delay = 500LL << (w->crashes < 7 ? w->crashes : 7);
+        if (delay > MAX_RESTART_DELAY_MS)
+          delay = MAX_RESTART_DELAY_MS;
+      }
+      w->pid = 0;
+      w->restart_at_ms = now + delay;
+      if (w->ready_read >= 0) {
+        close(w->ready_read);
+        w->ready_read = -1;
+      }
+    }
+  }
+}
+
+// Replaces the workers one at a time. Returns true in a new worker.
+static bool rolling_reload(void) {
+  log_write(LOG_INFO, "supervisor", "reloading %d workers", worker_count);
+  for (int i = 0; i < worker_count; i++) {
+    pid_t old = slots[i].pid;
+    pid_t pid = spawn(i);
+    if (pid == 0)
+      return true;
+    if (pid < 0 || !wait_ready(i, pid)) {
+      if (pid > 0)
+        stop_worker(pid);
+      log_write(LOG_ERROR, "supervisor", "reload aborted at worker %d, "
+                "keeping the running workers", i);
+      return false;
+    }
+    slots[i].pid = pid;
+    slots[i].crashes = 0;
+    if (old > 0)
+      stop_worker(old);
+  }
+  log_write(LOG_INFO, "supervisor", "reload complete");
+  return false;
+}
+
+static void shutdown_workers(void) {
+  log_write(LOG_INFO, "supervisor", "stopping %d workers", worker_count);
+  for (int i = 0; i < worker_count; i++)
+    if (slots[i].pid > 0)
+      kill(slots[i].pid, SIGTERM);
+  int64_t deadline = now_ms() + stop_ms;
+  for (int i = 0; i < worker_count; i++)
+    if (slots[i].pid > 0)
+      wait_exit(slots[i].pid, deadline);
+
+  // Anything a dying worker published late
+  DIR *dir = opendir(metrics_dir);
+  if (dir) {
+    struct dirent *e;
+    while ((e = readdir(dir)) != NULL) {
+      if (e->d_name[0] == '.')
+        continue;
+      char path[512];
+      snprintf(path, sizeof(path), "%s/%s", metrics_dir, e->d_name);
+      unlink(path);
+    }
+    closedir(dir);
+  }
+  rmdir(metrics_dir);
+}
+
+int supervisor_start(void) {
+  worker_count = env_int("SERVER_WORKERS", 0);
+  if (worker_count <= 0)
+    return -1;
+  if (worker_count > MAX_WORKERS)
+    worker_count = MAX_WORKERS;
+  ready_ms = env_int("SERVER_WORKER_READY_MS", 10000);
+  stop_ms = env_int("SERVER_WORKER_STOP_MS", 30000);
+  supervisor_pid = getpid();
+
+  snprintf(metrics_dir, sizeof(metrics_dir), "/tmp/plugin-server.XXXXXX");
+  if (mkdtemp(metrics_dir) == NULL) {
+    log_write(LOG_ERROR, "supervisor", "mkdtemp: %s", strerror(errno));
+    metrics_dir[0] = '\0';
+  }
+
+  // Handled synchronously below; workers inherit the mask and wait for
+  // the same signals in worker_wait()
+  sigset_t handled;
+  sigemptyset(&handled);
+  sigaddset(&handled, SIGTERM);
+  sigaddset(&handled, SIGINT);
+  sigaddset(&handled, SIGHUP);
+  sigaddset(&handled, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &handled, NULL);
+
+  // 1. Initial workers, started together
+  for (int i = 0; i < worker_count; i++)
+    slots[i].ready_read = -1;
+  for (int i = 0; i < worker_count; i++) {
+    slots[i].pid = spawn(i);
+    if (slots[i].pid == 0)
+      return worker_index;
+    if (slots[i].pid < 0)
+      slots[i].pid = 0; // retried by the loop below
+  }
+  int ready = 0;
+  for (int i = 0; i < worker_count; i++)
+    ready += slots[i].pid > 0 && wait_ready(i, slots[i].pid);
+  log_write(LOG_INFO, "supervisor", "%d of %d workers ready", ready,
+            worker_count);
+
+  // 2. Supervise until told to stop
+  for (;;) {
+    struct timespec tick = {1, 0};
+    int sig = sigtimedwait(&handled, NULL, &tick);
+    if (sig == SIGTERM || sig == SIGINT)
+      break;
+    if (sig == SIGHUP && rolling_reload())
+      return worker_index;
+    reap();
+
+    int64_t now = now_ms();
+    for (int i = 0; i < worker_count; i++) {
+      if (slots[i].pid != 0 || now < slots[i].restart_at_ms)
+        continue;
+      pid_t pid = spawn(i);
+      if (pid == 0)
+        return worker_index;
+      if (pid > 0) {
+        // Readiness only matters during a reload
+        close(slots[i].ready_read);
+        slots[i].ready_read = -1;
+        slots[i].pid = pid;
+      }
+    }
+  }
+
+  shutdown_workers();
+  log_write(LOG_INFO, "supervisor", "stopped");
+  exit(0);
+}
+
+// ---------------------------------------------------------------------------
+// Worker
+// ---------------------------------------------------------------------------
+
+void worker_ready(void) {
+  if (ready_fd < 0)
+    return;
+  char c = 1;
+  // EPIPE: a plain restart, nobody is waiting for this one
+  if (write(ready_fd, &c, 1) != 1 && errno != EPIPE)
+    log_write(LOG_WARN, "server", "could not report ready to the supervisor");
+  close(ready_fd);
+  ready_fd = -1;
+}
+
+// Writes this worker's metrics where the other workers read them
+static void publish(PluginManager *pm) {
+  if (metrics_dir[0] == '\0')
+    return;
+  size_t len = 0;
+  char *text = metrics_render(pm, &len);
+  if (text == NULL)
+    return;
+  char path[128], tmp[136];
+  published_path(path, sizeof(path), getpid());
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *f = fopen(tmp, "w");
+  if (f) {
+    bool ok = fwrite(text, 1, len, f) == len;
+    if (fclose(f) == 0 && ok)
+      rename(tmp, path); // readers never see a partial file
+    else
+      unlink(tmp);
+  }
+  free(text);
+}
+
+void worker_wait(PluginManager *pm) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGHUP);
+  for (;;) {
+    publish(pm);
+    struct timespec tick = {PUBLISH_MS / 1000, 0};
+    int sig = sigtimedwait(&set, NULL, &tick);
+    if (sig == SIGTERM || sig == SIGINT)
+      break;
+    if (sig == SIGHUP) {
+      log_write(LOG_INFO, "server", "refreshing plugins");
+      refresh_plugins(pm);
+    }
+  }
+  forget_worker(getpid());
+}
+
+// ---------------------------------------------------------------------------
+// Metrics aggregation
+// ---------------------------------------------------------------------------
+
+// Samples with the same name and labels are summed; counters, histogram
+// buckets / sums / counts and the host's gauges (queue depth, heap
+// bytes) are all totals, so a plain sum is the fleet value.
+typedef struct {
+  char *key; // "name{labels}"
+  double value;
+  int next; // next sample of the same family, -1 at the end
+} Sample;
+
+typedef struct {
+  char *name;
+  char *help; // full comment lines, NULL until seen
+  char *type;
+  int first, last;
+} Family;
+
+typedef struct {
+  Family *families;
+  int nfamilies, family_cap;
+  Sample *samples;
+  int nsamples, sample_cap;
+  int *index; // open addressing over samples, -1 empty
+  size_t index_cap;
+} Merge;
+
+static uint64_t hash_key(const char *s) {
+  uint64_t h = 1469598103934665603ULL;
+  while (*s)
+    h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+  return h;
+}
+
+static bool grow_index(Merge *m) {
+  size_t cap = m->index_cap ? m->index_cap * 2 : 1024;
+  int *index = malloc(cap * sizeof(int));
+  if (index == NULL)
+    return false;
+  for (size_t i = 0; i < cap; i++)
+    index[i] = -1;
+  for (int s = 0; s < m->nsamples; s++) {
+    size_t slot = hash_key(m->samples[s].key) & (cap - 1);
+    while (index[slot] >= 0)
+      slot = (slot + 1) & (cap - 1);
+    index[slot] = s;
+  }
+  free(m->index);
+  m->index = index;
+  m->index_cap = cap;
+  return true;
+}
+
+static Family *find_family(Merge *m, const char *name, size_t len) {
+  for (int i = 0; i < m->nfamilies; i++)
+    if (strlen(m->families[i].name) == len &&
+        strncmp(m->families[i].name, name, len) == 0)
+      return &m->families[i];
+  if (m->nfamilies == m->family_cap) {
+    int cap = m->family_cap ? m->family_cap * 2 : 32;
+    Family *grown = realloc(m->families, cap * sizeof(Family));
+    if (grown == NULL)
+      return NULL;
+    m->families = grown;
+    m->family_cap = cap;
+  }
+  Family *f = &m->families[m->nfamilies];
+  *f = (Family){strndup(name, len), NULL, NULL, -1, -1};
+  if (f->name == NULL)
+    return NULL;
+  m->nfamilies++;
+  return f;
+}
+
+static void add_sample(Merge *m, Family *f, const char *key, double value) {
+  if ((size_t)(m->nsamples + 1) * 2 > m->index_cap && !grow_index(m))
+    return;
+  size_t slot = hash_key(key) & (m->index_cap - 1);
+  while (m->index[slot] >= 0) {
+    Sample *s = &m->samples[m->index[slot]];
+    if (strcmp(s->key, key) == 0) {
+      s->value += value;
+      return;
+    }
+    slot = (slot + 1) & (m->index_cap - 1);
+  }
+
+  if (m->nsamples == m->sample_cap) {
+    int cap = m->sample_cap ? m->sample_cap * 2 : 1024;
+    Sample *grown = realloc(m->samples, cap * sizeof(Sample));
+    if (grown == NULL)
+      return;
+    m->samples = grown;
+    m->sample_cap = cap;
+  }
+  int id = m->nsamples;
+  m->samples[id] = (Sample){strdup(key), value, -1};
+  if (m->samples[id].key == NULL)
+    return;
+  m->nsamples++;
+  m->index[slot] = id;
+  if (f->last >= 0)
+    m->samples[f->last].next = id;
+  else
+    f->first = id;
+  f->last = id;
+}
+
+static void merge_text(Merge *m, FILE *in) {
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t n;
+  Family *current = NULL;
+  while ((n = getline(&line, &cap, in)) > 0) {
+    if (line[n - 1] == '\n')
+      line[--n] = '\0';
+    if (n == 0)
+      continue;
+
+    // "# HELP name ..." / "# TYPE name ..."
+    if (strncmp(line, "# HELP ", 7) == 0 || strncmp(line, "# TYPE ", 7) == 0) {
+      const char *name = line + 7;
+      current = find_family(m, name, strcspn(name, " "));
+      if (current == NULL)
+        break;
+      char **slot = line[2] == 'H' ? &current->help : &current->type;
+      if (*slot == NULL)
+        *slot = strdup(line);
+      continue;
+    }
+    if (line[0] == '#')
+      continue;
+
+    char *space = strrchr(line, ' ');
+    if (space == NULL)
+      continue;
+    *space = '\0';
+    if (current == NULL)
+      current = find_family(m, line, strcspn(line, "{"));
+    if (current)
+      add_sample(m, current, line, strtod(space + 1, NULL));
+  }
+  free(line);
+}
+
+static char *merge_output(Merge *m, size_t *len) {
+  char *text = NULL;
+  FILE *out = open_memstream(&text, len);
+  if (out == NULL)
+    return NULL;
+  for (int i = 0; i < m->nfamilies; i++) {
+    Family *f = &m->families[i];
+    if (f->help)
+      fprintf(out, "%s\n", f->help);
+    if (f->type)
+      fprintf(out, "%s\n", f->type);
+    for (int s = f->first; s >= 0; s = m->samples[s].next)
+      fprintf(out, "%s %.17g\n", m->samples[s].key, m->samples[s].value);
+  }
+  fclose(out);
+  return text;
+}
+
+static void merge_free(Merge *m) {
+  for (int i = 0; i < m->nfamilies; i++) {
+    free(m->families[i].name);
+    free(m->families[i].help);
+    free(m->families[i].type);
+  }
+  for (int i = 0; i < m->nsamples; i++)
+    free(m->samples[i].key);
+  free(m->families);
+  free(m->samples);
+  free(m->index);
+}
+
+char *supervisor_metrics_render(PluginManager *pm, size_t *len) {
+  char *own = metrics_render(pm, len);
+  if (!supervisor_is_worker() || own == NULL || metrics_dir[0] == '\0')
+    return own;
+
+  Merge m = {0};
+  FILE *in = fmemopen(own, *len, "r");
+  if (in) {
+    merge_text(&m, in);
+    fclose(in);
+  }
+  free(own);
+
+  // The other workers, as of their last publish
+  char mine[64];
+  snprintf(mine, sizeof(mine), "%d.prom", (int)getpid());
+  DIR *dir = opendir(metrics_dir);
+  if (dir) {
+    struct dirent *e;
+    while ((e = readdir(dir)) != NULL) {
+      size_t n = strlen(e->d_name);
+      if (e->d_name[0] == '.' || n < 5 ||
+          strcmp(e->d_name + n - 5, ".prom") != 0 ||
+          strcmp(e->d_name, mine) == 0)
+        continue;
+      char path[512];
+      snprintf(path, sizeof(path), "%s/%s", metrics_dir, e->d_name);
+      FILE *f = fopen(path, "r");
+      if (f) {
+        merge_text(&m, f);
+        fclose(f);
+      }
+    }
+    closedir(dir);
+  }
+
+  char *text = merge_output(&m, len);
+  merge_free(&m);
+  return text;
+}
@@ -0,0 +1,111 @@
+#include "timer_wheel.h"
+
+#define SLOT_BITS 8
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+#define MAX_DELTA ((1ULL << (SLOT_BITS * WHEEL_LEVELS)) - 1)
+
+static void list_init(WheelEntry *head) { head->prev = head->next = head; }
+
+static void list_push(WheelEntry *head, WheelEntry *e) {
+  e->prev = head->prev;
+  e->next = head;
+  head->prev->next = e;
+  head->prev = e;
+}
+
+static void list_unlink(WheelEntry *e) {
+  e->prev->next = e->next;
+  e->next->prev = e->prev;
+  e->prev = e->next = NULL;
+}
+
+void wheel_init(TimerWheel *w, uint64_t now) {
+  w->now = now;
+  w->count = 0;
+  for (int l = 0; l < WHEEL_LEVELS; l++)
+    for (int s = 0; s < WHEEL_SLOTS; s++)
+      list_init(&w->slots[l][s]);
+}
+
+// The lowest level whose range covers the delay; the slot is taken from
+// the expiry's own bits, so it lines up with the cascade below
+static void place(TimerWheel *w, WheelEntry *e) {
+  uint64_t expires = e->expires < w->now ? w->now : e->expires;
+  uint64_t delta = expires - w->now;
+  if (delta > MAX_DELTA) {
+    // Parked at the farthest slot; it is placed again when it cascades
+    delta = MAX_DELTA;
+    expires = w->now + delta;
+  }
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 &&
+         delta >= 1ULL << (SLOT_BITS * (level + 1)))
+    level++;
+  int slot = (int)((expires >> (SLOT_BITS * level)) & SLOT_MASK);
+  list_push(&w->slots[level][slot], e);
+}
+
+void wheel_add(TimerWheel *w, WheelEntry *e) {
+  if (e->expires <= w->now)
+    e->expires = w->now + 1;
+  place(w, e);
+  w->count++;
+}
+
+void wheel_remove(TimerWheel *w, WheelEntry *e) {
+  if (e->next == NULL)
+    return; // not scheduled
+  list_unlink(e);
+  w->count--;
+}
+
+// Moves every timer of one slot down to the levels below
+static void cascade(TimerWheel *w, int level, int slot) {
+  WheelEntry pending;
+  list_init(&pending);
+  WheelEntry *head = &w->slots[level][slot];
+  if (head->next == head)
+    return;
+  // Detach the whole list first: place() may put timers back here
+  pending.next = head->next;
+  pending.prev = head->prev;
+  pending.next->prev = &pending;
+  pending.prev->next = &pending;
+  list_init(head);
+
+  while (pending.next != &pending) {
+    WheelEntry *e = pending.next;
+    list_unlink(e);
+    place(w, e);
+  }
+}
+
+static void tick(TimerWheel *w, WheelFireFn fire, void *arg) {
+  uint64_t t = ++w->now;
+
+  // 1. Crossing a boundary of level n pulls its current slot down;
+  // coarsest first so timers can fall through several levels at once
+  for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+    if ((t & ((1ULL << (SLOT_BITS * level)) - 1)) == 0)
+      cascade(w, level, (int)((t >> (SLOT_BITS * level)) & SLOT_MASK));
+  }
+
+  // 2. Everything left in the current level-0 slot is due
+  WheelEntry *head = &w->slots[0][t & SLOT_MASK];
+  while (head->next != head) {
+    WheelEntry *e = head->next;
+    list_unlink(e);
+    w->count--;
+    fire(e, arg);
+  }
+}
+
+void wheel_advance(TimerWheel *w, uint64_t now, WheelFireFn fire, void *arg) {
+  while (w->now < now) {
+    if (w->count == 0) {
+      w->now = now; // nothing to cascade or fire on the way
+      return;
+    }
+    tick(w, fire, arg);
+  }
+}
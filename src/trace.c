@@ -0,0 +1,362 @@
+#include "trace.h"
+#include <lauxlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Each thread records into its own ring, so recording is a plain store
+// plus one release increment of `head`. Request threads are short-lived,
+// so a ring outlives its thread: on exit it goes to a free list and the
+// next new thread adopts it (old events stay readable until overwritten).
+#define TRACE_RING_SIZE 8192 // power of two
+#define TRACE_NAME_LEN 40
+
+#define PROFILE_BUCKETS 1024
+#define PROFILE_MAX_DEPTH 64
+#define PROFILE_HOOK_COUNT 1000 // VM instructions between hook calls
+
+typedef struct {
+  char name[TRACE_NAME_LEN];
+  const char *cat;
+  uint64_t start_ns;
+  uint64_t dur_ns;
+  uint64_t request_id;
+  int tid;
+} TraceEvent;
+
+typedef struct TraceRing {
+  TraceEvent events[TRACE_RING_SIZE];
+  _Atomic uint64_t head;
+  struct TraceRing *next_all;
+  struct TraceRing *next_free;
+} TraceRing;
+
+typedef struct ProfileEntry {
+  char *stack;
+  uint64_t us;
+  struct ProfileEntry *next;
+} ProfileEntry;
+
+static bool tracing = false;
+static bool profiling = false;
+static uint64_t profile_period_ns = 1000000;
+static const char *trace_file = NULL;
+
+static _Atomic(TraceRing *) all_rings = NULL;
+static TraceRing *free_rings = NULL;
+static pthread_mutex_t free_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static _Atomic uint64_t next_request_id = 1;
+
+static _Thread_local TraceRing *tls_ring = NULL;
+static _Thread_local uint64_t tls_request_id = 0;
+static _Thread_local int tls_tid = 0;
+static _Thread_local uint64_t tls_last_sample_ns = 0;
+
+static ProfileEntry *profile_table[PROFILE_BUCKETS];
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static bool env_flag(const char *name) {
+  const char *v = getenv(name);
+  return v && *v && strcmp(v, "0") != 0;
+}
+
+static void release_ring(void *arg) {
+  TraceRing *ring = (TraceRing *)arg;
+  pthread_mutex_lock(&free_rings_lock);
+  ring->next_free = free_rings;
+  free_rings = ring;
+  pthread_mutex_unlock(&free_rings_lock);
+}
+
+void trace_init(void) {
+  tracing = env_flag("SERVER_TRACE");
+  profiling = env_flag("SERVER_PROFILE");
+  trace_file = getenv("SERVER_TRACE_FILE");
+  const char *period = getenv("SERVER_PROFILE_US");
+  if (period && atol(period) > 0)
+    profile_period_ns = (uint64_t)atol(period) * 1000;
+  pthread_key_create(&ring_key, release_ring);
+}
+
+bool trace_enabled(void) { return tracing; }
+bool profile_enabled(void) { return profiling; }
+
+static TraceRing *acquire_ring(void) {
+  pthread_mutex_lock(&free_rings_lock);
+  TraceRing *ring = free_rings;
+  if (ring)
+    free_rings = ring->next_free;
+  pthread_mutex_unlock(&free_rings_lock);
+
+  if (ring == NULL) {
+    ring = calloc(1, sizeof(TraceRing));
+    if (ring == NULL)
+      return NULL;
+    // Publish in the registry so trace_render can find it
+    TraceRing *head = atomic_load(&all_rings);
+    do {
+      ring->next_all = head;
+    } while (!atomic_compare_exchange_weak(&all_rings, &head, ring));
+  }
+  pthread_setspecific(ring_key, ring);
+  tls_tid = (int)syscall(SYS_gettid);
+  return ring;
+}
+
+void trace_begin_request(void) {
+  if (tracing)
+    tls_request_id = atomic_fetch_add(&next_request_id, 1);
+  // Idle time between requests must not be attributed to the next sample
+  if (profiling)
+    tls_last_sample_ns = now_ns();
+}
+
+uint64_t trace_now(void) { return tracing ? now_ns() : 0; }
+
+void trace_span(const char *cat, const char *name, uint64_t start_ns) {
+  if (!tracing || start_ns == 0)
+    return;
+  if (tls_ring == NULL && (tls_ring = acquire_ring()) == NULL)
+    return;
+
+  uint64_t head = atomic_load_explicit(&tls_ring->head, memory_order_relaxed);
+  TraceEvent *ev = &tls_ring->events[head & (TRACE_RING_SIZE - 1)];
+  snprintf(ev->name, sizeof(ev->name), "%s", name);
+  ev->cat = cat;
+  ev->start_ns = start_ns;
+  ev->dur_ns = now_ns() - start_ns;
+  ev->request_id = tls_request_id;
+  ev->tid = tls_tid;
+  atomic_store_explicit(&tls_ring->head, head + 1, memory_order_release);
+}
+
+// --- Output helpers ---
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} OutBuf;
+
+static void out_append(OutBuf *b, const char *s, size_t n) {
+  if (b->len + n + 1 > b->cap) {
+    size_t new_cap = b->cap ? b->cap : 4096;
+    while (new_cap < b->len + n + 1)
+      new_cap *= 2;
+    char *grown = realloc(b->data, new_cap);
+    if (grown == NULL)
+      return;
+    b->data = grown;
+    b->cap = new_cap;
+  }
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+  b->data[b->len] = '\0';
+}
+
+static void out_str(OutBuf *b, const char *s) { out_append(b, s, strlen(s)); }
+
+static void out_json_str(OutBuf *b, const char *s) {
+  out_append(b, "\"", 1);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      char esc[2] = {'\\', *s};
+      out_append(b, esc, 2);
+    } else if ((unsigned char)*s >= 0x20) {
+      out_append(b, s, 1);
+    }
+  }
+  out_append(b, "\"", 1);
+}
+
+char *trace_render(size_t *len_out) {
+  OutBuf b = {0};
+  out_str(&b, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+  bool first = true;
+  TraceEvent *copy = malloc(sizeof(TraceEvent) * TRACE_RING_SIZE);
+  for (TraceRing *ring = atomic_load(&all_rings); ring && copy;
+       ring = ring->next_all) {
+    // Copy, then drop whatever the owner may have overwritten meanwhile
+    uint64_t before = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t from = before > TRACE_RING_SIZE ? before - TRACE_RING_SIZE : 0;
+    for (uint64_t i = from; i < before; i++)
+      copy[i - from] = ring->events[i & (TRACE_RING_SIZE - 1)];
+    uint64_t after = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t valid_from =
+        after > TRACE_RING_SIZE ? after - TRACE_RING_SIZE : 0;
+
+    for (uint64_t i = from; i < before; i++) {
+      if (i < valid_from)
+        continue;
+      TraceEvent *ev = &copy[i - from];
+      char line[256];
+      if (!first)
+        out_str(&b, ",\n");
+      first = false;
+      out_str(&b, "{\"ph\":\"X\",\"pid\":1,\"name\":");
+      out_json_str(&b, ev->name);
+      snprintf(line, sizeof(line),
+               ",\"cat\":\"%s\",\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+               "\"args\":{\"request\":%llu}}",
+               ev->cat, ev->tid, ev->start_ns / 1e3, ev->dur_ns / 1e3,
+               (unsigned long long)ev->request_id);
+      out_str(&b, line);
+    }
+  }
+  free(copy);
+  out_str(&b, "]}\n");
+
+  *len_out = b.len;
+  return b.data;
+}
+
+// --- Sampling Lua profiler ---
+
+static void profile_add(const char *stack, uint64_t us) {
+  uint64_t h = 1469598103934665603ull;
+  for (const char *c = stack; *c; c++) {
+    h ^= (unsigned char)*c;
+    h *= 1099511628211ull;
+  }
+  size_t slot = h & (PROFILE_BUCKETS - 1);
+
+  pthread_mutex_lock(&profile_lock);
+  ProfileEntry *e = profile_table[slot];
+  while (e && strcmp(e->stack, stack) != 0)
+    e = e->next;
+  if (e == NULL) {
+    e = malloc(sizeof(ProfileEntry));
+    if (e) {
+      e->stack = strdup(stack);
+      e->us = 0;
+      e->next = profile_table[slot];
+      profile_table[slot] = e;
+    }
+  }
+  if (e)
+    e->us += us;
+  pthread_mutex_unlock(&profile_lock);
+}
+
+// Frame label in folded format: no ';' (frame separator) allowed
+static void frame_label(lua_State *L, lua_Debug *ar, char *out, size_t size) {
+  lua_getinfo(L, "Sn", ar);
+  if (*ar->what == 'C')
+    snprintf(out, size, "%s [C]", ar->name ? ar->name : "?");
+  else if (*ar->what == 'm')
+    snprintf(out, size, "main chunk (%s)", ar->short_src);
+  else
+    snprintf(out, size, "%s (%s:%d)", ar->name ? ar->name : "?",
+             ar->short_src, ar->linedefined);
+  for (char *c = out; *c; c++) {
+    if (*c == ';')
+      *c = ':';
+  }
+}
+
+static void profile_hook(lua_State *L, lua_Debug *hook_ar) {
+  (void)hook_ar;
+  uint64_t now = now_ns();
+  if (tls_last_sample_ns == 0) {
+    tls_last_sample_ns = now;
+    return;
+  }
+  uint64_t elapsed = now - tls_last_sample_ns;
+  if (elapsed < profile_period_ns)
+    return;
+  tls_last_sample_ns = now;
+
+  // Collect innermost-first, then emit outermost-first
+  char frames[PROFILE_MAX_DEPTH][128];
+  int depth = 0;
+  lua_Debug ar;
+  while (depth < PROFILE_MAX_DEPTH && lua_getstack(L, depth, &ar)) {
+    frame_label(L, &ar, frames[depth], sizeof(frames[depth]));
+    depth++;
+  }
+  if (depth == 0)
+    return;
+
+  char stack[PROFILE_MAX_DEPTH * 128];
+  size_t len = 0;
+  for (int i = depth - 1; i >= 0; i--) {
+    int n = snprintf(stack + len, sizeof(stack) - len, "%s%s",
+                     i == depth - 1 ? "" : ";", frames[i]);
+    if (n < 0 || (size_t)n >= sizeof(stack) - len)
+      break;
+    len += (size_t)n;
+  }
+  profile_add(stack, elapsed / 1000);
+}
+
+char *profile_render(size_t *len_out) {
+  OutBuf b = {0};
+  out_str(&b, "");
+  pthread_mutex_lock(&profile_lock);
+  for (size_t i = 0; i < PROFILE_BUCKETS; i++) {
+    for (ProfileEntry *e = profile_table[i]; e; e = e->next) {
+      char count[32];
+      snprintf(count, sizeof(count), " %llu\n", (unsigned long long)e->us);
+      out_str(&b, e->stack);
+      out_str(&b, count);
+    }
+  }
+  pthread_mutex_unlock(&profile_lock);
+  *len_out = b.len;
+  return b.data;
+}
+
+// --- Lua bindings ---
+
+// c_trace_now() -> timestamp (0 when tracing is off)
+static int l_trace_now(lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)trace_now());
+  return 1;
+}
+
+// c_trace_span(name, start)
+static int l_trace_span(lua_State *L) {
+  const char *name = luaL_checkstring(L, 1);
+  lua_Integer start = luaL_optinteger(L, 2, 0);
+  trace_span("lua", name, (uint64_t)start);
+  return 0;
+}
+
+void trace_setup_lua(lua_State *L) {
+  lua_pushcfunction(L, l_trace_now);
+  lua_setglobal(L, "c_trace_now");
+  lua_pushcfunction(L, l_trace_span);
+  lua_setglobal(L, "c_trace_span");
+
+  if (profiling)
+    lua_sethook(L, profile_hook, LUA_MASKCOUNT, PROFILE_HOOK_COUNT);
+}
+
+void trace_shutdown(void) {
+  if (!tracing || trace_file == NULL)
+    return;
+  size_t len = 0;
+  char *json = trace_render(&len);
+  FILE *f = fopen(trace_file, "w");
+  if (f && json) {
+    fwrite(json, 1, len, f);
+    fclose(f);
+    printf("Trace written to %s\n", trace_file);
+  } else if (f) {
+    fclose(f);
+  }
+  free(json);
+}